@@ -0,0 +1,85 @@
+#!/usr/bin/env python3
+"""
+Intra-node key layout benchmark: key_layout="sorted" vs "eytzinger".
+
+Builds a tree of random int keys for each order and layout, then times
+random lookups (after the first pass has built the Eytzinger copies) and
+random inserts into an empty tree.
+
+Examples:
+  python benchmarks/bench_key_layout.py
+  python benchmarks/bench_key_layout.py --size 1000000 --key-type i64
+  python benchmarks/bench_key_layout.py --orders 64 256 1024
+"""
+
+from __future__ import annotations
+
+import argparse
+import os
+import random
+import sys
+import time
+
+# Add parent directory to path for in-place builds
+sys.path.insert(0, os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
+
+from btreedict import SortedDict
+
+LAYOUTS = ("sorted", "eytzinger")
+
+
+def best_of(repeat, func):
+    best = float("inf")
+    for _ in range(repeat):
+        start = time.perf_counter()
+        func()
+        best = min(best, time.perf_counter() - start)
+    return best
+
+
+def bench(order, key_layout, key_type, keys, probes, repeat):
+    options = dict(order=order, key_layout=key_layout, key_type=key_type)
+    tree = SortedDict.from_sorted(((k, None) for k in sorted(keys)), **options)
+    get = tree.get
+
+    def lookups():
+        for key in probes:
+            get(key)
+
+    def inserts():
+        fresh = SortedDict(**options)
+        for key in keys:
+            fresh[key] = None
+
+    lookups()  # Build the search copies outside the timing
+    return best_of(repeat, lookups), best_of(repeat, inserts)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[1])
+    parser.add_argument("--size", type=int, default=200_000, help="keys in the tree")
+    parser.add_argument("--lookups", type=int, default=1_000_000, help="random get() calls")
+    parser.add_argument("--orders", type=int, nargs="+",
+                        default=[16, 32, 64, 128, 256, 512, 1024])
+    parser.add_argument("--key-type", choices=("i64",), default=None,
+                        help="native key storage (default: object keys with cache_i64)")
+    parser.add_argument("--repeat", type=int, default=3)
+    args = parser.parse_args()
+
+    rng = random.Random(0)
+    keys = rng.sample(range(args.size * 10), args.size)
+    probes = [rng.choice(keys) for _ in range(args.lookups)]
+
+    print(f"{args.size:,} keys, {args.lookups:,} lookups, key_type={args.key_type}")
+    print(f"{'order':>6} | {'layout':<9} | {'lookups':>9} | {'inserts':>9}")
+    print(f"{'-' * 6}-+-{'-' * 9}-+-{'-' * 9}-+-{'-' * 9}")
+    for order in args.orders:
+        for key_layout in LAYOUTS:
+            lookup_s, insert_s = bench(order, key_layout, args.key_type, keys,
+                                       probes, args.repeat)
+            print(f"{order:>6} | {key_layout:<9} | {lookup_s * 1e3:7.1f}ms | "
+                  f"{insert_s * 1e3:7.1f}ms")
+
+
+if __name__ == "__main__":
+    main()
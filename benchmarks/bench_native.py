@@ -0,0 +1,196 @@
+#!/usr/bin/env python3
+"""
+Native core-operation benchmark driving the btreedict C API from C.
+
+Builds benchmarks/native/bench_core.c against include/btreeobject.h, then
+times PyBTree_Insert/Search/Delete and a full PyBTree_VisitRange walk in C
+loops, without interpreter dispatch between operations. Reports ns/op and,
+on Linux where perf_event_open() is allowed, cache and branch misses per
+op, for each key type, key distribution and order:
+
+  uniform     distinct keys in random order
+  sequential  distinct keys in ascending order
+  zipf        keys drawn with a Zipf(1.1) skew, inserted with repeats
+
+--save writes the results to a JSON file, and --baseline compares against
+one, exiting with status 1 if an entry got slower by more than --threshold
+percent. A baseline saved with another --size is refused, and one saved
+with another --repeat is compared with a warning.
+
+Examples:
+  python benchmarks/bench_native.py --key-types i64 int --orders 64
+  python benchmarks/bench_native.py --save base.json
+  python benchmarks/bench_native.py --baseline base.json --threshold 5
+"""
+
+from __future__ import annotations
+
+import argparse
+import itertools
+import json
+import os
+import platform
+import random
+import sys
+import tempfile
+
+# Add parent directory to path for in-place builds
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+sys.path.insert(0, ROOT)
+
+from btreedict import SortedDict
+
+KEY_TYPES = ("int", "i64", "float", "f64", "str", "tuple", "pair")
+DISTRIBUTIONS = ("uniform", "sequential", "zipf")
+OPERATIONS = ("insert", "search", "delete", "iterate")
+ORDERS = (8, 16, 32, 64, 128, 256, 512, 1024)
+COUNTERS = ("cache_misses", "branch_misses")
+
+
+def build_native(build_dir):
+    """Compile the _bench_core extension into build_dir and import it."""
+    from setuptools import Distribution, Extension
+
+    extension = Extension(
+        "_bench_core",
+        sources=[os.path.join(ROOT, "benchmarks", "native", "bench_core.c")],
+        include_dirs=[os.path.join(ROOT, "include")],
+        extra_compile_args=["-O3"] if sys.platform != "win32" else ["/O2"],
+    )
+    dist = Distribution({"name": "_bench_core", "ext_modules": [extension]})
+    cmd = dist.get_command_obj("build_ext")
+    cmd.build_lib = build_dir
+    cmd.build_temp = os.path.join(build_dir, "temp")
+    cmd.ensure_finalized()
+    cmd.run()
+    sys.path.insert(0, build_dir)
+    import _bench_core
+    return _bench_core
+
+
+def make_keys(key_type, n, rng):
+    """n distinct keys of key_type in ascending order."""
+    ints = sorted(rng.sample(range(n * 10), n))
+    if key_type in ("int", "i64"):
+        return ints
+    if key_type in ("float", "f64"):
+        return [i / 8 + 0.5 for i in ints]
+    if key_type == "str":
+        # Scrambled so the order of the strings is not that of the ints
+        return sorted(format(i * 2654435761 % 2**64, "016x") for i in ints)
+    return [(i // 1000, i % 1000) for i in ints]
+
+
+def make_streams(keys, distribution, rng):
+    """The keys to insert, to search and to delete, in that order."""
+    if distribution == "sequential":
+        return keys, keys, keys
+    if distribution == "uniform":
+        stream = list(keys)
+        rng.shuffle(stream)
+        return stream, stream, stream
+    ranked = list(keys)
+    rng.shuffle(ranked)  # Popularity unrelated to key order
+    weights = itertools.accumulate(1 / (r + 1) ** 1.1 for r in range(len(ranked)))
+    stream = rng.choices(ranked, cum_weights=list(weights), k=len(ranked))
+    # Searches follow the skew; deletes take each inserted key once, hot ones first
+    return stream, stream, list(dict.fromkeys(stream))
+
+
+def measure(native, op, order, key_type, streams, repeat):
+    """Best of repeat runs of op. Returns (ns/op, {counter: per op})."""
+    options = dict(order=order)
+    if key_type in ("i64", "f64"):
+        options["key_type"] = key_type
+    elif key_type == "pair":
+        options["cache_pairs"] = True
+    inserts, searches, deletes = streams
+    keys = {"insert": inserts, "search": searches, "delete": deletes, "iterate": []}[op]
+    best = None
+    for _ in range(repeat):
+        tree = SortedDict(**options)
+        if op != "insert":
+            native.run("insert", tree, inserts)
+        result = native.run(op, tree, keys)
+        if best is None or result["seconds"] < best["seconds"]:
+            best = result
+    per_op = {name: (best[name] / best["ops"] if best[name] is not None else None)
+              for name in COUNTERS}
+    return best["seconds"] / best["ops"] * 1e9, per_op
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[1])
+    parser.add_argument("--size", type=int, default=100_000, help="distinct keys")
+    parser.add_argument("--orders", type=int, nargs="+", default=list(ORDERS))
+    parser.add_argument("--key-types", nargs="+", choices=KEY_TYPES, default=list(KEY_TYPES),
+                        help="int/float/str/tuple: object keys; i64/f64: typed trees; "
+                             "pair: tuple keys with cache_pairs=True")
+    parser.add_argument("--distributions", nargs="+", choices=DISTRIBUTIONS,
+                        default=list(DISTRIBUTIONS))
+    parser.add_argument("--ops", nargs="+", choices=OPERATIONS, default=list(OPERATIONS))
+    parser.add_argument("--repeat", type=int, default=3)
+    parser.add_argument("--save", metavar="JSON", help="write the results to this file")
+    parser.add_argument("--baseline", metavar="JSON", help="compare against saved results")
+    parser.add_argument("--threshold", type=float, default=10.0,
+                        help="percent slowdown against --baseline that fails (default: 10)")
+    parser.add_argument("--build-dir", default=os.path.join(tempfile.gettempdir(),
+                                                            "btreedict-bench-native"))
+    args = parser.parse_args()
+
+    baseline = None
+    if args.baseline:
+        with open(args.baseline) as f:
+            saved = json.load(f)
+        baseline = saved["results"]
+        meta = saved.get("meta", {})
+        # ns/op depends on the tree size, so other sizes are not comparable
+        if meta.get("size", args.size) != args.size:
+            parser.error(f"--baseline was saved with --size {meta['size']}, not {args.size}")
+        if meta.get("repeat", args.repeat) != args.repeat:
+            print(f"warning: --baseline was saved with --repeat {meta['repeat']}, "
+                  f"not {args.repeat}", file=sys.stderr)
+    native = build_native(args.build_dir)
+
+    print(f"{args.size:,} keys, best of {args.repeat}")
+    print(f"{'op':<7} | {'keys':<6} | {'distribution':<12} | {'order':>5} | {'ns/op':>8} | "
+          f"{'cache miss':>10} | {'branch miss':>11}" + (" | vs base" if baseline else ""))
+    print("-" * (82 + (10 if baseline else 0)))
+
+    results = {}
+    regressions = []
+    for key_type in args.key_types:
+        keys = make_keys(key_type, args.size, random.Random(0))
+        for distribution in args.distributions:
+            streams = make_streams(keys, distribution, random.Random(1))
+            for order in args.orders:
+                for op in args.ops:
+                    ns, per_op = measure(native, op, order, key_type, streams, args.repeat)
+                    name = f"{op}/{key_type}/{distribution}/{order}"
+                    results[name] = {"ns": ns, **per_op}
+                    counters = [f"{per_op[c]:.2f}" if per_op[c] is not None else "n/a"
+                                for c in COUNTERS]
+                    line = (f"{op:<7} | {key_type:<6} | {distribution:<12} | {order:>5} | "
+                            f"{ns:8.1f} | {counters[0]:>10} | {counters[1]:>11}")
+                    if baseline and name in baseline:
+                        change = (ns / baseline[name]["ns"] - 1) * 100
+                        line += f" | {change:+6.1f}%"
+                        if change > args.threshold:
+                            regressions.append((name, change))
+                    print(line)
+
+    if args.save:
+        meta = {"size": args.size, "repeat": args.repeat, "python": sys.version,
+                "platform": platform.platform()}
+        with open(args.save, "w") as f:
+            json.dump({"meta": meta, "results": results}, f, indent=1, sort_keys=True)
+        print(f"Saved {len(results)} results to {args.save}")
+    if regressions:
+        print(f"{len(regressions)} slower than the baseline by more than {args.threshold}%:")
+        for name, change in regressions:
+            print(f"  {name}: {change:+.1f}%")
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
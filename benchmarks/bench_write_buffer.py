@@ -0,0 +1,85 @@
+#!/usr/bin/env python3
+"""
+Write buffer benchmark: random bt[key] = value writes with write_buffer=n.
+
+Times filling an empty tree with random int keys, and rewriting the values
+of a full tree in random order, for each buffer size (0 writes through).
+A read after every --read-every writes flushes the buffer early, showing
+what interleaved lookups cost the batching.
+
+Examples:
+  python benchmarks/bench_write_buffer.py
+  python benchmarks/bench_write_buffer.py --size 1000000 --key-type i64
+  python benchmarks/bench_write_buffer.py --buffers 0 1024 --read-every 100
+"""
+
+from __future__ import annotations
+
+import argparse
+import os
+import random
+import sys
+import time
+
+# Add parent directory to path for in-place builds
+sys.path.insert(0, os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
+
+from btreedict import SortedDict
+
+
+def best_of(repeat, func):
+    best = float("inf")
+    for _ in range(repeat):
+        start = time.perf_counter()
+        func()
+        best = min(best, time.perf_counter() - start)
+    return best
+
+
+def bench(write_buffer, key_type, keys, read_every, repeat):
+    options = dict(key_type=key_type, write_buffer=write_buffer)
+    full = SortedDict.from_sorted(((k, None) for k in sorted(keys)), **options)
+    probe = keys[0]
+
+    def writes(tree):
+        if read_every:
+            for i, key in enumerate(keys):
+                tree[key] = i
+                if i % read_every == 0:
+                    tree.get(probe)
+        else:
+            for key in keys:
+                tree[key] = None
+        len(tree)  # Apply what is still held back
+
+    return (best_of(repeat, lambda: writes(SortedDict(**options))),
+            best_of(repeat, lambda: writes(full)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[1])
+    parser.add_argument("--size", type=int, default=200_000, help="keys written")
+    parser.add_argument("--buffers", type=int, nargs="+",
+                        default=[0, 256, 4096, 65536])
+    parser.add_argument("--key-type", choices=("i64", "f64"), default=None,
+                        help="native key storage (default: object keys with cache_i64)")
+    parser.add_argument("--read-every", type=int, default=0,
+                        help="get() after every n writes (default: never)")
+    parser.add_argument("--repeat", type=int, default=3)
+    args = parser.parse_args()
+
+    rng = random.Random(0)
+    keys = rng.sample(range(args.size * 10), args.size)
+
+    print(f"{args.size:,} random writes, key_type={args.key_type}, "
+          f"read_every={args.read_every or None}")
+    print(f"{'buffer':>7} | {'fill':>9} | {'rewrite':>9}")
+    print(f"{'-' * 7}-+-{'-' * 9}-+-{'-' * 9}")
+    for write_buffer in args.buffers:
+        fill_s, rewrite_s = bench(write_buffer, args.key_type, keys,
+                                  args.read_every, args.repeat)
+        print(f"{write_buffer:>7} | {fill_s * 1e3:7.1f}ms | {rewrite_s * 1e3:7.1f}ms")
+
+
+if __name__ == "__main__":
+    main()
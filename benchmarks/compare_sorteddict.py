@@ -7,12 +7,14 @@ Includes:
 - Micro-benchmarks
 - Memory usage
 - Optional Hypothesis property checks
+- Per-call method overhead
 - Optional pyperf benchmarks
 
 Examples:
   python benchmarks/compare_sorteddict.py --test
   python benchmarks/compare_sorteddict.py --benchmark
   python benchmarks/compare_sorteddict.py --hypothesis
+  python benchmarks/compare_sorteddict.py --calls
   python benchmarks/compare_sorteddict.py --pyperf --impl btree --size 10000
 """
 
@@ -24,6 +26,7 @@ import os
 import random
 import sys
 import time
+import timeit
 import tracemalloc
 import unittest
 from typing import List, Tuple
@@ -492,9 +495,9 @@ def benchmark_keys_values_items(n: int) -> BenchmarkResult:
 
     start = time.perf_counter()
     for _ in range(100):
-        _ = bt.keys()
-        _ = bt.values()
-        _ = bt.items()
+        _ = list(bt.keys())
+        _ = list(bt.values())
+        _ = list(bt.items())
     btree_time = time.perf_counter() - start
 
     start = time.perf_counter()
@@ -709,6 +712,54 @@ def run_hypothesis_tests() -> None:
     irange_matches_sorteddict()
 
 
+# =============================================================================
+# METHOD CALL OVERHEAD
+# =============================================================================
+
+# One call per statement on a small tree, so argument parsing is a visible
+# share of each call. --calls and --pyperf time the same statements; the
+# btree-only ones are skipped for sortedcontainers.
+METHOD_CALLS = [
+    ("get", "t.get(k)", False),
+    ("get_miss", "t.get(-1, 0)", False),
+    ("insert", "t.insert(k, k)", True),
+    ("setdefault", "t.setdefault(k, 0)", False),
+    ("peekitem", "t.peekitem(k)", False),
+    ("irange", "t.irange(k, k + 10)", False),
+    ("islice", "t.islice(k, k + 10)", False),
+    ("construct", "cls()", False),
+    ("construct_order", "cls(order=32)", True),
+    ("getitem", "t[k]", False),
+]
+
+
+def method_call_globals(size: int, impl: str) -> dict:
+    if impl == "btree":
+        cls = SortedDict
+    else:
+        require_sortedcontainers()
+        cls = sortedcontainers.SortedDict
+    tree = cls()
+    for i in range(size):
+        tree[i] = i
+    return {"t": tree, "k": size // 2, "cls": cls}
+
+
+def method_calls(impl: str):
+    return [(name, stmt) for name, stmt, btree_only in METHOD_CALLS
+            if impl == "btree" or not btree_only]
+
+
+def run_method_calls(size: int, impl: str, repeat: int = 3) -> None:
+    namespace = method_call_globals(size, impl)
+    print(f"Per-call time, {impl}, {size:,} keys, best of {repeat}")
+    for name, stmt in method_calls(impl):
+        timer = timeit.Timer(stmt, globals=namespace)
+        number, _ = timer.autorange()
+        best = min(timer.repeat(repeat=repeat, number=number))
+        print(f"  {stmt:<22} {best / number * 1e9:8.1f} ns")
+
+
 # =============================================================================
 # OPTIONAL PYPERF BENCHMARKS
 # =============================================================================
@@ -883,6 +934,9 @@ def run_pyperf(size: int, impl: str, remaining_argv: List[str]) -> None:
     runner.bench_func("range_iter", bench_range_iter(size, impl))
     runner.bench_func("delete_random", bench_delete_random(size, impl))
     runner.bench_func("mixed", bench_mixed(size, impl))
+    namespace = method_call_globals(size, impl)
+    for name, stmt in method_calls(impl):
+        runner.timeit("call_" + name, stmt, globals=namespace)
 
 
 def main() -> None:
@@ -890,8 +944,10 @@ def main() -> None:
     parser.add_argument("--test", action="store_true", help="Run correctness tests")
     parser.add_argument("--benchmark", action="store_true", help="Run benchmarks")
     parser.add_argument("--hypothesis", action="store_true", help="Run Hypothesis checks")
+    parser.add_argument("--calls", action="store_true", help="Time per-call method overhead")
     parser.add_argument("--pyperf", action="store_true", help="Run pyperf benchmarks")
-    parser.add_argument("--size", type=int, default=10000, help="Pyperf size")
+    parser.add_argument("--size", type=int, default=None,
+                        help="Tree size (default 10000 for --pyperf, 1000 for --calls)")
     parser.add_argument("--impl", choices=["btree", "sorteddict"], default="btree")
     args, remaining = parser.parse_known_args()
 
@@ -899,8 +955,12 @@ def main() -> None:
         run_hypothesis_tests()
         return
 
+    if args.calls:
+        run_method_calls(args.size or 1000, args.impl)
+        return
+
     if args.pyperf:
-        run_pyperf(args.size, args.impl, remaining)
+        run_pyperf(args.size or 10000, args.impl, remaining)
         return
 
     if args.test:
@@ -914,7 +974,7 @@ def main() -> None:
         run_benchmarks()
         return
 
-    print("No mode selected. Use --test, --benchmark, --hypothesis, or --pyperf.")
+    print("No mode selected. Use --test, --benchmark, --hypothesis, --calls, or --pyperf.")
     sys.exit(2)
 
 
@@ -0,0 +1,251 @@
+/* Native timing loops for benchmarks/bench_native.py
+ *
+ * Each run() call times one operation over a whole list of keys from C,
+ * calling PyBTree_Insert(), PyBTree_Search(), PyBTree_Delete() or
+ * PyBTree_VisitRange() through the btreedict._C_API capsule, so the
+ * numbers hold no interpreter dispatch, only the tree code and the key
+ * comparisons it makes. On Linux the loop is also wrapped in
+ * perf_event_open() counters for cache and branch misses; where the kernel
+ * refuses them (containers, perf_event_paranoid) they are reported as None.
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include "btreeobject.h"
+
+#include <string.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#define BENCH_HAVE_PERF 1
+#endif
+
+#define N_COUNTERS 2
+
+static const char *const counter_names[N_COUNTERS] = {"cache_misses", "branch_misses"};
+
+typedef struct {
+    int fds[N_COUNTERS];          /* -1 where the counter could not be opened */
+    long long values[N_COUNTERS];
+} Counters;
+
+static void
+counters_open(Counters *c)
+{
+    int i;
+
+    for (i = 0; i < N_COUNTERS; i++) {
+        c->fds[i] = -1;
+        c->values[i] = -1;
+    }
+#ifdef BENCH_HAVE_PERF
+    static const unsigned long long configs[N_COUNTERS] = {
+        PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+
+    for (i = 0; i < N_COUNTERS; i++) {
+        struct perf_event_attr attr;
+
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = configs[i];
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        c->fds[i] = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+#endif
+}
+
+static void
+counters_start(Counters *c)
+{
+#ifdef BENCH_HAVE_PERF
+    int i;
+
+    for (i = 0; i < N_COUNTERS; i++) {
+        if (c->fds[i] >= 0) {
+            ioctl(c->fds[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(c->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+#else
+    (void)c;
+#endif
+}
+
+static void
+counters_stop(Counters *c)
+{
+#ifdef BENCH_HAVE_PERF
+    int i;
+
+    for (i = 0; i < N_COUNTERS; i++) {
+        long long value;
+
+        if (c->fds[i] < 0) {
+            continue;
+        }
+        ioctl(c->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        if (read(c->fds[i], &value, sizeof(value)) == (ssize_t)sizeof(value)) {
+            c->values[i] = value;
+        }
+        close(c->fds[i]);
+    }
+#else
+    (void)c;
+#endif
+}
+
+static double
+now_seconds(void)
+{
+    struct timespec ts;
+
+#ifdef _WIN32
+    timespec_get(&ts, TIME_UTC);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static int
+count_visit(PyObject *Py_UNUSED(key), PyObject *Py_UNUSED(value), void *arg)
+{
+    (*(Py_ssize_t *)arg)++;
+    return 0;
+}
+
+/* Run op over keys; returns the number of operations or -1 on error */
+static Py_ssize_t
+run_op(const char *op, PyObject *tree, PyObject *keys)
+{
+    Py_ssize_t i, n = PyList_GET_SIZE(keys);
+
+    if (strcmp(op, "insert") == 0) {
+        for (i = 0; i < n; i++) {
+            if (PyBTree_Insert(tree, PyList_GET_ITEM(keys, i), Py_None) < 0) {
+                return -1;
+            }
+        }
+        return n;
+    }
+    if (strcmp(op, "search") == 0) {
+        for (i = 0; i < n; i++) {
+            PyObject *value = PyBTree_Search(tree, PyList_GET_ITEM(keys, i));
+            if (value == NULL) {
+                if (PyErr_Occurred()) {
+                    return -1;
+                }
+                PyErr_SetString(PyExc_KeyError, "search key missing from the tree");
+                return -1;
+            }
+            Py_DECREF(value);
+        }
+        return n;
+    }
+    if (strcmp(op, "delete") == 0) {
+        for (i = 0; i < n; i++) {
+            if (PyBTree_Delete(tree, PyList_GET_ITEM(keys, i)) < 0) {
+                return -1;
+            }
+        }
+        return n;
+    }
+    if (strcmp(op, "iterate") == 0) {
+        Py_ssize_t seen = 0;
+
+        if (PyBTree_VisitRange(tree, NULL, NULL, 1, 1, count_visit, &seen) < 0) {
+            return -1;
+        }
+        return seen;
+    }
+    PyErr_Format(PyExc_ValueError, "unknown operation %s", op);
+    return -1;
+}
+
+PyDoc_STRVAR(bench_run_doc,
+"run(op, tree, keys)\n"
+"--\n\n"
+"Time op ('insert', 'search', 'delete' or 'iterate') on the SortedDict\n"
+"tree for every key of the list keys (iterate ignores them). Returns a\n"
+"dict of ops, seconds, cache_misses and branch_misses, the counters None\n"
+"where they are not available.");
+
+static PyObject *
+bench_run(PyObject *Py_UNUSED(module), PyObject *args)
+{
+    const char *op;
+    PyObject *tree, *keys, *result, *value;
+    Counters counters;
+    Py_ssize_t ops;
+    double start, seconds;
+    int i;
+
+    if (!PyArg_ParseTuple(args, "sO!O!:run", &op, &PyBTree_Type, &tree, &PyList_Type, &keys)) {
+        return NULL;
+    }
+    /* The list must not change under the loop */
+    keys = PyList_GetSlice(keys, 0, PyList_GET_SIZE(keys));
+    if (keys == NULL) {
+        return NULL;
+    }
+    counters_open(&counters);
+    start = now_seconds();
+    counters_start(&counters);
+    ops = run_op(op, tree, keys);
+    counters_stop(&counters);
+    seconds = now_seconds() - start;
+    Py_DECREF(keys);
+    if (ops < 0) {
+        return NULL;
+    }
+
+    result = Py_BuildValue("{s:n,s:d}", "ops", ops, "seconds", seconds);
+    for (i = 0; result != NULL && i < N_COUNTERS; i++) {
+        if (counters.values[i] >= 0) {
+            value = PyLong_FromLongLong(counters.values[i]);
+        }
+        else {
+            value = Py_None;
+            Py_INCREF(value);
+        }
+        if (value == NULL || PyDict_SetItemString(result, counter_names[i], value) < 0) {
+            Py_CLEAR(result);
+        }
+        Py_XDECREF(value);
+    }
+    return result;
+}
+
+static PyMethodDef bench_methods[] = {
+    {"run", bench_run, METH_VARARGS, bench_run_doc},
+    {NULL, NULL, 0, NULL}
+};
+
+static struct PyModuleDef bench_module = {
+    PyModuleDef_HEAD_INIT,
+    "_bench_core",
+    "Native timing loops over the btreedict C API.",
+    -1,
+    bench_methods,
+    NULL,                       /* m_slots */
+    NULL,                       /* m_traverse */
+    NULL,                       /* m_clear */
+    NULL,                       /* m_free */
+};
+
+PyMODINIT_FUNC
+PyInit__bench_core(void)
+{
+    if (PyBTree_IMPORT < 0) {
+        return NULL;
+    }
+    return PyModule_Create(&bench_module);
+}
@@ -3,6 +3,19 @@
  * A self-balancing tree data structure that maintains sorted data and allows
  * searches, sequential access, insertions, and deletions in logarithmic time.
  * This implementation stores Python objects as keys.
+ *
+ * Other extension modules cannot link against btreedict, which exports the
+ * functions below in the capsule btreedict._C_API instead. Including this
+ * header outside the module maps each PyBTree_* name to its capsule entry,
+ * so after a successful PyBTree_IMPORT in the module init function
+ *
+ *     if (PyBTree_IMPORT < 0) {
+ *         return NULL;
+ *     }
+ *     ...
+ *     if (PyBTree_Check(obj) && PyBTree_Insert(obj, key, value) < 0) ...
+ *
+ * calls straight into the tree without going through Python.
  */
 
 #ifndef Py_BTREEOBJECT_H
@@ -19,18 +32,20 @@ extern "C" {
 typedef struct _PyBTreeNode PyBTreeNode;
 typedef struct _PyBTreeObject PyBTreeObject;
 
-/* Type objects */
-PyAPI_DATA(PyTypeObject) PyBTree_Type;
-PyAPI_DATA(PyTypeObject) PyBTreeNode_Type;
-PyAPI_DATA(PyTypeObject) PyBTreeIter_Type;
-PyAPI_DATA(PyTypeObject) PyBTreeReverseIter_Type;
-PyAPI_DATA(PyTypeObject) PyBTreeRangeIter_Type;
+/* Called by PyBTree_VisitRange() for each item, with borrowed references.
+ * Returns 0 to go on, 1 to stop, -1 with an exception set to fail. */
+typedef int (*PyBTree_VisitFunc)(PyObject *key, PyObject *value, void *arg);
 
 /* Type check macros */
 #define PyBTree_Check(op) PyObject_TypeCheck((op), &PyBTree_Type)
 #define PyBTree_CheckExact(op) Py_IS_TYPE((op), &PyBTree_Type)
 
-/* Public API functions */
+/* Public API functions
+ *
+ * On free-threaded builds PyBTree_Search() and PyBTree_Contains() lock the
+ * tree themselves; callers of the other functions on a tree that other
+ * threads can reach hold Py_BEGIN_CRITICAL_SECTION(btree) around the call.
+ */
 
 /* Create a new empty B-tree with specified order (minimum degree).
  * Order must be >= 2. Default order is 64 if order <= 1.
@@ -38,21 +53,36 @@ PyAPI_DATA(PyTypeObject) PyBTreeRangeIter_Type;
  */
 PyAPI_FUNC(PyObject *) PyBTree_New(int order);
 
+/* Build a new B-tree from an iterable of (key, value) pairs whose keys are
+ * strictly ascending. Leaves are packed to fill_factor (0 < f <= 1) of their
+ * capacity and internal levels are built bottom-up in O(n).
+ * Returns NULL with ValueError set if the keys are not strictly ascending.
+ */
+PyAPI_FUNC(PyObject *) PyBTree_FromSortedItems(PyObject *iterable, int order, double fill_factor);
+
+/* Like PyBTree_FromSortedItems() for the n keys and values in two C arrays,
+ * without building a (key, value) tuple per item.
+ */
+PyAPI_FUNC(PyObject *) PyBTree_FromSortedArrays(PyObject *const *keys, PyObject *const *values,
+                                                Py_ssize_t n, int order, double fill_factor);
+
 /* Get the number of items in the B-tree */
 PyAPI_FUNC(Py_ssize_t) PyBTree_Size(PyObject *btree);
 
-/* Insert a key-value pair into the B-tree.
+/* Insert a key-value pair into the B-tree, replacing the value of an equal
+ * key; a tree created with duplicates=True adds it after the equal keys.
  * Returns 0 on success, -1 on failure.
  */
 PyAPI_FUNC(int) PyBTree_Insert(PyObject *btree, PyObject *key, PyObject *value);
 
-/* Search for a key in the B-tree.
+/* Search for a key in the B-tree (the first item with key if duplicates=True).
  * Returns a new reference to the value if found, NULL if not found.
  * Does not set an exception if key is not found.
  */
 PyAPI_FUNC(PyObject *) PyBTree_Search(PyObject *btree, PyObject *key);
 
-/* Delete a key from the B-tree.
+/* Delete a key from the B-tree (only the first item with key if
+ * duplicates=True).
  * Returns 0 on success, -1 on failure (key not found or error).
  */
 PyAPI_FUNC(int) PyBTree_Delete(PyObject *btree, PyObject *key);
@@ -93,6 +123,8 @@ PyAPI_FUNC(PyObject *) PyBTree_Items(PyObject *btree);
 PyAPI_FUNC(int) PyBTree_Clear(PyObject *btree);
 
 /* Copy the B-tree (shallow copy).
+ * Clones the node structure directly in O(n) without comparing keys; keys
+ * and values are shared with the original.
  * Returns a new B-tree object, or NULL on failure.
  */
 PyAPI_FUNC(PyObject *) PyBTree_Copy(PyObject *btree);
@@ -102,6 +134,85 @@ PyAPI_FUNC(PyObject *) PyBTree_Copy(PyObject *btree);
  */
 PyAPI_FUNC(int) PyBTree_Update(PyObject *btree, PyObject *other);
 
+/* Call visit for each item whose key lies between min and max, in key order,
+ * as irange(min, max, (inclusive_min, inclusive_max)) selects them; NULL
+ * means no bound. visit must not write to the tree.
+ * Returns 0 once every item was visited, 1 if visit stopped early,
+ * -1 on failure (RuntimeError if the tree changed).
+ */
+PyAPI_FUNC(int) PyBTree_VisitRange(PyObject *btree, PyObject *min, PyObject *max,
+                                   int inclusive_min, int inclusive_max,
+                                   PyBTree_VisitFunc visit, void *arg);
+
+/* The capsule. Entries are only ever appended, raising PyBTree_CAPI_VERSION;
+ * PyBTree_IMPORT fails if the installed module is older than the header. */
+#define PyBTree_CAPI_VERSION 1
+#define PyBTree_CAPSULE_NAME "btreedict._C_API"
+
+typedef struct {
+    int version;                  /* PyBTree_CAPI_VERSION of the module */
+    PyTypeObject *SortedDictType;
+    PyObject *(*New)(int order);
+    PyObject *(*FromSortedItems)(PyObject *iterable, int order, double fill_factor);
+    PyObject *(*FromSortedArrays)(PyObject *const *keys, PyObject *const *values,
+                                  Py_ssize_t n, int order, double fill_factor);
+    Py_ssize_t (*Size)(PyObject *btree);
+    int (*Insert)(PyObject *btree, PyObject *key, PyObject *value);
+    PyObject *(*Search)(PyObject *btree, PyObject *key);
+    int (*Delete)(PyObject *btree, PyObject *key);
+    int (*Contains)(PyObject *btree, PyObject *key);
+    PyObject *(*GetMin)(PyObject *btree);
+    PyObject *(*GetMax)(PyObject *btree);
+    PyObject *(*Keys)(PyObject *btree);
+    PyObject *(*Values)(PyObject *btree);
+    PyObject *(*Items)(PyObject *btree);
+    int (*Clear)(PyObject *btree);
+    PyObject *(*Copy)(PyObject *btree);
+    int (*Update)(PyObject *btree, PyObject *other);
+    int (*VisitRange)(PyObject *btree, PyObject *min, PyObject *max,
+                      int inclusive_min, int inclusive_max,
+                      PyBTree_VisitFunc visit, void *arg);
+} PyBTree_CAPI;
+
+#ifndef BTREEDICT_MODULE
+static PyBTree_CAPI *PyBTreeAPI = NULL;
+
+/* Import the capsule into PyBTreeAPI. Returns 0, or -1 with ImportError set. */
+static inline int
+PyBTree_ImportAPI(void)
+{
+    PyBTreeAPI = (PyBTree_CAPI *)PyCapsule_Import(PyBTree_CAPSULE_NAME, 0);
+    if (PyBTreeAPI != NULL && PyBTreeAPI->version < PyBTree_CAPI_VERSION) {
+        PyErr_Format(PyExc_ImportError,
+                     "btreedict C API version %d is older than this extension's %d",
+                     PyBTreeAPI->version, PyBTree_CAPI_VERSION);
+        PyBTreeAPI = NULL;
+    }
+    return PyBTreeAPI != NULL ? 0 : -1;
+}
+
+#define PyBTree_IMPORT PyBTree_ImportAPI()
+
+#define PyBTree_Type (*PyBTreeAPI->SortedDictType)
+#define PyBTree_New (PyBTreeAPI->New)
+#define PyBTree_FromSortedItems (PyBTreeAPI->FromSortedItems)
+#define PyBTree_FromSortedArrays (PyBTreeAPI->FromSortedArrays)
+#define PyBTree_Size (PyBTreeAPI->Size)
+#define PyBTree_Insert (PyBTreeAPI->Insert)
+#define PyBTree_Search (PyBTreeAPI->Search)
+#define PyBTree_Delete (PyBTreeAPI->Delete)
+#define PyBTree_Contains (PyBTreeAPI->Contains)
+#define PyBTree_GetMin (PyBTreeAPI->GetMin)
+#define PyBTree_GetMax (PyBTreeAPI->GetMax)
+#define PyBTree_Keys (PyBTreeAPI->Keys)
+#define PyBTree_Values (PyBTreeAPI->Values)
+#define PyBTree_Items (PyBTreeAPI->Items)
+#define PyBTree_Clear (PyBTreeAPI->Clear)
+#define PyBTree_Copy (PyBTreeAPI->Copy)
+#define PyBTree_Update (PyBTreeAPI->Update)
+#define PyBTree_VisitRange (PyBTreeAPI->VisitRange)
+#endif /* !BTREEDICT_MODULE */
+
 #ifdef __cplusplus
 }
 #endif
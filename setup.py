@@ -8,8 +8,12 @@
 #
 # Or using setup.py directly:
 #   python setup.py build_ext --inplace
+#
+# Set BTREE_STATS=1 in the environment to compile in the counters reported
+# by SortedDict.stats().
 
 from setuptools import setup, Extension
+import os
 import sys
 
 # Extra compile args based on platform
@@ -21,10 +25,16 @@ else:
     extra_compile_args = ['/O2', '/W3']
     extra_link_args = []
 
+define_macros = []
+if os.environ.get('BTREE_STATS'):
+    define_macros.append(('BTREE_STATS', '1'))
+
 btree_module = Extension(
     'btreedict',
     sources=['src/btreemodule.c'],
     include_dirs=['include'],
+    depends=['include/btreeobject.h'],
+    define_macros=define_macros,
     extra_compile_args=extra_compile_args,
     extra_link_args=extra_link_args,
 )
@@ -40,6 +50,8 @@ setup(
     url='https://github.com/irazza/btree',
     license='MIT',
     ext_modules=[btree_module],
+    # The C API header, for extensions that import btreedict._C_API
+    headers=['include/btreeobject.h'],
     python_requires='>=3.12',
     classifiers=[
         'Development Status :: 4 - Beta',
@@ -50,6 +62,7 @@ setup(
         'Programming Language :: Python :: 3.12',
         'Programming Language :: Python :: 3.13',
         'Programming Language :: Python :: 3.14',
+        'Programming Language :: Python :: Free Threading :: 2 - Beta',
         'Topic :: Software Development :: Libraries :: Python Modules',
     ],
 )
@@ -15,34 +15,325 @@
 #define PY_SSIZE_T_CLEAN
 #include <Python.h>
 
+#define BTREEDICT_MODULE
+#include "btreeobject.h"
+
+/* Vector node search kernels, chosen at import (see select_i64_search_kernel) */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define BTREE_HAVE_X86_KERNELS 1
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define BTREE_HAVE_NEON_KERNEL 1
+#endif
+
+/* Free-threaded builds (Py_GIL_DISABLED) run each SortedDict, view and
+ * iterator operation inside a critical section on the tree: the table
+ * entries name BTREE_LOCKED(fn), the wrapper BTREE_DEFINE_LOCKED() generates
+ * for fn. With the GIL both reduce to fn itself. Before 3.13 the critical
+ * section macros do not exist and are plain blocks. */
+#ifndef Py_BEGIN_CRITICAL_SECTION
+#define Py_BEGIN_CRITICAL_SECTION(op) {
+#define Py_END_CRITICAL_SECTION() }
+#define Py_BEGIN_CRITICAL_SECTION2(a, b) {
+#define Py_END_CRITICAL_SECTION2() }
+#endif
+
+#ifdef Py_GIL_DISABLED
+#define BTREE_LOCKED(fn) fn##_locked
+#define BTREE_DEFINE_LOCKED(ret, fn, lock, params, args)        \
+    static ret fn##_locked params                               \
+    {                                                           \
+        ret result;                                             \
+        Py_BEGIN_CRITICAL_SECTION(lock);                        \
+        result = fn args;                                       \
+        Py_END_CRITICAL_SECTION();                              \
+        return result;                                          \
+    }
+#else
+#define BTREE_LOCKED(fn) fn
+#define BTREE_DEFINE_LOCKED(ret, fn, lock, params, args)
+#endif
+
+/* Wrappers for the common method signatures, locking self */
+#define BTREE_LOCKED_METHOD(fn) \
+    BTREE_DEFINE_LOCKED(PyObject *, fn, self, (PyObject *self, PyObject *arg), (self, arg))
+#define BTREE_LOCKED_FASTCALL(fn) \
+    BTREE_DEFINE_LOCKED(PyObject *, fn, self, \
+                        (PyObject *self, PyObject *const *args, Py_ssize_t nargs), \
+                        (self, args, nargs))
+#define BTREE_LOCKED_FASTCALL_KW(fn) \
+    BTREE_DEFINE_LOCKED(PyObject *, fn, self, \
+                        (PyObject *self, PyObject *const *args, Py_ssize_t nargs, \
+                         PyObject *kwnames), (self, args, nargs, kwnames))
+
+/* Hot-path counters reported by stats(), compiled in with -DBTREE_STATS
+ * (BTREE_STATS=1 in the environment of setup.py). Node code does not know
+ * which tree it works on, so the counters are shared by every tree in the
+ * process; free-threaded builds bump them atomically. */
+#ifdef BTREE_STATS
+typedef struct {
+    Py_ssize_t cache_i64_hits;    /* Node searches answered by the int64 cache */
+    Py_ssize_t cache_i64_misses;  /* int searches in nodes the cache cannot answer */
+    Py_ssize_t rich_compares;     /* compare_keys() calls that ran rich comparisons */
+    Py_ssize_t splits;
+    Py_ssize_t merges;
+    Py_ssize_t borrows;
+} BTreeCounters;
+
+static BTreeCounters btree_counters;
+
+#ifdef Py_GIL_DISABLED
+#define BTREE_COUNT(field) ((void)_Py_atomic_add_ssize(&btree_counters.field, 1))
+#else
+#define BTREE_COUNT(field) ((void)btree_counters.field++)
+#endif
+#else
+#define BTREE_COUNT(field) ((void)0)
+#endif
+
 /* Default minimum degree (order) of the B-tree */
 #define BTREE_DEFAULT_ORDER 64
 #define BTREE_MIN_ORDER 2
 
 /* ==================== BTreeNode Implementation ==================== */
 
+/* How a node stores its keys, fixed per tree and passed to node_alloc().
+ * Typed trees (key_type="i64"/"f64") keep packed native keys and no key
+ * objects; keys are materialized as int/float objects when read. */
+#define KEYS_OBJECT 0                 /* PyObject* keys */
+#define KEYS_CACHED 1                 /* PyObject* keys with an int64/str prefix cache */
+#define KEYS_I64    2                 /* Native int64 keys */
+#define KEYS_F64    3                 /* Native double keys */
+#define KEYS_STORAGE_MASK 3
+#define KEYS_EYTZINGER 4              /* Flag: keep an Eytzinger search copy */
+#define KEYS_DUPLICATES 8             /* Flag: equal keys allowed, see node_search_bound() */
+#define KEYS_PAIRS 16                 /* Flag: KEYS_CACHED also caches int64 2-tuples */
+
+typedef union {
+    long long i64;
+    double f64;
+} NativeKey;
+
+/* Nodes are plain reference-counted C structs, not Python objects: their
+ * owners are parent nodes and trees (several of them once shared by
+ * copy-on-write). The cyclic GC never sees a node with one owner;
+ * btree_traverse() visits its keys and values through the tree instead.
+ * A shared node is visited through its NodeShare, see node_share(). */
 typedef struct _PyBTreeNode {
-    PyObject_HEAD
+    Py_ssize_t refcnt;            /* Owning parents and trees, and pins */
+    PyObject *share;              /* NodeShare while shared, else NULL */
     Py_ssize_t n_keys;           /* Number of keys currently in node */
     int is_leaf;                  /* True if node is a leaf */
-    PyObject **keys;              /* Array of keys (Python objects) */
+    PyObject **keys;              /* Array of keys (Python objects), NULL if typed */
+    NativeKey *nkeys;             /* Packed native keys of typed trees, else NULL */
     PyObject **values;            /* Array of values (Python objects) */
     struct _PyBTreeNode **children; /* Array of child pointers */
-    long long *keys_i64;           /* Cached int64 key values */
-    unsigned char *keys_i64_valid; /* 1 if keys_i64 entry is valid */
+    Py_ssize_t *counts;           /* Items in each child's subtree (internal only) */
+    long long *keys_i64;           /* Cached int64 key values or str prefixes */
+    long long *keys_i64_2;         /* Second items of CACHE_PAIR keys, NULL without KEYS_PAIRS */
+    unsigned char *keys_i64_valid; /* What keys_i64 holds (CACHE_*) */
     int order;                    /* Order (t) - needed for node operations */
+    int key_storage;              /* KEYS_OBJECT, KEYS_CACHED, KEYS_I64 or KEYS_F64 */
+    int eytzinger;                /* Read searches use eyt_keys (key_layout) */
+    int duplicates;               /* Equal keys kept in insertion order (KEYS_DUPLICATES) */
+    long long *eyt_keys;          /* 1-based Eytzinger copy of the int64 keys */
+    int *eyt_rank;                /* Sorted position of each eyt_keys entry */
+    Py_ssize_t eyt_n;             /* Entries in eyt_keys, or EYT_STALE/EYT_NONE */
+    struct _PyBTreeNode *next;    /* Leaf chain in B+tree layout (borrowed) */
+    struct _PyBTreeNode *prev;
+    PyObject *agg;                /* Aggregate of the subtree's values, or NULL */
+    int agg_valid;                /* agg is up to date, see agg_subtree() */
 } PyBTreeNode;
 
+/* The Eytzinger copy is rebuilt by the first read search after the keys
+ * change. EYT_NONE marks keys that are not all int64 until the next change.
+ * Searches outside the tree lock may share a node, so in free-threaded
+ * builds one of them claims the rebuild (EYT_BUILDING) and publishes eyt_n
+ * atomically once the copy is filled; the others use the sorted keys. */
+#define EYT_STALE (-1)
+#define EYT_NONE (-2)
+#define EYT_BUILDING (-3)
+#define NODE_KEYS_CHANGED(node) ((node)->eyt_n = EYT_STALE, NODE_AGG_CHANGED(node))
+
+/* The cached aggregate of a tree created with aggregate= is recomputed by
+ * the next query after the subtree changes. Moving keys marks both nodes;
+ * writers mark each node on the path to a changed value, which for
+ * classic trees node_unshare() does. The stale object is kept until then:
+ * releasing it could run arbitrary code in the middle of a split. */
+#define NODE_AGG_CHANGED(node) ((node)->agg_valid = 0)
+
+#ifdef Py_GIL_DISABLED
+#define NODE_EYT_N(node) _Py_atomic_load_ssize(&(node)->eyt_n)
+#define NODE_EYT_PUBLISH(node, n) _Py_atomic_store_ssize(&(node)->eyt_n, (n))
+#else
+#define NODE_EYT_N(node) ((node)->eyt_n)
+#define NODE_EYT_PUBLISH(node, n) ((node)->eyt_n = (n))
+#endif
+
+/* Contents of a keys_i64 entry */
+#define CACHE_NONE 0
+#define CACHE_I64 1                   /* The key is an exact int in int64 range */
+#define CACHE_STR 2                   /* Prefix of an exact str, see str_prefix() */
+#define CACHE_PAIR 3                  /* An exact 2-tuple of such ints, split over keys_i64
+                                       * and keys_i64_2 */
+
+/* Storage argument for node_alloc() that recreates node's key storage */
+#define NODE_KEY_SPEC(node) \
+    ((node)->key_storage | ((node)->eytzinger ? KEYS_EYTZINGER : 0) | \
+     ((node)->duplicates ? KEYS_DUPLICATES : 0) | ((node)->keys_i64_2 != NULL ? KEYS_PAIRS : 0))
+
+/* In the B+tree layout internal nodes hold only separator keys and are
+ * allocated without a values array. Every other node stores items. */
+#define NODE_HAS_ITEMS(node) ((node)->values != NULL)
+
 /* Forward declarations */
-static PyTypeObject PyBTreeNode_Type;
-static PyObject *btreenode_new(int order, int is_leaf, int cache_i64);
-static void btreenode_dealloc(PyObject *self);
-static int btreenode_traverse(PyObject *self, visitproc visit, void *arg);
-static int btreenode_clear(PyObject *self);
+static PyBTreeNode *btreenode_new(int order, int is_leaf, int key_storage);
+static PyBTreeNode *node_alloc(int order, int is_leaf, int has_values, int key_storage);
+static void node_free(PyBTreeNode *node);
+
+/* Node reference counting, mirroring Py_INCREF and friends. An owner
+ * (a tree or a parent node) takes its reference with node_share() and
+ * releases it with NODE_DECREF. Searches and iterators that hold a node only
+ * for the length of a call pin it with NODE_PIN/NODE_UNPIN instead: they
+ * are not visited by the cyclic GC, and hold no NodeShare reference. Searches
+ * run outside the tree lock, so free-threaded builds count atomically. */
+#ifdef Py_GIL_DISABLED
+#define NODE_PIN(node) ((void)_Py_atomic_add_ssize(&(node)->refcnt, 1))
+#define NODE_REFCNT(node) _Py_atomic_load_ssize(&(node)->refcnt)
+#define NODE_SHARE(node) ((PyObject *)_Py_atomic_load_ptr(&(node)->share))
+#else
+#define NODE_PIN(node) ((node)->refcnt++)
+#define NODE_REFCNT(node) ((node)->refcnt)
+#define NODE_SHARE(node) ((node)->share)
+#endif
+
+static inline void
+NODE_UNPIN(PyBTreeNode *node)
+{
+#ifdef Py_GIL_DISABLED
+    if (_Py_atomic_add_ssize(&node->refcnt, -1) == 1) {
+#else
+    if (--node->refcnt == 0) {
+#endif
+        node_free(node);
+    }
+}
+
+static inline void
+NODE_DECREF(PyBTreeNode *node)
+{
+    PyObject *share = NODE_SHARE(node);
+
+    if (share != NULL) {
+        Py_DECREF(share);
+    }
+    NODE_UNPIN(node);
+}
+
+static inline void
+NODE_XDECREF(PyBTreeNode *node)
+{
+    if (node != NULL) {
+        NODE_DECREF(node);
+    }
+}
+
+/* Store node in *slot and release the node it held */
+static inline void
+node_setref(PyBTreeNode **slot, PyBTreeNode *node)
+{
+    PyBTreeNode *old = *slot;
+    *slot = node;
+    NODE_XDECREF(old);
+}
+
+#define NODE_CLEAR(slot) node_setref(&(slot), NULL)
+#define NODE_SETREF(slot, node) node_setref(&(slot), (node))
+
+/* The first 8 bytes of the UTF-8 encoding of str s, big-endian and padded
+ * with zero bytes. UTF-8 byte order is code point order, so when the
+ * prefixes of two strings differ they order the strings as
+ * PyUnicode_Compare() does; equal prefixes need the full comparison. */
+static inline unsigned long long
+str_prefix(PyObject *s)
+{
+    Py_ssize_t len = PyUnicode_GET_LENGTH(s);
+    int kind = PyUnicode_KIND(s);
+    const void *data = PyUnicode_DATA(s);
+    unsigned long long prefix = 0;
+    int shift = 56;
+    Py_ssize_t i;
+
+    if (PyUnicode_IS_ASCII(s)) {
+        const unsigned char *ascii = (const unsigned char *)data;
+        for (i = 0; i < len && i < 8; i++) {
+            prefix |= (unsigned long long)ascii[i] << (56 - 8 * i);
+        }
+        return prefix;
+    }
+    for (i = 0; i < len && shift >= 0; i++) {
+        Py_UCS4 ch = PyUnicode_READ(kind, data, i);
+        unsigned char bytes[4];
+        int n, j;
+
+        if (ch < 0x80) {
+            bytes[0] = (unsigned char)ch;
+            n = 1;
+        }
+        else if (ch < 0x800) {
+            bytes[0] = (unsigned char)(0xC0 | (ch >> 6));
+            bytes[1] = (unsigned char)(0x80 | (ch & 0x3F));
+            n = 2;
+        }
+        else if (ch < 0x10000) {
+            bytes[0] = (unsigned char)(0xE0 | (ch >> 12));
+            bytes[1] = (unsigned char)(0x80 | ((ch >> 6) & 0x3F));
+            bytes[2] = (unsigned char)(0x80 | (ch & 0x3F));
+            n = 3;
+        }
+        else {
+            bytes[0] = (unsigned char)(0xF0 | (ch >> 18));
+            bytes[1] = (unsigned char)(0x80 | ((ch >> 12) & 0x3F));
+            bytes[2] = (unsigned char)(0x80 | ((ch >> 6) & 0x3F));
+            bytes[3] = (unsigned char)(0x80 | (ch & 0x3F));
+            n = 4;
+        }
+        for (j = 0; j < n && shift >= 0; j++, shift -= 8) {
+            prefix |= (unsigned long long)bytes[j] << shift;
+        }
+    }
+    return prefix;
+}
+
+/* 1 if obj is an exact int in int64 range, stored in *out. Never fails:
+ * PyLong_AsLongLongAndOverflow() only raises for non-int objects. */
+static inline int
+exact_int64(PyObject *obj, long long *out)
+{
+    int overflow = 0;
+
+    if (!PyLong_CheckExact(obj)) {
+        return 0;
+    }
+    *out = PyLong_AsLongLongAndOverflow(obj, &overflow);
+    return overflow == 0;
+}
+
+/* 1 if obj is an exact 2-tuple of exact ints in int64 range, the key kind
+ * of CACHE_PAIR, stored in *first and *second */
+static inline int
+exact_int64_pair(PyObject *obj, long long *first, long long *second)
+{
+    return PyTuple_CheckExact(obj) && PyTuple_GET_SIZE(obj) == 2 &&
+           exact_int64(PyTuple_GET_ITEM(obj, 0), first) &&
+           exact_int64(PyTuple_GET_ITEM(obj, 1), second);
+}
 
 static inline void
 cache_key(PyBTreeNode *node, Py_ssize_t idx, PyObject *key)
 {
+    NODE_KEYS_CHANGED(node);
     if (node->keys_i64_valid == NULL) {
         return;
     }
@@ -51,110 +342,374 @@ cache_key(PyBTreeNode *node, Py_ssize_t idx, PyObject *key)
         long long value = PyLong_AsLongLongAndOverflow(key, &overflow);
         if (!PyErr_Occurred() && overflow == 0) {
             node->keys_i64[idx] = value;
-            node->keys_i64_valid[idx] = 1;
+            node->keys_i64_valid[idx] = CACHE_I64;
             return;
         }
         PyErr_Clear();
     }
-    node->keys_i64_valid[idx] = 0;
+    else if (PyUnicode_CheckExact(key)) {
+        node->keys_i64[idx] = (long long)str_prefix(key);
+        node->keys_i64_valid[idx] = CACHE_STR;
+        return;
+    }
+    else if (node->keys_i64_2 != NULL &&
+             exact_int64_pair(key, &node->keys_i64[idx], &node->keys_i64_2[idx])) {
+        node->keys_i64_valid[idx] = CACHE_PAIR;
+        return;
+    }
+    node->keys_i64_valid[idx] = CACHE_NONE;
+}
+
+/* 1 if every key of node is cached as kind (CACHE_I64, CACHE_STR or
+ * CACHE_PAIR). Nodes without KEYS_PAIRS hold no CACHE_PAIR entries. */
+static inline int
+node_all_cached(const PyBTreeNode *node, unsigned char kind)
+{
+    unsigned char other;
+
+    if (node->keys_i64_valid == NULL || node->n_keys == 0) {
+        return 0;
+    }
+    for (other = CACHE_NONE; other <= CACHE_PAIR; other++) {
+        if (other != kind && (other != CACHE_PAIR || node->keys_i64_2 != NULL) &&
+            memchr(node->keys_i64_valid, other, node->n_keys) != NULL) {
+            return 0;
+        }
+    }
+    return 1;
 }
 
 static inline void
 cache_key_clear(PyBTreeNode *node, Py_ssize_t idx)
 {
+    NODE_KEYS_CHANGED(node);
     if (node->keys_i64_valid == NULL) {
         return;
     }
-    node->keys_i64_valid[idx] = 0;
+    node->keys_i64_valid[idx] = CACHE_NONE;
 }
 
-/* Create a new B-tree node */
+/* Convert key to the native representation used by a typed tree. Sets
+ * *overflow instead of failing when an int lies outside the int64 range, so
+ * lookups can still place it before or after every stored key.
+ * Returns 0 on success, -1 with an exception set. */
+static int
+native_key_convert(int key_storage, PyObject *key, NativeKey *out, int *overflow)
+{
+    *overflow = 0;
+    if (key_storage == KEYS_I64) {
+        if (!PyLong_Check(key)) {
+            PyErr_Format(PyExc_TypeError,
+                         "key_type='i64' requires int keys, not %.200s",
+                         Py_TYPE(key)->tp_name);
+            return -1;
+        }
+        out->i64 = PyLong_AsLongLongAndOverflow(key, overflow);
+        if (out->i64 == -1 && PyErr_Occurred()) {
+            return -1;
+        }
+        return 0;
+    }
+
+    if (PyFloat_Check(key)) {
+        out->f64 = PyFloat_AS_DOUBLE(key);
+    }
+    else if (PyLong_Check(key)) {
+        out->f64 = PyLong_AsDouble(key);
+        if (out->f64 == -1.0 && PyErr_Occurred()) {
+            return -1;
+        }
+    }
+    else {
+        PyErr_Format(PyExc_TypeError,
+                     "key_type='f64' requires float or int keys, not %.200s",
+                     Py_TYPE(key)->tp_name);
+        return -1;
+    }
+    if (Py_IS_NAN(out->f64)) {
+        PyErr_SetString(PyExc_ValueError, "NaN is not a valid key_type='f64' key");
+        return -1;
+    }
+    return 0;
+}
+
+/* Like native_key_convert() for keys about to be stored: out-of-range ints
+ * raise OverflowError. */
+static int
+native_key_check(int key_storage, PyObject *key, NativeKey *out)
+{
+    int overflow;
+
+    if (native_key_convert(key_storage, key, out, &overflow) < 0) {
+        return -1;
+    }
+    if (overflow) {
+        PyErr_SetString(PyExc_OverflowError, "int key out of range for key_type='i64'");
+        return -1;
+    }
+    return 0;
+}
+
+/* ---------- Key slots ----------
+ * A key slot is keys[i] together with its int64 cache entry, or nkeys[i] in
+ * a typed node. Moving a slot transfers the key reference; the helpers below
+ * keep the parallel arrays in step so callers need not know the storage. */
+
+/* Move n key slots from src[from] to dst[to] (ranges may overlap) */
+static inline void
+move_keys(PyBTreeNode *dst, Py_ssize_t to, PyBTreeNode *src, Py_ssize_t from, Py_ssize_t n)
+{
+    NODE_KEYS_CHANGED(dst);
+    NODE_KEYS_CHANGED(src);
+    if (dst->nkeys != NULL) {
+        memmove(&dst->nkeys[to], &src->nkeys[from], n * sizeof(NativeKey));
+        return;
+    }
+    memmove(&dst->keys[to], &src->keys[from], n * sizeof(PyObject *));
+    if (dst->keys_i64_valid) {
+        memmove(&dst->keys_i64[to], &src->keys_i64[from], n * sizeof(long long));
+        if (dst->keys_i64_2 != NULL && src->keys_i64_2 != NULL) {
+            memmove(&dst->keys_i64_2[to], &src->keys_i64_2[from], n * sizeof(long long));
+        }
+        memmove(&dst->keys_i64_valid[to], &src->keys_i64_valid[from], n * sizeof(unsigned char));
+    }
+}
+
+/* Mark n slots starting at from as empty after their keys moved away */
+static inline void
+clear_keys(PyBTreeNode *node, Py_ssize_t from, Py_ssize_t n)
+{
+    NODE_KEYS_CHANGED(node);
+    if (node->keys == NULL) {
+        return;
+    }
+    memset(&node->keys[from], 0, n * sizeof(PyObject *));
+    if (node->keys_i64_valid) {
+        memset(&node->keys_i64_valid[from], 0, n * sizeof(unsigned char));
+    }
+}
+
+/* Store key in slot idx, taking a new reference. Keys of typed trees must
+ * have been validated with native_key_check() already. */
+static inline void
+node_set_key(PyBTreeNode *node, Py_ssize_t idx, PyObject *key)
+{
+    if (node->nkeys != NULL) {
+        int overflow;
+        (void)native_key_convert(node->key_storage, key, &node->nkeys[idx], &overflow);
+        NODE_KEYS_CHANGED(node);
+        return;
+    }
+    Py_INCREF(key);
+    node->keys[idx] = key;
+    cache_key(node, idx, key);
+}
+
+/* Copy slot sidx of src into slot idx of dst, taking a new reference */
+static inline void
+node_copy_key(PyBTreeNode *dst, Py_ssize_t idx, PyBTreeNode *src, Py_ssize_t sidx)
+{
+    move_keys(dst, idx, src, sidx, 1);
+    if (dst->keys != NULL) {
+        Py_INCREF(dst->keys[idx]);
+    }
+}
+
+/* Drop the reference held by slot idx */
+static inline void
+node_release_key(PyBTreeNode *node, Py_ssize_t idx)
+{
+    NODE_KEYS_CHANGED(node);
+    if (node->keys != NULL) {
+        Py_DECREF(node->keys[idx]);
+    }
+}
+
+/* Return a new int or float object for a native key */
+static inline PyObject *
+native_key_object(int key_storage, NativeKey key)
+{
+    if (key_storage == KEYS_I64) {
+        return PyLong_FromLongLong(key.i64);
+    }
+    return PyFloat_FromDouble(key.f64);
+}
+
+/* Return a new reference to the key in slot idx, creating the int or float
+ * object for typed trees. Returns NULL on memory error. */
+static inline PyObject *
+node_get_key(PyBTreeNode *node, Py_ssize_t idx)
+{
+    if (node->keys != NULL) {
+        Py_INCREF(node->keys[idx]);
+        return node->keys[idx];
+    }
+    return native_key_object(node->key_storage, node->nkeys[idx]);
+}
+
+/* Return a new (key, value) tuple for slot idx of an item-holding node */
 static PyObject *
-btreenode_new(int order, int is_leaf, int cache_i64)
+node_get_item(PyBTreeNode *node, Py_ssize_t idx)
+{
+    PyObject *key = node_get_key(node, idx);
+    PyObject *item;
+
+    if (key == NULL) {
+        return NULL;
+    }
+    item = PyTuple_Pack(2, key, node->values[idx]);
+    Py_DECREF(key);
+    return item;
+}
+
+/* Create a new node; has_values is false only for B+tree separator nodes */
+static PyBTreeNode *
+node_alloc(int order, int is_leaf, int has_values, int key_storage)
 {
     PyBTreeNode *node;
     Py_ssize_t max_keys = 2 * order - 1;
     Py_ssize_t max_children = 2 * order;
-    size_t keys_size, values_size, children_size, keys_i64_size, keys_i64_valid_size;
+    int eytzinger = (key_storage & KEYS_EYTZINGER) != 0;
+    int duplicates = (key_storage & KEYS_DUPLICATES) != 0;
+    int pairs = (key_storage & KEYS_PAIRS) != 0;
+    int typed;
+    size_t keys_size, values_size, children_size, counts_size, keys_i64_size, keys_i64_valid_size;
+    size_t header_size = (sizeof(PyBTreeNode) + 7) & ~(size_t)7;
     char *block;
 
-    node = PyObject_GC_New(PyBTreeNode, &PyBTreeNode_Type);
-    if (node == NULL) {
-        return NULL;
-    }
-
-    node->n_keys = 0;
-    node->is_leaf = is_leaf;
-    node->order = order;
+    key_storage &= KEYS_STORAGE_MASK;
+    typed = key_storage == KEYS_I64 || key_storage == KEYS_F64;
 
-    /* Allocate arrays for keys, values, children, and int64 cache in one block */
-    keys_size = max_keys * sizeof(PyObject *);
-    values_size = max_keys * sizeof(PyObject *);
+    /* The node header and all of its arrays (keys, values, children,
+     * subtree counts, int64 cache and its pair column) are one zeroed block */
+    keys_size = max_keys * (typed ? sizeof(NativeKey) : sizeof(PyObject *));
+    values_size = has_values ? max_keys * sizeof(PyObject *) : 0;
     children_size = is_leaf ? 0 : max_children * sizeof(PyBTreeNode *);
-    if (cache_i64) {
-        keys_i64_size = max_keys * sizeof(long long);
+    counts_size = is_leaf ? 0 : max_children * sizeof(Py_ssize_t);
+    if (key_storage == KEYS_CACHED) {
+        keys_i64_size = max_keys * sizeof(long long) * (pairs ? 2 : 1);
         keys_i64_valid_size = max_keys * sizeof(unsigned char);
-        block = (char *)PyMem_Calloc(1, keys_size + values_size + children_size +
-                                     keys_i64_size + keys_i64_valid_size);
     }
     else {
         keys_i64_size = 0;
         keys_i64_valid_size = 0;
-        block = (char *)PyMem_Calloc(1, keys_size + values_size + children_size);
     }
+    block = (char *)PyMem_Calloc(1, header_size + keys_size + values_size + children_size +
+                                 counts_size + keys_i64_size + keys_i64_valid_size);
     if (block == NULL) {
-        Py_DECREF(node);
-        return PyErr_NoMemory();
+        PyErr_NoMemory();
+        return NULL;
     }
+    node = (PyBTreeNode *)block;
+    block += header_size;
+
+    node->refcnt = 1;
+    node->n_keys = 0;
+    node->is_leaf = is_leaf;
+    node->order = order;
+    node->key_storage = key_storage;
+    node->eytzinger = eytzinger && key_storage != KEYS_F64 && key_storage != KEYS_OBJECT;
+    node->eyt_keys = NULL;
+    node->eyt_rank = NULL;
+    node->eyt_n = EYT_STALE;
+    node->duplicates = duplicates;
+    node->keys = NULL;
+    node->nkeys = NULL;
+    node->values = NULL;
+    node->children = NULL;
+    node->next = NULL;
+    node->prev = NULL;
+    node->agg = NULL;
+    node->agg_valid = 0;
+
+    if (typed) {
+        node->nkeys = (NativeKey *)block;
+    }
+    else {
+        node->keys = (PyObject **)block;
+    }
+    node->values = has_values ? (PyObject **)(block + keys_size) : NULL;
+    block += keys_size + values_size;
 
-    node->keys = (PyObject **)block;
-    node->values = (PyObject **)(block + keys_size);
-    
     if (!is_leaf) {
-        node->children = (PyBTreeNode **)(block + keys_size + values_size);
-        if (cache_i64) {
-            node->keys_i64 = (long long *)(block + keys_size + values_size + children_size);
-        }
-        else {
-            node->keys_i64 = NULL;
-        }
+        node->children = (PyBTreeNode **)block;
+        node->counts = (Py_ssize_t *)(block + children_size);
+        block += children_size + counts_size;
     } else {
         node->children = NULL;
-        if (cache_i64) {
-            node->keys_i64 = (long long *)(block + keys_size + values_size);
-        }
-        else {
-            node->keys_i64 = NULL;
-        }
+        node->counts = NULL;
     }
 
-    if (cache_i64) {
-        node->keys_i64_valid = (unsigned char *)((char *)node->keys_i64 + keys_i64_size);
+    if (key_storage == KEYS_CACHED) {
+        node->keys_i64 = (long long *)block;
+        node->keys_i64_2 = pairs ? node->keys_i64 + max_keys : NULL;
+        node->keys_i64_valid = (unsigned char *)(block + keys_i64_size);
     }
     else {
+        node->keys_i64 = NULL;
+        node->keys_i64_2 = NULL;
         node->keys_i64_valid = NULL;
     }
 
-    PyObject_GC_Track((PyObject *)node);
-    return (PyObject *)node;
+    return node;
+}
+
+/* Bytes of a node's search caches: the int64 (or str prefix) cache in its
+ * block with its pair column, and the Eytzinger copy, if one was built */
+static size_t
+node_cache_bytes(const PyBTreeNode *node)
+{
+    size_t max_keys = 2 * (size_t)node->order - 1;
+    size_t size = 0;
+
+    if (node->keys_i64 != NULL) {
+        size += max_keys * (sizeof(long long) + sizeof(unsigned char));
+    }
+    if (node->keys_i64_2 != NULL) {
+        size += max_keys * sizeof(long long);
+    }
+    if (node->eyt_keys != NULL) {
+        size += (max_keys + 1) * (sizeof(long long) + sizeof(int));
+    }
+    return size;
+}
+
+/* Bytes held by a node: the block node_alloc() sized for it plus the
+ * Eytzinger copy, if one was built */
+static size_t
+node_bytes(const PyBTreeNode *node)
+{
+    size_t max_keys = 2 * (size_t)node->order - 1;
+    size_t size = (sizeof(PyBTreeNode) + 7) & ~(size_t)7;
+
+    size += max_keys * (node->nkeys != NULL ? sizeof(NativeKey) : sizeof(PyObject *));
+    if (NODE_HAS_ITEMS(node)) {
+        size += max_keys * sizeof(PyObject *);
+    }
+    if (!node->is_leaf) {
+        size += (max_keys + 1) * (sizeof(PyBTreeNode *) + sizeof(Py_ssize_t));
+    }
+    return size + node_cache_bytes(node);
+}
+
+/* Create a new B-tree node */
+static PyBTreeNode *
+btreenode_new(int order, int is_leaf, int key_storage)
+{
+    return node_alloc(order, is_leaf, 1, key_storage);
 }
 
+/* Release everything a node owns and free it; called by NODE_DECREF */
 static void
-btreenode_dealloc(PyObject *self)
+node_free(PyBTreeNode *node)
 {
-    PyBTreeNode *node = (PyBTreeNode *)self;
     Py_ssize_t i;
 
-    PyObject_GC_UnTrack(self);
-
     /* Decref all keys */
     if (node->keys) {
         for (i = 0; i < node->n_keys; i++) {
             Py_XDECREF(node->keys[i]);
         }
-        /* node->keys points to the start of the allocated block */
-        /* keys, values, children are in one block, so freeing keys frees all */
-        /* But we must loop over values/children to decref them first */
     }
 
     /* Decref all values */
@@ -168,67 +723,80 @@ btreenode_dealloc(PyObject *self)
     if (node->children) {
         Py_ssize_t max_children = 2 * node->order;
         for (i = 0; i <= node->n_keys && i < max_children; i++) {
-            Py_XDECREF(node->children[i]);
+            NODE_XDECREF(node->children[i]);
         }
     }
 
-    if (node->keys) {
-        PyMem_Free(node->keys);
-    }
-
-    Py_TYPE(self)->tp_free(self);
+    Py_XDECREF(node->agg);
+    PyMem_Free(node->eyt_keys);
+    PyMem_Free(node);
 }
 
+static int node_traverse(PyBTreeNode *node, visitproc visit, void *arg);
+
+/* Visit the keys, values and children of node for the cyclic GC */
 static int
-btreenode_traverse(PyObject *self, visitproc visit, void *arg)
+node_traverse_items(PyBTreeNode *node, visitproc visit, void *arg)
 {
-    PyBTreeNode *node = (PyBTreeNode *)self;
     Py_ssize_t i;
 
+    Py_VISIT(node->agg);
     for (i = 0; i < node->n_keys; i++) {
-        Py_VISIT(node->keys[i]);
-        Py_VISIT(node->values[i]);
+        if (node->keys) {
+            Py_VISIT(node->keys[i]);
+        }
+        if (node->values) {
+            Py_VISIT(node->values[i]);
+        }
     }
-
     if (node->children) {
         for (i = 0; i <= node->n_keys; i++) {
-            Py_VISIT(node->children[i]);
+            int err = node_traverse(node->children[i], visit, arg);
+            if (err) {
+                return err;
+            }
         }
     }
-
     return 0;
 }
 
-static int
-btreenode_clear(PyObject *self)
+/* A shared node's stand-in for the cyclic GC. Its reference count is the
+ * number of the node's owners, each of which visits it once, and it visits
+ * the node's contents once: the collector counts every reference a
+ * (copy-on-write) subtree holds exactly once, however many trees share it. */
+typedef struct {
+    PyObject_HEAD
+    PyBTreeNode *node;            /* Borrowed, NULL before it is installed */
+} NodeShareObject;
+
+static PyTypeObject NodeShare_Type;
+
+static void
+nodeshare_dealloc(PyObject *self)
 {
-    PyBTreeNode *node = (PyBTreeNode *)self;
-    Py_ssize_t i;
+    NodeShareObject *share = (NodeShareObject *)self;
 
-    for (i = 0; i < node->n_keys; i++) {
-        Py_CLEAR(node->keys[i]);
-        Py_CLEAR(node->values[i]);
-        if (node->keys_i64_valid) {
-            node->keys_i64_valid[i] = 0;
-        }
+    PyObject_GC_UnTrack(self);
+    if (share->node != NULL) {
+        share->node->share = NULL;
     }
+    PyObject_GC_Del(self);
+}
 
-    if (node->children) {
-        for (i = 0; i <= node->n_keys; i++) {
-            Py_CLEAR(node->children[i]);
-        }
-    }
+static int
+nodeshare_traverse(PyObject *self, visitproc visit, void *arg)
+{
+    PyBTreeNode *node = ((NodeShareObject *)self)->node;
 
-    node->n_keys = 0;
-    return 0;
+    return node == NULL ? 0 : node_traverse_items(node, visit, arg);
 }
 
-static PyTypeObject PyBTreeNode_Type = {
+static PyTypeObject NodeShare_Type = {
     PyVarObject_HEAD_INIT(NULL, 0)
-    "_btree.BTreeNode",                         /* tp_name */
-    sizeof(PyBTreeNode),                        /* tp_basicsize */
+    "btreedict._NodeShare",                     /* tp_name */
+    sizeof(NodeShareObject),                    /* tp_basicsize */
     0,                                          /* tp_itemsize */
-    btreenode_dealloc,                          /* tp_dealloc */
+    nodeshare_dealloc,                          /* tp_dealloc */
     0,                                          /* tp_vectorcall_offset */
     0,                                          /* tp_getattr */
     0,                                          /* tp_setattr */
@@ -245,42 +813,127 @@ static PyTypeObject PyBTreeNode_Type = {
     0,                                          /* tp_as_buffer */
     Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,    /* tp_flags */
     0,                                          /* tp_doc */
-    btreenode_traverse,                         /* tp_traverse */
-    btreenode_clear,                            /* tp_clear */
-    0,                                          /* tp_richcompare */
-    0,                                          /* tp_weaklistoffset */
-    0,                                          /* tp_iter */
-    0,                                          /* tp_iternext */
-    0,                                          /* tp_methods */
-    0,                                          /* tp_members */
-    0,                                          /* tp_getset */
-    0,                                          /* tp_base */
-    0,                                          /* tp_dict */
-    0,                                          /* tp_descr_get */
-    0,                                          /* tp_descr_set */
-    0,                                          /* tp_dictoffset */
-    0,                                          /* tp_init */
-    0,                                          /* tp_alloc */
-    0,                                          /* tp_new */
-    PyObject_GC_Del,                            /* tp_free */
+    nodeshare_traverse,                         /* tp_traverse */
 };
 
+/* Take a new owner's reference to node, which already has an owner (the
+ * caller's tree or node). The first share gives the node a NodeShare
+ * counting both owners; it is kept until the last owner lets go, so the
+ * children of a node that is copied again and again are shared for free.
+ * Returns -1 with MemoryError set. */
+static int
+node_share(PyBTreeNode *node)
+{
+    PyObject *share = NODE_SHARE(node);
+
+    if (share == NULL) {
+        NodeShareObject *created = PyObject_GC_New(NodeShareObject, &NodeShare_Type);
+        if (created == NULL) {
+            return -1;
+        }
+        created->node = NULL;
+#ifdef Py_GIL_DISABLED
+        /* Two trees copying a shared parent may share its children at once */
+        if (!_Py_atomic_compare_exchange_ptr(&node->share, &share, created)) {
+            Py_DECREF(created);
+            Py_INCREF(share);
+            NODE_PIN(node);
+            return 0;
+        }
+#else
+        node->share = (PyObject *)created;
+#endif
+        created->node = node;
+        share = (PyObject *)created;
+        PyObject_GC_Track(share);
+    }
+    Py_INCREF(share);
+    NODE_PIN(node);
+    return 0;
+}
+
+/* Visit the subtree at node for the cyclic GC: through its NodeShare once
+ * it has been shared, else directly (the caller is its only owner) */
+static int
+node_traverse(PyBTreeNode *node, visitproc visit, void *arg)
+{
+    PyObject *share;
+
+    if (node == NULL) {
+        return 0;
+    }
+    share = NODE_SHARE(node);
+    if (share != NULL) {
+        Py_VISIT(share);
+        return 0;
+    }
+    return node_traverse_items(node, visit, arg);
+}
+
 /* ==================== BTree Implementation ==================== */
 
+/* A bt[key] = value held back by a write_buffer= tree, see btree_buffer_write() */
+typedef struct {
+    long long order_key;          /* key as an int64 with the same order */
+    PyObject *key;
+    PyObject *value;
+} BufferedWrite;
+
 typedef struct _PyBTreeObject {
     PyObject_HEAD
     PyBTreeNode *root;           /* Root node of the tree */
     Py_ssize_t size;             /* Total number of key-value pairs */
     int order;                    /* Order (minimum degree) of the B-tree */
     int cache_i64;                /* Enable int64 key cache */
+    int key_storage;              /* Storage of the nodes' keys (KEYS_*) */
+    int readonly;                 /* Snapshot: mutation raises TypeError */
+    int bplus;                    /* Leaf-chained B+tree layout */
+    int eytzinger;                /* key_layout="eytzinger" */
+    int duplicates;               /* duplicates=True: equal keys allowed */
+    int cache_pairs;              /* cache_pairs=True: cache int64 2-tuple keys */
+    size_t version;               /* Bumped by every write, see btree_begin_write() */
+    int aggregate;                /* Values combined by aggregate_range() (AGG_*) */
+    PyObject *agg_func;           /* Combining callable for AGG_CALL, else NULL */
+    Py_ssize_t wbuf_size;         /* write_buffer=: writes held back, 0 for none */
+    Py_ssize_t wbuf_n;            /* Writes waiting in wbuf */
+    Py_ssize_t wbuf_cap;          /* Room in wbuf, grown up to wbuf_size */
+    BufferedWrite *wbuf;          /* wbuf_cap writes and as many for sorting */
+    Py_ssize_t searches;          /* B+tree searches in progress, see BTREE_SEARCH_ENTER */
+    int edge_hint;                /* End the last insert landed at, see btree_edge_of() */
 } PyBTreeObject;
 
+/* aggregate= of a tree */
+#define AGG_NONE 0
+#define AGG_SUM 1
+#define AGG_MIN 2
+#define AGG_MAX 3
+#define AGG_CALL 4
+
+/* Storage argument for node_alloc() when creating a node of btree */
+#define BTREE_KEY_SPEC(btree) \
+    ((btree)->key_storage | ((btree)->eytzinger ? KEYS_EYTZINGER : 0) | \
+     ((btree)->duplicates ? KEYS_DUPLICATES : 0) | ((btree)->cache_pairs ? KEYS_PAIRS : 0))
+
+/* Whether writers pass the nodes they modify through node_unshare(): B+tree
+ * nodes are never shared, but the call also marks cached aggregates stale */
+#define BTREE_UNSHARES(btree) (!(btree)->bplus || (btree)->aggregate != AGG_NONE)
+
+/* B+tree nodes are searched in place under the tree lock rather than on a
+ * pinned root, so writes are refused while such a search runs: a key
+ * comparison that writes to the tree, or another thread that takes the lock
+ * while a comparison waits (free-threaded builds), gets RuntimeError instead
+ * of freeing the nodes under the search. See btree_begin_write(). */
+#define BTREE_SEARCH_ENTER(btree) ((btree)->searches += (btree)->bplus)
+#define BTREE_SEARCH_EXIT(btree) ((btree)->searches -= (btree)->bplus)
+
+/* Apply the writes a write_buffer= tree holds back before anything else
+ * reads the tree or writes to it; nonzero if that failed */
+#define BTREE_FLUSH(btree) ((btree)->wbuf_n > 0 && btree_flush_writes(btree) < 0)
+static int btree_flush_writes(PyBTreeObject *btree);
+
 /* Forward declarations */
 static PyTypeObject PyBTree_Type;
 
-/* Type check macro */
-#define PyBTree_Check(op) PyObject_TypeCheck((op), &PyBTree_Type)
-
 static void btree_dealloc(PyObject *self);
 static int btree_traverse(PyObject *self, visitproc visit, void *arg);
 static int btree_clear_internal(PyBTreeObject *self);
@@ -330,6 +983,7 @@ compare_keys(PyObject *a, PyObject *b)
         }
 
         /* Fallback for big ints: use rich comparison */
+        BTREE_COUNT(rich_compares);
         int result = PyObject_RichCompareBool(a, b, Py_LT);
         if (result < 0) {
             return -2;
@@ -370,10 +1024,41 @@ compare_keys(PyObject *a, PyObject *b)
         if (cmp > 0) return 1;
         return 0;
     }
-    
-    /* General case: use rich comparison */
-    int result = PyObject_RichCompareBool(a, b, Py_EQ);
-    if (result < 0) {
+
+    /* For tuples, compare the items with the paths above in one pass. The
+     * first unequal pair of items decides, as in tuple's own comparison,
+     * instead of an EQ and then an LT walk over the same items. */
+    if (PyTuple_CheckExact(a) && PyTuple_CheckExact(b)) {
+        Py_ssize_t len_a = PyTuple_GET_SIZE(a), len_b = PyTuple_GET_SIZE(b);
+        Py_ssize_t i;
+
+        for (i = 0; i < len_a && i < len_b; i++) {
+            PyObject *item_a = PyTuple_GET_ITEM(a, i);
+            PyObject *item_b = PyTuple_GET_ITEM(b, i);
+            int cmp;
+
+            if (PyTuple_CheckExact(item_a)) {
+                /* Nested tuples recurse */
+                if (Py_EnterRecursiveCall(" in comparison")) {
+                    return -2;
+                }
+                cmp = compare_keys(item_a, item_b);
+                Py_LeaveRecursiveCall();
+            }
+            else {
+                cmp = compare_keys(item_a, item_b);
+            }
+            if (cmp != 0) {
+                return cmp;
+            }
+        }
+        return len_a < len_b ? -1 : len_a > len_b;
+    }
+
+    /* General case: use rich comparison */
+    BTREE_COUNT(rich_compares);
+    int result = PyObject_RichCompareBool(a, b, Py_EQ);
+    if (result < 0) {
         return -2;  /* Error */
     }
     if (result) {
@@ -391,6 +1076,294 @@ compare_keys(PyObject *a, PyObject *b)
     return 1;       /* a > b */
 }
 
+/* ==================== int64 Search Kernels ==================== */
+
+/* Lower bound (number of keys < k) over n sorted int64 keys. The kernel is
+ * picked once at import from the CPU's features: each halves the range with
+ * branchless steps until it fits a few vectors, then counts the keys below
+ * k with vector compares instead of branching on every probe. */
+typedef Py_ssize_t (*i64_search_fn)(const long long *keys, Py_ssize_t n, long long k);
+
+static Py_ssize_t
+i64_lower_bound_scalar(const long long *keys, Py_ssize_t n, long long k)
+{
+    const long long *base = keys;
+
+    if (n == 0) {
+        return 0;
+    }
+    while (n > 1) {
+        Py_ssize_t half = n / 2;
+        base = base[half] < k ? base + half : base;
+        n -= half;
+    }
+    return (base - keys) + (*base < k);
+}
+
+#if defined(BTREE_HAVE_X86_KERNELS)
+__attribute__((target("avx2,popcnt")))
+static Py_ssize_t
+i64_lower_bound_avx2(const long long *keys, Py_ssize_t n, long long k)
+{
+    const long long *base = keys;
+    __m256i probe = _mm256_set1_epi64x(k);
+    Py_ssize_t count = 0, i = 0;
+
+    while (n > 16) {
+        Py_ssize_t half = n / 2;
+        base = base[half] < k ? base + half : base;
+        n -= half;
+    }
+    for (; i + 4 <= n; i += 4) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(base + i));
+        __m256i lt = _mm256_cmpgt_epi64(probe, v);
+        count += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(lt)));
+    }
+    for (; i < n; i++) {
+        count += base[i] < k;
+    }
+    return (base - keys) + count;
+}
+
+__attribute__((target("avx512f")))
+static Py_ssize_t
+i64_lower_bound_avx512(const long long *keys, Py_ssize_t n, long long k)
+{
+    const long long *base = keys;
+    __m512i probe = _mm512_set1_epi64(k);
+    Py_ssize_t count = 0, i = 0;
+
+    while (n > 32) {
+        Py_ssize_t half = n / 2;
+        base = base[half] < k ? base + half : base;
+        n -= half;
+    }
+    for (; i < n; i += 8) {
+        __mmask8 live = (__mmask8)(n - i >= 8 ? 0xFF : (1u << (n - i)) - 1);
+        __m512i v = _mm512_maskz_loadu_epi64(live, base + i);
+        count += __builtin_popcount(_mm512_mask_cmpgt_epi64_mask(live, probe, v));
+    }
+    return (base - keys) + count;
+}
+#endif
+
+#if defined(BTREE_HAVE_NEON_KERNEL)
+static Py_ssize_t
+i64_lower_bound_neon(const long long *keys, Py_ssize_t n, long long k)
+{
+    const long long *base = keys;
+    int64x2_t probe = vdupq_n_s64(k);
+    int64x2_t acc = vdupq_n_s64(0);
+    Py_ssize_t count = 0, i = 0;
+
+    while (n > 8) {
+        Py_ssize_t half = n / 2;
+        base = base[half] < k ? base + half : base;
+        n -= half;
+    }
+    for (; i + 2 <= n; i += 2) {
+        /* Lanes below k compare to all ones, i.e. -1 */
+        uint64x2_t lt = vcltq_s64(vld1q_s64((const int64_t *)(base + i)), probe);
+        acc = vsubq_s64(acc, vreinterpretq_s64_u64(lt));
+    }
+    count = (Py_ssize_t)vaddvq_s64(acc);
+    for (; i < n; i++) {
+        count += base[i] < k;
+    }
+    return (base - keys) + count;
+}
+#endif
+
+#if defined(__GNUC__)
+#define BTREE_PREFETCH(p) __builtin_prefetch(p)
+#define BTREE_CTZ(x) __builtin_ctzll(x)
+#else
+#define BTREE_PREFETCH(p) ((void)0)
+static inline int
+btree_ctz(unsigned long long x)
+{
+    int n = 0;
+    while (!(x & 1)) {
+        x >>= 1;
+        n++;
+    }
+    return n;
+}
+#define BTREE_CTZ(x) btree_ctz(x)
+#endif
+
+static i64_search_fn i64_lower_bound = i64_lower_bound_scalar;
+static const char *i64_search_kernel = "scalar";
+
+/* Pick the widest kernel the running CPU supports; called once at import */
+static void
+select_i64_search_kernel(void)
+{
+#if defined(BTREE_HAVE_X86_KERNELS)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        i64_lower_bound = i64_lower_bound_avx512;
+        i64_search_kernel = "avx512";
+        return;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+        i64_lower_bound = i64_lower_bound_avx2;
+        i64_search_kernel = "avx2";
+        return;
+    }
+#elif defined(BTREE_HAVE_NEON_KERNEL)
+    i64_lower_bound = i64_lower_bound_neon;
+    i64_search_kernel = "neon";
+#endif
+}
+
+/* ---------- Eytzinger search copy ----------
+ * key_layout="eytzinger" keeps, next to the sorted keys, a copy of a node's
+ * int64 keys in BFS order of the implicit binary search tree (slot k has
+ * children 2k and 2k+1). A search then reads slots 1, 2-3, 4-7, ..., so the
+ * top levels share cache lines and the next levels can be prefetched. Writes
+ * keep updating only the sorted arrays; the copy is rebuilt in O(n) by the
+ * first read search after a change. */
+
+/* Fill the subtree rooted at slot k with keys[i...] in order; returns the
+ * next unused key */
+static Py_ssize_t
+eytzinger_fill(PyBTreeNode *node, const long long *keys, Py_ssize_t i, Py_ssize_t k)
+{
+    if (k <= node->n_keys) {
+        i = eytzinger_fill(node, keys, i, 2 * k);
+        node->eyt_keys[k] = keys[i];
+        node->eyt_rank[k] = (int)i;
+        i = eytzinger_fill(node, keys, i + 1, 2 * k + 1);
+    }
+    return i;
+}
+
+/* Rebuild the Eytzinger copy. Leaves eyt_n at EYT_NONE when some key is not
+ * an int64 or memory is short; searches then use the sorted keys. */
+static void
+node_build_eytzinger(PyBTreeNode *node)
+{
+    const long long *keys;
+
+#ifdef Py_GIL_DISABLED
+    Py_ssize_t stale = EYT_STALE;
+    if (!_Py_atomic_compare_exchange_ssize(&node->eyt_n, &stale, EYT_BUILDING)) {
+        return;  /* Another search is rebuilding it */
+    }
+#endif
+    if (node->nkeys != NULL) {
+        keys = &node->nkeys[0].i64;
+    }
+    else if (node_all_cached(node, CACHE_I64)) {
+        keys = node->keys_i64;
+    }
+    else {
+        NODE_EYT_PUBLISH(node, EYT_NONE);
+        return;
+    }
+    if (node->eyt_keys == NULL) {
+        Py_ssize_t slots = 2 * (Py_ssize_t)node->order;
+        char *block = (char *)PyMem_Malloc(slots * (sizeof(long long) + sizeof(int)));
+        if (block == NULL) {
+            NODE_EYT_PUBLISH(node, EYT_NONE);
+            return;
+        }
+        node->eyt_keys = (long long *)block;
+        node->eyt_rank = (int *)(block + slots * sizeof(long long));
+    }
+    eytzinger_fill(node, keys, 0, 1);
+    NODE_EYT_PUBLISH(node, node->n_keys);
+}
+
+/* Lower bound of k through a built Eytzinger copy */
+static inline Py_ssize_t
+eytzinger_lower_bound(PyBTreeNode *node, long long k, int *found)
+{
+    const long long *eyt = node->eyt_keys;
+    size_t n = (size_t)node->eyt_n;
+    size_t i = 1;
+
+    while (i <= n) {
+        /* Slots 16i... are four levels down: two cache lines of keys */
+        BTREE_PREFETCH(eyt + 16 * i);
+        BTREE_PREFETCH(eyt + 16 * i + 8);
+        i = 2 * i + (eyt[i] < k);
+    }
+    /* Drop the trailing right turns and the last left turn: what remains is
+     * the slot of the first key >= k, or 0 if every key is below k */
+    i >>= BTREE_CTZ(~(unsigned long long)i) + 1;
+    if (i == 0) {
+        *found = 0;
+        return (Py_ssize_t)n;
+    }
+    *found = eyt[i] == k;
+    return node->eyt_rank[i];
+}
+
+/* node_search_key() for typed nodes: convert key once, then a lower-bound
+ * binary search over the packed native keys with no per-probe type checks. */
+static Py_ssize_t
+node_search_native(PyBTreeNode *node, PyObject *key, int *found)
+{
+    NativeKey k;
+    int overflow;
+    Py_ssize_t low = 0, high = node->n_keys;
+
+    *found = 0;
+    if (native_key_convert(node->key_storage, key, &k, &overflow) < 0) {
+        return -1;
+    }
+    if (overflow) {
+        /* Beyond the int64 range: before or after every stored key */
+        return overflow < 0 ? 0 : node->n_keys;
+    }
+
+    if (node->key_storage == KEYS_I64) {
+        const long long *keys = &node->nkeys[0].i64;
+        if (NODE_EYT_N(node) >= 0) {
+            return eytzinger_lower_bound(node, k.i64, found);
+        }
+        low = i64_lower_bound(keys, node->n_keys, k.i64);
+        *found = low < node->n_keys && keys[low] == k.i64;
+    }
+    else {
+        const NativeKey *keys = node->nkeys;
+        while (low < high) {
+            Py_ssize_t mid = low + (high - low) / 2;
+            if (keys[mid].f64 < k.f64) {
+                low = mid + 1;
+            }
+            else {
+                high = mid;
+            }
+        }
+        *found = low < node->n_keys && keys[low].f64 == k.f64;
+    }
+    return low;
+}
+
+/* node_search_key() in a node whose keys are all cached as CACHE_PAIR: the
+ * run of keys with the first item is found in the first column, then the
+ * second item within it, both with the int64 kernels. */
+static Py_ssize_t
+node_search_pair(PyBTreeNode *node, long long first, long long second, int *found)
+{
+    const long long *a = node->keys_i64, *b = node->keys_i64_2;
+    Py_ssize_t n = node->n_keys;
+    Py_ssize_t low = i64_lower_bound(a, n, first);
+    Py_ssize_t high;
+
+    if (low == n || a[low] != first) {
+        *found = 0;
+        return low;
+    }
+    high = first == LLONG_MAX ? n : low + i64_lower_bound(a + low, n - low, first + 1);
+    low += i64_lower_bound(b + low, high - low, second);
+    *found = low < high && b[low] == second;
+    return low;
+}
+
 /* Search for a key in a node using binary search, returning the index 
  * where the key is found or should be inserted. 
  * Sets *found to 1 if key is found, 0 otherwise.
@@ -401,6 +1374,10 @@ node_search_key(PyBTreeNode *node, PyObject *key, int *found)
 {
     Py_ssize_t low = 0;
     Py_ssize_t high = node->n_keys - 1;
+
+    if (node->nkeys != NULL) {
+        return node_search_native(node, key, found);
+    }
     *found = 0;
 
     int key_is_int64 = 0;
@@ -416,13 +1393,71 @@ node_search_key(PyBTreeNode *node, PyObject *key, int *found)
         }
     }
 
+    /* Every key cached as an exact int64: the native kernels give the same
+     * answer as comparing the objects */
+    if (key_is_int64 && NODE_EYT_N(node) >= 0) {
+        BTREE_COUNT(cache_i64_hits);
+        return eytzinger_lower_bound(node, key_ll, found);
+    }
+    if (key_is_int64 && node_all_cached(node, CACHE_I64)) {
+        BTREE_COUNT(cache_i64_hits);
+        low = i64_lower_bound(node->keys_i64, node->n_keys, key_ll);
+        *found = low < node->n_keys && node->keys_i64[low] == key_ll;
+        return low;
+    }
+    if (key_is_int64 && node->n_keys > 0) {
+        BTREE_COUNT(cache_i64_misses);
+    }
+
+    /* Likewise for a 2-tuple of int64 in a tree with cache_pairs=True */
+    long long key_first = 0, key_second = 0;
+    int key_is_pair = node->keys_i64_2 != NULL &&
+                      exact_int64_pair(key, &key_first, &key_second);
+    if (key_is_pair && node_all_cached(node, CACHE_PAIR)) {
+        return node_search_pair(node, key_first, key_second, found);
+    }
+
+    /* Cached str prefixes decide the comparison unless they are equal. With
+     * the first and last keys sharing one prefix, every key in between does
+     * too, and only a key outside the node can be told apart by it. */
+    int key_is_str = node->keys_i64_valid != NULL && node->n_keys > 0 &&
+                     node->keys_i64_valid[0] == CACHE_STR &&
+                     node->keys_i64_valid[node->n_keys - 1] == CACHE_STR &&
+                     PyUnicode_CheckExact(key);
+    unsigned long long key_prefix = 0;
+    if (key_is_str) {
+        unsigned long long first = (unsigned long long)node->keys_i64[0];
+        unsigned long long last = (unsigned long long)node->keys_i64[node->n_keys - 1];
+        key_prefix = str_prefix(key);
+        if (key_prefix < first) {
+            return 0;
+        }
+        if (key_prefix > last) {
+            return node->n_keys;
+        }
+        key_is_str = first != last;
+    }
+
     while (low <= high) {
         Py_ssize_t mid = low + (high - low) / 2;
         int cmp;
         PyObject *mid_key = node->keys[mid];
 
-        if (key_is_int64 && PyLong_CheckExact(mid_key)) {
-            if (node->keys_i64_valid && node->keys_i64_valid[mid]) {
+        if (key_is_str && node->keys_i64_valid[mid] == CACHE_STR &&
+            (unsigned long long)node->keys_i64[mid] != key_prefix) {
+            cmp = key_prefix < (unsigned long long)node->keys_i64[mid] ? -1 : 1;
+        }
+        else if (key_is_pair && node->keys_i64_valid[mid] == CACHE_PAIR) {
+            long long mid_first = node->keys_i64[mid], mid_second = node->keys_i64_2[mid];
+            if (key_first != mid_first) {
+                cmp = key_first < mid_first ? -1 : 1;
+            }
+            else {
+                cmp = key_second < mid_second ? -1 : key_second > mid_second;
+            }
+        }
+        else if (key_is_int64 && PyLong_CheckExact(mid_key)) {
+            if (node->keys_i64_valid && node->keys_i64_valid[mid] == CACHE_I64) {
                 long long mid_ll = node->keys_i64[mid];
                 if (key_ll < mid_ll) {
                     cmp = -1;
@@ -476,6 +1511,127 @@ node_search_key(PyBTreeNode *node, PyObject *key, int *found)
     return low;  /* Insert position */
 }
 
+/* Rebuild node's Eytzinger copy if a write left it stale */
+static inline void
+node_refresh_eytzinger(PyBTreeNode *node)
+{
+    if (node->eytzinger && NODE_EYT_N(node) == EYT_STALE) {
+        node_build_eytzinger(node);
+    }
+}
+
+/* node_search_key() for lookups: refresh a stale Eytzinger copy first.
+ * Writers call node_search_key() directly and leave the copy stale. */
+static inline Py_ssize_t
+node_search_read(PyBTreeNode *node, PyObject *key, int *found)
+{
+    node_refresh_eytzinger(node);
+    return node_search_key(node, key, found);
+}
+
+/* Compare key with the key in slot idx, with the result convention of
+ * compare_keys(key, slot key): -1, 0, 1, or -2 on error. */
+static int
+node_compare_key(PyObject *key, PyBTreeNode *node, Py_ssize_t idx)
+{
+    NativeKey k;
+    int overflow;
+
+    if (node->nkeys == NULL) {
+        return compare_keys(key, node->keys[idx]);
+    }
+    if (native_key_convert(node->key_storage, key, &k, &overflow) < 0) {
+        return -2;
+    }
+    if (overflow) {
+        return overflow < 0 ? -1 : 1;
+    }
+    if (node->key_storage == KEYS_I64) {
+        return k.i64 < node->nkeys[idx].i64 ? -1 : k.i64 > node->nkeys[idx].i64;
+    }
+    return k.f64 < node->nkeys[idx].f64 ? -1 : k.f64 > node->nkeys[idx].f64;
+}
+
+/* node_search_key() for trees with duplicates=True, where it stops at any
+ * of several equal keys: the first slot with a key >= key, or > key when
+ * upper is true. Sets *found if the node holds a key equal to key. The
+ * equal run is narrowed by a second binary search, so a node full of one
+ * key costs O(log order) comparisons like any other. Returns -1 on error. */
+static Py_ssize_t
+node_search_bound(PyBTreeNode *node, PyObject *key, int upper, int *found)
+{
+    Py_ssize_t i = node_search_key(node, key, found);
+    Py_ssize_t low, high;
+
+    if (i < 0 || !*found) {
+        return i;
+    }
+    if (node->key_storage == KEYS_I64 || node_all_cached(node, CACHE_I64)) {
+        /* Bound the run by its int64 value, without comparing objects */
+        const long long *keys = node->nkeys != NULL ? &node->nkeys[0].i64 : node->keys_i64;
+        long long k = keys[i];
+
+        if (!upper) {
+            return i64_lower_bound(keys, i + 1, k);
+        }
+        return k == LLONG_MAX ? node->n_keys
+                              : i + i64_lower_bound(keys + i, node->n_keys - i, k + 1);
+    }
+    /* Slot i holds key: search (low, high] for the end of the run */
+    if (upper) {
+        low = i;
+        high = node->n_keys;
+    }
+    else {
+        low = -1;
+        high = i;
+    }
+    while (high - low > 1) {
+        Py_ssize_t mid = low + (high - low) / 2;
+        int cmp = node_compare_key(key, node, mid);
+
+        if (cmp == -2) {
+            return -1;
+        }
+        if (upper ? cmp < 0 : cmp == 0) {
+            high = mid;
+        }
+        else {
+            low = mid;
+        }
+    }
+    return high;
+}
+
+/* node_search() in a tree with duplicates: the value of the first key equal
+ * to key. A match in an internal node is only a candidate until the subtree
+ * to its left turns out to hold no equal key. */
+static PyObject *
+node_search_first(PyBTreeNode *node, PyObject *key)
+{
+    PyObject *first = NULL;
+
+    for (;;) {
+        int found;
+        Py_ssize_t i;
+
+        node_refresh_eytzinger(node);
+        i = node_search_bound(node, key, 0, &found);
+        if (i < 0) {
+            return NULL;
+        }
+        if (found) {
+            first = node->values[i];
+        }
+        if (node->is_leaf) {
+            break;
+        }
+        node = node->children[i];
+    }
+    Py_XINCREF(first);
+    return first;
+}
+
 /* Search for a key starting from a node. Returns the value if found,
  * NULL if not found (does not set exception).
  */
@@ -485,18 +1641,23 @@ node_search(PyBTreeNode *node, PyObject *key)
     int found;
     Py_ssize_t i;
 
+    if (node != NULL && node->duplicates) {
+        return node_search_first(node, key);
+    }
     while (node != NULL) {
-        i = node_search_key(node, key, &found);
+        i = node_search_read(node, key, &found);
         if (i < 0) {
             return NULL;  /* Error already set */
         }
 
         if (found) {
-            Py_INCREF(node->values[i]);
-            return node->values[i];
+            if (NODE_HAS_ITEMS(node)) {
+                Py_INCREF(node->values[i]);
+                return node->values[i];
+            }
+            i++;  /* B+tree separator: equal keys live to the right */
         }
-
-        if (node->is_leaf) {
+        else if (node->is_leaf) {
             return NULL;  /* Not found */
         }
 
@@ -506,170 +1667,284 @@ node_search(PyBTreeNode *node, PyObject *key)
     return NULL;
 }
 
-/* Split a full child node. The parent must have room for one more key. */
+/* Number of items stored in the subtree rooted at node. Internal nodes keep
+ * the size of each child's subtree in counts[], so this is O(order). */
+static Py_ssize_t
+node_size(PyBTreeNode *node)
+{
+    Py_ssize_t i, total = NODE_HAS_ITEMS(node) ? node->n_keys : 0;
+
+    if (!node->is_leaf) {
+        for (i = 0; i <= node->n_keys; i++) {
+            total += node->counts[i];
+        }
+    }
+    return total;
+}
+
+/* ==================== Copy-on-Write Node Sharing ==================== */
+
+/* Nodes are reference counted and may be shared between a tree and its
+ * snapshots. A node referenced more than once is immutable: writers copy it
+ * (and only it) before changing it, so a mutation copies at most the nodes
+ * on the paths it touches and a snapshot keeps seeing the old versions.
+ */
+
+/* Copy a single node. Keys, values and children are shared (INCREF'd,
+ * node_share()).
+ * Leaf chain pointers are not copied. */
+static PyBTreeNode *
+node_copy_shallow(PyBTreeNode *src)
+{
+    PyBTreeNode *dst;
+    Py_ssize_t i, n = src->n_keys;
+    int agg_valid = src->agg_valid;
+
+    dst = node_alloc(src->order, src->is_leaf, NODE_HAS_ITEMS(src),
+                                    NODE_KEY_SPEC(src));
+    if (dst == NULL) {
+        return NULL;
+    }
+
+    move_keys(dst, 0, src, 0, n);
+    src->agg_valid = agg_valid;   /* src keeps its keys */
+    if (dst->keys != NULL) {
+        for (i = 0; i < n; i++) {
+            Py_INCREF(dst->keys[i]);
+        }
+    }
+    if (NODE_HAS_ITEMS(src)) {
+        memcpy(dst->values, src->values, n * sizeof(PyObject *));
+        for (i = 0; i < n; i++) {
+            Py_INCREF(dst->values[i]);
+        }
+    }
+    dst->n_keys = n;
+    if (!src->is_leaf) {
+        memcpy(dst->counts, src->counts, (n + 1) * sizeof(Py_ssize_t));
+        for (i = 0; i <= n; i++) {
+            if (node_share(src->children[i]) < 0) {
+                NODE_DECREF(dst);
+                return NULL;
+            }
+            dst->children[i] = src->children[i];
+        }
+    }
+
+    return dst;
+}
+
+/* Make the node stored in *slot safe to modify, replacing it with a private
+ * copy if it is shared. The owner of slot must itself be writable.
+ * Returns the writable node, or NULL on failure (the tree is left unchanged).
+ */
+static PyBTreeNode *
+node_unshare(PyBTreeNode **slot)
+{
+    PyBTreeNode *node = *slot;
+    PyBTreeNode *copy;
+
+    if (NODE_REFCNT(node) == 1) {
+        NODE_AGG_CHANGED(node);   /* The caller is about to modify it */
+        return node;
+    }
+    copy = node_copy_shallow(node);
+    if (copy == NULL) {
+        return NULL;
+    }
+    node_setref(slot, copy);
+    return copy;
+}
+
+/* Split a full child node. The parent must have room for one more key.
+ * Both the parent and the child must be writable. */
 static int
 split_child(PyBTreeNode *parent, Py_ssize_t child_index)
 {
     PyBTreeNode *full_child = parent->children[child_index];
     int order = full_child->order;
     Py_ssize_t t = order;
+    Py_ssize_t total = parent->counts[child_index];
 
     /* Create a new node that will hold the right half */
-    PyBTreeNode *new_node = (PyBTreeNode *)btreenode_new(order, full_child->is_leaf, full_child->keys_i64_valid != NULL);
+    PyBTreeNode *new_node = btreenode_new(order, full_child->is_leaf,
+                                                         NODE_KEY_SPEC(full_child));
     if (new_node == NULL) {
         return -1;
     }
+    BTREE_COUNT(splits);
 
     /* Copy the right half of keys and values to new_node */
     new_node->n_keys = t - 1;
-    memcpy(new_node->keys, &full_child->keys[t], (t - 1) * sizeof(PyObject *));
+    move_keys(new_node, 0, full_child, t, t - 1);
     memcpy(new_node->values, &full_child->values[t], (t - 1) * sizeof(PyObject *));
-    if (new_node->keys_i64_valid) {
-        memcpy(new_node->keys_i64, &full_child->keys_i64[t], (t - 1) * sizeof(long long));
-        memcpy(new_node->keys_i64_valid, &full_child->keys_i64_valid[t], (t - 1) * sizeof(unsigned char));
-    }
     
     /* Clear moved pointers in full_child to avoid double-free/decref issues */
-    memset(&full_child->keys[t], 0, (t - 1) * sizeof(PyObject *));
+    clear_keys(full_child, t, t - 1);
     memset(&full_child->values[t], 0, (t - 1) * sizeof(PyObject *));
-    if (full_child->keys_i64_valid) {
-        memset(&full_child->keys_i64_valid[t], 0, (t - 1) * sizeof(unsigned char));
-    }
 
     /* Copy children if not a leaf */
     if (!full_child->is_leaf) {
         memcpy(new_node->children, &full_child->children[t], t * sizeof(PyBTreeNode *));
+        memcpy(new_node->counts, &full_child->counts[t], t * sizeof(Py_ssize_t));
         memset(&full_child->children[t], 0, t * sizeof(PyBTreeNode *));
+        memset(&full_child->counts[t], 0, t * sizeof(Py_ssize_t));
     }
 
     /* Move parent's keys and children to make room */
     if (parent->n_keys > child_index) {
-        memmove(&parent->keys[child_index + 1], &parent->keys[child_index], (parent->n_keys - child_index) * sizeof(PyObject *));
+        move_keys(parent, child_index + 1, parent, child_index, parent->n_keys - child_index);
         memmove(&parent->values[child_index + 1], &parent->values[child_index], (parent->n_keys - child_index) * sizeof(PyObject *));
-        if (parent->keys_i64_valid) {
-            memmove(&parent->keys_i64[child_index + 1], &parent->keys_i64[child_index], (parent->n_keys - child_index) * sizeof(long long));
-            memmove(&parent->keys_i64_valid[child_index + 1], &parent->keys_i64_valid[child_index], (parent->n_keys - child_index) * sizeof(unsigned char));
-        }
     }
     
     if (parent->n_keys + 1 > child_index + 1) {
         memmove(&parent->children[child_index + 2], &parent->children[child_index + 1], (parent->n_keys - child_index) * sizeof(PyBTreeNode *));
+        memmove(&parent->counts[child_index + 2], &parent->counts[child_index + 1], (parent->n_keys - child_index) * sizeof(Py_ssize_t));
     }
 
     /* Insert the middle key into parent */
-    parent->keys[child_index] = full_child->keys[t - 1];
+    move_keys(parent, child_index, full_child, t - 1, 1);
     parent->values[child_index] = full_child->values[t - 1];
-    if (parent->keys_i64_valid) {
-        parent->keys_i64[child_index] = full_child->keys_i64[t - 1];
-        parent->keys_i64_valid[child_index] = full_child->keys_i64_valid[t - 1];
-    }
-    full_child->keys[t - 1] = NULL;
+    clear_keys(full_child, t - 1, 1);
     full_child->values[t - 1] = NULL;
-    if (full_child->keys_i64_valid) {
-        full_child->keys_i64_valid[t - 1] = 0;
-    }
 
     parent->children[child_index + 1] = new_node;
     full_child->n_keys = t - 1;
     parent->n_keys++;
+    parent->counts[child_index] = node_size(full_child);
+    parent->counts[child_index + 1] = total - parent->counts[child_index] - 1;
 
     return 0;
 }
 
-/* Insert a key-value pair into a non-full node - optimized with binary search */
+/* Insert a key-value pair into a writable, non-full leaf.
+ * Returns 0 if a new key was inserted, 1 if an existing value was replaced,
+ * -1 on error. */
 static int
-insert_non_full(PyBTreeNode *node, PyObject *key, PyObject *value)
+leaf_insert(PyBTreeNode *node, PyObject *key, PyObject *value)
 {
-    int order = node->order;
     int found;
     Py_ssize_t i;
 
-    if (node->is_leaf) {
-        /* Use binary search to find insert position */
+    /* Use binary search to find insert position. With duplicates the item
+     * goes after any equal keys and never replaces one. */
+    if (node->duplicates) {
+        i = node_search_bound(node, key, 1, &found);
+        found = 0;
+    }
+    else {
         i = node_search_key(node, key, &found);
-        if (i < 0) {
-            return -1;  /* Error */
-        }
-        
-        if (found) {
-            /* Key exists, update value */
-            Py_INCREF(value);
-            Py_SETREF(node->values[i], value);
-            return 1;  /* Updated existing key */
-        }
-
-        /* Key not found, need to insert at position i */
-        /* Shift keys from the end to make room */
-        if (node->n_keys > i) {
-            memmove(&node->keys[i + 1], &node->keys[i], (node->n_keys - i) * sizeof(PyObject *));
-            memmove(&node->values[i + 1], &node->values[i], (node->n_keys - i) * sizeof(PyObject *));
-            if (node->keys_i64_valid) {
-                memmove(&node->keys_i64[i + 1], &node->keys_i64[i], (node->n_keys - i) * sizeof(long long));
-                memmove(&node->keys_i64_valid[i + 1], &node->keys_i64_valid[i], (node->n_keys - i) * sizeof(unsigned char));
-            }
-        }
-
-        /* Insert new key-value */
-        Py_INCREF(key);
-        Py_INCREF(value);
-        node->keys[i] = key;
-        node->values[i] = value;
-        cache_key(node, i, key);
-        node->n_keys++;
-        return 0;  /* Inserted new key */
     }
-
-    /* Use binary search to find child to descend into */
-    i = node_search_key(node, key, &found);
     if (i < 0) {
         return -1;  /* Error */
     }
     
     if (found) {
-        /* Key exists in internal node, update value */
+        /* Key exists, update value */
+        NODE_AGG_CHANGED(node);
         Py_INCREF(value);
         Py_SETREF(node->values[i], value);
         return 1;  /* Updated existing key */
     }
 
-    /* Check if child is full */
-    if (node->children[i]->n_keys == 2 * order - 1) {
-        if (split_child(node, i) < 0) {
-            return -1;
-        }
-        int cmp = compare_keys(key, node->keys[i]);
-        if (cmp == -2) {
-            return -1;
-        }
-        if (cmp == 0) {
-            Py_INCREF(value);
-            Py_SETREF(node->values[i], value);
-            return 1;
-        }
-        if (cmp > 0) {
-            i++;
-        }
+    /* Key not found, need to insert at position i */
+    /* Shift keys from the end to make room */
+    if (node->n_keys > i) {
+        move_keys(node, i + 1, node, i, node->n_keys - i);
+        memmove(&node->values[i + 1], &node->values[i], (node->n_keys - i) * sizeof(PyObject *));
     }
 
-    return insert_non_full(node->children[i], key, value);
+    /* Insert new key-value */
+    Py_INCREF(value);
+    node_set_key(node, i, key);
+    node->values[i] = value;
+    node->n_keys++;
+    return 0;  /* Inserted new key */
 }
 
-/* ==================== B-Tree Delete Operations ==================== */
-
-/* Get predecessor key-value (rightmost in left subtree) */
+/* Insert a key-value pair into a non-full, writable node - optimized with binary search */
 static int
-get_predecessor(PyBTreeNode *node, Py_ssize_t idx, PyObject **pred_key, PyObject **pred_value)
+insert_non_full(PyBTreeNode *node, PyObject *key, PyObject *value)
 {
-    PyBTreeNode *current = node->children[idx];
-    while (!current->is_leaf) {
+    int order = node->order;
+    int found;
+    Py_ssize_t i;
+
+    if (node->is_leaf) {
+        return leaf_insert(node, key, value);
+    }
+
+    /* Use binary search to find child to descend into */
+    if (node->duplicates) {
+        i = node_search_bound(node, key, 1, &found);
+        found = 0;
+    }
+    else {
+        i = node_search_key(node, key, &found);
+    }
+    if (i < 0) {
+        return -1;  /* Error */
+    }
+    
+    if (found) {
+        /* Key exists in internal node, update value */
+        Py_INCREF(value);
+        Py_SETREF(node->values[i], value);
+        return 1;  /* Updated existing key */
+    }
+
+    if (node_unshare(&node->children[i]) == NULL) {
+        return -1;
+    }
+
+    /* Check if child is full */
+    if (node->children[i]->n_keys == 2 * order - 1) {
+        if (split_child(node, i) < 0) {
+            return -1;
+        }
+        int cmp = node_compare_key(key, node, i);
+        if (cmp == -2) {
+            return -1;
+        }
+        if (cmp == 0 && !node->duplicates) {
+            Py_INCREF(value);
+            Py_SETREF(node->values[i], value);
+            return 1;
+        }
+        if (cmp >= 0) {
+            i++;
+        }
+    }
+
+    int result = insert_non_full(node->children[i], key, value);
+    if (result == 0) {
+        node->counts[i]++;
+    }
+    return result;
+}
+
+/* ==================== B-Tree Delete Operations ==================== */
+
+/* Get predecessor key-value (rightmost in left subtree) as new references.
+ * Returns -1 on memory error. */
+static int
+get_predecessor(PyBTreeNode *node, Py_ssize_t idx, PyObject **pred_key, PyObject **pred_value)
+{
+    PyBTreeNode *current = node->children[idx];
+    while (!current->is_leaf) {
         current = current->children[current->n_keys];
     }
-    *pred_key = current->keys[current->n_keys - 1];
+    *pred_key = node_get_key(current, current->n_keys - 1);
+    if (*pred_key == NULL) {
+        return -1;
+    }
     *pred_value = current->values[current->n_keys - 1];
+    Py_INCREF(*pred_value);
     return 0;
 }
 
-/* Get successor key-value (leftmost in right subtree) */
+/* Get successor key-value (leftmost in right subtree) as new references.
+ * Returns -1 on memory error. */
 static int
 get_successor(PyBTreeNode *node, Py_ssize_t idx, PyObject **succ_key, PyObject **succ_value)
 {
@@ -677,262 +1952,302 @@ get_successor(PyBTreeNode *node, Py_ssize_t idx, PyObject **succ_key, PyObject *
     while (!current->is_leaf) {
         current = current->children[0];
     }
-    *succ_key = current->keys[0];
+    *succ_key = node_get_key(current, 0);
+    if (*succ_key == NULL) {
+        return -1;
+    }
     *succ_value = current->values[0];
+    Py_INCREF(*succ_value);
     return 0;
 }
 
-/* Merge children[idx] with children[idx+1] */
+/* Merge children[idx] with children[idx+1], which together with the
+ * separator must fit in one node. Node and both children must be writable. */
 static void
 merge_children(PyBTreeNode *node, Py_ssize_t idx)
 {
     PyBTreeNode *child = node->children[idx];
     PyBTreeNode *sibling = node->children[idx + 1];
-    Py_ssize_t t = node->order;
+    Py_ssize_t n = child->n_keys;
+
+    BTREE_COUNT(merges);
 
     /* Move key from parent to child */
-    child->keys[t - 1] = node->keys[idx];
-    child->values[t - 1] = node->values[idx];
-    if (child->keys_i64_valid) {
-        child->keys_i64[t - 1] = node->keys_i64[idx];
-        child->keys_i64_valid[t - 1] = node->keys_i64_valid[idx];
-    }
+    move_keys(child, n, node, idx, 1);
+    child->values[n] = node->values[idx];
 
     /* Copy keys from sibling */
-    memcpy(&child->keys[t], sibling->keys, sibling->n_keys * sizeof(PyObject *));
-    memcpy(&child->values[t], sibling->values, sibling->n_keys * sizeof(PyObject *));
-    if (child->keys_i64_valid) {
-        memcpy(&child->keys_i64[t], sibling->keys_i64, sibling->n_keys * sizeof(long long));
-        memcpy(&child->keys_i64_valid[t], sibling->keys_i64_valid, sibling->n_keys * sizeof(unsigned char));
-    }
-    memset(sibling->keys, 0, sibling->n_keys * sizeof(PyObject *));
+    move_keys(child, n + 1, sibling, 0, sibling->n_keys);
+    memcpy(&child->values[n + 1], sibling->values, sibling->n_keys * sizeof(PyObject *));
+    clear_keys(sibling, 0, sibling->n_keys);
     memset(sibling->values, 0, sibling->n_keys * sizeof(PyObject *));
-    if (sibling->keys_i64_valid) {
-        memset(sibling->keys_i64_valid, 0, sibling->n_keys * sizeof(unsigned char));
-    }
 
     /* Copy children if not leaf */
     if (!child->is_leaf) {
-        memcpy(&child->children[t], sibling->children, (sibling->n_keys + 1) * sizeof(PyBTreeNode *));
+        memcpy(&child->children[n + 1], sibling->children, (sibling->n_keys + 1) * sizeof(PyBTreeNode *));
+        memcpy(&child->counts[n + 1], sibling->counts, (sibling->n_keys + 1) * sizeof(Py_ssize_t));
         memset(sibling->children, 0, (sibling->n_keys + 1) * sizeof(PyBTreeNode *));
     }
+    node->counts[idx] += node->counts[idx + 1] + 1;
 
     /* Shift parent's keys */
     if (node->n_keys - 1 > idx) {
-        memmove(&node->keys[idx], &node->keys[idx + 1], (node->n_keys - 1 - idx) * sizeof(PyObject *));
+        move_keys(node, idx, node, idx + 1, node->n_keys - 1 - idx);
         memmove(&node->values[idx], &node->values[idx + 1], (node->n_keys - 1 - idx) * sizeof(PyObject *));
-        if (node->keys_i64_valid) {
-            memmove(&node->keys_i64[idx], &node->keys_i64[idx + 1], (node->n_keys - 1 - idx) * sizeof(long long));
-            memmove(&node->keys_i64_valid[idx], &node->keys_i64_valid[idx + 1], (node->n_keys - 1 - idx) * sizeof(unsigned char));
-        }
     }
-    node->keys[node->n_keys - 1] = NULL;
+    clear_keys(node, node->n_keys - 1, 1);
     node->values[node->n_keys - 1] = NULL;
-    if (node->keys_i64_valid) {
-        node->keys_i64_valid[node->n_keys - 1] = 0;
-    }
 
     /* Shift parent's children */
     if (node->n_keys > idx + 1) {
         memmove(&node->children[idx + 1], &node->children[idx + 2], (node->n_keys - (idx + 1)) * sizeof(PyBTreeNode *));
+        memmove(&node->counts[idx + 1], &node->counts[idx + 2], (node->n_keys - (idx + 1)) * sizeof(Py_ssize_t));
     }
     node->children[node->n_keys] = NULL;
+    node->counts[node->n_keys] = 0;
 
     child->n_keys += sibling->n_keys + 1;
     node->n_keys--;
 
     sibling->n_keys = 0;
-    Py_DECREF(sibling);
+    NODE_DECREF(sibling);
 }
 
-/* Borrow a key from children[idx-1] */
+/* Borrow a key from children[idx-1]. Node and both children must be writable. */
 static void
 borrow_from_prev(PyBTreeNode *node, Py_ssize_t idx)
 {
     PyBTreeNode *child = node->children[idx];
     PyBTreeNode *sibling = node->children[idx - 1];
+    Py_ssize_t moved;
+
+    BTREE_COUNT(borrows);
 
     /* Shift child's keys right */
-    memmove(&child->keys[1], &child->keys[0], child->n_keys * sizeof(PyObject *));
+    move_keys(child, 1, child, 0, child->n_keys);
     memmove(&child->values[1], &child->values[0], child->n_keys * sizeof(PyObject *));
-    if (child->keys_i64_valid) {
-        memmove(&child->keys_i64[1], &child->keys_i64[0], child->n_keys * sizeof(long long));
-        memmove(&child->keys_i64_valid[1], &child->keys_i64_valid[0], child->n_keys * sizeof(unsigned char));
-    }
 
     if (!child->is_leaf) {
         memmove(&child->children[1], &child->children[0], (child->n_keys + 1) * sizeof(PyBTreeNode *));
+        memmove(&child->counts[1], &child->counts[0], (child->n_keys + 1) * sizeof(Py_ssize_t));
     }
 
     /* Move key from parent to child */
-    child->keys[0] = node->keys[idx - 1];
+    move_keys(child, 0, node, idx - 1, 1);
     child->values[0] = node->values[idx - 1];
-    if (child->keys_i64_valid) {
-        child->keys_i64[0] = node->keys_i64[idx - 1];
-        child->keys_i64_valid[0] = node->keys_i64_valid[idx - 1];
-    }
 
+    moved = 1;
     if (!child->is_leaf) {
         child->children[0] = sibling->children[sibling->n_keys];
+        child->counts[0] = sibling->counts[sibling->n_keys];
+        moved += child->counts[0];
         sibling->children[sibling->n_keys] = NULL;
+        sibling->counts[sibling->n_keys] = 0;
     }
+    node->counts[idx] += moved;
+    node->counts[idx - 1] -= moved;
 
     /* Move key from sibling to parent */
-    node->keys[idx - 1] = sibling->keys[sibling->n_keys - 1];
+    move_keys(node, idx - 1, sibling, sibling->n_keys - 1, 1);
     node->values[idx - 1] = sibling->values[sibling->n_keys - 1];
-    sibling->keys[sibling->n_keys - 1] = NULL;
+    clear_keys(sibling, sibling->n_keys - 1, 1);
     sibling->values[sibling->n_keys - 1] = NULL;
-    if (node->keys_i64_valid) {
-        node->keys_i64[idx - 1] = sibling->keys_i64[sibling->n_keys - 1];
-        node->keys_i64_valid[idx - 1] = sibling->keys_i64_valid[sibling->n_keys - 1];
-        sibling->keys_i64_valid[sibling->n_keys - 1] = 0;
-    }
 
     child->n_keys++;
     sibling->n_keys--;
 }
 
-/* Borrow a key from children[idx+1] */
+/* Borrow a key from children[idx+1]. Node and both children must be writable. */
 static void
 borrow_from_next(PyBTreeNode *node, Py_ssize_t idx)
 {
     PyBTreeNode *child = node->children[idx];
     PyBTreeNode *sibling = node->children[idx + 1];
+    Py_ssize_t moved;
+
+    BTREE_COUNT(borrows);
 
     /* Move key from parent to child */
-    child->keys[child->n_keys] = node->keys[idx];
+    move_keys(child, child->n_keys, node, idx, 1);
     child->values[child->n_keys] = node->values[idx];
-    if (child->keys_i64_valid) {
-        child->keys_i64[child->n_keys] = node->keys_i64[idx];
-        child->keys_i64_valid[child->n_keys] = node->keys_i64_valid[idx];
-    }
 
+    moved = 1;
     if (!child->is_leaf) {
         child->children[child->n_keys + 1] = sibling->children[0];
+        child->counts[child->n_keys + 1] = sibling->counts[0];
+        moved += sibling->counts[0];
     }
+    node->counts[idx] += moved;
+    node->counts[idx + 1] -= moved;
 
     /* Move key from sibling to parent */
-    node->keys[idx] = sibling->keys[0];
+    move_keys(node, idx, sibling, 0, 1);
     node->values[idx] = sibling->values[0];
-    if (node->keys_i64_valid) {
-        node->keys_i64[idx] = sibling->keys_i64[0];
-        node->keys_i64_valid[idx] = sibling->keys_i64_valid[0];
-    }
 
     /* Shift sibling's keys left */
     if (sibling->n_keys > 1) {
-        memmove(&sibling->keys[0], &sibling->keys[1], (sibling->n_keys - 1) * sizeof(PyObject *));
+        move_keys(sibling, 0, sibling, 1, sibling->n_keys - 1);
         memmove(&sibling->values[0], &sibling->values[1], (sibling->n_keys - 1) * sizeof(PyObject *));
-        if (sibling->keys_i64_valid) {
-            memmove(&sibling->keys_i64[0], &sibling->keys_i64[1], (sibling->n_keys - 1) * sizeof(long long));
-            memmove(&sibling->keys_i64_valid[0], &sibling->keys_i64_valid[1], (sibling->n_keys - 1) * sizeof(unsigned char));
-        }
     }
-    sibling->keys[sibling->n_keys - 1] = NULL;
+    clear_keys(sibling, sibling->n_keys - 1, 1);
     sibling->values[sibling->n_keys - 1] = NULL;
-    if (sibling->keys_i64_valid) {
-        sibling->keys_i64_valid[sibling->n_keys - 1] = 0;
-    }
 
     if (!sibling->is_leaf) {
         memmove(&sibling->children[0], &sibling->children[1], sibling->n_keys * sizeof(PyBTreeNode *));
+        memmove(&sibling->counts[0], &sibling->counts[1], sibling->n_keys * sizeof(Py_ssize_t));
         sibling->children[sibling->n_keys] = NULL;
+        sibling->counts[sibling->n_keys] = 0;
     }
 
     child->n_keys++;
     sibling->n_keys--;
 }
 
-/* Ensure children[idx] has at least t keys */
-static void
+/* Ensure children[idx] has at least t keys. Node must be writable; the
+ * children involved are unshared first. Returns 0 on success, -1 on failure
+ * (before anything is moved).
+ */
+static int
 fill_child(PyBTreeNode *node, Py_ssize_t idx)
 {
     int order = node->order;
     Py_ssize_t t = order;
 
+    if (node_unshare(&node->children[idx]) == NULL) {
+        return -1;
+    }
+
     if (idx > 0 && node->children[idx - 1]->n_keys >= t) {
+        if (node_unshare(&node->children[idx - 1]) == NULL) {
+            return -1;
+        }
         borrow_from_prev(node, idx);
     }
     else if (idx < node->n_keys && node->children[idx + 1]->n_keys >= t) {
+        if (node_unshare(&node->children[idx + 1]) == NULL) {
+            return -1;
+        }
         borrow_from_next(node, idx);
     }
     else {
         if (idx < node->n_keys) {
+            if (node_unshare(&node->children[idx + 1]) == NULL) {
+                return -1;
+            }
             merge_children(node, idx);
         }
         else {
+            if (node_unshare(&node->children[idx - 1]) == NULL) {
+                return -1;
+            }
             merge_children(node, idx - 1);
         }
     }
+    return 0;
 }
 
-/* Forward declaration */
+/* Forward declarations */
 static int delete_from_node(PyBTreeNode *node, PyObject *key);
+static int delete_rank_from_node(PyBTreeNode *node, Py_ssize_t rank);
 
 /* Delete from a leaf node */
 static int
 delete_from_leaf(PyBTreeNode *node, Py_ssize_t idx)
 {
-    Py_DECREF(node->keys[idx]);
+    node_release_key(node, idx);
     Py_DECREF(node->values[idx]);
 
     if (node->n_keys - 1 > idx) {
-        memmove(&node->keys[idx], &node->keys[idx + 1], (node->n_keys - 1 - idx) * sizeof(PyObject *));
+        move_keys(node, idx, node, idx + 1, node->n_keys - 1 - idx);
         memmove(&node->values[idx], &node->values[idx + 1], (node->n_keys - 1 - idx) * sizeof(PyObject *));
-        if (node->keys_i64_valid) {
-            memmove(&node->keys_i64[idx], &node->keys_i64[idx + 1], (node->n_keys - 1 - idx) * sizeof(long long));
-            memmove(&node->keys_i64_valid[idx], &node->keys_i64_valid[idx + 1], (node->n_keys - 1 - idx) * sizeof(unsigned char));
-        }
     }
-    node->keys[node->n_keys - 1] = NULL;
+    clear_keys(node, node->n_keys - 1, 1);
     node->values[node->n_keys - 1] = NULL;
-    cache_key_clear(node, node->n_keys - 1);
     node->n_keys--;
 
     return 0;
 }
 
-/* Delete from an internal node */
+/* Delete from an internal, writable node. The item that takes its place, or
+ * the item itself after a merge, is removed from the child by key, or by
+ * rank with duplicates where other items may share its key. */
 static int
 delete_from_internal(PyBTreeNode *node, Py_ssize_t idx)
 {
-    PyObject *key = node->keys[idx];
     Py_ssize_t t = node->order;
 
-    if (node->children[idx]->n_keys >= t) {
-        /* Get predecessor and replace */
-        PyObject *pred_key, *pred_value;
-        get_predecessor(node, idx, &pred_key, &pred_value);
-        Py_INCREF(pred_key);
-        Py_INCREF(pred_value);
-        Py_DECREF(node->keys[idx]);
-        Py_DECREF(node->values[idx]);
-        node->keys[idx] = pred_key;
-        node->values[idx] = pred_value;
-        cache_key(node, idx, pred_key);
-        return delete_from_node(node->children[idx], pred_key);
-    }
-    else if (node->children[idx + 1]->n_keys >= t) {
-        /* Get successor and replace */
-        PyObject *succ_key, *succ_value;
-        get_successor(node, idx, &succ_key, &succ_value);
-        Py_INCREF(succ_key);
-        Py_INCREF(succ_value);
-        Py_DECREF(node->keys[idx]);
+    if (node->children[idx]->n_keys >= t || node->children[idx + 1]->n_keys >= t) {
+        /* Replace the key with its predecessor (or successor) after removing
+         * that from the child, so a failure below leaves the tree intact. */
+        PyObject *repl_key, *repl_value;
+        Py_ssize_t child_idx;
+
+        Py_ssize_t child_rank;
+
+        if (node->children[idx]->n_keys >= t) {
+            if (get_predecessor(node, idx, &repl_key, &repl_value) < 0) {
+                return -1;
+            }
+            child_idx = idx;
+            child_rank = node->counts[idx] - 1;
+        }
+        else {
+            if (get_successor(node, idx, &repl_key, &repl_value) < 0) {
+                return -1;
+            }
+            child_idx = idx + 1;
+            child_rank = 0;
+        }
+        if (node_unshare(&node->children[child_idx]) == NULL ||
+            (node->duplicates
+                 ? delete_rank_from_node(node->children[child_idx], child_rank)
+                 : delete_from_node(node->children[child_idx], repl_key)) < 0) {
+            Py_DECREF(repl_key);
+            Py_DECREF(repl_value);
+            return -1;
+        }
+        node->counts[child_idx]--;
+        node_release_key(node, idx);
         Py_DECREF(node->values[idx]);
-        node->keys[idx] = succ_key;
-        node->values[idx] = succ_value;
-        cache_key(node, idx, succ_key);
-        return delete_from_node(node->children[idx + 1], succ_key);
+        node_set_key(node, idx, repl_key);
+        Py_DECREF(repl_key);
+        node->values[idx] = repl_value;
+        return 0;
     }
     else {
         /* Merge children and delete from merged node */
+        PyObject *key;
+        Py_ssize_t rank = node->counts[idx];
+        int status;
+
+        if (node_unshare(&node->children[idx]) == NULL ||
+            node_unshare(&node->children[idx + 1]) == NULL) {
+            return -1;
+        }
+        if (node->duplicates) {
+            merge_children(node, idx);
+            if (delete_rank_from_node(node->children[idx], rank) < 0) {
+                return -1;
+            }
+            node->counts[idx]--;
+            return 0;
+        }
+        key = node_get_key(node, idx);
+        if (key == NULL) {
+            return -1;
+        }
         merge_children(node, idx);
-        return delete_from_node(node->children[idx], key);
+        status = delete_from_node(node->children[idx], key);
+        Py_DECREF(key);
+        if (status < 0) {
+            return -1;
+        }
+        node->counts[idx]--;
+        return 0;
     }
 }
 
-/* Delete a key from a node */
+/* Delete a key from a writable node */
 static int
 delete_from_node(PyBTreeNode *node, PyObject *key)
 {
@@ -960,1759 +2275,9676 @@ delete_from_node(PyBTreeNode *node, PyObject *key)
         Py_ssize_t t = node->order;
 
         if (node->children[idx]->n_keys < t) {
-            fill_child(node, idx);
+            if (fill_child(node, idx) < 0) {
+                return -1;
+            }
         }
 
         if (last_child && idx > node->n_keys) {
-            return delete_from_node(node->children[idx - 1], key);
+            idx--;
         }
-        else {
-            return delete_from_node(node->children[idx], key);
+        if (node_unshare(&node->children[idx]) == NULL ||
+            delete_from_node(node->children[idx], key) < 0) {
+            return -1;
         }
+        node->counts[idx]--;
+        return 0;
     }
 }
 
-/* ==================== B-Tree Public API ==================== */
-
-PyObject *
-PyBTree_New(int order)
+/* Delete the item at rank of the subtree of a writable node, descending by
+ * the subtree counts instead of comparing keys, as trees with duplicates do
+ * to pick one of several equal items */
+static int
+delete_rank_from_node(PyBTreeNode *node, Py_ssize_t rank)
 {
-    PyBTreeObject *btree;
+    for (;;) {
+        Py_ssize_t i, r = rank;
 
-    if (order < BTREE_MIN_ORDER) {
-        order = BTREE_DEFAULT_ORDER;
+        if (node->is_leaf) {
+            return delete_from_leaf(node, rank);
+        }
+        for (i = 0; i < node->n_keys && r > node->counts[i]; i++) {
+            r -= node->counts[i] + 1;
+        }
+        if (i < node->n_keys && r == node->counts[i]) {
+            return delete_from_internal(node, i);
+        }
+        if (node->children[i]->n_keys < node->order) {
+            /* The item keeps its rank but may move to another child */
+            if (fill_child(node, i) < 0) {
+                return -1;
+            }
+            continue;
+        }
+        if (node_unshare(&node->children[i]) == NULL ||
+            delete_rank_from_node(node->children[i], r) < 0) {
+            return -1;
+        }
+        node->counts[i]--;
+        return 0;
     }
+}
 
-    btree = PyObject_GC_New(PyBTreeObject, &PyBTree_Type);
-    if (btree == NULL) {
-        return NULL;
-    }
+/* ==================== B+Tree Layout ==================== */
 
-    btree->order = order;
-    btree->size = 0;
-    btree->cache_i64 = 1;
-    btree->root = (PyBTreeNode *)btreenode_new(order, 1, btree->cache_i64);  /* Start with leaf root */
-    if (btree->root == NULL) {
-        Py_DECREF(btree);
-        return NULL;
-    }
+/* With layout="bplus" every item lives in a leaf and leaves are chained
+ * through next/prev, so scans walk the leaf level without a stack. Internal
+ * nodes hold separator keys only (no values array): child i covers the keys
+ * k with sep[i-1] <= k < sep[i]. Separators are references to keys that
+ * were the first of their right subtree when the separator was made; a
+ * later delete may leave a separator that is no longer a key, which is
+ * harmless.
+ *
+ * B+tree nodes are never shared between trees (snapshot() copies), so the
+ * functions below modify nodes in place without node_unshare().
+ */
 
-    PyObject_GC_Track((PyObject *)btree);
-    return (PyObject *)btree;
+/* Descend to the leaf whose key range covers key. Returns NULL on error. */
+static PyBTreeNode *
+bplus_find_leaf(PyBTreeNode *node, PyObject *key)
+{
+    while (!node->is_leaf) {
+        int found;
+        Py_ssize_t i = node_search_key(node, key, &found);
+        if (i < 0) {
+            return NULL;
+        }
+        node = node->children[found ? i + 1 : i];
+    }
+    return node;
 }
 
-Py_ssize_t
-PyBTree_Size(PyObject *btree)
+/* Move n children and their subtree counts from src[from] to dst[to] */
+static inline void
+move_children(PyBTreeNode *dst, Py_ssize_t to, PyBTreeNode *src, Py_ssize_t from, Py_ssize_t n)
 {
-    if (!PyBTree_Check(btree)) {
-        PyErr_BadInternalCall();
-        return -1;
-    }
-    return ((PyBTreeObject *)btree)->size;
+    memmove(&dst->children[to], &src->children[from], n * sizeof(PyBTreeNode *));
+    memmove(&dst->counts[to], &src->counts[from], n * sizeof(Py_ssize_t));
 }
 
-int
-PyBTree_Insert(PyObject *self, PyObject *key, PyObject *value)
+/* Replace separator idx of a B+tree internal node with a copy of key sidx
+ * of src */
+static inline void
+bplus_set_separator(PyBTreeNode *node, Py_ssize_t idx, PyBTreeNode *src, Py_ssize_t sidx)
 {
-    PyBTreeObject *btree = (PyBTreeObject *)self;
-    int order = btree->order;
-    int result;
+    node_release_key(node, idx);
+    node_copy_key(node, idx, src, sidx);
+}
 
-    if (!PyBTree_Check(self)) {
-        PyErr_BadInternalCall();
+/* Split the full child at child_index. A full leaf keeps its first order
+ * items and moves the rest to a new right sibling whose first key becomes
+ * the separator; a full internal node pushes its middle separator up. */
+static int
+bplus_split_child(PyBTreeNode *parent, Py_ssize_t child_index)
+{
+    PyBTreeNode *child = parent->children[child_index];
+    Py_ssize_t t = child->order;
+    Py_ssize_t total = parent->counts[child_index];
+    Py_ssize_t left_n, right_n;
+    PyBTreeNode *right;
+
+    right = node_alloc(child->order, child->is_leaf, child->is_leaf,
+                                      NODE_KEY_SPEC(child));
+    if (right == NULL) {
         return -1;
     }
+    BTREE_COUNT(splits);
 
-    /* If root is full, create a new root */
-    if (btree->root->n_keys == 2 * order - 1) {
-        PyBTreeNode *new_root = (PyBTreeNode *)btreenode_new(order, 0, btree->cache_i64);
-        if (new_root == NULL) {
-            return -1;
-        }
-        new_root->children[0] = btree->root;
-        btree->root = new_root;
+    /* Make room in the parent for the separator */
+    move_keys(parent, child_index + 1, parent, child_index, parent->n_keys - child_index);
+    move_children(parent, child_index + 2, parent, child_index + 1, parent->n_keys - child_index);
 
-        if (split_child(new_root, 0) < 0) {
-            return -1;
-        }
-    }
+    if (child->is_leaf) {
+        left_n = t;
+        right_n = child->n_keys - t;
+        move_keys(right, 0, child, left_n, right_n);
+        memcpy(right->values, &child->values[left_n], right_n * sizeof(PyObject *));
+        node_copy_key(parent, child_index, right, 0);
 
-    result = insert_non_full(btree->root, key, value);
-    if (result < 0) {
-        return -1;
+        right->next = child->next;
+        right->prev = child;
+        if (child->next != NULL) {
+            child->next->prev = right;
+        }
+        child->next = right;
     }
-    if (result == 0) {
-        btree->size++;  /* New key inserted */
+    else {
+        left_n = t - 1;
+        right_n = t - 1;
+        move_keys(right, 0, child, t, right_n);
+        move_children(right, 0, child, t, right_n + 1);
+        move_keys(parent, child_index, child, t - 1, 1);   /* Moves up */
     }
-    return 0;
-}
-
-PyObject *
-PyBTree_Search(PyObject *self, PyObject *key)
-{
-    PyBTreeObject *btree = (PyBTreeObject *)self;
 
-    if (!PyBTree_Check(self)) {
-        PyErr_BadInternalCall();
-        return NULL;
+    /* Clear the moved slots in the left half */
+    clear_keys(child, left_n, child->n_keys - left_n);
+    if (child->is_leaf) {
+        memset(&child->values[left_n], 0, right_n * sizeof(PyObject *));
     }
-
-    if (btree->root == NULL) {
-        return NULL;
+    else {
+        memset(&child->children[t], 0, t * sizeof(PyBTreeNode *));
+        memset(&child->counts[t], 0, t * sizeof(Py_ssize_t));
     }
+    child->n_keys = left_n;
+    right->n_keys = right_n;
+
+    parent->children[child_index + 1] = right;
+    parent->n_keys++;
+    parent->counts[child_index] = node_size(child);
+    parent->counts[child_index + 1] = total - parent->counts[child_index];
 
-    return node_search(btree->root, key);
+    return 0;
 }
 
-int
-PyBTree_Delete(PyObject *self, PyObject *key)
+/* Insert into a non-full node of a B+tree */
+static int
+bplus_insert_non_full(PyBTreeNode *node, PyObject *key, PyObject *value)
 {
-    PyBTreeObject *btree = (PyBTreeObject *)self;
-    int result;
+    int found, result;
+    Py_ssize_t i;
 
-    if (!PyBTree_Check(self)) {
-        PyErr_BadInternalCall();
-        return -1;
+    NODE_AGG_CHANGED(node);
+    if (node->is_leaf) {
+        return leaf_insert(node, key, value);
     }
 
-    if (btree->root == NULL || btree->size == 0) {
-        PyErr_SetObject(PyExc_KeyError, key);
+    i = node_search_key(node, key, &found);
+    if (i < 0) {
         return -1;
     }
-
-    result = delete_from_node(btree->root, key);
-    if (result < 0) {
-        return -1;
+    if (found) {
+        i++;
     }
 
-    btree->size--;
-
-    /* If root has no keys but has a child, make the child the new root */
-    if (btree->root->n_keys == 0 && !btree->root->is_leaf) {
-        PyBTreeNode *old_root = btree->root;
-        btree->root = old_root->children[0];
-        old_root->children[0] = NULL;
-        Py_DECREF(old_root);
+    if (node->children[i]->n_keys == 2 * node->order - 1) {
+        int cmp;
+        if (bplus_split_child(node, i) < 0) {
+            return -1;
+        }
+        cmp = node_compare_key(key, node, i);
+        if (cmp == -2) {
+            return -1;
+        }
+        if (cmp >= 0) {
+            i++;
+        }
     }
 
-    return 0;
+    result = bplus_insert_non_full(node->children[i], key, value);
+    if (result == 0) {
+        node->counts[i]++;
+    }
+    return result;
 }
 
-/* Optimized contains check - avoids INCREF/DECREF overhead */
-static int
-node_contains(PyBTreeNode *node, PyObject *key)
+/* Move one item or subtree from children[idx-1] into children[idx] */
+static void
+bplus_borrow_from_prev(PyBTreeNode *node, Py_ssize_t idx)
 {
-    int found;
+    PyBTreeNode *child = node->children[idx];
+    PyBTreeNode *sibling = node->children[idx - 1];
+    Py_ssize_t last = sibling->n_keys - 1;
+    Py_ssize_t moved;
+
+    BTREE_COUNT(borrows);
+    move_keys(child, 1, child, 0, child->n_keys);
+    if (child->is_leaf) {
+        memmove(&child->values[1], &child->values[0], child->n_keys * sizeof(PyObject *));
+        move_keys(child, 0, sibling, last, 1);
+        child->values[0] = sibling->values[last];
+        sibling->values[last] = NULL;
+        bplus_set_separator(node, idx - 1, child, 0);
+        moved = 1;
+    }
+    else {
+        move_children(child, 1, child, 0, child->n_keys + 1);
+        /* The parent separator comes down, the sibling's last goes up */
+        move_keys(child, 0, node, idx - 1, 1);
+        child->children[0] = sibling->children[last + 1];
+        child->counts[0] = sibling->counts[last + 1];
+        move_keys(node, idx - 1, sibling, last, 1);
+        sibling->children[last + 1] = NULL;
+        moved = sibling->counts[last + 1];
+        sibling->counts[last + 1] = 0;
+    }
+    clear_keys(sibling, last, 1);
 
-    while (node != NULL) {
-        Py_ssize_t i = node_search_key(node, key, &found);
-        if (i < 0) {
-            return -1;  /* Error */
-        }
+    child->n_keys++;
+    sibling->n_keys--;
+    node->counts[idx] += moved;
+    node->counts[idx - 1] -= moved;
+}
 
-        if (found) {
-            return 1;  /* Found */
-        }
+/* Move one item or subtree from children[idx+1] into children[idx] */
+static void
+bplus_borrow_from_next(PyBTreeNode *node, Py_ssize_t idx)
+{
+    PyBTreeNode *child = node->children[idx];
+    PyBTreeNode *sibling = node->children[idx + 1];
+    Py_ssize_t n = child->n_keys;
+    Py_ssize_t last = sibling->n_keys - 1;
+    Py_ssize_t moved;
+
+    BTREE_COUNT(borrows);
+    if (child->is_leaf) {
+        move_keys(child, n, sibling, 0, 1);
+        child->values[n] = sibling->values[0];
+        move_keys(sibling, 0, sibling, 1, last);
+        memmove(&sibling->values[0], &sibling->values[1], last * sizeof(PyObject *));
+        sibling->values[last] = NULL;
+        bplus_set_separator(node, idx, sibling, 0);
+        moved = 1;
+    }
+    else {
+        /* The parent separator comes down, the sibling's first goes up */
+        move_keys(child, n, node, idx, 1);
+        child->children[n + 1] = sibling->children[0];
+        child->counts[n + 1] = sibling->counts[0];
+        moved = sibling->counts[0];
+        move_keys(node, idx, sibling, 0, 1);
+        move_keys(sibling, 0, sibling, 1, last);
+        move_children(sibling, 0, sibling, 1, last + 1);
+        sibling->children[last + 1] = NULL;
+        sibling->counts[last + 1] = 0;
+    }
+    clear_keys(sibling, last, 1);
 
-        if (node->is_leaf) {
-            return 0;  /* Not found */
-        }
+    child->n_keys++;
+    sibling->n_keys--;
+    node->counts[idx] += moved;
+    node->counts[idx + 1] -= moved;
+}
 
-        node = node->children[i];
+/* Merge children[idx+1] into children[idx], removing separator idx */
+static void
+bplus_merge_children(PyBTreeNode *node, Py_ssize_t idx)
+{
+    PyBTreeNode *child = node->children[idx];
+    PyBTreeNode *sibling = node->children[idx + 1];
+    Py_ssize_t n = child->n_keys;
+
+    BTREE_COUNT(merges);
+    if (child->is_leaf) {
+        move_keys(child, n, sibling, 0, sibling->n_keys);
+        memcpy(&child->values[n], sibling->values, sibling->n_keys * sizeof(PyObject *));
+        memset(sibling->values, 0, sibling->n_keys * sizeof(PyObject *));
+        child->n_keys += sibling->n_keys;
+        node_release_key(node, idx);   /* Separator is dropped */
+
+        child->next = sibling->next;
+        if (sibling->next != NULL) {
+            sibling->next->prev = child;
+        }
     }
+    else {
+        move_keys(child, n, node, idx, 1);   /* Separator comes down */
+        move_keys(child, n + 1, sibling, 0, sibling->n_keys);
+        move_children(child, n + 1, sibling, 0, sibling->n_keys + 1);
+        memset(sibling->children, 0, (sibling->n_keys + 1) * sizeof(PyBTreeNode *));
+        child->n_keys += sibling->n_keys + 1;
+    }
+    clear_keys(sibling, 0, sibling->n_keys);
+    sibling->n_keys = 0;
 
-    return 0;
+    node->counts[idx] += node->counts[idx + 1];
+    move_keys(node, idx, node, idx + 1, node->n_keys - 1 - idx);
+    move_children(node, idx + 1, node, idx + 2, node->n_keys - 1 - idx);
+    clear_keys(node, node->n_keys - 1, 1);
+    node->children[node->n_keys] = NULL;
+    node->counts[node->n_keys] = 0;
+    node->n_keys--;
+
+    NODE_DECREF(sibling);
 }
 
-int
-PyBTree_Contains(PyObject *self, PyObject *key)
+/* Ensure children[idx] has at least order keys */
+static void
+bplus_fill_child(PyBTreeNode *node, Py_ssize_t idx)
 {
-    PyBTreeObject *btree = (PyBTreeObject *)self;
+    Py_ssize_t t = node->order;
 
-    if (!PyBTree_Check(self)) {
-        PyErr_BadInternalCall();
-        return -1;
+    if (idx > 0 && node->children[idx - 1]->n_keys >= t) {
+        bplus_borrow_from_prev(node, idx);
     }
-
-    if (btree->root == NULL) {
-        return 0;
+    else if (idx < node->n_keys && node->children[idx + 1]->n_keys >= t) {
+        bplus_borrow_from_next(node, idx);
+    }
+    else if (idx < node->n_keys) {
+        bplus_merge_children(node, idx);
+    }
+    else {
+        bplus_merge_children(node, idx - 1);
     }
-
-    return node_contains(btree->root, key);
 }
 
-/* Optimized helper to collect keys with pre-allocated index */
+/* Delete key from the subtree rooted at node */
 static int
-collect_keys_fast(PyBTreeNode *node, PyObject **items, Py_ssize_t *idx)
+bplus_delete_from_node(PyBTreeNode *node, PyObject *key)
 {
+    int found;
     Py_ssize_t i;
 
-    if (node == NULL) {
-        return 0;
+    NODE_AGG_CHANGED(node);
+    i = node_search_key(node, key, &found);
+    if (i < 0) {
+        return -1;
     }
-
-    for (i = 0; i < node->n_keys; i++) {
-        if (!node->is_leaf && node->children[i]) {
-            if (collect_keys_fast(node->children[i], items, idx) < 0) {
-                return -1;
-            }
+    if (node->is_leaf) {
+        if (!found) {
+            PyErr_SetObject(PyExc_KeyError, key);
+            return -1;
         }
-        Py_INCREF(node->keys[i]);
-        items[*idx] = node->keys[i];
-        (*idx)++;
+        return delete_from_leaf(node, i);
     }
 
-    if (!node->is_leaf && node->children[node->n_keys]) {
-        if (collect_keys_fast(node->children[node->n_keys], items, idx) < 0) {
+    if (found) {
+        i++;
+    }
+    if (node->children[i]->n_keys < node->order) {
+        bplus_fill_child(node, i);
+        /* Separators may have moved; find the child again */
+        i = node_search_key(node, key, &found);
+        if (i < 0) {
             return -1;
         }
+        if (found) {
+            i++;
+        }
     }
 
+    if (bplus_delete_from_node(node->children[i], key) < 0) {
+        return -1;
+    }
+    node->counts[i]--;
     return 0;
 }
 
-PyObject *
-PyBTree_Keys(PyObject *self)
+/* Link the leaves under node, in order, after *last */
+static void
+bplus_link_leaves(PyBTreeNode *node, PyBTreeNode **last)
 {
-    PyBTreeObject *btree = (PyBTreeObject *)self;
+    Py_ssize_t i;
 
-    if (!PyBTree_Check(self)) {
-        PyErr_BadInternalCall();
-        return NULL;
+    if (node->is_leaf) {
+        node->prev = *last;
+        node->next = NULL;
+        if (*last != NULL) {
+            (*last)->next = node;
+        }
+        *last = node;
+        return;
     }
-
-    /* Pre-allocate list with exact size */
-    PyObject *list = PyList_New(btree->size);
-    if (list == NULL) {
-        return NULL;
+    for (i = 0; i <= node->n_keys; i++) {
+        bplus_link_leaves(node->children[i], last);
     }
+}
 
-    if (btree->size > 0) {
-        Py_ssize_t idx = 0;
-        if (collect_keys_fast(btree->root, &PyList_GET_ITEM(list, 0), &idx) < 0) {
-            Py_DECREF(list);
-            return NULL;
-        }
-    }
+/* ==================== Range Deletion ==================== */
 
-    return list;
-}
+/* Deleting the items at ranks [start, stop) cuts along the two root-to-leaf
+ * paths through the range ends: subtrees wholly inside the range are
+ * dropped with one reference each, and only the nodes on the two paths lose
+ * items piecemeal. Nodes on the paths may then be short of order-1 keys,
+ * down to empty, so range_repair() rebalances them bottom-up against their
+ * neighbours. Everything else stays untouched, so the work is O(log n)
+ * nodes plus releasing the k deleted items.
+ *
+ * Positions inside a node are gaps: gap r lies before item r of the
+ * subtree. range_locate() maps a gap to (child, offset within the child),
+ * an offset equal to the child's size being the gap just after its items.
+ */
 
-/* Optimized helper to collect values with pre-allocated index */
-static int
-collect_values_fast(PyBTreeNode *node, PyObject **items, Py_ssize_t *idx)
+/* References removed by a cut. They are released once the tree is
+ * consistent again, since releasing a key or value may run Python code. */
+typedef struct {
+    PyObject **objs;
+    Py_ssize_t n_objs;
+    PyBTreeNode **nodes;
+    Py_ssize_t n_nodes;
+} RangeTrash;
+
+/* Map gap r of the subtree at internal node to a child index, storing the
+ * gap's offset inside that child in *offset */
+static Py_ssize_t
+range_locate(PyBTreeNode *node, Py_ssize_t r, Py_ssize_t *offset)
 {
+    int has_items = NODE_HAS_ITEMS(node);
     Py_ssize_t i;
 
-    if (node == NULL) {
+    for (i = 0; i < node->n_keys && r > node->counts[i]; i++) {
+        r -= node->counts[i] + has_items;
+    }
+    *offset = r;
+    return i;
+}
+
+/* Remove keys [k, k + n) and, from an internal node, children [c, c + n),
+ * moving their references to trash. Dropped B+tree leaves leave the chain.
+ * Returns the number of items removed. */
+static Py_ssize_t
+range_remove(PyBTreeNode *node, Py_ssize_t k, Py_ssize_t c, Py_ssize_t n, RangeTrash *trash)
+{
+    int has_items = NODE_HAS_ITEMS(node);
+    Py_ssize_t x, tail = node->n_keys - k - n;
+    Py_ssize_t removed = has_items ? n : 0;
+
+    if (n == 0) {
         return 0;
     }
+    for (x = k; x < k + n; x++) {
+        if (node->keys != NULL) {
+            trash->objs[trash->n_objs++] = node->keys[x];
+        }
+        if (has_items) {
+            trash->objs[trash->n_objs++] = node->values[x];
+        }
+    }
+    move_keys(node, k, node, k + n, tail);
+    clear_keys(node, node->n_keys - n, n);
+    if (has_items) {
+        memmove(&node->values[k], &node->values[k + n], tail * sizeof(PyObject *));
+        memset(&node->values[node->n_keys - n], 0, n * sizeof(PyObject *));
+    }
 
-    for (i = 0; i < node->n_keys; i++) {
-        if (!node->is_leaf && node->children[i]) {
-            if (collect_values_fast(node->children[i], items, idx) < 0) {
-                return -1;
+    if (!node->is_leaf) {
+        if (!has_items) {
+            PyBTreeNode *first = node->children[c], *last = node->children[c + n - 1];
+            while (!first->is_leaf) {
+                first = first->children[0];
+            }
+            while (!last->is_leaf) {
+                last = last->children[last->n_keys];
+            }
+            if (first->prev != NULL) {
+                first->prev->next = last->next;
+            }
+            if (last->next != NULL) {
+                last->next->prev = first->prev;
             }
         }
-        Py_INCREF(node->values[i]);
-        items[*idx] = node->values[i];
-        (*idx)++;
+        for (x = c; x < c + n; x++) {
+            trash->nodes[trash->n_nodes++] = node->children[x];
+            removed += node->counts[x];
+        }
+        move_children(node, c, node, c + n, node->n_keys + 1 - c - n);
+        memset(&node->children[node->n_keys + 1 - n], 0, n * sizeof(PyBTreeNode *));
+        memset(&node->counts[node->n_keys + 1 - n], 0, n * sizeof(Py_ssize_t));
     }
+    node->n_keys -= n;
+    return removed;
+}
 
-    if (!node->is_leaf && node->children[node->n_keys]) {
-        if (collect_values_fast(node->children[node->n_keys], items, idx) < 0) {
-            return -1;
-        }
+static Py_ssize_t range_cut(PyBTreeNode *node, Py_ssize_t start, Py_ssize_t stop, int right,
+                            RangeTrash *trash);
+
+/* Cut the ranks [start, stop) of child i, if any */
+static Py_ssize_t
+range_cut_child(PyBTreeNode *node, Py_ssize_t i, Py_ssize_t start, Py_ssize_t stop, int right,
+                RangeTrash *trash)
+{
+    Py_ssize_t removed = 0;
+
+    if (start < stop) {
+        removed = range_cut(node->children[i], start, stop, right, trash);
+        node->counts[i] -= removed;
     }
+    return removed;
+}
 
-    return 0;
+/* Remove the items at ranks [start, stop) of the subtree at node, which
+ * must be writable along both cut paths. Where the two paths part with both
+ * end children keeping items, a B-tree keeps the key between them (the
+ * range's items around it are gone); range_kept_key() names it beforehand
+ * and the caller deletes it once the tree is repaired. A subtree emptied
+ * entirely keeps one child to hang its empty nodes from: the last one when
+ * right is true (below the stop end of the range), else the first.
+ * Returns the number of items removed. */
+static Py_ssize_t
+range_cut(PyBTreeNode *node, Py_ssize_t start, Py_ssize_t stop, int right, RangeTrash *trash)
+{
+    Py_ssize_t i, j, so, eo, removed;
+
+    if (node->is_leaf) {
+        return range_remove(node, start, 0, stop - start, trash);
+    }
+    i = range_locate(node, start, &so);
+    j = range_locate(node, stop, &eo);
+    if (i == j) {
+        return range_cut_child(node, i, so, eo, right, trash);
+    }
+    if (eo == node->counts[j] && !(so == 0 && right)) {
+        /* Child j goes whole: drop children i+1..j and keys i..j-1 */
+        removed = range_cut_child(node, i, so, node->counts[i], 0, trash);
+        return removed + range_remove(node, i, i + 1, j - i, trash);
+    }
+    if (so == 0) {
+        /* Child i goes whole: drop children i..j-1 and keys i..j-1 */
+        removed = range_cut_child(node, j, 0, eo, 1, trash);
+        return removed + range_remove(node, i, i, j - i, trash);
+    }
+    /* Keep key j-1 between the two partial children */
+    removed = range_cut_child(node, i, so, node->counts[i], 0, trash);
+    removed += range_cut_child(node, j, 0, eo, 1, trash);
+    return removed + range_remove(node, i, i + 1, j - 1 - i, trash);
 }
 
-PyObject *
-PyBTree_Values(PyObject *self)
+/* The key range_cut() keeps in B-tree layout for [start, stop), as a new
+ * reference: Py_None if it keeps none, NULL on memory error */
+static PyObject *
+range_kept_key(PyBTreeNode *node, Py_ssize_t start, Py_ssize_t stop)
 {
-    PyBTreeObject *btree = (PyBTreeObject *)self;
+    while (!node->is_leaf) {
+        Py_ssize_t so, eo;
+        Py_ssize_t i = range_locate(node, start, &so);
+        Py_ssize_t j = range_locate(node, stop, &eo);
 
-    if (!PyBTree_Check(self)) {
-        PyErr_BadInternalCall();
-        return NULL;
+        if (i != j) {
+            if (eo == node->counts[j] || so == 0) {
+                break;
+            }
+            return node_get_key(node, j - 1);
+        }
+        node = node->children[i];
+        start = so;
+        stop = eo;
     }
+    Py_RETURN_NONE;
+}
 
-    /* Pre-allocate list with exact size */
-    PyObject *list = PyList_New(btree->size);
-    if (list == NULL) {
-        return NULL;
-    }
+/* Unshare the nodes on the path from *slot to gap r, as range_cut()
+ * descends */
+static int
+range_unshare_path(PyBTreeNode **slot, Py_ssize_t r)
+{
+    for (;;) {
+        PyBTreeNode *node = node_unshare(slot);
 
-    if (btree->size > 0) {
-        Py_ssize_t idx = 0;
-        if (collect_values_fast(btree->root, &PyList_GET_ITEM(list, 0), &idx) < 0) {
-            Py_DECREF(list);
-            return NULL;
+        if (node == NULL) {
+            return -1;
         }
+        if (node->is_leaf) {
+            return 0;
+        }
+        slot = &node->children[range_locate(node, r, &r)];
     }
-
-    return list;
 }
 
-/* Optimized helper to collect items with pre-allocated index */
+/* Make every node a B-tree cut of [start, stop) and its repair may modify
+ * writable before anything changes: the nodes on the two cut paths and the
+ * facing spines of their neighbours, which rebalancing borrows from or
+ * merges with. The neighbours of a subtree holding ranks [first, last] end
+ * at gap first-1 and start at gap last+2, one separator away. */
 static int
-collect_items_fast(PyBTreeNode *node, PyObject **items, Py_ssize_t *idx)
+range_unshare(PyBTreeNode **root, Py_ssize_t start, Py_ssize_t stop, Py_ssize_t size)
 {
-    Py_ssize_t i;
+    Py_ssize_t ends[2] = {start, stop};
+    int e;
 
-    if (node == NULL) {
-        return 0;
+    if (range_unshare_path(root, start) < 0 || range_unshare_path(root, stop) < 0) {
+        return -1;
     }
+    for (e = 0; e < 2; e++) {
+        PyBTreeNode *node = *root;
+        Py_ssize_t first = 0, r = ends[e];
 
-    for (i = 0; i < node->n_keys; i++) {
-        if (!node->is_leaf && node->children[i]) {
-            if (collect_items_fast(node->children[i], items, idx) < 0) {
+        while (!node->is_leaf) {
+            Py_ssize_t offset, i = range_locate(node, r, &offset);
+            Py_ssize_t last = first + r - offset + node->counts[i] - 1;
+
+            first += r - offset;
+            r = offset;
+            node = node->children[i];
+            if ((first >= 1 && range_unshare_path(root, first - 1) < 0) ||
+                (last + 2 <= size && range_unshare_path(root, last + 2) < 0)) {
                 return -1;
             }
         }
-        PyObject *tuple = PyTuple_Pack(2, node->keys[i], node->values[i]);
-        if (tuple == NULL) {
-            return -1;
-        }
-        items[*idx] = tuple;
-        (*idx)++;
     }
+    return 0;
+}
 
-    if (!node->is_leaf && node->children[node->n_keys]) {
-        if (collect_items_fast(node->children[node->n_keys], items, idx) < 0) {
-            return -1;
+/* Bring child idx of node, short of order-1 keys, back to size: merge it
+ * with a neighbour when both fit in one node, otherwise borrow from the
+ * neighbour. Returns the index of the child now holding its items. */
+static Py_ssize_t
+range_rebalance(PyBTreeNode *node, Py_ssize_t idx, int bplus)
+{
+    Py_ssize_t t = node->order;
+    Py_ssize_t left = idx > 0 ? idx - 1 : 0;
+    PyBTreeNode *a = node->children[left];
+    PyBTreeNode *b = node->children[left + 1];
+
+    /* range_unshare() made the neighbours writable; B+tree nodes are never
+     * shared */
+    /* B+tree leaves merge without the separator */
+    if (a->n_keys + b->n_keys + !(bplus && a->is_leaf) <= 2 * t - 1) {
+        if (bplus) {
+            bplus_merge_children(node, left);
         }
+        else {
+            merge_children(node, left);
+        }
+        return left;
     }
-
-    return 0;
+    while (node->children[idx]->n_keys < t - 1) {
+        if (idx > 0) {
+            if (bplus) {
+                bplus_borrow_from_prev(node, idx);
+            }
+            else {
+                borrow_from_prev(node, idx);
+            }
+        }
+        else if (bplus) {
+            bplus_borrow_from_next(node, idx);
+        }
+        else {
+            borrow_from_next(node, idx);
+        }
+    }
+    return idx;
 }
 
-PyObject *
-PyBTree_Items(PyObject *self)
+/* Restore the node size invariant below node after a cut (or a split or
+ * concatenation) whose boundary lies at gaps [lo, hi] of node's subtree. Subtrees touching the boundary
+ * are repaired first; a child that then remains short is rebalanced, after
+ * which its own short children may have gained the siblings they lacked
+ * (an emptied node keeps a single child), so it is repaired again. Node
+ * itself may be left short for its parent to fix. */
+static void
+range_repair(PyBTreeNode *node, Py_ssize_t lo, Py_ssize_t hi, int bplus)
 {
-    PyBTreeObject *btree = (PyBTreeObject *)self;
-
-    if (!PyBTree_Check(self)) {
-        PyErr_BadInternalCall();
-        return NULL;
-    }
+    int has_items = NODE_HAS_ITEMS(node);
+    Py_ssize_t i, offset;
 
-    /* Pre-allocate list with exact size */
-    PyObject *list = PyList_New(btree->size);
-    if (list == NULL) {
-        return NULL;
+    if (node->is_leaf) {
+        return;
     }
-
-    if (btree->size > 0) {
-        Py_ssize_t idx = 0;
-        if (collect_items_fast(btree->root, &PyList_GET_ITEM(list, 0), &idx) < 0) {
-            Py_DECREF(list);
-            return NULL;
+    for (i = 0, offset = 0; i <= node->n_keys && offset <= hi; i++) {
+        Py_ssize_t count = node->counts[i];
+        if (lo <= offset + count) {
+            range_repair(node->children[i], lo > offset ? lo - offset : 0,
+                         hi - offset < count ? hi - offset : count, bplus);
         }
+        offset += count + has_items;
     }
 
-    return list;
-}
+    i = 0;
+    while (node->n_keys > 0 && i <= node->n_keys) {
+        Py_ssize_t idx, k, count;
 
-static PyObject *
-get_min_from_node(PyBTreeNode *node)
-{
-    if (node == NULL || node->n_keys == 0) {
-        return NULL;
-    }
-    while (!node->is_leaf) {
-        node = node->children[0];
+        if (node->children[i]->n_keys >= node->order - 1) {
+            i++;
+            continue;
+        }
+        idx = range_rebalance(node, i, bplus);
+        for (k = 0, offset = 0; k < idx; k++) {
+            offset += node->counts[k] + has_items;
+        }
+        count = node->counts[idx];
+        if (lo <= offset + count && offset <= hi) {
+            range_repair(node->children[idx], lo > offset ? lo - offset : 0,
+                         hi - offset < count ? hi - offset : count, bplus);
+        }
+        i = 0;
     }
-    Py_INCREF(node->keys[0]);
-    return node->keys[0];
 }
 
-static PyObject *
-get_max_from_node(PyBTreeNode *node)
+/* Drop the empty internal roots a cut, split or concatenation leaves */
+static void
+range_collapse_root(PyBTreeNode **root)
 {
-    if (node == NULL || node->n_keys == 0) {
-        return NULL;
-    }
-    while (!node->is_leaf) {
-        node = node->children[node->n_keys];
+    while ((*root)->n_keys == 0 && !(*root)->is_leaf) {
+        PyBTreeNode *old_root = *root;
+        *root = old_root->children[0];
+        old_root->children[0] = NULL;
+        NODE_DECREF(old_root);
     }
-    Py_INCREF(node->keys[node->n_keys - 1]);
-    return node->keys[node->n_keys - 1];
 }
 
-PyObject *
-PyBTree_GetMin(PyObject *self)
+/* Number of levels in the subtree at node, 1 for a leaf */
+static Py_ssize_t
+node_height(PyBTreeNode *node)
 {
-    PyBTreeObject *btree = (PyBTreeObject *)self;
+    Py_ssize_t height = 1;
 
-    if (!PyBTree_Check(self)) {
-        PyErr_BadInternalCall();
-        return NULL;
+    for (; !node->is_leaf; node = node->children[0]) {
+        height++;
     }
-
-    return get_min_from_node(btree->root);
+    return height;
 }
 
-PyObject *
-PyBTree_GetMax(PyObject *self)
-{
-    PyBTreeObject *btree = (PyBTreeObject *)self;
+/* ==================== Bulk Loading ==================== */
 
-    if (!PyBTree_Check(self)) {
-        PyErr_BadInternalCall();
-        return NULL;
-    }
+#define BTREE_DEFAULT_FILL_FACTOR 1.0
 
-    return get_max_from_node(btree->root);
-}
+/* Growable buffer of (key, value) pairs holding strong references.
+ * Tracks whether the keys seen so far are strictly ascending (or just
+ * ascending, for a tree with duplicates) so callers can pick between the
+ * bottom-up builder and ordinary inserts.
+ */
+typedef struct {
+    PyObject **keys;
+    PyObject **values;
+    Py_ssize_t n;
+    Py_ssize_t allocated;
+    int sorted;                   /* 1 while keys are strictly ascending */
+    int duplicates;               /* Equal neighbours keep sorted set */
+} PairBuffer;
 
-int
-PyBTree_Clear(PyObject *self)
+static void
+pairbuf_init(PairBuffer *buf)
 {
-    PyBTreeObject *btree = (PyBTreeObject *)self;
-
-    if (!PyBTree_Check(self)) {
-        PyErr_BadInternalCall();
-        return -1;
-    }
-
-    return btree_clear_internal(btree);
+    buf->keys = NULL;
+    buf->values = NULL;
+    buf->n = 0;
+    buf->allocated = 0;
+    buf->sorted = 1;
+    buf->duplicates = 0;
 }
 
-/* ==================== Type Methods ==================== */
-
 static void
-btree_dealloc(PyObject *self)
+pairbuf_release(PairBuffer *buf)
 {
-    PyBTreeObject *btree = (PyBTreeObject *)self;
-
-    PyObject_GC_UnTrack(self);
-
-    Py_XDECREF(btree->root);
-
-    Py_TYPE(self)->tp_free(self);
+    Py_ssize_t i;
+    for (i = 0; i < buf->n; i++) {
+        Py_DECREF(buf->keys[i]);
+        Py_DECREF(buf->values[i]);
+    }
+    PyMem_Free(buf->keys);
+    PyMem_Free(buf->values);
+    pairbuf_init(buf);
 }
 
 static int
-btree_traverse(PyObject *self, visitproc visit, void *arg)
+pairbuf_reserve(PairBuffer *buf, Py_ssize_t needed)
 {
-    PyBTreeObject *btree = (PyBTreeObject *)self;
-    Py_VISIT(btree->root);
+    PyObject **keys, **values;
+    Py_ssize_t allocated;
+
+    if (needed <= buf->allocated) {
+        return 0;
+    }
+    allocated = buf->allocated ? buf->allocated : 16;
+    while (allocated < needed) {
+        allocated += allocated >> 1;
+    }
+    keys = PyMem_Realloc(buf->keys, allocated * sizeof(PyObject *));
+    if (keys == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    buf->keys = keys;
+    values = PyMem_Realloc(buf->values, allocated * sizeof(PyObject *));
+    if (values == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    buf->values = values;
+    buf->allocated = allocated;
     return 0;
 }
 
+/* Append a pair (borrowed references). Returns 0 on success, -1 on error. */
 static int
-btree_clear_internal(PyBTreeObject *btree)
+pairbuf_append(PairBuffer *buf, PyObject *key, PyObject *value)
 {
-    int order = btree->order;
-    Py_CLEAR(btree->root);
-    btree->size = 0;
-
-    /* Create a new empty root */
-    btree->root = (PyBTreeNode *)btreenode_new(order, 1, btree->cache_i64);
-    if (btree->root == NULL) {
+    if (pairbuf_reserve(buf, buf->n + 1) < 0) {
         return -1;
     }
-
+    if (buf->sorted && buf->n > 0) {
+        int cmp = compare_keys(buf->keys[buf->n - 1], key);
+        if (cmp == -2) {
+            return -1;
+        }
+        if (cmp > 0 || (cmp == 0 && !buf->duplicates)) {
+            buf->sorted = 0;
+        }
+    }
+    Py_INCREF(key);
+    Py_INCREF(value);
+    buf->keys[buf->n] = key;
+    buf->values[buf->n] = value;
+    buf->n++;
     return 0;
 }
 
-static int
-btree_clear_slot(PyObject *self)
+/* Decide how many nodes a level with n_items keys is packed into. Each
+ * node receives between t-1 and 2t-1 keys, as close to the requested
+ * capacity as the invariants allow, with one separator between nodes.
+ */
+static Py_ssize_t
+bulk_level_width(Py_ssize_t n_items, Py_ssize_t t, Py_ssize_t capacity)
 {
-    return btree_clear_internal((PyBTreeObject *)self);
-}
+    Py_ssize_t max_keys = 2 * t - 1;
+    Py_ssize_t k_min, k_max, k;
 
-static PyObject *
-btree_repr(PyObject *self)
-{
-    PyBTreeObject *btree = (PyBTreeObject *)self;
-    return PyUnicode_FromFormat("SortedDict(order=%d, size=%zd, cache_i64=%s)",
-                                btree->order, btree->size,
-                                btree->cache_i64 ? "True" : "False");
+    if (n_items <= max_keys) {
+        return 1;
+    }
+    k_min = (n_items + 1 + max_keys) / (max_keys + 1);
+    k_max = (n_items + 1) / t;
+    k = (n_items + 1 + capacity) / (capacity + 1);
+    if (k < k_min) {
+        k = k_min;
+    }
+    if (k > k_max) {
+        k = k_max;
+    }
+    return k;
 }
 
+/* Keys per node when packing to fill_factor, within the node bounds */
 static Py_ssize_t
-btree_length(PyObject *self)
+bulk_capacity(Py_ssize_t t, double fill_factor)
 {
-    return ((PyBTreeObject *)self)->size;
+    Py_ssize_t max_keys = 2 * t - 1;
+    Py_ssize_t capacity = (Py_ssize_t)(fill_factor * (double)max_keys + 0.5);
+
+    if (capacity < t - 1) {
+        capacity = t - 1;
+    }
+    if (capacity < 1) {
+        capacity = 1;
+    }
+    if (capacity > max_keys) {
+        capacity = max_keys;
+    }
+    return capacity;
 }
 
-static int
-btree_contains(PyObject *self, PyObject *key)
+/* Store key src of the builder input in slot idx: keys[src], or nkeys[src]
+ * when a typed tree is built from packed native keys (keys is NULL). */
+static inline void
+bulk_set_key(PyBTreeNode *node, Py_ssize_t idx, PyObject **keys, const NativeKey *nkeys,
+             Py_ssize_t src)
 {
-    return PyBTree_Contains(self, key);
+    if (keys != NULL) {
+        node_set_key(node, idx, keys[src]);
+        return;
+    }
+    node->nkeys[idx] = nkeys[src];
+    NODE_KEYS_CHANGED(node);
 }
 
-static PyObject *
-btree_subscript(PyObject *self, PyObject *key)
+/* Build a tree bottom-up from n strictly ascending pairs. Leaves are packed to
+ * fill_factor of their capacity; the keys between consecutive nodes of a level
+ * become the items of the level above, until a single root remains. Keys and
+ * values are borrowed and INCREF'd into the nodes. Typed trees may pass
+ * native keys in nkeys instead of key objects in keys.
+ * Returns the new root (an empty leaf when n == 0), or NULL on failure.
+ */
+static PyBTreeNode *
+bulk_build(int order, int key_storage, PyObject **keys, const NativeKey *nkeys,
+           PyObject **values, Py_ssize_t n, double fill_factor)
 {
-    PyObject *value = PyBTree_Search(self, key);
-    if (value == NULL) {
-        if (!PyErr_Occurred()) {
-            PyErr_SetObject(PyExc_KeyError, key);
+    Py_ssize_t t = order;
+    Py_ssize_t capacity;
+    Py_ssize_t *items = NULL;       /* Item indices of the current level, NULL = 0..n-1 */
+    Py_ssize_t n_items = n;
+    PyBTreeNode **kids = NULL;      /* Nodes built for the level below */
+    PyBTreeNode *root = NULL;
+    int is_leaf = 1;
+
+    if (n == 0) {
+        return btreenode_new(order, 1, key_storage);
+    }
+
+    capacity = bulk_capacity(t, fill_factor);
+
+    for (;;) {
+        Py_ssize_t width = bulk_level_width(n_items, t, capacity);
+        Py_ssize_t content = n_items - (width - 1);
+        Py_ssize_t base = content / width;
+        Py_ssize_t extra = content % width;
+        Py_ssize_t *next_items = NULL;
+        PyBTreeNode **nodes;
+        Py_ssize_t pos = 0, kid = 0, j;
+
+        nodes = PyMem_Calloc(width, sizeof(PyBTreeNode *));
+        if (width > 1) {
+            next_items = PyMem_Malloc((width - 1) * sizeof(Py_ssize_t));
+        }
+        if (nodes == NULL || (width > 1 && next_items == NULL)) {
+            PyMem_Free(nodes);
+            PyMem_Free(next_items);
+            PyErr_NoMemory();
+            goto error;
+        }
+
+        for (j = 0; j < width; j++) {
+            Py_ssize_t count = base + (j < extra ? 1 : 0);
+            Py_ssize_t i;
+            PyBTreeNode *node = btreenode_new(order, is_leaf, key_storage);
+            if (node == NULL) {
+                for (i = 0; i < j; i++) {
+                    NODE_DECREF(nodes[i]);
+                }
+                PyMem_Free(nodes);
+                PyMem_Free(next_items);
+                goto error;
+            }
+            for (i = 0; i < count; i++, pos++) {
+                Py_ssize_t src = items ? items[pos] : pos;
+                Py_INCREF(values[src]);
+                bulk_set_key(node, i, keys, nkeys, src);
+                node->values[i] = values[src];
+            }
+            if (!is_leaf) {
+                memcpy(node->children, &kids[kid], (count + 1) * sizeof(PyBTreeNode *));
+                memset(&kids[kid], 0, (count + 1) * sizeof(PyBTreeNode *));
+                for (i = 0; i <= count; i++) {
+                    node->counts[i] = node_size(node->children[i]);
+                }
+                kid += count + 1;
+            }
+            node->n_keys = count;
+            nodes[j] = node;
+            if (j < width - 1) {
+                next_items[j] = items ? items[pos] : pos;
+                pos++;
+            }
+        }
+
+        /* Children now owned by this level */
+        PyMem_Free(kids);
+        PyMem_Free(items);
+        kids = nodes;
+        items = next_items;
+        n_items = width - 1;
+        is_leaf = 0;
+
+        if (width == 1) {
+            root = nodes[0];
+            break;
         }
-        return NULL;
     }
-    return value;
+
+    PyMem_Free(kids);
+    PyMem_Free(items);
+    return root;
+
+error:
+    if (kids != NULL) {
+        /* Nodes of the level below not yet attached to a parent (attached
+         * slots were cleared and are released with their new parent) */
+        Py_ssize_t i;
+        for (i = 0; i <= n_items; i++) {
+            NODE_XDECREF(kids[i]);
+        }
+        PyMem_Free(kids);
+    }
+    PyMem_Free(items);
+    return NULL;
 }
 
-static int
-btree_ass_subscript(PyObject *self, PyObject *key, PyObject *value)
+/* Number of nodes for one B+tree level holding n entries (items for leaves,
+ * children for internal nodes) at most capacity per node and at least
+ * min_per per node whenever there is more than one node. */
+static Py_ssize_t
+bplus_level_width(Py_ssize_t n, Py_ssize_t min_per, Py_ssize_t capacity)
 {
-    if (value == NULL) {
-        return PyBTree_Delete(self, key);
-    }
-    else {
-        return PyBTree_Insert(self, key, value);
+    Py_ssize_t width = (n + capacity - 1) / capacity;
+    Py_ssize_t max_width = n / min_per;
+
+    if (width > max_width) {
+        width = max_width;
     }
+    return width < 1 ? 1 : width;
 }
 
-/* ==================== SortedDict Iterator ==================== */
+/* B+tree counterpart of bulk_build(): pack the items into chained leaves,
+ * then build separator levels from the first key under each node. */
+static PyBTreeNode *
+bplus_bulk_build(int order, int key_storage, PyObject **keys, const NativeKey *nkeys,
+                 PyObject **values, Py_ssize_t n, double fill_factor)
+{
+    Py_ssize_t t = order;
+    Py_ssize_t capacity, width, base, extra, pos = 0, j;
+    PyBTreeNode **level, **above = NULL;
+    Py_ssize_t *firsts, *above_firsts = NULL;  /* Input positions of first keys */
+    PyBTreeNode *prev = NULL;
+
+    if (n == 0) {
+        return btreenode_new(order, 1, key_storage);
+    }
+    capacity = bulk_capacity(t, fill_factor);
+
+    width = bplus_level_width(n, t - 1, capacity);
+    level = PyMem_Calloc(width, sizeof(PyBTreeNode *));
+    firsts = PyMem_Malloc(width * sizeof(Py_ssize_t));
+    if (level == NULL || firsts == NULL) {
+        PyErr_NoMemory();
+        goto error;
+    }
+
+    base = n / width;
+    extra = n % width;
+    for (j = 0; j < width; j++) {
+        Py_ssize_t count = base + (j < extra ? 1 : 0), i;
+        PyBTreeNode *leaf = btreenode_new(order, 1, key_storage);
+        if (leaf == NULL) {
+            goto error;
+        }
+        firsts[j] = pos;
+        for (i = 0; i < count; i++, pos++) {
+            Py_INCREF(values[pos]);
+            bulk_set_key(leaf, i, keys, nkeys, pos);
+            leaf->values[i] = values[pos];
+        }
+        leaf->n_keys = count;
+        leaf->prev = prev;
+        if (prev != NULL) {
+            prev->next = leaf;
+        }
+        prev = leaf;
+        level[j] = leaf;
+    }
 
-/* Stack-based iterator for efficient in-order traversal without copying */
-#define ITER_STACK_SIZE 64  /* Max tree depth - sufficient for huge trees */
+    while (width > 1) {
+        Py_ssize_t up = bplus_level_width(width, t, capacity + 1);
+        Py_ssize_t kid = 0;
 
-typedef struct {
-    PyBTreeNode *node;
-    Py_ssize_t key_idx;  /* Next key index to return */
-} IterStackFrame;
+        above = PyMem_Calloc(up, sizeof(PyBTreeNode *));
+        above_firsts = PyMem_Malloc(up * sizeof(Py_ssize_t));
+        if (above == NULL || above_firsts == NULL) {
+            PyErr_NoMemory();
+            goto error;
+        }
 
-typedef struct {
-    PyObject_HEAD
-    PyBTreeObject *btree;           /* The B-tree being iterated */
-    Py_ssize_t remaining;           /* Items remaining for length hint */
-    int leaf_only;                  /* Fast path when root is a leaf */
-    PyBTreeNode *leaf;              /* Leaf node for fast path */
-    Py_ssize_t leaf_index;          /* Next index in leaf */
-    Py_ssize_t stack_top;           /* Top of stack (-1 = empty) */
-    IterStackFrame stack[ITER_STACK_SIZE];  /* Stack for tree traversal */
-} PyBTreeIterObject;
+        base = width / up;
+        extra = width % up;
+        for (j = 0; j < up; j++) {
+            Py_ssize_t count = base + (j < extra ? 1 : 0), i;
+            PyBTreeNode *node = node_alloc(order, 0, 0, key_storage);
+            if (node == NULL) {
+                goto error;
+            }
+            above[j] = node;
+            above_firsts[j] = firsts[kid];
+            for (i = 0; i < count; i++, kid++) {
+                node->children[i] = level[kid];
+                node->counts[i] = node_size(level[kid]);
+                level[kid] = NULL;
+                if (i > 0) {
+                    bulk_set_key(node, i - 1, keys, nkeys, firsts[kid]);
+                }
+            }
+            node->n_keys = count - 1;
+        }
 
-static PyTypeObject PyBTreeIter_Type;
+        PyMem_Free(level);
+        PyMem_Free(firsts);
+        level = above;
+        firsts = above_firsts;
+        above = NULL;
+        above_firsts = NULL;
+        width = up;
+    }
+
+    prev = level[0];
+    PyMem_Free(level);
+    PyMem_Free(firsts);
+    return prev;
+
+error:
+    /* Unattached nodes of both levels; attached slots were cleared */
+    if (level != NULL) {
+        for (j = 0; j < width; j++) {
+            NODE_XDECREF(level[j]);
+        }
+    }
+    if (above != NULL) {
+        Py_ssize_t up = bplus_level_width(width, t, capacity + 1);
+        for (j = 0; j < up; j++) {
+            NODE_XDECREF(above[j]);
+        }
+    }
+    PyMem_Free(level);
+    PyMem_Free(firsts);
+    PyMem_Free(above);
+    PyMem_Free(above_firsts);
+    return NULL;
+}
 
-/* Push a node onto the stack and descend to leftmost leaf */
-static void
-iter_descend_left(PyBTreeIterObject *it, PyBTreeNode *node)
+/* ==================== B-Tree Public API ==================== */
+
+PyObject *
+PyBTree_New(int order)
 {
-    while (node != NULL) {
-        it->stack_top++;
-        it->stack[it->stack_top].node = node;
-        it->stack[it->stack_top].key_idx = 0;
-        
-        if (node->is_leaf) {
-            break;
-        }
-        node = node->children[0];
+    PyBTreeObject *btree;
+
+    if (order < BTREE_MIN_ORDER) {
+        order = BTREE_DEFAULT_ORDER;
+    }
+
+    btree = PyObject_GC_New(PyBTreeObject, &PyBTree_Type);
+    if (btree == NULL) {
+        return NULL;
+    }
+
+    btree->order = order;
+    btree->size = 0;
+    btree->cache_i64 = 1;
+    btree->key_storage = KEYS_CACHED;
+    btree->readonly = 0;
+    btree->bplus = 0;
+    btree->eytzinger = 0;
+    btree->duplicates = 0;
+    btree->cache_pairs = 0;
+    btree->version = 0;
+    btree->aggregate = AGG_NONE;
+    btree->agg_func = NULL;
+    btree->wbuf_size = 0;
+    btree->wbuf_n = 0;
+    btree->wbuf_cap = 0;
+    btree->wbuf = NULL;
+    btree->searches = 0;
+    btree->edge_hint = 0;
+    btree->root = btreenode_new(order, 1, btree->key_storage);  /* Start with leaf root */
+    if (btree->root == NULL) {
+        Py_DECREF(btree);
+        return NULL;
     }
+
+    PyObject_GC_Track((PyObject *)btree);
+    return (PyObject *)btree;
 }
 
-static void
-btreeiter_dealloc(PyObject *self)
+Py_ssize_t
+PyBTree_Size(PyObject *btree)
 {
-    PyBTreeIterObject *it = (PyBTreeIterObject *)self;
-    PyObject_GC_UnTrack(self);
-    Py_XDECREF(it->btree);
-    PyObject_GC_Del(self);
+    if (!PyBTree_Check(btree)) {
+        PyErr_BadInternalCall();
+        return -1;
+    }
+    if (BTREE_FLUSH((PyBTreeObject *)btree)) {
+        return -1;
+    }
+    return ((PyBTreeObject *)btree)->size;
 }
 
+/* Raise TypeError if btree is a read-only snapshot and RuntimeError during a
+ * B+tree search (BTREE_SEARCH_ENTER); otherwise bump its version for the
+ * write that follows. Every write, even one that only
+ * replaces a value, bumps it: unsharing a node can leave the old copy owned
+ * by a snapshot alone, so iterators and cursors holding node pointers
+ * re-seek whenever the version moves. */
 static int
-btreeiter_traverse(PyObject *self, visitproc visit, void *arg)
+btree_begin_write(PyBTreeObject *btree)
 {
-    PyBTreeIterObject *it = (PyBTreeIterObject *)self;
-    Py_VISIT(it->btree);
+    if (btree->readonly) {
+        PyErr_SetString(PyExc_TypeError, "SortedDict snapshot is read-only");
+        return -1;
+    }
+    if (btree->searches > 0) {
+        PyErr_SetString(PyExc_RuntimeError, "SortedDict modified during a lookup");
+        return -1;
+    }
+    if (BTREE_FLUSH(btree)) {
+        return -1;
+    }
+    btree->version++;
     return 0;
 }
 
-static PyObject *
-btreeiter_next(PyObject *self)
+/* ---------- Edge inserts ----------
+ * A key above the tree's maximum (or below its minimum) belongs at the end
+ * (or start) of the rightmost (leftmost) leaf, reached by following the edge
+ * children without searching. A split there leaves two half-full nodes of
+ * which the inner one would never receive another key, so a full edge node
+ * first spills items into its inner sibling and only splits once that
+ * sibling is full too: ascending or descending inserts fill all nodes but
+ * the last two of each level. */
+
+/* Move the first m items of children[idx] to the end of children[idx-1].
+ * In the B-tree layout, and between B+tree internal nodes, they rotate
+ * through separator idx-1; B+tree leaves take them directly and get a new
+ * separator. Node and both children must be writable, and both children
+ * must keep order-1 keys and fit in one node. */
+static void
+spill_to_prev(PyBTreeNode *node, Py_ssize_t idx, Py_ssize_t m)
 {
-    PyBTreeIterObject *it = (PyBTreeIterObject *)self;
+    PyBTreeNode *left = node->children[idx - 1];
+    PyBTreeNode *right = node->children[idx];
+    Py_ssize_t n_left = left->n_keys, n_right = right->n_keys;
+    int has_items = NODE_HAS_ITEMS(node);
+    Py_ssize_t moved, k;
+
+    /* Separators of B+tree internal nodes are not items */
+    moved = has_items || right->is_leaf ? m : 0;
+    if (right->is_leaf && !has_items) {
+        move_keys(left, n_left, right, 0, m);
+        memcpy(&left->values[n_left], right->values, m * sizeof(PyObject *));
+    }
+    else {
+        move_keys(left, n_left, node, idx - 1, 1);
+        move_keys(left, n_left + 1, right, 0, m - 1);
+        move_keys(node, idx - 1, right, m - 1, 1);
+        if (has_items) {
+            left->values[n_left] = node->values[idx - 1];
+            memcpy(&left->values[n_left + 1], right->values, (m - 1) * sizeof(PyObject *));
+            node->values[idx - 1] = right->values[m - 1];
+        }
+    }
+    if (right->values != NULL) {
+        memmove(right->values, &right->values[m], (n_right - m) * sizeof(PyObject *));
+        memset(&right->values[n_right - m], 0, m * sizeof(PyObject *));
+    }
+    move_keys(right, 0, right, m, n_right - m);
+    clear_keys(right, n_right - m, m);
+    if (!right->is_leaf) {
+        for (k = 0; k < m; k++) {
+            moved += right->counts[k];
+        }
+        move_children(left, n_left + 1, right, 0, m);
+        move_children(right, 0, right, m, n_right - m + 1);
+        memset(&right->children[n_right - m + 1], 0, m * sizeof(PyBTreeNode *));
+        memset(&right->counts[n_right - m + 1], 0, m * sizeof(Py_ssize_t));
+    }
+    left->n_keys += m;
+    right->n_keys -= m;
+    if (right->is_leaf && !has_items) {
+        bplus_set_separator(node, idx - 1, right, 0);
+    }
+    node->counts[idx - 1] += moved;
+    node->counts[idx] -= moved;
+}
 
-    if (it->leaf_only) {
-        if (it->leaf_index < it->leaf->n_keys) {
-            PyObject *key = it->leaf->keys[it->leaf_index++];
-            it->remaining--;
-            Py_INCREF(key);
-            return key;
+/* Move the last m items of children[idx] to the start of children[idx+1],
+ * the mirror of spill_to_prev() */
+static void
+spill_to_next(PyBTreeNode *node, Py_ssize_t idx, Py_ssize_t m)
+{
+    PyBTreeNode *left = node->children[idx];
+    PyBTreeNode *right = node->children[idx + 1];
+    Py_ssize_t n_left = left->n_keys, n_right = right->n_keys;
+    Py_ssize_t first = n_left - m;
+    int has_items = NODE_HAS_ITEMS(node);
+    Py_ssize_t moved, k;
+
+    moved = has_items || left->is_leaf ? m : 0;
+    move_keys(right, m, right, 0, n_right);
+    if (right->values != NULL) {
+        memmove(&right->values[m], right->values, n_right * sizeof(PyObject *));
+    }
+    if (left->is_leaf && !has_items) {
+        move_keys(right, 0, left, first, m);
+        memcpy(right->values, &left->values[first], m * sizeof(PyObject *));
+    }
+    else {
+        move_keys(right, m - 1, node, idx, 1);
+        move_keys(right, 0, left, first + 1, m - 1);
+        move_keys(node, idx, left, first, 1);
+        if (has_items) {
+            right->values[m - 1] = node->values[idx];
+            memcpy(right->values, &left->values[first + 1], (m - 1) * sizeof(PyObject *));
+            node->values[idx] = left->values[first];
         }
-        return NULL;
     }
-    
-    while (it->stack_top >= 0) {
+    if (left->values != NULL) {
+        memset(&left->values[first], 0, m * sizeof(PyObject *));
+    }
+    clear_keys(left, first, m);
+    if (!left->is_leaf) {
+        for (k = first + 1; k <= n_left; k++) {
+            moved += left->counts[k];
+        }
+        move_children(right, m, right, 0, n_right + 1);
+        move_children(right, 0, left, first + 1, m);
+        memset(&left->children[first + 1], 0, m * sizeof(PyBTreeNode *));
+        memset(&left->counts[first + 1], 0, m * sizeof(Py_ssize_t));
+    }
+    left->n_keys -= m;
+    right->n_keys += m;
+    if (left->is_leaf && !has_items) {
+        bplus_set_separator(node, idx, right, 0);
+    }
+    node->counts[idx] -= moved;
+    node->counts[idx + 1] += moved;
+}
+
+/* Make room in the full edge child idx of writable node. right selects the
+ * right edge. Returns 0 on success, -1 on failure (nothing is moved). */
+static int
+edge_make_room(PyBTreeObject *btree, PyBTreeNode *node, Py_ssize_t idx, int right)
+{
+    Py_ssize_t t = node->order;
+    PyBTreeNode *sibling = node_unshare(&node->children[right ? idx - 1 : idx + 1]);
+    Py_ssize_t room;
+
+    if (sibling == NULL) {
+        return -1;
+    }
+    room = 2 * t - 1 - sibling->n_keys;
+    if (room > 0) {
+        /* The edge child keeps at least order-1 keys */
+        Py_ssize_t m = room < t ? room : t;
+        if (right) {
+            spill_to_prev(node, idx, m);
+        }
+        else {
+            spill_to_next(node, idx, m);
+        }
+        return 0;
+    }
+    return btree->bplus ? bplus_split_child(node, idx) : split_child(node, idx);
+}
+
+/* Insert key, known to lie beyond the right (or left) end of the non-empty
+ * tree, at that end. The root must be writable and not full. */
+static int
+edge_insert(PyBTreeObject *btree, PyObject *key, PyObject *value, int right)
+{
+    PyBTreeNode *node = btree->root;
+    Py_ssize_t n;
+
+    while (!node->is_leaf) {
+        Py_ssize_t i = right ? node->n_keys : 0;
+        PyBTreeNode *child = node_unshare(&node->children[i]);
+
+        if (child == NULL) {
+            return -1;
+        }
+        if (child->n_keys == 2 * node->order - 1) {
+            if (edge_make_room(btree, node, i, right) < 0) {
+                return -1;
+            }
+            i = right ? node->n_keys : 0;
+        }
+        node = node->children[i];
+    }
+
+    n = node->n_keys;
+    if (!right) {
+        move_keys(node, 1, node, 0, n);
+        memmove(&node->values[1], &node->values[0], n * sizeof(PyObject *));
+    }
+    Py_INCREF(value);
+    node_set_key(node, right ? n : 0, key);
+    node->values[right ? n : 0] = value;
+    node->n_keys++;
+
+    /* Nothing can fail now: count the item on the way down again */
+    for (node = btree->root; !node->is_leaf; node = node->children[right ? node->n_keys : 0]) {
+        node->counts[right ? node->n_keys : 0]++;
+    }
+    btree->size++;
+    return 0;
+}
+
+/* 1 if key sorts after every key of btree, -1 if before, 0 otherwise, -2
+ * on error. With duplicates a key equal to the maximum also goes after it,
+ * so appending to an event log stays an edge insert. Only the end named by
+ * btree->edge_hint is compared with, and none while the hint is 0: inserts
+ * that land elsewhere pay no extra comparisons, and btree_edge_landed()
+ * arms the hint again once an ordinary insert reaches either end. */
+static int
+btree_edge_of(PyBTreeObject *btree, PyObject *key)
+{
+    PyBTreeNode *node;
+    int cmp;
+
+    if (btree->size == 0 || btree->edge_hint == 0) {
+        return 0;
+    }
+    if (btree->edge_hint > 0) {
+        for (node = btree->root; !node->is_leaf; node = node->children[node->n_keys]) {
+        }
+        cmp = node_compare_key(key, node, node->n_keys - 1);
+        if (cmp == 0 && btree->duplicates) {
+            return 1;
+        }
+        return cmp == -2 ? -2 : cmp == 1;
+    }
+    for (node = btree->root; !node->is_leaf; node = node->children[0]) {
+    }
+    cmp = node_compare_key(key, node, 0);
+    return cmp == -2 ? -2 : -(cmp == -1);
+}
+
+/* Whether slot idx of node holds key itself: the same object, or for typed
+ * trees the same native value */
+static inline int
+node_slot_is(PyBTreeNode *node, Py_ssize_t idx, PyObject *key, NativeKey k)
+{
+    return node->keys != NULL ? node->keys[idx] == key : node->nkeys[idx].i64 == k.i64;
+}
+
+/* The btree->edge_hint for the next insert after an ordinary insert of key:
+ * 1 if it became the last key of the tree, -1 if the first, else 0. Found by
+ * walking the edges, without comparing keys. */
+static int
+btree_edge_landed(PyBTreeObject *btree, PyObject *key, NativeKey k)
+{
+    PyBTreeNode *node;
+
+    for (node = btree->root; !node->is_leaf; node = node->children[node->n_keys]) {
+    }
+    if (node->n_keys > 0 && node_slot_is(node, node->n_keys - 1, key, k)) {
+        return 1;
+    }
+    for (node = btree->root; !node->is_leaf; node = node->children[0]) {
+    }
+    return node->n_keys > 0 && node_slot_is(node, 0, key, k) ? -1 : 0;
+}
+
+int
+PyBTree_Insert(PyObject *self, PyObject *key, PyObject *value)
+{
+    PyBTreeObject *btree = (PyBTreeObject *)self;
+    NativeKey k;
+    size_t version;
+    int order;
+    int result;
+    int edge;
+
+    if (!PyBTree_Check(self)) {
+        PyErr_BadInternalCall();
+        return -1;
+    }
+    if (btree_begin_write(btree) < 0) {
+        return -1;
+    }
+    k.i64 = 0;
+    if (btree->key_storage >= KEYS_I64 && native_key_check(btree->key_storage, key, &k) < 0) {
+        return -1;
+    }
+    /* A comparison that writes to the tree voids its answer */
+    version = btree->version;
+    edge = btree_edge_of(btree, key);
+    if (edge == -2) {
+        return -1;
+    }
+    if (btree->version != version) {
+        edge = 0;
+    }
+    if (node_unshare(&btree->root) == NULL) {
+        return -1;
+    }
+    order = btree->order;
+
+    /* If root is full, create a new root */
+    if (btree->root->n_keys == 2 * order - 1) {
+        PyBTreeNode *new_root = node_alloc(order, 0, !btree->bplus, BTREE_KEY_SPEC(btree));
+        if (new_root == NULL) {
+            return -1;
+        }
+        new_root->children[0] = btree->root;
+        new_root->counts[0] = btree->size;
+        btree->root = new_root;
+
+        if ((btree->bplus ? bplus_split_child(new_root, 0) : split_child(new_root, 0)) < 0) {
+            return -1;
+        }
+    }
+
+    if (edge != 0) {
+        return edge_insert(btree, key, value, edge > 0);
+    }
+    if (btree->bplus) {
+        result = bplus_insert_non_full(btree->root, key, value);
+    }
+    else {
+        result = insert_non_full(btree->root, key, value);
+    }
+    if (result < 0) {
+        return -1;
+    }
+    if (result == 0) {
+        btree->size++;  /* New key inserted */
+    }
+    btree->edge_hint = btree_edge_landed(btree, key, k);
+    return 0;
+}
+
+/* ==================== Write Buffer ==================== */
+
+/* A tree created with write_buffer=n holds back up to n bt[key] = value
+ * writes in an array instead of descending the tree for each. Once the
+ * array fills, or before anything else reads or writes the tree, the writes
+ * are sorted by key and applied in that order, so consecutive inserts land
+ * in the leaves the previous ones just brought into cache. Only keys whose
+ * order is that of an int64 are held back, which keeps Python code out of
+ * the sort: exact ints, or whatever a typed tree stores. */
+
+/* Map a native key to an int64 of the same order: the bits of a double with
+ * the negative ones flipped, -0.0 counting as 0.0 */
+static long long
+wbuf_order_key(int key_storage, NativeKey k)
+{
+    long long bits;
+
+    if (key_storage != KEYS_F64) {
+        return k.i64;
+    }
+    if (k.f64 == 0.0) {
+        return 0;
+    }
+    memcpy(&bits, &k.f64, sizeof(bits));
+    return bits < 0 ? bits ^ LLONG_MAX : bits;
+}
+
+/* Stable sort of n writes by order_key into place, using the n entries at
+ * tmp: insertion sort for a few, otherwise an LSD radix sort on the bytes of
+ * the key, skipping the bytes every key shares. Ascending ingest costs a
+ * comparison per write. */
+static void
+wbuf_sort(BufferedWrite *writes, BufferedWrite *tmp, Py_ssize_t n)
+{
+    Py_ssize_t counts[8][256];
+    BufferedWrite *src = writes, *dst = tmp, *swap;
+    Py_ssize_t i, j;
+    int d;
+
+    for (i = 1; i < n && writes[i - 1].order_key <= writes[i].order_key; i++) {
+    }
+    if (i >= n) {
+        return;
+    }
+    if (n <= 32) {
+        for (; i < n; i++) {
+            BufferedWrite w = writes[i];
+            for (j = i; j > 0 && writes[j - 1].order_key > w.order_key; j--) {
+                writes[j] = writes[j - 1];
+            }
+            writes[j] = w;
+        }
+        return;
+    }
+    memset(counts, 0, sizeof(counts));
+    for (i = 0; i < n; i++) {
+        /* The sign bit flipped orders the keys as unsigned integers */
+        unsigned long long u = (unsigned long long)writes[i].order_key ^ (1ULL << 63);
+        for (d = 0; d < 8; d++) {
+            counts[d][(u >> (8 * d)) & 0xff]++;
+        }
+    }
+    for (d = 0; d < 8; d++) {
+        unsigned long long first = (unsigned long long)src[0].order_key ^ (1ULL << 63);
+        Py_ssize_t offset = 0;
+
+        if (counts[d][(first >> (8 * d)) & 0xff] == n) {
+            continue;
+        }
+        for (j = 0; j < 256; j++) {
+            Py_ssize_t c = counts[d][j];
+            counts[d][j] = offset;
+            offset += c;
+        }
+        for (i = 0; i < n; i++) {
+            unsigned long long u = (unsigned long long)src[i].order_key ^ (1ULL << 63);
+            dst[counts[d][(u >> (8 * d)) & 0xff]++] = src[i];
+        }
+        swap = src;
+        src = dst;
+        dst = swap;
+    }
+    if (src != writes) {
+        memcpy(writes, src, (size_t)n * sizeof(*writes));
+    }
+}
+
+/* Whether the first and last keys of an object-key tree are exact ints: an
+ * int key is only held back then, so one that cannot be compared with the
+ * tree's keys raises from its own bt[key] = value rather than a later call */
+static int
+btree_ends_are_ints(PyBTreeObject *btree)
+{
+    PyBTreeNode *node;
+
+    if (btree->size == 0) {
+        return 1;
+    }
+    for (node = btree->root; !node->is_leaf; node = node->children[0]) {
+    }
+    if (!PyLong_CheckExact(node->keys[0])) {
+        return 0;
+    }
+    for (node = btree->root; !node->is_leaf; node = node->children[node->n_keys]) {
+    }
+    return PyLong_CheckExact(node->keys[node->n_keys - 1]);
+}
+
+/* Room for the first held-back writes; the array doubles up to wbuf_size */
+#define WBUF_INITIAL 64
+
+/* Make room for one more held-back write, so a large write_buffer= only
+ * costs memory for the writes actually waiting. Returns -1 on error. */
+static int
+btree_grow_writes(PyBTreeObject *btree)
+{
+    Py_ssize_t cap = btree->wbuf_cap;
+    BufferedWrite *grown;
+
+    if (cap == 0) {
+        cap = WBUF_INITIAL;
+    }
+    else if (cap <= btree->wbuf_size / 2) {
+        cap *= 2;
+    }
+    else {
+        cap = btree->wbuf_size;
+    }
+    if (cap > btree->wbuf_size) {
+        cap = btree->wbuf_size;
+    }
+    /* The second half is wbuf_sort()'s scratch space, nothing to keep */
+    grown = (size_t)cap > PY_SSIZE_T_MAX / (2 * sizeof(BufferedWrite)) ? NULL
+            : PyMem_Realloc(btree->wbuf, 2 * (size_t)cap * sizeof(BufferedWrite));
+    if (grown == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    btree->wbuf = grown;
+    btree->wbuf_cap = cap;
+    return 0;
+}
+
+/* Hold back bt[key] = value in a write_buffer= tree. Returns 1 if it was
+ * held back, 0 if key needs the tree's comparisons or the write cannot run
+ * now (the caller writes it through), -1 on error. */
+static int
+btree_buffer_write(PyBTreeObject *btree, PyObject *key, PyObject *value)
+{
+    BufferedWrite *w;
+    NativeKey k;
+
+    if (btree->readonly || btree->searches > 0) {
+        return 0;
+    }
+    if (btree->key_storage >= KEYS_I64) {
+        if (native_key_check(btree->key_storage, key, &k) < 0) {
+            return -1;
+        }
+    }
+    else {
+        int overflow;
+
+        if (!PyLong_CheckExact(key) || !btree_ends_are_ints(btree)) {
+            return 0;
+        }
+        k.i64 = PyLong_AsLongLongAndOverflow(key, &overflow);
+        if (overflow) {
+            return 0;
+        }
+    }
+    if (btree->wbuf_n == btree->wbuf_cap && btree_grow_writes(btree) < 0) {
+        return -1;
+    }
+    w = &btree->wbuf[btree->wbuf_n++];
+    w->order_key = wbuf_order_key(btree->key_storage, k);
+    Py_INCREF(key);
+    w->key = key;
+    Py_INCREF(value);
+    w->value = value;
+    btree->version++;
+    if (btree->wbuf_n == btree->wbuf_size && btree_flush_writes(btree) < 0) {
+        return -1;
+    }
+    return 1;
+}
+
+/* Apply the held-back writes in key order; of several writes to one key only
+ * the last is applied, unless the tree keeps duplicates. The array is taken
+ * off the tree first: releasing a replaced value can run a finalizer that
+ * writes to the tree again. A write that still fails (out of memory, or a key
+ * between the ints that cannot be compared with them) is skipped and the
+ * first such error raised once the others are in. */
+static int
+btree_flush_writes(PyBTreeObject *btree)
+{
+    BufferedWrite *writes = btree->wbuf;
+    Py_ssize_t i, n = btree->wbuf_n, cap = btree->wbuf_cap;
+    PyObject *type = NULL, *value = NULL, *traceback = NULL;
+
+    btree->wbuf = NULL;
+    btree->wbuf_n = 0;
+    btree->wbuf_cap = 0;
+    wbuf_sort(writes, writes + cap, n);
+    for (i = 0; i < n; i++) {
+        if ((btree->duplicates || i + 1 == n ||
+             writes[i + 1].order_key != writes[i].order_key) &&
+            PyBTree_Insert((PyObject *)btree, writes[i].key, writes[i].value) < 0) {
+            if (type == NULL) {
+                PyErr_Fetch(&type, &value, &traceback);
+            }
+            else {
+                PyErr_Clear();
+            }
+        }
+    }
+    for (i = 0; i < n; i++) {
+        Py_DECREF(writes[i].key);
+        Py_DECREF(writes[i].value);
+    }
+    if (btree->wbuf == NULL) {
+        btree->wbuf = writes;
+        btree->wbuf_cap = cap;
+    }
+    else {
+        PyMem_Free(writes);
+    }
+    if (type != NULL) {
+        PyErr_Restore(type, value, traceback);
+        return -1;
+    }
+    return 0;
+}
+
+/* Drop the held-back writes of a tree that is being cleared */
+static void
+btree_discard_writes(PyBTreeObject *btree)
+{
+    BufferedWrite *writes = btree->wbuf;
+    Py_ssize_t i, n = btree->wbuf_n;
+
+    btree->wbuf = NULL;
+    btree->wbuf_n = 0;
+    btree->wbuf_cap = 0;
+    for (i = 0; i < n; i++) {
+        Py_DECREF(writes[i].key);
+        Py_DECREF(writes[i].value);
+    }
+    PyMem_Free(writes);
+}
+
+/* Load buffered pairs into btree. An empty tree given strictly ascending
+ * input is rebuilt bottom-up; anything else goes through PyBTree_Insert in
+ * buffer order, so later duplicates win as they would in a dict.
+ */
+static int
+btree_load_pairs(PyBTreeObject *btree, PairBuffer *buf, double fill_factor)
+{
+    Py_ssize_t i;
+    int sorted = buf->sorted;
+
+    if (buf->n == 0) {
+        return 0;
+    }
+    if (btree_begin_write(btree) < 0) {
+        return -1;
+    }
+
+    if (btree->size == 0 && sorted && btree->key_storage >= KEYS_I64) {
+        /* Validate the keys for a typed tree. Distinct ints can convert to
+         * the same double, so the native keys must be ascending too. */
+        NativeKey prev = {0}, cur;
+        for (i = 0; i < buf->n && sorted; i++) {
+            if (native_key_check(btree->key_storage, buf->keys[i], &cur) < 0) {
+                return -1;
+            }
+            if (i > 0) {
+                int cmp = btree->key_storage == KEYS_I64
+                    ? (prev.i64 > cur.i64) - (prev.i64 < cur.i64)
+                    : (prev.f64 > cur.f64) - (prev.f64 < cur.f64);
+                if (cmp > 0 || (cmp == 0 && !btree->duplicates)) {
+                    sorted = 0;
+                }
+            }
+            prev = cur;
+        }
+    }
+
+    if (btree->size == 0 && sorted) {
+        PyBTreeNode *root = (btree->bplus ? bplus_bulk_build : bulk_build)(
+            btree->order, BTREE_KEY_SPEC(btree), buf->keys, NULL, buf->values, buf->n,
+            fill_factor);
+        if (root == NULL) {
+            return -1;
+        }
+        NODE_SETREF(btree->root, root);
+        btree->size = buf->n;
+        return 0;
+    }
+
+    for (i = 0; i < buf->n; i++) {
+        if (PyBTree_Insert((PyObject *)btree, buf->keys[i], buf->values[i]) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Streams pairs into a tree. While the tree started out empty and keys keep
+ * arriving in strictly ascending order they are buffered for the bottom-up
+ * builder; the first out-of-order key flushes the buffer through ordinary
+ * inserts and the rest of the input is inserted directly.
+ */
+typedef struct {
+    PyBTreeObject *btree;
+    PairBuffer buf;
+    int buffering;
+    int strict;                   /* Raise ValueError instead of falling back */
+    double fill_factor;
+} PairLoader;
+
+static void
+pairloader_init(PairLoader *loader, PyObject *btree)
+{
+    loader->btree = (PyBTreeObject *)btree;
+    pairbuf_init(&loader->buf);
+    loader->buf.duplicates = loader->btree->duplicates;
+    loader->buffering = (loader->btree->size == 0);
+    loader->strict = 0;
+    loader->fill_factor = BTREE_DEFAULT_FILL_FACTOR;
+}
+
+static int
+pairloader_add(PairLoader *loader, PyObject *key, PyObject *value)
+{
+    if (!loader->buffering) {
+        return PyBTree_Insert((PyObject *)loader->btree, key, value);
+    }
+    if (pairbuf_append(&loader->buf, key, value) < 0) {
+        return -1;
+    }
+    if (!loader->buf.sorted) {
+        if (loader->strict) {
+            PyErr_SetString(PyExc_ValueError,
+                            loader->buf.duplicates
+                                ? "from_sorted() requires keys in ascending order"
+                                : "from_sorted() requires keys in strictly ascending order");
+            return -1;
+        }
+        loader->buffering = 0;
+        if (btree_load_pairs(loader->btree, &loader->buf, loader->fill_factor) < 0) {
+            return -1;
+        }
+        pairbuf_release(&loader->buf);
+    }
+    return 0;
+}
+
+/* Flush anything still buffered and release the loader. On error (status < 0)
+ * the buffer is dropped without being loaded.
+ */
+static int
+pairloader_finish(PairLoader *loader, int status)
+{
+    if (status == 0 && loader->buffering) {
+        status = btree_load_pairs(loader->btree, &loader->buf, loader->fill_factor);
+    }
+    pairbuf_release(&loader->buf);
+    return status;
+}
+
+static int
+check_fill_factor(double fill_factor)
+{
+    if (!(fill_factor > 0.0 && fill_factor <= 1.0)) {
+        PyErr_SetString(PyExc_ValueError, "fill_factor must be in (0, 1]");
+        return -1;
+    }
+    return 0;
+}
+
+static int btree_merge_from_seq2(PyObject *seq2, PairLoader *loader);
+
+/* Populate an empty tree from strictly ascending pairs. */
+static int
+btree_fill_from_sorted(PyObject *self, PyObject *iterable, double fill_factor)
+{
+    PairLoader loader;
+
+    if (((PyBTreeObject *)self)->size != 0) {
+        PyErr_SetString(PyExc_ValueError, "from_sorted() requires an empty B-tree");
+        return -1;
+    }
+
+    pairloader_init(&loader, self);
+    loader.strict = 1;
+    loader.fill_factor = fill_factor;
+    return pairloader_finish(&loader, btree_merge_from_seq2(iterable, &loader));
+}
+
+PyObject *
+PyBTree_FromSortedItems(PyObject *iterable, int order, double fill_factor)
+{
+    PyObject *btree;
+
+    if (check_fill_factor(fill_factor) < 0) {
+        return NULL;
+    }
+
+    btree = PyBTree_New(order);
+    if (btree == NULL) {
+        return NULL;
+    }
+    if (btree_fill_from_sorted(btree, iterable, fill_factor) < 0) {
+        Py_DECREF(btree);
+        return NULL;
+    }
+    return btree;
+}
+
+PyObject *
+PyBTree_FromSortedArrays(PyObject *const *keys, PyObject *const *values, Py_ssize_t n,
+                         int order, double fill_factor)
+{
+    PyObject *btree;
+    PairLoader loader;
+    Py_ssize_t i;
+    int status = 0;
+
+    if (check_fill_factor(fill_factor) < 0) {
+        return NULL;
+    }
+
+    btree = PyBTree_New(order);
+    if (btree == NULL) {
+        return NULL;
+    }
+    pairloader_init(&loader, btree);
+    loader.strict = 1;
+    loader.fill_factor = fill_factor;
+    if (pairbuf_reserve(&loader.buf, n) < 0) {
+        status = -1;
+    }
+    for (i = 0; i < n && status == 0; i++) {
+        status = pairloader_add(&loader, keys[i], values[i]);
+    }
+    if (pairloader_finish(&loader, status) < 0) {
+        Py_DECREF(btree);
+        return NULL;
+    }
+    return btree;
+}
+
+/* Pin the root for a search outside the tree lock in *root,
+ * after applying held-back writes: writers unshare top-down, so they copy
+ * every node the search can still reach instead of changing it, and key
+ * comparisons are free to run Python code that modifies the tree. B+tree
+ * leaves are linked and never shared, so those trees get NULL and are
+ * searched under the lock. Returns -1 if the writes failed. */
+static int
+btree_pin_root(PyBTreeObject *btree, PyBTreeNode **root)
+{
+    int result = 0;
+
+    *root = NULL;
+    Py_BEGIN_CRITICAL_SECTION(btree);
+    if (BTREE_FLUSH(btree)) {
+        result = -1;
+    }
+    else if (!btree->bplus && btree->root != NULL) {
+        *root = btree->root;
+        NODE_PIN(*root);
+    }
+    Py_END_CRITICAL_SECTION();
+    return result;
+}
+
+/* A search by the callers of node_rank() and node_range_ranks(), which run
+ * under the tree lock but compare keys, and so may run Python code that
+ * writes to the tree. See btree_search_begin(). */
+typedef struct {
+    PyBTreeNode *root;            /* Root to search, NULL for an empty tree */
+    PyBTreeNode *pin;             /* Reference held on root, NULL for B+trees */
+    size_t version;               /* btree->version when the search started */
+} TreeSearch;
+
+/* Start a search of btree, whose lock the caller holds: s->root stays
+ * intact until btree_search_end() however the tree changes, pinned as
+ * btree_pin_root() pins it, or for B+trees by refusing writes. Returns -1
+ * if held-back writes failed. */
+static int
+btree_search_begin(PyBTreeObject *btree, TreeSearch *s)
+{
+    if (BTREE_FLUSH(btree)) {
+        return -1;
+    }
+    s->root = btree->root;
+    s->pin = NULL;
+    if (!btree->bplus && s->root != NULL) {
+        s->pin = s->root;
+        NODE_PIN(s->pin);
+    }
+    BTREE_SEARCH_ENTER(btree);
+    s->version = btree->version;
+    return 0;
+}
+
+/* Release the root of a search; status is the search's own result, passed
+ * through unless it succeeded on a tree that changed meanwhile, which
+ * raises RuntimeError. Returns 0 or -1. */
+static int
+btree_search_end(PyBTreeObject *btree, TreeSearch *s, int status)
+{
+    BTREE_SEARCH_EXIT(btree);
+    if (s->pin != NULL) {
+        NODE_UNPIN(s->pin);
+    }
+    if (status < 0) {
+        return -1;
+    }
+    if (btree->version != s->version) {
+        PyErr_SetString(PyExc_RuntimeError, "SortedDict changed during lookup");
+        return -1;
+    }
+    return 0;
+}
+
+static Py_ssize_t node_rank(PyBTreeNode *node, PyObject *key, int right, int *found);
+
+/* node_rank() of the tree's root, pinned for the search: RuntimeError if a
+ * comparison wrote to the tree. Returns -1 on error. */
+static Py_ssize_t
+btree_rank(PyBTreeObject *btree, PyObject *key, int right, int *found)
+{
+    TreeSearch s;
+    Py_ssize_t rank;
+
+    if (btree_search_begin(btree, &s) < 0) {
+        return -1;
+    }
+    rank = node_rank(s.root, key, right, found);
+    return btree_search_end(btree, &s, rank < 0 ? -1 : 0) < 0 ? -1 : rank;
+}
+
+PyObject *
+PyBTree_Search(PyObject *self, PyObject *key)
+{
+    PyBTreeObject *btree = (PyBTreeObject *)self;
+    PyBTreeNode *root;
+    PyObject *value = NULL;
+
+    if (!PyBTree_Check(self)) {
+        PyErr_BadInternalCall();
+        return NULL;
+    }
+
+    if (btree_pin_root(btree, &root) < 0) {
+        return NULL;
+    }
+    if (root != NULL) {
+        value = node_search(root, key);
+        NODE_UNPIN(root);
+        return value;
+    }
+    Py_BEGIN_CRITICAL_SECTION(self);
+    if (btree->root != NULL) {
+        BTREE_SEARCH_ENTER(btree);
+        value = node_search(btree->root, key);
+        BTREE_SEARCH_EXIT(btree);
+    }
+    Py_END_CRITICAL_SECTION();
+    return value;
+}
+
+/* Delete the item at rank of a tree in the classic layout, after
+ * btree_begin_write(). Trees with duplicates delete this way, as a key does
+ * not tell which of its items to remove. */
+static int
+btree_delete_rank(PyBTreeObject *btree, Py_ssize_t rank)
+{
+    int result;
+
+    if (node_unshare(&btree->root) == NULL) {
+        return -1;
+    }
+    result = delete_rank_from_node(btree->root, rank);
+    range_collapse_root(&btree->root);
+    if (result < 0) {
+        return -1;
+    }
+    btree->size--;
+    return 0;
+}
+
+int
+PyBTree_Delete(PyObject *self, PyObject *key)
+{
+    PyBTreeObject *btree = (PyBTreeObject *)self;
+    int result;
+
+    if (!PyBTree_Check(self)) {
+        PyErr_BadInternalCall();
+        return -1;
+    }
+
+    if (btree_begin_write(btree) < 0) {
+        return -1;
+    }
+    if (btree->root == NULL || btree->size == 0) {
+        PyErr_SetObject(PyExc_KeyError, key);
+        return -1;
+    }
+    if (btree->duplicates) {
+        /* The first item with key */
+        int found;
+        Py_ssize_t rank = btree_rank(btree, key, 0, &found);
+
+        if (rank < 0) {
+            return -1;
+        }
+        if (!found) {
+            PyErr_SetObject(PyExc_KeyError, key);
+            return -1;
+        }
+        return btree_delete_rank(btree, rank);
+    }
+    if (node_unshare(&btree->root) == NULL) {
+        return -1;
+    }
+
+    if (btree->bplus) {
+        result = bplus_delete_from_node(btree->root, key);
+    }
+    else {
+        result = delete_from_node(btree->root, key);
+    }
+
+    /* If root has no keys but has a child, make the child the new root.
+     * Rebalancing on the way down can empty the root even when the key
+     * turns out to be missing. */
+    if (btree->root->n_keys == 0 && !btree->root->is_leaf) {
+        PyBTreeNode *old_root = btree->root;
+        btree->root = old_root->children[0];
+        old_root->children[0] = NULL;
+        NODE_DECREF(old_root);
+    }
+
+    if (result < 0) {
+        return -1;
+    }
+
+    btree->size--;
+    return 0;
+}
+
+/* Optimized contains check - avoids INCREF/DECREF overhead */
+static int
+node_contains(PyBTreeNode *node, PyObject *key)
+{
+    int found;
+
+    while (node != NULL) {
+        Py_ssize_t i = node_search_read(node, key, &found);
+        if (i < 0) {
+            return -1;  /* Error */
+        }
+
+        if (found) {
+            if (NODE_HAS_ITEMS(node)) {
+                return 1;  /* Found */
+            }
+            i++;  /* B+tree separator: equal keys live to the right */
+        }
+        else if (node->is_leaf) {
+            return 0;  /* Not found */
+        }
+
+        node = node->children[i];
+    }
+
+    return 0;
+}
+
+int
+PyBTree_Contains(PyObject *self, PyObject *key)
+{
+    PyBTreeObject *btree = (PyBTreeObject *)self;
+
+    PyBTreeNode *root;
+    int result = 0;
+
+    if (!PyBTree_Check(self)) {
+        PyErr_BadInternalCall();
+        return -1;
+    }
+
+    if (btree_pin_root(btree, &root) < 0) {
+        return -1;
+    }
+    if (root != NULL) {
+        result = node_contains(root, key);
+        NODE_UNPIN(root);
+        return result;
+    }
+    Py_BEGIN_CRITICAL_SECTION(self);
+    if (btree->root != NULL) {
+        BTREE_SEARCH_ENTER(btree);
+        result = node_contains(btree->root, key);
+        BTREE_SEARCH_EXIT(btree);
+    }
+    Py_END_CRITICAL_SECTION();
+    return result;
+}
+
+/* Optimized helper to collect keys with pre-allocated index */
+static int
+collect_keys_fast(PyBTreeNode *node, PyObject **items, Py_ssize_t *idx)
+{
+    Py_ssize_t i;
+
+    if (node == NULL) {
+        return 0;
+    }
+
+    for (i = 0; i < node->n_keys; i++) {
+        if (!node->is_leaf && node->children[i]) {
+            if (collect_keys_fast(node->children[i], items, idx) < 0) {
+                return -1;
+            }
+        }
+        if (!NODE_HAS_ITEMS(node)) {
+            continue;
+        }
+        items[*idx] = node_get_key(node, i);
+        if (items[*idx] == NULL) {
+            return -1;
+        }
+        (*idx)++;
+    }
+
+    if (!node->is_leaf && node->children[node->n_keys]) {
+        if (collect_keys_fast(node->children[node->n_keys], items, idx) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+PyObject *
+PyBTree_Keys(PyObject *self)
+{
+    PyBTreeObject *btree = (PyBTreeObject *)self;
+
+    if (!PyBTree_Check(self)) {
+        PyErr_BadInternalCall();
+        return NULL;
+    }
+    if (BTREE_FLUSH(btree)) {
+        return NULL;
+    }
+
+    /* Pre-allocate list with exact size */
+    PyObject *list = PyList_New(btree->size);
+    if (list == NULL) {
+        return NULL;
+    }
+
+    if (btree->size > 0) {
+        Py_ssize_t idx = 0;
+        if (collect_keys_fast(btree->root, &PyList_GET_ITEM(list, 0), &idx) < 0) {
+            Py_DECREF(list);
+            return NULL;
+        }
+    }
+
+    return list;
+}
+
+/* Optimized helper to collect values with pre-allocated index */
+static int
+collect_values_fast(PyBTreeNode *node, PyObject **items, Py_ssize_t *idx)
+{
+    Py_ssize_t i;
+
+    if (node == NULL) {
+        return 0;
+    }
+
+    for (i = 0; i < node->n_keys; i++) {
+        if (!node->is_leaf && node->children[i]) {
+            if (collect_values_fast(node->children[i], items, idx) < 0) {
+                return -1;
+            }
+        }
+        if (!NODE_HAS_ITEMS(node)) {
+            continue;
+        }
+        Py_INCREF(node->values[i]);
+        items[*idx] = node->values[i];
+        (*idx)++;
+    }
+
+    if (!node->is_leaf && node->children[node->n_keys]) {
+        if (collect_values_fast(node->children[node->n_keys], items, idx) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+PyObject *
+PyBTree_Values(PyObject *self)
+{
+    PyBTreeObject *btree = (PyBTreeObject *)self;
+
+    if (!PyBTree_Check(self)) {
+        PyErr_BadInternalCall();
+        return NULL;
+    }
+    if (BTREE_FLUSH(btree)) {
+        return NULL;
+    }
+
+    /* Pre-allocate list with exact size */
+    PyObject *list = PyList_New(btree->size);
+    if (list == NULL) {
+        return NULL;
+    }
+
+    if (btree->size > 0) {
+        Py_ssize_t idx = 0;
+        if (collect_values_fast(btree->root, &PyList_GET_ITEM(list, 0), &idx) < 0) {
+            Py_DECREF(list);
+            return NULL;
+        }
+    }
+
+    return list;
+}
+
+/* Optimized helper to collect items with pre-allocated index */
+static int
+collect_items_fast(PyBTreeNode *node, PyObject **items, Py_ssize_t *idx)
+{
+    Py_ssize_t i;
+
+    if (node == NULL) {
+        return 0;
+    }
+
+    for (i = 0; i < node->n_keys; i++) {
+        if (!node->is_leaf && node->children[i]) {
+            if (collect_items_fast(node->children[i], items, idx) < 0) {
+                return -1;
+            }
+        }
+        if (!NODE_HAS_ITEMS(node)) {
+            continue;
+        }
+        PyObject *tuple = node_get_item(node, i);
+        if (tuple == NULL) {
+            return -1;
+        }
+        items[*idx] = tuple;
+        (*idx)++;
+    }
+
+    if (!node->is_leaf && node->children[node->n_keys]) {
+        if (collect_items_fast(node->children[node->n_keys], items, idx) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+PyObject *
+PyBTree_Items(PyObject *self)
+{
+    PyBTreeObject *btree = (PyBTreeObject *)self;
+
+    if (!PyBTree_Check(self)) {
+        PyErr_BadInternalCall();
+        return NULL;
+    }
+    if (BTREE_FLUSH(btree)) {
+        return NULL;
+    }
+
+    /* Pre-allocate list with exact size */
+    PyObject *list = PyList_New(btree->size);
+    if (list == NULL) {
+        return NULL;
+    }
+
+    if (btree->size > 0) {
+        Py_ssize_t idx = 0;
+        if (collect_items_fast(btree->root, &PyList_GET_ITEM(list, 0), &idx) < 0) {
+            Py_DECREF(list);
+            return NULL;
+        }
+    }
+
+    return list;
+}
+
+static PyObject *
+get_min_from_node(PyBTreeNode *node)
+{
+    if (node == NULL || node->n_keys == 0) {
+        return NULL;
+    }
+    while (!node->is_leaf) {
+        node = node->children[0];
+    }
+    return node_get_key(node, 0);
+}
+
+static PyObject *
+get_max_from_node(PyBTreeNode *node)
+{
+    if (node == NULL || node->n_keys == 0) {
+        return NULL;
+    }
+    while (!node->is_leaf) {
+        node = node->children[node->n_keys];
+    }
+    return node_get_key(node, node->n_keys - 1);
+}
+
+PyObject *
+PyBTree_GetMin(PyObject *self)
+{
+    PyBTreeObject *btree = (PyBTreeObject *)self;
+
+    if (!PyBTree_Check(self)) {
+        PyErr_BadInternalCall();
+        return NULL;
+    }
+    if (BTREE_FLUSH(btree)) {
+        return NULL;
+    }
+
+    return get_min_from_node(btree->root);
+}
+
+PyObject *
+PyBTree_GetMax(PyObject *self)
+{
+    PyBTreeObject *btree = (PyBTreeObject *)self;
+
+    if (!PyBTree_Check(self)) {
+        PyErr_BadInternalCall();
+        return NULL;
+    }
+    if (BTREE_FLUSH(btree)) {
+        return NULL;
+    }
+
+    return get_max_from_node(btree->root);
+}
+
+/* Clone a subtree node by node. Key and value arrays are memcpy'd and their
+ * objects INCREF'd, and the int64 key cache is copied verbatim, so no key
+ * is ever compared. Returns a new node, or NULL on failure.
+ */
+static PyBTreeNode *
+node_clone(PyBTreeNode *src)
+{
+    PyBTreeNode *dst;
+    Py_ssize_t i;
+
+    dst = node_copy_shallow(src);
+    if (dst == NULL) {
+        return NULL;
+    }
+
+    if (!src->is_leaf) {
+        for (i = 0; i <= src->n_keys; i++) {
+            PyBTreeNode *child = node_clone(src->children[i]);
+            if (child == NULL) {
+                NODE_DECREF(dst);
+                return NULL;
+            }
+            NODE_SETREF(dst->children[i], child);
+        }
+    }
+
+    return dst;
+}
+
+PyObject *
+PyBTree_Copy(PyObject *self)
+{
+    PyBTreeObject *btree = (PyBTreeObject *)self;
+    PyBTreeObject *copy;
+    PyBTreeNode *root;
+
+    if (!PyBTree_Check(self)) {
+        PyErr_BadInternalCall();
+        return NULL;
+    }
+    if (BTREE_FLUSH(btree)) {
+        return NULL;
+    }
+
+    copy = (PyBTreeObject *)PyBTree_New(btree->order);
+    if (copy == NULL) {
+        return NULL;
+    }
+    copy->cache_i64 = btree->cache_i64;
+    copy->key_storage = btree->key_storage;
+    copy->eytzinger = btree->eytzinger;
+    copy->duplicates = btree->duplicates;
+    copy->cache_pairs = btree->cache_pairs;
+    copy->bplus = btree->bplus;
+    copy->aggregate = btree->aggregate;
+    Py_XINCREF(btree->agg_func);
+    copy->agg_func = btree->agg_func;
+    copy->wbuf_size = btree->wbuf_size;
+
+    root = node_clone(btree->root);
+    if (root == NULL) {
+        Py_DECREF(copy);
+        return NULL;
+    }
+    if (copy->bplus) {
+        PyBTreeNode *last = NULL;
+        bplus_link_leaves(root, &last);
+    }
+    NODE_SETREF(copy->root, root);
+    copy->size = btree->size;
+
+    return (PyObject *)copy;
+}
+
+int
+PyBTree_Clear(PyObject *self)
+{
+    PyBTreeObject *btree = (PyBTreeObject *)self;
+
+    if (!PyBTree_Check(self)) {
+        PyErr_BadInternalCall();
+        return -1;
+    }
+    btree_discard_writes(btree);
+    if (btree_begin_write(btree) < 0) {
+        return -1;
+    }
+
+    return btree_clear_internal(btree);
+}
+
+/* ==================== Argument Parsing ==================== */
+
+/* Methods take METH_FASTCALL arguments: a C array instead of a tuple that
+ * PyArg_ParseTuple() would take apart again on every call. */
+
+/* Check the positional argument count of a method named name */
+static int
+check_nargs(const char *name, Py_ssize_t nargs, Py_ssize_t min, Py_ssize_t max)
+{
+    if (nargs < min) {
+        PyErr_Format(PyExc_TypeError, "%s expected %s%zd argument%s, got %zd",
+                     name, min == max ? "" : "at least ", min, min == 1 ? "" : "s", nargs);
+        return -1;
+    }
+    if (nargs > max) {
+        PyErr_Format(PyExc_TypeError, "%s expected %s%zd argument%s, got %zd",
+                     name, min == max ? "" : "at most ", max, max == 1 ? "" : "s", nargs);
+        return -1;
+    }
+    return 0;
+}
+
+/* Match positional and keyword arguments to the NULL-terminated parameter
+ * names in kwlist (at most 16), storing them in out[] and leaving absent
+ * parameters as they are. The first required parameters must be given. */
+static int
+unpack_args(const char *name, PyObject *const *args, Py_ssize_t nargs,
+            PyObject *kwnames, const char *const *kwlist, Py_ssize_t required,
+            PyObject **out)
+{
+    Py_ssize_t n = 0, i, j;
+    Py_ssize_t nkw = kwnames != NULL ? PyTuple_GET_SIZE(kwnames) : 0;
+    unsigned int given = 0;
+
+    while (kwlist[n] != NULL) {
+        n++;
+    }
+    if (nargs > n) {
+        PyErr_Format(PyExc_TypeError, "%s() takes at most %zd argument%s (%zd given)",
+                     name, n, n == 1 ? "" : "s", nargs);
+        return -1;
+    }
+    for (i = 0; i < nargs; i++) {
+        out[i] = args[i];
+        given |= 1u << i;
+    }
+    for (j = 0; j < nkw; j++) {
+        PyObject *kw = PyTuple_GET_ITEM(kwnames, j);
+        for (i = 0; i < n; i++) {
+            if (PyUnicode_CompareWithASCIIString(kw, kwlist[i]) == 0) {
+                break;
+            }
+        }
+        if (i == n) {
+            PyErr_Format(PyExc_TypeError, "%s() got an unexpected keyword argument '%U'",
+                         name, kw);
+            return -1;
+        }
+        if (given & (1u << i)) {
+            PyErr_Format(PyExc_TypeError,
+                         "argument for %s() given by name ('%s') and position (%zd)",
+                         name, kwlist[i], i + 1);
+            return -1;
+        }
+        out[i] = args[nargs + j];
+        given |= 1u << i;
+    }
+    for (i = 0; i < required; i++) {
+        if (!(given & (1u << i))) {
+            PyErr_Format(PyExc_TypeError, "%s() missing required argument '%s' (pos %zd)",
+                         name, kwlist[i], i + 1);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Converters for unpack_args() results, as the "i", "d", "s" and "z"
+ * PyArg_Parse formats would convert them. Argument obj may be NULL (not
+ * given), which keeps *out. */
+static int
+arg_int(const char *name, const char *param, PyObject *obj, int *out)
+{
+    long value;
+
+    if (obj == NULL) {
+        return 0;
+    }
+    if (PyFloat_Check(obj)) {
+        PyErr_Format(PyExc_TypeError, "%s() argument '%s' must be int, not float",
+                     name, param);
+        return -1;
+    }
+    value = PyLong_AsLong(obj);
+    if (value == -1 && PyErr_Occurred()) {
+        return -1;
+    }
+    if (value > INT_MAX || value < INT_MIN) {
+        PyErr_Format(PyExc_OverflowError, "%s() argument '%s' does not fit in a C int",
+                     name, param);
+        return -1;
+    }
+    *out = (int)value;
+    return 0;
+}
+
+static int
+arg_double(PyObject *obj, double *out)
+{
+    double value;
+
+    if (obj == NULL) {
+        return 0;
+    }
+    value = PyFloat_AsDouble(obj);
+    if (value == -1.0 && PyErr_Occurred()) {
+        return -1;
+    }
+    *out = value;
+    return 0;
+}
+
+static int
+arg_str(const char *name, const char *param, PyObject *obj, int allow_none,
+        const char **out)
+{
+    const char *value;
+    Py_ssize_t size;
+
+    if (obj == NULL) {
+        return 0;
+    }
+    if (allow_none && obj == Py_None) {
+        *out = NULL;
+        return 0;
+    }
+    if (!PyUnicode_Check(obj)) {
+        PyErr_Format(PyExc_TypeError, "%s() argument '%s' must be str%s, not %.50s",
+                     name, param, allow_none ? " or None" : "", Py_TYPE(obj)->tp_name);
+        return -1;
+    }
+    value = PyUnicode_AsUTF8AndSize(obj, &size);
+    if (value == NULL) {
+        return -1;
+    }
+    if ((Py_ssize_t)strlen(value) != size) {
+        PyErr_SetString(PyExc_ValueError, "embedded null character");
+        return -1;
+    }
+    *out = value;
+    return 0;
+}
+
+static int
+arg_bool(PyObject *obj, int *out)
+{
+    int value;
+
+    if (obj == NULL) {
+        return 0;
+    }
+    value = PyObject_IsTrue(obj);
+    if (value < 0) {
+        return -1;
+    }
+    *out = value;
+    return 0;
+}
+
+/* ==================== Type Methods ==================== */
+
+static void
+btree_dealloc(PyObject *self)
+{
+    PyBTreeObject *btree = (PyBTreeObject *)self;
+
+    PyObject_GC_UnTrack(self);
+
+    NODE_XDECREF(btree->root);
+    Py_XDECREF(btree->agg_func);
+    btree_discard_writes(btree);
+
+    Py_TYPE(self)->tp_free(self);
+}
+
+static int
+btree_traverse(PyObject *self, visitproc visit, void *arg)
+{
+    PyBTreeObject *btree = (PyBTreeObject *)self;
+    Py_ssize_t i;
+
+    Py_VISIT(btree->agg_func);
+    for (i = 0; i < btree->wbuf_n; i++) {
+        Py_VISIT(btree->wbuf[i].key);
+        Py_VISIT(btree->wbuf[i].value);
+    }
+    return node_traverse(btree->root, visit, arg);
+}
+
+static int
+btree_clear_internal(PyBTreeObject *btree)
+{
+    int order = btree->order;
+    NODE_CLEAR(btree->root);
+    btree->size = 0;
+    btree->version++;
+
+    /* Create a new empty root */
+    btree->root = btreenode_new(order, 1, BTREE_KEY_SPEC(btree));
+    if (btree->root == NULL) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+btree_clear_slot(PyObject *self)
+{
+    PyBTreeObject *btree = (PyBTreeObject *)self;
+
+    btree->aggregate = AGG_NONE;
+    Py_CLEAR(btree->agg_func);
+    btree_discard_writes(btree);
+    return btree_clear_internal(btree);
+}
+
+/* Name of a typed tree's key_type, or NULL for object keys */
+static const char *
+btree_key_type_name(PyBTreeObject *btree)
+{
+    if (btree->key_storage == KEYS_I64) {
+        return "i64";
+    }
+    if (btree->key_storage == KEYS_F64) {
+        return "f64";
+    }
+    return NULL;
+}
+
+/* The aggregate= argument that recreates btree's aggregate (new reference) */
+static PyObject *
+btree_aggregate_arg(PyBTreeObject *btree)
+{
+    switch (btree->aggregate) {
+    case AGG_SUM:
+        return PyUnicode_FromString("sum");
+    case AGG_MIN:
+        return PyUnicode_FromString("min");
+    case AGG_MAX:
+        return PyUnicode_FromString("max");
+    case AGG_CALL:
+        Py_INCREF(btree->agg_func);
+        return btree->agg_func;
+    default:
+        Py_RETURN_NONE;
+    }
+}
+
+static PyObject *
+btree_repr(PyObject *self)
+{
+    PyBTreeObject *btree = (PyBTreeObject *)self;
+    const char *key_type = btree_key_type_name(btree);
+    const char *layout = btree->bplus ? ", layout='bplus'" : "";
+    const char *key_layout = btree->eytzinger ? ", key_layout='eytzinger'" : "";
+    const char *duplicates = btree->duplicates ? ", duplicates=True" : "";
+    const char *cache_pairs = btree->cache_pairs ? ", cache_pairs=True" : "";
+
+    PyObject *aggregate, *options, *result;
+
+    if (BTREE_FLUSH(btree)) {
+        return NULL;
+    }
+    /* The options that need a number or an object: aggregate=, write_buffer= */
+    aggregate = btree_aggregate_arg(btree);
+    if (aggregate == NULL) {
+        return NULL;
+    }
+    if (aggregate == Py_None) {
+        options = btree->wbuf_size > 0
+                  ? PyUnicode_FromFormat(", write_buffer=%zd", btree->wbuf_size)
+                  : PyUnicode_FromString("");
+    }
+    else if (btree->wbuf_size > 0) {
+        options = PyUnicode_FromFormat(", aggregate=%R, write_buffer=%zd",
+                                       aggregate, btree->wbuf_size);
+    }
+    else {
+        options = PyUnicode_FromFormat(", aggregate=%R", aggregate);
+    }
+    Py_DECREF(aggregate);
+    if (options == NULL) {
+        return NULL;
+    }
+    if (key_type != NULL) {
+        result = PyUnicode_FromFormat("SortedDict(order=%d, size=%zd, key_type='%s'%s%s%s%U)",
+                                      btree->order, btree->size, key_type,
+                                      layout, key_layout, duplicates, options);
+    }
+    else {
+        result = PyUnicode_FromFormat("SortedDict(order=%d, size=%zd, cache_i64=%s%s%s%s%s%U)",
+                                      btree->order, btree->size,
+                                      btree->cache_i64 ? "True" : "False",
+                                      cache_pairs, layout, key_layout, duplicates, options);
+    }
+    Py_DECREF(options);
+    return result;
+}
+
+static Py_ssize_t
+btree_length(PyObject *self)
+{
+    PyBTreeObject *btree = (PyBTreeObject *)self;
+
+    if (BTREE_FLUSH(btree)) {
+        return -1;
+    }
+    return btree->size;
+}
+
+static int
+btree_contains(PyObject *self, PyObject *key)
+{
+    return PyBTree_Contains(self, key);
+}
+
+static PyObject *
+btree_subscript(PyObject *self, PyObject *key)
+{
+    PyObject *value = PyBTree_Search(self, key);
+    if (value == NULL) {
+        if (!PyErr_Occurred()) {
+            PyErr_SetObject(PyExc_KeyError, key);
+        }
+        return NULL;
+    }
+    return value;
+}
+
+static int btree_delete_equal(PyBTreeObject *btree, PyObject *key);
+
+static int
+btree_ass_subscript(PyObject *self, PyObject *key, PyObject *value)
+{
+    if (value == NULL) {
+        if (((PyBTreeObject *)self)->duplicates) {
+            return btree_delete_equal((PyBTreeObject *)self, key);
+        }
+        return PyBTree_Delete(self, key);
+    }
+    if (((PyBTreeObject *)self)->wbuf_size > 0) {
+        int held = btree_buffer_write((PyBTreeObject *)self, key, value);
+        if (held != 0) {
+            return held < 0 ? -1 : 0;
+        }
+    }
+    return PyBTree_Insert(self, key, value);
+}
+
+/* ==================== SortedDict Iterator ==================== */
+
+/* Leftmost and rightmost leaves under node */
+static PyBTreeNode *
+get_min_leaf(PyBTreeNode *node)
+{
+    while (!node->is_leaf) {
+        node = node->children[0];
+    }
+    return node;
+}
+
+static PyBTreeNode *
+get_max_leaf(PyBTreeNode *node)
+{
+    while (!node->is_leaf) {
+        node = node->children[node->n_keys];
+    }
+    return node;
+}
+
+/* Stack-based iterator for efficient in-order traversal without copying */
+#define ITER_STACK_SIZE 64  /* Max tree depth - sufficient for huge trees */
+
+typedef struct {
+    PyBTreeNode *node;
+    Py_ssize_t key_idx;  /* Next key index to return */
+} IterStackFrame;
+
+/* What an iterator yields for each entry */
+#define ITER_KEYS   0
+#define ITER_VALUES 1
+#define ITER_ITEMS  2
+
+/* Return a new reference to the object yielded for entry idx of node.
+ * Items iterators keep their last tuple in *result and refill it in place
+ * when the caller has already dropped it, as dict's item iterator does. */
+static PyObject *
+iter_yield(int kind, PyObject **result, PyBTreeNode *node, Py_ssize_t idx)
+{
+    PyObject *key;
+    PyObject *value = node->values[idx];
+    PyObject *tuple = *result;
+
+    if (kind == ITER_VALUES) {
+        Py_INCREF(value);
+        return value;
+    }
+    key = node_get_key(node, idx);
+    if (key == NULL || kind == ITER_KEYS) {
+        return key;
+    }
+
+    if (tuple != NULL && Py_REFCNT(tuple) == 1) {
+        PyObject *old_key = PyTuple_GET_ITEM(tuple, 0);
+        PyObject *old_value = PyTuple_GET_ITEM(tuple, 1);
+        Py_INCREF(value);
+        PyTuple_SET_ITEM(tuple, 0, key);
+        PyTuple_SET_ITEM(tuple, 1, value);
+        Py_INCREF(tuple);
+        Py_DECREF(old_key);
+        Py_DECREF(old_value);
+        /* The GC may have untracked the tuple while it held only
+         * atomic objects; it may not now. */
+        if (!PyObject_GC_IsTracked(tuple)) {
+            PyObject_GC_Track(tuple);
+        }
+        return tuple;
+    }
+
+    tuple = PyTuple_Pack(2, key, value);
+    Py_DECREF(key);
+    if (tuple == NULL) {
+        return NULL;
+    }
+    Py_INCREF(tuple);
+    Py_XSETREF(*result, tuple);
+    return tuple;
+}
+
+typedef struct {
+    PyObject_HEAD
+    PyBTreeObject *btree;           /* The B-tree being iterated */
+    Py_ssize_t remaining;           /* Items remaining for length hint */
+    int kind;                       /* ITER_KEYS, ITER_VALUES or ITER_ITEMS */
+    PyObject *result;               /* Recycled tuple for ITER_ITEMS */
+    size_t version;                 /* Tree version the position belongs to */
+    Py_ssize_t size;                /* Tree size when the iterator was made */
+    Py_ssize_t end;                 /* Rank one past the last item to yield */
+    int leaf_only;                  /* Fast path when root is a leaf */
+    PyBTreeNode *leaf;              /* Leaf node for fast path */
+    Py_ssize_t leaf_index;          /* Next index in leaf */
+    Py_ssize_t stack_top;           /* Top of stack (-1 = empty) */
+    IterStackFrame stack[ITER_STACK_SIZE];  /* Stack for tree traversal */
+} PyBTreeIterObject;
+
+static void iter_seek(PyBTreeIterObject *it, Py_ssize_t rank);
+
+static PyTypeObject PyBTreeIter_Type;
+
+/* Push a node onto an iterator's stack and descend to leftmost leaf */
+static void
+iter_descend_left(IterStackFrame *stack, Py_ssize_t *top, PyBTreeNode *node)
+{
+    while (node != NULL) {
+        (*top)++;
+        stack[*top].node = node;
+        stack[*top].key_idx = 0;
+        
+        if (node->is_leaf) {
+            break;
+        }
+        node = node->children[0];
+    }
+}
+
+static void
+btreeiter_dealloc(PyObject *self)
+{
+    PyBTreeIterObject *it = (PyBTreeIterObject *)self;
+    PyObject_GC_UnTrack(self);
+    Py_XDECREF(it->btree);
+    Py_XDECREF(it->result);
+    PyObject_GC_Del(self);
+}
+
+static int
+btreeiter_traverse(PyObject *self, visitproc visit, void *arg)
+{
+    PyBTreeIterObject *it = (PyBTreeIterObject *)self;
+    Py_VISIT(it->btree);
+    Py_VISIT(it->result);
+    return 0;
+}
+
+/* Step the iterator to its next entry, storing the node and slot that hold
+ * it. Returns 0 once the iteration is complete. */
+static int
+iter_advance(PyBTreeIterObject *it, PyBTreeNode **node_out, Py_ssize_t *idx_out)
+{
+    if (it->remaining <= 0) {
+        return 0;  /* Iteration complete (or islice() limit reached) */
+    }
+    if (it->leaf_only) {
+        /* Root leaf, or the B+tree leaf chain */
+        while (it->leaf != NULL) {
+            if (it->leaf_index < it->leaf->n_keys) {
+                it->remaining--;
+                *node_out = it->leaf;
+                *idx_out = it->leaf_index++;
+                return 1;
+            }
+            it->leaf = it->leaf->next;
+            it->leaf_index = 0;
+        }
+        return 0;
+    }
+    
+    while (it->stack_top >= 0) {
+        IterStackFrame *frame = &it->stack[it->stack_top];
+        PyBTreeNode *node = frame->node;
+        
+        if (frame->key_idx < node->n_keys) {
+            /* Return current entry and advance */
+            *node_out = node;
+            *idx_out = frame->key_idx;
+            frame->key_idx++;
+            it->remaining--;
+            
+            /* If not a leaf, descend into right child of this key */
+            if (!node->is_leaf) {
+                iter_descend_left(it->stack, &it->stack_top, node->children[frame->key_idx]);
+            }
+            return 1;
+        } else {
+            /* Done with this node, pop stack */
+            it->stack_top--;
+        }
+    }
+    
+    return 0;  /* Iteration complete */
+}
+
+/* Raise RuntimeError, as dict iterators do, if the tree has grown or
+ * shrunk since an iterator over it was created */
+static int
+iter_check_size(PyBTreeObject *btree, Py_ssize_t size)
+{
+    if (btree->size != size) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "SortedDict changed size during iteration");
+        return -1;
+    }
+    return 0;
+}
+
+static PyObject *
+btreeiter_next(PyObject *self)
+{
+    PyBTreeIterObject *it = (PyBTreeIterObject *)self;
+    PyBTreeNode *node;
+    Py_ssize_t idx;
+
+    if (it->remaining < 0) {
+        return NULL;  /* Already exhausted */
+    }
+    if (BTREE_FLUSH(it->btree)) {
+        return NULL;
+    }
+    if (it->version != it->btree->version) {
+        /* The nodes on the stack may be gone; writes that kept the size
+         * (value updates) leave the ranks alone, so seek back by rank */
+        if (iter_check_size(it->btree, it->size) < 0) {
+            return NULL;
+        }
+        it->version = it->btree->version;
+        if (it->remaining > 0) {
+            iter_seek(it, it->end - it->remaining);
+        }
+    }
+    if (!iter_advance(it, &node, &idx)) {
+        it->remaining = -1;
+        return NULL;
+    }
+    return iter_yield(it->kind, &it->result, node, idx);
+}
+
+static PyObject *
+btreeiter_len(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+    PyBTreeIterObject *it = (PyBTreeIterObject *)self;
+    return PyLong_FromSsize_t(it->remaining > 0 ? it->remaining : 0);
+}
+
+#define ITER_TREE(type) (((type *)self)->btree)
+BTREE_DEFINE_LOCKED(PyObject *, btreeiter_next, ITER_TREE(PyBTreeIterObject),
+                    (PyObject *self), (self))
+BTREE_DEFINE_LOCKED(PyObject *, btreeiter_len, ITER_TREE(PyBTreeIterObject),
+                    (PyObject *self, PyObject *arg), (self, arg))
+
+static PyMethodDef btreeiter_methods[] = {
+    {"__length_hint__", BTREE_LOCKED(btreeiter_len), METH_NOARGS, "Private method returning estimate of len(list(it))."},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyTypeObject PyBTreeIter_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "btree_iterator",                           /* tp_name */
+    sizeof(PyBTreeIterObject),                  /* tp_basicsize */
+    0,                                          /* tp_itemsize */
+    btreeiter_dealloc,                          /* tp_dealloc */
+    0,                                          /* tp_vectorcall_offset */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_as_async */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    0,                                          /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    PyObject_GenericGetAttr,                    /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,    /* tp_flags */
+    0,                                          /* tp_doc */
+    btreeiter_traverse,                         /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    PyObject_SelfIter,                          /* tp_iter */
+    BTREE_LOCKED(btreeiter_next),               /* tp_iternext */
+    btreeiter_methods,                          /* tp_methods */
+    0,                                          /* tp_members */
+};
+
+/* Create a forward iterator over the keys, values or items of btree */
+static PyObject *
+btree_iter_kind(PyBTreeObject *btree, int kind)
+{
+    PyBTreeIterObject *it;
+
+    if (BTREE_FLUSH(btree)) {
+        return NULL;
+    }
+    it = PyObject_GC_New(PyBTreeIterObject, &PyBTreeIter_Type);
+    if (it == NULL) {
+        return NULL;
+    }
+
+    Py_INCREF(btree);
+    it->btree = btree;
+    it->remaining = btree->size;
+    it->kind = kind;
+    it->result = NULL;
+    it->version = btree->version;
+    it->size = btree->size;
+    it->end = btree->size;
+    it->leaf_only = 0;
+    it->leaf = NULL;
+    it->leaf_index = 0;
+    it->stack_top = -1;  /* Empty stack */
+
+    /* Initialize by descending to leftmost leaf */
+    if (btree->root != NULL && btree->root->n_keys > 0) {
+        if (btree->root->is_leaf || btree->bplus) {
+            it->leaf_only = 1;
+            it->leaf = get_min_leaf(btree->root);
+        }
+        else {
+            iter_descend_left(it->stack, &it->stack_top, btree->root);
+        }
+    }
+
+    PyObject_GC_Track((PyObject *)it);
+    return (PyObject *)it;
+}
+
+static PyObject *
+btree_iter(PyObject *self)
+{
+    return btree_iter_kind((PyBTreeObject *)self, ITER_KEYS);
+}
+
+/* ==================== Reversed Iterator ==================== */
+
+typedef struct {
+    PyObject_HEAD
+    PyBTreeObject *btree;           /* The B-tree being iterated */
+    Py_ssize_t remaining;           /* Items remaining for length hint */
+    int kind;                       /* ITER_KEYS, ITER_VALUES or ITER_ITEMS */
+    PyObject *result;               /* Recycled tuple for ITER_ITEMS */
+    size_t version;                 /* Tree version the position belongs to */
+    Py_ssize_t size;                /* Tree size when the iterator was made */
+    Py_ssize_t base;                /* Rank of the last item to yield */
+    int leaf_only;                  /* Fast path when root is a leaf */
+    PyBTreeNode *leaf;              /* Leaf node for fast path */
+    Py_ssize_t leaf_index;          /* Next index in leaf */
+    Py_ssize_t stack_top;           /* Top of stack (-1 = empty) */
+    IterStackFrame stack[ITER_STACK_SIZE];  /* Stack for tree traversal */
+} PyBTreeReverseIterObject;
+
+static void reviter_seek(PyBTreeReverseIterObject *it, Py_ssize_t rank);
+
+static PyTypeObject PyBTreeReverseIter_Type;
+
+/* Push a node onto an iterator's stack and descend to rightmost leaf */
+static void
+iter_descend_right(IterStackFrame *stack, Py_ssize_t *top, PyBTreeNode *node)
+{
+    while (node != NULL) {
+        (*top)++;
+        stack[*top].node = node;
+        stack[*top].key_idx = node->n_keys - 1;
+        
+        if (node->is_leaf) {
+            break;
+        }
+        node = node->children[node->n_keys];
+    }
+}
+
+static void
+btreereviter_dealloc(PyObject *self)
+{
+    PyBTreeReverseIterObject *it = (PyBTreeReverseIterObject *)self;
+    PyObject_GC_UnTrack(self);
+    Py_XDECREF(it->btree);
+    Py_XDECREF(it->result);
+    PyObject_GC_Del(self);
+}
+
+static int
+btreereviter_traverse(PyObject *self, visitproc visit, void *arg)
+{
+    PyBTreeReverseIterObject *it = (PyBTreeReverseIterObject *)self;
+    Py_VISIT(it->btree);
+    Py_VISIT(it->result);
+    return 0;
+}
+
+static PyObject *
+btreereviter_next(PyObject *self)
+{
+    PyBTreeReverseIterObject *it = (PyBTreeReverseIterObject *)self;
+
+    if (it->remaining < 0) {
+        return NULL;  /* Already exhausted */
+    }
+    if (BTREE_FLUSH(it->btree)) {
+        return NULL;
+    }
+    if (it->version != it->btree->version) {
+        /* As in btreeiter_next() */
+        if (iter_check_size(it->btree, it->size) < 0) {
+            return NULL;
+        }
+        it->version = it->btree->version;
+        if (it->remaining > 0) {
+            reviter_seek(it, it->base + it->remaining - 1);
+        }
+    }
+    if (it->remaining == 0) {
+        it->remaining = -1;
+        return NULL;  /* Iteration complete (or islice() limit reached) */
+    }
+    if (it->leaf_only) {
+        /* Root leaf, or the B+tree leaf chain */
+        while (it->leaf != NULL) {
+            if (it->leaf_index >= 0) {
+                it->remaining--;
+                return iter_yield(it->kind, &it->result, it->leaf, it->leaf_index--);
+            }
+            it->leaf = it->leaf->prev;
+            it->leaf_index = it->leaf != NULL ? it->leaf->n_keys - 1 : -1;
+        }
+        return NULL;
+    }
+    
+    while (it->stack_top >= 0) {
         IterStackFrame *frame = &it->stack[it->stack_top];
         PyBTreeNode *node = frame->node;
         
-        if (frame->key_idx < node->n_keys) {
-            /* Return current key and advance */
-            PyObject *key = node->keys[frame->key_idx];
-            frame->key_idx++;
-            it->remaining--;
+        if (frame->key_idx >= 0) {
+            /* Return current entry and move backwards */
+            Py_ssize_t child_idx = frame->key_idx;
+            frame->key_idx--;
+            it->remaining--;
+            
+            /* If not a leaf, descend into left child of this key */
+            if (!node->is_leaf) {
+                iter_descend_right(it->stack, &it->stack_top, node->children[child_idx]);
+            }
+            
+            return iter_yield(it->kind, &it->result, node, child_idx);
+        } else {
+            /* Done with this node, pop stack */
+            it->stack_top--;
+        }
+    }
+    
+    return NULL;  /* Iteration complete */
+}
+
+static PyObject *
+btreereviter_len(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+    PyBTreeReverseIterObject *it = (PyBTreeReverseIterObject *)self;
+    return PyLong_FromSsize_t(it->remaining > 0 ? it->remaining : 0);
+}
+
+BTREE_DEFINE_LOCKED(PyObject *, btreereviter_next, ITER_TREE(PyBTreeReverseIterObject),
+                    (PyObject *self), (self))
+BTREE_DEFINE_LOCKED(PyObject *, btreereviter_len, ITER_TREE(PyBTreeReverseIterObject),
+                    (PyObject *self, PyObject *arg), (self, arg))
+
+static PyMethodDef btreereviter_methods[] = {
+    {"__length_hint__", BTREE_LOCKED(btreereviter_len), METH_NOARGS, "Private method returning estimate of len(list(it))."},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyTypeObject PyBTreeReverseIter_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "btree_reverseiterator",                    /* tp_name */
+    sizeof(PyBTreeReverseIterObject),           /* tp_basicsize */
+    0,                                          /* tp_itemsize */
+    btreereviter_dealloc,                       /* tp_dealloc */
+    0,                                          /* tp_vectorcall_offset */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_as_async */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    0,                                          /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    PyObject_GenericGetAttr,                    /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,    /* tp_flags */
+    0,                                          /* tp_doc */
+    btreereviter_traverse,                      /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    PyObject_SelfIter,                          /* tp_iter */
+    BTREE_LOCKED(btreereviter_next),            /* tp_iternext */
+    btreereviter_methods,                       /* tp_methods */
+    0,                                          /* tp_members */
+};
+
+/* Create a reverse iterator over the keys, values or items of btree */
+static PyObject *
+btree_reversed_kind(PyBTreeObject *btree, int kind)
+{
+    PyBTreeReverseIterObject *it;
+
+    if (BTREE_FLUSH(btree)) {
+        return NULL;
+    }
+    it = PyObject_GC_New(PyBTreeReverseIterObject, &PyBTreeReverseIter_Type);
+    if (it == NULL) {
+        return NULL;
+    }
+
+    Py_INCREF(btree);
+    it->btree = btree;
+    it->remaining = btree->size;
+    it->kind = kind;
+    it->result = NULL;
+    it->version = btree->version;
+    it->size = btree->size;
+    it->base = 0;
+    it->leaf_only = 0;
+    it->leaf = NULL;
+    it->leaf_index = -1;
+    it->stack_top = -1;  /* Empty stack */
+
+    /* Initialize by descending to rightmost leaf */
+    if (btree->root != NULL && btree->root->n_keys > 0) {
+        if (btree->root->is_leaf || btree->bplus) {
+            it->leaf_only = 1;
+            it->leaf = get_max_leaf(btree->root);
+            it->leaf_index = it->leaf->n_keys - 1;
+        }
+        else {
+            iter_descend_right(it->stack, &it->stack_top, btree->root);
+        }
+    }
+
+    PyObject_GC_Track((PyObject *)it);
+    return (PyObject *)it;
+}
+
+static PyObject *
+btree_reversed(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+    return btree_reversed_kind((PyBTreeObject *)self, ITER_KEYS);
+}
+
+/* ==================== Range Iterator (irange) ==================== */
+
+typedef struct {
+    PyObject_HEAD
+    PyBTreeObject *btree;           /* The B-tree being iterated */
+    PyObject *min_key;              /* Minimum key (inclusive), NULL for no min */
+    PyObject *max_key;              /* Maximum key (exclusive), NULL for no max */
+    int inclusive_min;              /* Include min_key */
+    int inclusive_max;              /* Include max_key */
+    int reverse;                    /* Walk from max_key down to min_key */
+    int kind;                       /* ITER_KEYS, ITER_VALUES or ITER_ITEMS */
+    PyObject *result;               /* Recycled tuple for ITER_ITEMS */
+    Py_ssize_t remaining;           /* Items left before limit is reached */
+    int has_last;                   /* Whether a key has been yielded */
+    PyObject *last;                 /* Last key yielded (object keys) */
+    NativeKey last_native;          /* Last key yielded (typed trees) */
+    Py_ssize_t run;                 /* Keys yielded equal to last (duplicates=True) */
+    size_t version;                 /* Tree version the position belongs to */
+    Py_ssize_t size;                /* Tree size when the iterator was made */
+    int leaf_only;                   /* Fast path when root is a leaf */
+    PyBTreeNode *leaf;               /* Leaf node for fast path */
+    Py_ssize_t leaf_index;           /* Next index in leaf */
+    Py_ssize_t stack_top;           /* Top of stack (-1 = empty) */
+    IterStackFrame stack[ITER_STACK_SIZE];  /* Stack for tree traversal */
+    int started;                    /* 0 before the first key, -1 when done */
+} PyBTreeRangeIterObject;
+
+static PyTypeObject PyBTreeRangeIter_Type;
+
+static void
+btreerangeiter_dealloc(PyObject *self)
+{
+    PyBTreeRangeIterObject *it = (PyBTreeRangeIterObject *)self;
+    PyObject_GC_UnTrack(self);
+    Py_XDECREF(it->btree);
+    Py_XDECREF(it->min_key);
+    Py_XDECREF(it->max_key);
+    Py_XDECREF(it->result);
+    Py_XDECREF(it->last);
+    PyObject_GC_Del(self);
+}
+
+static int
+btreerangeiter_traverse(PyObject *self, visitproc visit, void *arg)
+{
+    PyBTreeRangeIterObject *it = (PyBTreeRangeIterObject *)self;
+    Py_VISIT(it->btree);
+    Py_VISIT(it->min_key);
+    Py_VISIT(it->max_key);
+    Py_VISIT(it->result);
+    Py_VISIT(it->last);
+    return 0;
+}
+
+/* node_search_read() for a range bound. In a tree with duplicates the slot
+ * past the keys equal to key if upper, else the first of them, with *found
+ * cleared: the bound falls between two slots like a missing key's. */
+static Py_ssize_t
+range_search_bound(PyBTreeNode *node, PyObject *key, int upper, int *found)
+{
+    Py_ssize_t idx;
+
+    if (!node->duplicates) {
+        return node_search_read(node, key, found);
+    }
+    node_refresh_eytzinger(node);
+    idx = node_search_bound(node, key, upper, found);
+    *found = 0;
+    return idx;
+}
+
+/* Descend to first key >= min_key (or leftmost if no min) */
+static int
+range_iter_descend_to_start(PyBTreeRangeIterObject *it, PyBTreeNode *node)
+{
+    while (node != NULL) {
+        it->stack_top++;
+        it->stack[it->stack_top].node = node;
+        
+        if (it->min_key == NULL) {
+            /* No minimum, start from leftmost */
+            it->stack[it->stack_top].key_idx = 0;
+            if (node->is_leaf) {
+                break;
+            }
+            node = node->children[0];
+        } else {
+            /* Find position where keys >= min_key */
+            int found;
+            Py_ssize_t idx = range_search_bound(node, it->min_key, !it->inclusive_min,
+                                                &found);
+            if (idx < 0) {
+                return -1;
+            }
             
-            /* If not a leaf, descend into right child of this key */
+            if (found && !it->inclusive_min) {
+                /* Found exact match but not inclusive, move to next */
+                idx++;
+            }
+            
+            it->stack[it->stack_top].key_idx = idx;
+            
+            if (node->is_leaf) {
+                break;
+            }
+            
+            /* Descend to appropriate child */
+            if (found && !it->inclusive_min) {
+                if (idx <= node->n_keys) {
+                    node = node->children[idx];
+                } else {
+                    break;
+                }
+            } else {
+                node = node->children[idx];
+            }
+        }
+    }
+    return 0;
+}
+
+/* Descend to last key <= max_key (or < max_key when the bound is
+ * exclusive), or rightmost if no max; the mirror of
+ * range_iter_descend_to_start() for reverse=True */
+static int
+range_iter_descend_to_end(PyBTreeRangeIterObject *it, PyBTreeNode *node)
+{
+    if (it->max_key == NULL) {
+        iter_descend_right(it->stack, &it->stack_top, node);
+        return 0;
+    }
+    for (;;) {
+        int found;
+        Py_ssize_t idx = range_search_bound(node, it->max_key, it->inclusive_max, &found);
+        if (idx < 0) {
+            return -1;
+        }
+        it->stack_top++;
+        it->stack[it->stack_top].node = node;
+        if (found && it->inclusive_max) {
+            /* max_key itself comes first */
+            it->stack[it->stack_top].key_idx = idx;
+            return 0;
+        }
+        it->stack[it->stack_top].key_idx = idx - 1;
+        if (node->is_leaf) {
+            return 0;
+        }
+        if (found) {
+            /* Every key left of an excluded max_key is in range */
+            iter_descend_right(it->stack, &it->stack_top, node->children[idx]);
+            return 0;
+        }
+        node = node->children[idx];
+    }
+}
+
+/* range_iter_seek() from root, which the caller keeps intact */
+static int
+range_iter_locate(PyBTreeRangeIterObject *it, PyBTreeNode *root)
+{
+    PyObject *bound = it->reverse ? it->max_key : it->min_key;
+
+    if (root->is_leaf || it->btree->bplus) {
+        /* Start in the leaf covering the bound and walk the leaf chain */
+        PyBTreeNode *leaf;
+        int found;
+        Py_ssize_t idx;
+        if (bound == NULL) {
+            leaf = it->reverse ? get_max_leaf(root) : get_min_leaf(root);
+            idx = it->reverse ? leaf->n_keys - 1 : 0;
+        }
+        else {
+            leaf = bplus_find_leaf(root, bound);
+            if (leaf == NULL) {
+                return -1;
+            }
+            idx = range_search_bound(leaf, bound,
+                                     it->reverse ? it->inclusive_max : !it->inclusive_min,
+                                     &found);
+            if (idx < 0) {
+                return -1;
+            }
+            if (it->reverse) {
+                if (!found || !it->inclusive_max) {
+                    idx--;  /* Last key before max_key */
+                }
+            }
+            else if (found && !it->inclusive_min) {
+                idx++;
+            }
+        }
+        it->leaf_only = 1;
+        it->leaf = leaf;
+        it->leaf_index = idx;
+        return 0;
+    }
+    if (it->reverse) {
+        return range_iter_descend_to_end(it, root);
+    }
+    return range_iter_descend_to_start(it, root);
+}
+
+/* Position the iterator on the first key of the range in its direction.
+ * Key comparisons can run Python code, so a classic tree's root is pinned
+ * while the search runs (a B+tree refuses writes instead); the caller
+ * checks the version afterwards. */
+static int
+range_iter_seek(PyBTreeRangeIterObject *it)
+{
+    PyBTreeObject *btree = it->btree;
+    PyBTreeNode *root = btree->root;
+    int result;
+
+    it->leaf_only = 0;
+    it->leaf = NULL;
+    it->leaf_index = 0;
+    it->stack_top = -1;
+    it->started = 1;
+    if (root == NULL || root->n_keys == 0) {
+        return 0;
+    }
+    if (!btree->bplus) {
+        NODE_PIN(root);
+    }
+    BTREE_SEARCH_ENTER(btree);
+    result = range_iter_locate(it, root);
+    BTREE_SEARCH_EXIT(btree);
+    if (!btree->bplus) {
+        NODE_UNPIN(root);
+    }
+    return result;
+}
+
+/* Store the node and slot of the next key in *node_out and *idx_out without
+ * moving past it. Returns 0 when no keys are left. */
+static int
+range_iter_peek(PyBTreeRangeIterObject *it, PyBTreeNode **node_out, Py_ssize_t *idx_out)
+{
+    if (it->leaf_only) {
+        /* Root leaf, or the B+tree leaf chain */
+        if (it->reverse) {
+            while (it->leaf != NULL && it->leaf_index < 0) {
+                it->leaf = it->leaf->prev;
+                it->leaf_index = it->leaf != NULL ? it->leaf->n_keys - 1 : -1;
+            }
+        }
+        else {
+            while (it->leaf != NULL && it->leaf_index >= it->leaf->n_keys) {
+                it->leaf = it->leaf->next;
+                it->leaf_index = 0;
+            }
+        }
+        if (it->leaf == NULL) {
+            return 0;
+        }
+        *node_out = it->leaf;
+        *idx_out = it->leaf_index;
+        return 1;
+    }
+    while (it->stack_top >= 0) {
+        IterStackFrame *frame = &it->stack[it->stack_top];
+        if (it->reverse ? frame->key_idx >= 0 : frame->key_idx < frame->node->n_keys) {
+            *node_out = frame->node;
+            *idx_out = frame->key_idx;
+            return 1;
+        }
+        it->stack_top--;  /* Done with this node, pop stack */
+    }
+    return 0;
+}
+
+/* Move past the key range_iter_peek() returned */
+static void
+range_iter_step(PyBTreeRangeIterObject *it)
+{
+    IterStackFrame *frame;
+    Py_ssize_t idx;
+
+    if (it->leaf_only) {
+        it->leaf_index += it->reverse ? -1 : 1;
+        return;
+    }
+    frame = &it->stack[it->stack_top];
+    idx = frame->key_idx;
+    if (it->reverse) {
+        frame->key_idx--;
+        if (!frame->node->is_leaf) {
+            /* Descend to the rightmost key of the left child */
+            iter_descend_right(it->stack, &it->stack_top, frame->node->children[idx]);
+        }
+    }
+    else {
+        frame->key_idx++;
+        if (!frame->node->is_leaf) {
+            /* Descend to the leftmost key of the right child */
+            iter_descend_left(it->stack, &it->stack_top, frame->node->children[idx + 1]);
+        }
+    }
+}
+
+/* Store in *run the keys yielded equal to the one in slot idx once it is
+ * yielded: in a tree with duplicates range_iter_resume() tells them apart
+ * by position only. Returns -1 if a comparison fails. */
+static int
+range_iter_count_run(PyBTreeRangeIterObject *it, PyBTreeNode *node, Py_ssize_t idx,
+                     Py_ssize_t *run)
+{
+    int cmp;
+
+    if (!it->has_last) {
+        *run = 1;
+        return 0;
+    }
+    if (node->keys == NULL) {
+        cmp = node->key_storage == KEYS_I64 ? node->nkeys[idx].i64 != it->last_native.i64
+                                            : node->nkeys[idx].f64 != it->last_native.f64;
+    }
+    else {
+        cmp = compare_keys(it->last, node->keys[idx]);
+        if (cmp == -2) {
+            return -1;
+        }
+    }
+    *run = cmp == 0 ? it->run + 1 : 1;
+    return 0;
+}
+
+/* Narrow the range to the keys after the last one yielded, so a seek after
+ * a write resumes where the iterator left off. With duplicates the range
+ * keeps last and btreerangeiter_next() steps over the run yielded so far. */
+static int
+range_iter_resume(PyBTreeRangeIterObject *it)
+{
+    PyObject *last;
+
+    if (!it->has_last) {
+        return 0;
+    }
+    if (it->last != NULL) {
+        Py_INCREF(it->last);
+        last = it->last;
+    }
+    else {
+        last = native_key_object(it->btree->key_storage, it->last_native);
+        if (last == NULL) {
+            return -1;
+        }
+    }
+    if (it->reverse) {
+        Py_XSETREF(it->max_key, last);
+        it->inclusive_max = it->btree->duplicates;
+    }
+    else {
+        Py_XSETREF(it->min_key, last);
+        it->inclusive_min = it->btree->duplicates;
+    }
+    return 0;
+}
+
+static PyObject *
+btreerangeiter_next(PyObject *self)
+{
+    PyBTreeRangeIterObject *it = (PyBTreeRangeIterObject *)self;
+    PyObject *bound = NULL;
+    PyBTreeNode *node;
+    Py_ssize_t idx;
+
+    if (it->started < 0) {
+        return NULL;  /* Already exhausted */
+    }
+    if (BTREE_FLUSH(it->btree)) {
+        return NULL;
+    }
+    for (;;) {
+        if (!it->started || it->version != it->btree->version) {
+            /* Seek lazily on the first call, and again after a write in
+             * case the nodes on the stack are gone: the keys still to come
+             * are the ones after the last key yielded. */
+            if (iter_check_size(it->btree, it->size) < 0) {
+                return NULL;
+            }
+            it->version = it->btree->version;
+            if (range_iter_resume(it) < 0 || range_iter_seek(it) < 0) {
+                return NULL;
+            }
+            if (it->version != it->btree->version) {
+                continue;  /* A comparison modified the tree */
+            }
+            if (it->btree->duplicates && it->has_last) {
+                Py_ssize_t skip;
+                for (skip = 0; skip < it->run && range_iter_peek(it, &node, &idx); skip++) {
+                    range_iter_step(it);
+                }
+            }
+        }
+        if (it->remaining == 0 || !range_iter_peek(it, &node, &idx)) {
+            break;
+        }
+        bound = it->reverse ? it->min_key : it->max_key;
+        if (bound != NULL) {
+            /* Compares the far bound with the key, so the signs are
+             * flipped; reverse=True flips them back */
+            int cmp = node_compare_key(bound, node, idx);
+            int inclusive = it->reverse ? it->inclusive_min : it->inclusive_max;
+            if (cmp == -2) {
+                return NULL;
+            }
+            if (it->version != it->btree->version) {
+                continue;
+            }
+            if (it->reverse) {
+                cmp = -cmp;
+            }
+            if (inclusive ? cmp < 0 : cmp <= 0) {
+                break;  /* Past the bound, done */
+            }
+        }
+        if (node->duplicates) {
+            Py_ssize_t run;
+            if (range_iter_count_run(it, node, idx, &run) < 0) {
+                return NULL;
+            }
+            if (it->version != it->btree->version) {
+                continue;
+            }
+            it->run = run;
+        }
+        if (node->keys != NULL) {
+            Py_INCREF(node->keys[idx]);
+            Py_XSETREF(it->last, node->keys[idx]);
+        }
+        else {
+            it->last_native = node->nkeys[idx];
+        }
+        it->has_last = 1;
+        it->remaining--;
+        range_iter_step(it);
+        return iter_yield(it->kind, &it->result, node, idx);
+    }
+    it->started = -1;
+    return NULL;  /* Iteration complete */
+}
+
+BTREE_DEFINE_LOCKED(PyObject *, btreerangeiter_next, ITER_TREE(PyBTreeRangeIterObject),
+                    (PyObject *self), (self))
+
+static PyTypeObject PyBTreeRangeIter_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "btree_rangeiterator",                      /* tp_name */
+    sizeof(PyBTreeRangeIterObject),             /* tp_basicsize */
+    0,                                          /* tp_itemsize */
+    btreerangeiter_dealloc,                     /* tp_dealloc */
+    0,                                          /* tp_vectorcall_offset */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_as_async */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    0,                                          /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    PyObject_GenericGetAttr,                    /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,    /* tp_flags */
+    0,                                          /* tp_doc */
+    btreerangeiter_traverse,                    /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    PyObject_SelfIter,                          /* tp_iter */
+    BTREE_LOCKED(btreerangeiter_next),          /* tp_iternext */
+    0,                                          /* tp_methods */
+    0,                                          /* tp_members */
+};
+
+/* Parse irange()'s inclusive=(min_inclusive, max_inclusive); NULL or None
+ * keeps the defaults already stored in *inclusive_min and *inclusive_max */
+static int
+parse_inclusive(PyObject *inclusive, int *inclusive_min, int *inclusive_max)
+{
+    if (inclusive == NULL || inclusive == Py_None) {
+        return 0;
+    }
+    if (!PyTuple_Check(inclusive) || PyTuple_GET_SIZE(inclusive) != 2) {
+        PyErr_SetString(PyExc_TypeError,
+            "inclusive must be a tuple of two booleans");
+        return -1;
+    }
+    *inclusive_min = PyObject_IsTrue(PyTuple_GET_ITEM(inclusive, 0));
+    *inclusive_max = PyObject_IsTrue(PyTuple_GET_ITEM(inclusive, 1));
+    if (*inclusive_min < 0 || *inclusive_max < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+PyDoc_STRVAR(btree_irange_doc,
+"irange(min=None, max=None, inclusive=(True, False), reverse=False, limit=None)\n"
+"--\n\n"
+"Return an iterator over keys in the range [min, max).\n\n"
+"By default, the range is inclusive of min and exclusive of max.\n"
+"Use inclusive=(True, True) for a fully closed range.\n\n"
+"Args:\n"
+"    min: Minimum key (inclusive by default). None for no minimum.\n"
+"    max: Maximum key (exclusive by default). None for no maximum.\n"
+"    inclusive: Tuple of (min_inclusive, max_inclusive) booleans.\n"
+"    reverse: Yield the keys from max down to min. Positioning costs\n"
+"        O(log n) either way.\n"
+"    limit: Stop after this many keys. None for no limit.\n\n"
+"Example:\n"
+"    >>> bt = SortedDict()\n"
+"    >>> for i in range(10): bt[i] = i\n"
+"    >>> list(bt.irange(3, 7))\n"
+"    [3, 4, 5, 6]\n"
+"    >>> list(bt.irange(3, 7, inclusive=(True, True)))\n"
+"    [3, 4, 5, 6, 7]\n"
+"    >>> list(bt.irange(max=7, reverse=True, limit=3))\n"
+"    [6, 5, 4]\n");
+
+PyDoc_STRVAR(btree_items_range_doc,
+"items_range(min=None, max=None, inclusive=(True, False), reverse=False, limit=None)\n"
+"--\n\n"
+"Like irange(), but yield (key, value) pairs.");
+
+PyDoc_STRVAR(btree_values_range_doc,
+"values_range(min=None, max=None, inclusive=(True, False), reverse=False, limit=None)\n"
+"--\n\n"
+"Like irange(), but yield the values of the keys in range.");
+
+/* Create the range iterator behind irange(), items_range() and
+ * values_range() */
+static PyObject *
+btree_range_kind(PyObject *self, const char *name, int kind, PyObject *const *args,
+                 Py_ssize_t nargs, PyObject *kwnames)
+{
+    PyBTreeObject *btree = (PyBTreeObject *)self;
+    PyBTreeRangeIterObject *it;
+    PyObject *min_key = Py_None;
+    PyObject *max_key = Py_None;
+    PyObject *inclusive = NULL;
+    int inclusive_min = 1;  /* Default: inclusive of min */
+    int inclusive_max = 0;  /* Default: exclusive of max */
+    int reverse = 0;
+    Py_ssize_t limit = PY_SSIZE_T_MAX;
+    
+    static const char *const kwlist[] = {"min", "max", "inclusive", "reverse", "limit", NULL};
+    PyObject *argv[5] = {NULL, NULL, NULL, NULL, NULL};
+
+    if (unpack_args(name, args, nargs, kwnames, kwlist, 0, argv) < 0 ||
+        arg_bool(argv[3], &reverse) < 0) {
+        return NULL;
+    }
+    if (argv[0] != NULL) {
+        min_key = argv[0];
+    }
+    if (argv[1] != NULL) {
+        max_key = argv[1];
+    }
+    inclusive = argv[2];
+    if (argv[4] != NULL && argv[4] != Py_None) {
+        limit = PyNumber_AsSsize_t(argv[4], PyExc_OverflowError);
+        if (limit == -1 && PyErr_Occurred()) {
+            return NULL;
+        }
+        if (limit < 0) {
+            PyErr_SetString(PyExc_ValueError, "limit must be non-negative");
+            return NULL;
+        }
+    }
+    
+    if (parse_inclusive(inclusive, &inclusive_min, &inclusive_max) < 0 ||
+        BTREE_FLUSH(btree)) {
+        return NULL;
+    }
+    
+    it = PyObject_GC_New(PyBTreeRangeIterObject, &PyBTreeRangeIter_Type);
+    if (it == NULL) {
+        return NULL;
+    }
+    
+    Py_INCREF(btree);
+    it->btree = btree;
+    it->min_key = (min_key == Py_None) ? NULL : min_key;
+    it->max_key = (max_key == Py_None) ? NULL : max_key;
+    Py_XINCREF(it->min_key);
+    Py_XINCREF(it->max_key);
+    it->inclusive_min = inclusive_min;
+    it->inclusive_max = inclusive_max;
+    it->reverse = reverse;
+    it->kind = kind;
+    it->result = NULL;
+    it->remaining = limit;
+    it->has_last = 0;
+    it->last = NULL;
+    it->run = 0;
+    it->version = btree->version;
+    it->size = btree->size;
+    it->leaf_only = 0;
+    it->leaf = NULL;
+    it->leaf_index = 0;
+    it->stack_top = -1;
+    it->started = 0;
+
+    PyObject_GC_Track((PyObject *)it);
+    return (PyObject *)it;
+}
+
+static PyObject *
+btree_irange(PyObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    return btree_range_kind(self, "irange", ITER_KEYS, args, nargs, kwnames);
+}
+
+static PyObject *
+btree_items_range(PyObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    return btree_range_kind(self, "items_range", ITER_ITEMS, args, nargs, kwnames);
+}
+
+static PyObject *
+btree_values_range(PyObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    return btree_range_kind(self, "values_range", ITER_VALUES, args, nargs, kwnames);
+}
+
+/* ==================== Cursor ==================== */
+
+#define CURSOR_UNSET 0      /* Not on the tree: fresh, or stepped off an end */
+#define CURSOR_ON    1      /* On the item holding key */
+#define CURSOR_GAP   2      /* key was removed; path is on its successor */
+
+typedef struct {
+    PyObject_HEAD
+    PyBTreeObject *btree;           /* The B-tree being walked */
+    PyObject *key;                  /* Key the cursor is on, NULL when unset */
+    size_t version;                 /* Tree version the path belongs to */
+    int state;                      /* CURSOR_UNSET, CURSOR_ON or CURSOR_GAP */
+    Py_ssize_t depth;               /* Frames on the path, 0 past the end */
+    /* Root to item: internal frames hold the child descended into, the
+     * last frame the item's slot. B+trees only use the last frame. */
+    IterStackFrame path[ITER_STACK_SIZE];
+} PyBTreeCursorObject;
+
+static PyTypeObject PyBTreeCursor_Type;
+
+static void
+cursor_push(PyBTreeCursorObject *c, PyBTreeNode *node, Py_ssize_t idx)
+{
+    c->path[c->depth].node = node;
+    c->path[c->depth].key_idx = idx;
+    c->depth++;
+}
+
+/* Walk down to the first (last) item under node. Returns 0 if the subtree
+ * is empty, which only an empty tree's root leaf is. */
+static int
+cursor_descend_first(PyBTreeCursorObject *c, PyBTreeNode *node)
+{
+    while (!node->is_leaf) {
+        cursor_push(c, node, 0);
+        node = node->children[0];
+    }
+    cursor_push(c, node, 0);
+    return node->n_keys > 0;
+}
+
+static int
+cursor_descend_last(PyBTreeCursorObject *c, PyBTreeNode *node)
+{
+    while (!node->is_leaf) {
+        cursor_push(c, node, node->n_keys);
+        node = node->children[node->n_keys];
+    }
+    cursor_push(c, node, node->n_keys - 1);
+    return node->n_keys > 0;
+}
+
+/* Pop finished frames until an ancestor has an item after the child it
+ * descended into. Returns 0 (with depth 0) past the last item. */
+static int
+cursor_climb_next(PyBTreeCursorObject *c)
+{
+    while (--c->depth > 0) {
+        IterStackFrame *frame = &c->path[c->depth - 1];
+        if (frame->key_idx < frame->node->n_keys) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Step to the next (previous) item. Returns 0, leaving depth 0, when the
+ * cursor moves off the end. */
+static int
+cursor_step_next(PyBTreeCursorObject *c)
+{
+    IterStackFrame *top = &c->path[c->depth - 1];
+    PyBTreeNode *node = top->node;
+
+    if (c->btree->bplus) {
+        top->key_idx++;
+        while (top->key_idx >= top->node->n_keys) {
+            top->node = top->node->next;
+            top->key_idx = 0;
+            if (top->node == NULL) {
+                c->depth = 0;
+                return 0;
+            }
+        }
+        return 1;
+    }
+    if (!node->is_leaf) {
+        top->key_idx++;
+        return cursor_descend_first(c, node->children[top->key_idx]);
+    }
+    if (++top->key_idx < node->n_keys) {
+        return 1;
+    }
+    return cursor_climb_next(c);
+}
+
+static int
+cursor_step_prev(PyBTreeCursorObject *c)
+{
+    IterStackFrame *top = &c->path[c->depth - 1];
+    PyBTreeNode *node = top->node;
+
+    if (c->btree->bplus) {
+        top->key_idx--;
+        while (top->key_idx < 0) {
+            top->node = top->node->prev;
+            if (top->node == NULL) {
+                c->depth = 0;
+                return 0;
+            }
+            top->key_idx = top->node->n_keys - 1;
+        }
+        return 1;
+    }
+    if (!node->is_leaf) {
+        return cursor_descend_last(c, node->children[top->key_idx]);
+    }
+    if (--top->key_idx >= 0) {
+        return 1;
+    }
+    while (--c->depth > 0) {
+        top = &c->path[c->depth - 1];
+        if (top->key_idx > 0) {
+            top->key_idx--;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int
+cursor_first(PyBTreeCursorObject *c)
+{
+    c->depth = 0;
+    if (c->btree->bplus) {
+        PyBTreeNode *leaf = get_min_leaf(c->btree->root);
+        cursor_push(c, leaf, 0);
+        if (leaf->n_keys == 0) {
+            c->depth = 0;
+            return 0;
+        }
+        return 1;
+    }
+    if (!cursor_descend_first(c, c->btree->root)) {
+        c->depth = 0;
+        return 0;
+    }
+    return 1;
+}
+
+static int
+cursor_last(PyBTreeCursorObject *c)
+{
+    c->depth = 0;
+    if (c->btree->bplus) {
+        PyBTreeNode *leaf = get_max_leaf(c->btree->root);
+        cursor_push(c, leaf, leaf->n_keys - 1);
+        if (leaf->n_keys == 0) {
+            c->depth = 0;
+            return 0;
+        }
+        return 1;
+    }
+    if (!cursor_descend_last(c, c->btree->root)) {
+        c->depth = 0;
+        return 0;
+    }
+    return 1;
+}
+
+/* Build the path to the first item >= key, setting *found if its key
+ * equals key. Returns 1 on an item, 0 past the last one, -1 on error. */
+static int
+cursor_locate(PyBTreeCursorObject *c, PyBTreeNode *root, PyObject *key, int *found)
+{
+    PyBTreeNode *node = root;
+    Py_ssize_t idx;
+
+    c->depth = 0;
+    *found = 0;
+    if (c->btree->bplus) {
+        node = bplus_find_leaf(root, key);
+        if (node == NULL) {
+            return -1;
+        }
+    }
+    for (;;) {
+        int hit;
+
+        /* With duplicates the first equal key may lie below a match */
+        if (node->duplicates) {
+            node_refresh_eytzinger(node);
+            idx = node_search_bound(node, key, 0, &hit);
+        }
+        else {
+            idx = node_search_read(node, key, &hit);
+        }
+        if (idx < 0) {
+            return -1;
+        }
+        *found |= hit;
+        cursor_push(c, node, idx);
+        if (hit && NODE_HAS_ITEMS(node) && (node->is_leaf || !node->duplicates)) {
+            return 1;
+        }
+        if (node->is_leaf) {
+            break;
+        }
+        node = node->children[idx];
+    }
+    if (idx < node->n_keys) {
+        return 1;
+    }
+    if (c->btree->bplus) {
+        c->path[0].key_idx = node->n_keys - 1;
+        return cursor_step_next(c);
+    }
+    return cursor_climb_next(c);
+}
+
+/* cursor_locate() from the current root. Comparisons can run Python code
+ * that writes to the tree, so a classic tree's root is pinned for the
+ * search and the search is repeated until no write happened during it. */
+static int
+cursor_seek_key(PyBTreeCursorObject *c, PyObject *key, int *found)
+{
+    if (BTREE_FLUSH(c->btree)) {
+        return -1;
+    }
+    for (;;) {
+        size_t version = c->btree->version;
+        PyBTreeNode *root = c->btree->root;
+        int result;
+
+        if (!c->btree->bplus) {
+            NODE_PIN(root);
+        }
+        BTREE_SEARCH_ENTER(c->btree);
+        result = cursor_locate(c, root, key, found);
+        BTREE_SEARCH_EXIT(c->btree);
+        if (!c->btree->bplus) {
+            NODE_UNPIN(root);
+        }
+        if (result < 0) {
+            c->depth = 0;
+            return -1;
+        }
+        if (version == c->btree->version) {
+            c->version = version;
+            return result;
+        }
+    }
+}
+
+/* Re-seek from the cursor's key if the tree was written since the path was
+ * built: the cursor stays on the key, or sits in the gap it left. */
+static int
+cursor_sync(PyBTreeCursorObject *c)
+{
+    int found;
+
+    if (BTREE_FLUSH(c->btree)) {
+        return -1;
+    }
+    if (c->version == c->btree->version) {
+        return 0;
+    }
+    c->version = c->btree->version;
+    if (c->state == CURSOR_UNSET) {
+        return 0;
+    }
+    if (cursor_seek_key(c, c->key, &found) < 0) {
+        return -1;
+    }
+    c->state = found ? CURSOR_ON : CURSOR_GAP;
+    return 0;
+}
+
+/* Record the outcome of a move: on the item at the end of the path if
+ * on_item, otherwise unset. Returns the bool to hand back. */
+static PyObject *
+cursor_settle(PyBTreeCursorObject *c, int on_item)
+{
+    if (on_item) {
+        IterStackFrame *top = &c->path[c->depth - 1];
+        PyObject *key = node_get_key(top->node, top->key_idx);
+        if (key == NULL) {
+            return NULL;
+        }
+        Py_XSETREF(c->key, key);
+        c->state = CURSOR_ON;
+        Py_RETURN_TRUE;
+    }
+    c->depth = 0;
+    c->state = CURSOR_UNSET;
+    Py_CLEAR(c->key);
+    Py_RETURN_FALSE;
+}
+
+static void
+btreecursor_dealloc(PyObject *self)
+{
+    PyBTreeCursorObject *c = (PyBTreeCursorObject *)self;
+    PyObject_GC_UnTrack(self);
+    Py_XDECREF(c->btree);
+    Py_XDECREF(c->key);
+    PyObject_GC_Del(self);
+}
+
+static int
+btreecursor_traverse(PyObject *self, visitproc visit, void *arg)
+{
+    PyBTreeCursorObject *c = (PyBTreeCursorObject *)self;
+    Py_VISIT(c->btree);
+    Py_VISIT(c->key);
+    return 0;
+}
+
+PyDoc_STRVAR(btreecursor_seek_doc,
+"seek(key, /)\n"
+"--\n\n"
+"Move to the first key >= key. Returns False, leaving the cursor unset,\n"
+"if every key is smaller.");
+
+static PyObject *
+btreecursor_seek(PyObject *self, PyObject *key)
+{
+    PyBTreeCursorObject *c = (PyBTreeCursorObject *)self;
+    int found;
+    int result = cursor_seek_key(c, key, &found);
+
+    if (result < 0) {
+        return NULL;
+    }
+    return cursor_settle(c, result);
+}
+
+PyDoc_STRVAR(btreecursor_next_doc,
+"next()\n"
+"--\n\n"
+"Move to the next key, or to the first one if the cursor is unset.\n"
+"Returns False, leaving the cursor unset, when it moves past the last key.");
+
+static PyObject *
+btreecursor_next(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+    PyBTreeCursorObject *c = (PyBTreeCursorObject *)self;
+    int result;
+
+    if (cursor_sync(c) < 0) {
+        return NULL;
+    }
+    switch (c->state) {
+    case CURSOR_ON:
+        result = cursor_step_next(c);
+        break;
+    case CURSOR_GAP:
+        result = c->depth > 0;  /* Already on the successor */
+        break;
+    default:
+        result = cursor_first(c);
+        break;
+    }
+    return cursor_settle(c, result);
+}
+
+PyDoc_STRVAR(btreecursor_prev_doc,
+"prev()\n"
+"--\n\n"
+"Move to the previous key, or to the last one if the cursor is unset.\n"
+"Returns False, leaving the cursor unset, when it moves before the first key.");
+
+static PyObject *
+btreecursor_prev(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+    PyBTreeCursorObject *c = (PyBTreeCursorObject *)self;
+    int result;
+
+    if (cursor_sync(c) < 0) {
+        return NULL;
+    }
+    if (c->state == CURSOR_UNSET || c->depth == 0) {
+        result = cursor_last(c);
+    }
+    else {
+        result = cursor_step_prev(c);
+    }
+    return cursor_settle(c, result);
+}
+
+/* Raise KeyError unless the cursor is on an item */
+static int
+cursor_check_on(PyBTreeCursorObject *c)
+{
+    if (cursor_sync(c) < 0) {
+        return -1;
+    }
+    if (c->state == CURSOR_GAP) {
+        PyErr_SetObject(PyExc_KeyError, c->key);
+        return -1;
+    }
+    if (c->state == CURSOR_UNSET) {
+        PyErr_SetString(PyExc_KeyError, "cursor is not on a key");
+        return -1;
+    }
+    return 0;
+}
+
+/* Copy the nodes of the cursor's path that a snapshot shares, in the
+ * classic layout, updating the path */
+static int
+cursor_unshare_path(PyBTreeCursorObject *c)
+{
+    PyBTreeNode **slot = &c->btree->root;
+    Py_ssize_t d;
+
+    for (d = 0; d < c->depth; d++) {
+        PyBTreeNode *node = node_unshare(slot);
+
+        if (node == NULL) {
+            return -1;
+        }
+        c->path[d].node = node;
+        if (d + 1 < c->depth) {
+            slot = &node->children[c->path[d].key_idx];
+        }
+    }
+    return 0;
+}
+
+PyDoc_STRVAR(btreecursor_set_value_doc,
+"set_value(value, /)\n"
+"--\n\n"
+"Replace the value of the key the cursor is on.");
+
+static PyObject *
+btreecursor_set_value(PyObject *self, PyObject *value)
+{
+    PyBTreeCursorObject *c = (PyBTreeCursorObject *)self;
+    PyBTreeObject *btree = c->btree;
+    IterStackFrame *top;
+    Py_ssize_t i;
+    int copy;
+
+    if (cursor_check_on(c) < 0) {
+        return NULL;
+    }
+    /* A B+tree cursor holds only the leaf, so an insert replaces the value
+     * and marks the aggregates above it. */
+    if (btree->bplus && btree->aggregate != AGG_NONE) {
+        if (PyBTree_Insert((PyObject *)btree, c->key, value) < 0) {
+            return NULL;
+        }
+        Py_RETURN_NONE;
+    }
+    copy = 0;
+    for (i = 0; i < c->depth && !copy; i++) {
+        copy = NODE_REFCNT(c->path[i].node) != 1;
+    }
+    /* The value is replaced in place and the cursor keeps its path, copied
+     * first if a snapshot shares it. An insert would not do with
+     * duplicates, where it adds an item. */
+    if (btree_begin_write(btree) < 0 || (copy && cursor_unshare_path(c) < 0)) {
+        return NULL;
+    }
+    c->version = btree->version;
+    for (i = 0; i < c->depth; i++) {
+        NODE_AGG_CHANGED(c->path[i].node);
+    }
+    top = &c->path[c->depth - 1];
+    Py_INCREF(value);
+    Py_SETREF(top->node->values[top->key_idx], value);
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+btreecursor_get_key(PyObject *self, void *Py_UNUSED(closure))
+{
+    PyBTreeCursorObject *c = (PyBTreeCursorObject *)self;
+
+    if (cursor_check_on(c) < 0) {
+        return NULL;
+    }
+    Py_INCREF(c->key);
+    return c->key;
+}
+
+static PyObject *
+btreecursor_get_value(PyObject *self, void *Py_UNUSED(closure))
+{
+    PyBTreeCursorObject *c = (PyBTreeCursorObject *)self;
+    IterStackFrame *top;
+
+    if (cursor_check_on(c) < 0) {
+        return NULL;
+    }
+    top = &c->path[c->depth - 1];
+    Py_INCREF(top->node->values[top->key_idx]);
+    return top->node->values[top->key_idx];
+}
+
+BTREE_DEFINE_LOCKED(PyObject *, btreecursor_seek, ITER_TREE(PyBTreeCursorObject),
+                    (PyObject *self, PyObject *arg), (self, arg))
+BTREE_DEFINE_LOCKED(PyObject *, btreecursor_next, ITER_TREE(PyBTreeCursorObject),
+                    (PyObject *self, PyObject *arg), (self, arg))
+BTREE_DEFINE_LOCKED(PyObject *, btreecursor_prev, ITER_TREE(PyBTreeCursorObject),
+                    (PyObject *self, PyObject *arg), (self, arg))
+BTREE_DEFINE_LOCKED(PyObject *, btreecursor_set_value, ITER_TREE(PyBTreeCursorObject),
+                    (PyObject *self, PyObject *arg), (self, arg))
+BTREE_DEFINE_LOCKED(PyObject *, btreecursor_get_key, ITER_TREE(PyBTreeCursorObject),
+                    (PyObject *self, void *closure), (self, closure))
+BTREE_DEFINE_LOCKED(PyObject *, btreecursor_get_value, ITER_TREE(PyBTreeCursorObject),
+                    (PyObject *self, void *closure), (self, closure))
+
+static PyMethodDef btreecursor_methods[] = {
+    {"seek", BTREE_LOCKED(btreecursor_seek), METH_O, btreecursor_seek_doc},
+    {"next", BTREE_LOCKED(btreecursor_next), METH_NOARGS, btreecursor_next_doc},
+    {"prev", BTREE_LOCKED(btreecursor_prev), METH_NOARGS, btreecursor_prev_doc},
+    {"set_value", BTREE_LOCKED(btreecursor_set_value), METH_O, btreecursor_set_value_doc},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyGetSetDef btreecursor_getset[] = {
+    {"key", BTREE_LOCKED(btreecursor_get_key), NULL,
+     "Key the cursor is on; KeyError if it is unset or the key was removed.", NULL},
+    {"value", BTREE_LOCKED(btreecursor_get_value), NULL,
+     "Value of the key the cursor is on.", NULL},
+    {NULL, NULL, NULL, NULL, NULL}
+};
+
+PyDoc_STRVAR(btreecursor_doc,
+"Cursor(tree)\n"
+"--\n\n"
+"Bidirectional position in a SortedDict, made by SortedDict.cursor().\n"
+"Writes to the tree do not invalidate the cursor: its next operation\n"
+"re-seeks from its key in O(log n), and if that key was removed the\n"
+"cursor sits in the gap it left, where next() and prev() move to its\n"
+"neighbours.");
+
+static PyTypeObject PyBTreeCursor_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "btreedict.Cursor",                         /* tp_name */
+    sizeof(PyBTreeCursorObject),                /* tp_basicsize */
+    0,                                          /* tp_itemsize */
+    btreecursor_dealloc,                        /* tp_dealloc */
+    0,                                          /* tp_vectorcall_offset */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_as_async */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    0,                                          /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    PyObject_GenericGetAttr,                    /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,    /* tp_flags */
+    btreecursor_doc,                            /* tp_doc */
+    btreecursor_traverse,                       /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    0,                                          /* tp_iter */
+    0,                                          /* tp_iternext */
+    btreecursor_methods,                        /* tp_methods */
+    0,                                          /* tp_members */
+    btreecursor_getset,                         /* tp_getset */
+};
+
+PyDoc_STRVAR(btree_cursor_doc,
+"cursor()\n"
+"--\n\n"
+"Return an unset Cursor over the tree. Position it with seek(), next() or\n"
+"prev(); it survives writes to the tree by re-seeking from its key.\n\n"
+"Example:\n"
+"    >>> c = bt.cursor()\n"
+"    >>> while c.next():\n"
+"    ...     c.set_value(c.value * 2)\n");
+
+static PyObject *
+btree_cursor(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+    PyBTreeObject *btree = (PyBTreeObject *)self;
+    PyBTreeCursorObject *c;
+
+    c = PyObject_GC_New(PyBTreeCursorObject, &PyBTreeCursor_Type);
+    if (c == NULL) {
+        return NULL;
+    }
+    Py_INCREF(btree);
+    c->btree = btree;
+    c->key = NULL;
+    c->version = btree->version;
+    c->state = CURSOR_UNSET;
+    c->depth = 0;
+    PyObject_GC_Track((PyObject *)c);
+    return (PyObject *)c;
+}
+
+/* ==================== Python Methods ==================== */
+
+PyDoc_STRVAR(btree_insert_doc,
+"insert(key, value, /)\n"
+"--\n\n"
+"Insert a key-value pair into the B-tree.");
+
+static PyObject *
+btree_insert(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    if (check_nargs("insert", nargs, 2, 2) < 0) {
+        return NULL;
+    }
+    if (btree_ass_subscript(self, args[0], args[1]) < 0) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(btree_get_doc,
+"get(key, default=None, /)\n"
+"--\n\n"
+"Return the value for key if key is in the B-tree, else default.");
+
+static PyObject *
+btree_get(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    PyObject *key, *default_value;
+
+    if (check_nargs("get", nargs, 1, 2) < 0) {
+        return NULL;
+    }
+    key = args[0];
+    default_value = nargs > 1 ? args[1] : Py_None;
+
+    PyObject *value = PyBTree_Search(self, key);
+    if (value == NULL) {
+        if (PyErr_Occurred()) {
+            return NULL;
+        }
+        Py_INCREF(default_value);
+        return default_value;
+    }
+    return value;
+}
+
+PyDoc_STRVAR(btree_pop_doc,
+"pop(key, default=<marker>, /)\n"
+"--\n\n"
+"Remove specified key and return the corresponding value.\n"
+"If key is not found, default is returned if given, otherwise KeyError is raised.");
+
+static PyObject *
+btree_pop(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    PyObject *key, *default_value;
+
+    if (check_nargs("pop", nargs, 1, 2) < 0) {
+        return NULL;
+    }
+    key = args[0];
+    default_value = nargs > 1 ? args[1] : NULL;
+
+    PyObject *value = PyBTree_Search(self, key);
+    if (value == NULL) {
+        if (PyErr_Occurred()) {
+            return NULL;
+        }
+        if (default_value != NULL) {
+            Py_INCREF(default_value);
+            return default_value;
+        }
+        PyErr_SetObject(PyExc_KeyError, key);
+        return NULL;
+    }
+
+    if (PyBTree_Delete(self, key) < 0) {
+        Py_DECREF(value);
+        return NULL;
+    }
+
+    return value;
+}
+
+/* ==================== Batch Operations ==================== */
+
+/* Search path kept between the lookups of a batch. Frame d holds the node
+ * reached at depth d and the separators bounding its subtree (NULL node for
+ * unbounded). Each key restarts from the deepest frame whose range still
+ * holds it, so a sorted batch mostly searches just the leaves. */
+typedef struct {
+    PyBTreeNode *node;
+    PyBTreeNode *lo_node;           /* Separator below the subtree */
+    Py_ssize_t lo_idx;
+    PyBTreeNode *hi_node;           /* Separator above the subtree */
+    Py_ssize_t hi_idx;
+} FingerFrame;
+
+typedef struct {
+    int bplus;                      /* Separators equal to a key lead right */
+    int top;                        /* Deepest valid frame, -1 before the first search */
+    FingerFrame path[ITER_STACK_SIZE];
+} Finger;
+
+/* 1 if key belongs to the subtree of frame f, 0 if not, -1 on error. With
+ * duplicates the subtree left of a separator equal to key may hold earlier
+ * equal keys, and 2 means it does so for the separator above it. */
+static int
+finger_holds(Finger *finger, FingerFrame *f, PyObject *key)
+{
+    int cmp, above = 0;
+
+    if (f->hi_node != NULL) {
+        cmp = node_compare_key(key, f->hi_node, f->hi_idx);
+        if (cmp == -2) {
+            return -1;
+        }
+        if (cmp == 0 && f->hi_node->duplicates) {
+            above = 1;
+        }
+        else if (cmp >= 0) {
+            return 0;
+        }
+    }
+    if (f->lo_node != NULL) {
+        cmp = node_compare_key(key, f->lo_node, f->lo_idx);
+        if (cmp == -2) {
+            return -1;
+        }
+        /* In the classic layout a key equal to the separator is stored there */
+        if (cmp < (finger->bplus ? 0 : 1)) {
+            return 0;
+        }
+    }
+    return above ? 2 : 1;
+}
+
+/* Find key below root, starting from the deepest frame of the previous
+ * search that can hold it. Returns 1 with the slot in *node_out and *idx_out,
+ * 0 if key is missing, -1 on error. */
+static int
+finger_search(Finger *finger, PyBTreeNode *root, PyObject *key,
+              PyBTreeNode **node_out, Py_ssize_t *idx_out)
+{
+    int d = finger->top;
+    PyBTreeNode *node;
+    PyBTreeNode *first = NULL;      /* Earliest equal key seen with duplicates */
+    Py_ssize_t first_idx = 0;
+
+    while (d > 0) {
+        int holds = finger_holds(finger, &finger->path[d], key);
+        if (holds < 0) {
+            return -1;
+        }
+        if (holds == 2) {
+            first = finger->path[d].hi_node;
+            first_idx = finger->path[d].hi_idx;
+        }
+        if (holds) {
+            break;
+        }
+        d--;
+    }
+    if (d < 0) {
+        d = 0;
+        finger->path[0].node = root;
+        finger->path[0].lo_node = NULL;
+        finger->path[0].hi_node = NULL;
+    }
+
+    node = finger->path[d].node;
+    for (;;) {
+        FingerFrame *frame = &finger->path[d];
+        FingerFrame *child;
+        int found;
+        Py_ssize_t i;
+
+        if (node->duplicates) {
+            /* As in node_search_first() */
+            node_refresh_eytzinger(node);
+            i = node_search_bound(node, key, 0, &found);
+            if (i < 0) {
+                return -1;
+            }
+            if (found) {
+                first = node;
+                first_idx = i;
+                found = node->is_leaf;
+            }
+            else if (node->is_leaf && first != NULL) {
+                node = first;
+                i = first_idx;
+                found = 1;
+            }
+        }
+        else {
+            i = node_search_read(node, key, &found);
+        }
+        if (i < 0) {
+            return -1;
+        }
+        finger->top = d;
+        if (found) {
+            if (NODE_HAS_ITEMS(node)) {
+                *node_out = node;
+                *idx_out = i;
+                return 1;
+            }
+            i++;  /* B+tree separator: equal keys live to the right */
+        }
+        else if (node->is_leaf) {
+            return 0;
+        }
+
+        child = &finger->path[d + 1];
+        child->node = node->children[i];
+        if (i > 0) {
+            child->lo_node = node;
+            child->lo_idx = i - 1;
+        }
+        else {
+            child->lo_node = frame->lo_node;
+            child->lo_idx = frame->lo_idx;
+        }
+        if (i < node->n_keys) {
+            child->hi_node = node;
+            child->hi_idx = i;
+        }
+        else {
+            child->hi_node = frame->hi_node;
+            child->hi_idx = frame->hi_idx;
+        }
+        node = child->node;
+        d++;
+    }
+}
+
+/* Box element i of a native 1-D buffer whose element type buffer_kind()
+ * returned */
+static PyObject *
+buffer_item(const Py_buffer *view, char kind, Py_ssize_t i)
+{
+    const char *p = (const char *)view->buf + i * view->itemsize;
+
+    switch (kind) {
+    case 'i': {
+        long long v = 0;
+        switch (view->itemsize) {
+        case 1: { signed char x; memcpy(&x, p, 1); v = x; break; }
+        case 2: { short x; memcpy(&x, p, 2); v = x; break; }
+        case 4: { int x; memcpy(&x, p, 4); v = x; break; }
+        default: memcpy(&v, p, 8); break;
+        }
+        return PyLong_FromLongLong(v);
+    }
+    case 'u': {
+        unsigned long long v = 0;
+        switch (view->itemsize) {
+        case 1: { unsigned char x; memcpy(&x, p, 1); v = x; break; }
+        case 2: { unsigned short x; memcpy(&x, p, 2); v = x; break; }
+        case 4: { unsigned int x; memcpy(&x, p, 4); v = x; break; }
+        default: memcpy(&v, p, 8); break;
+        }
+        return PyLong_FromUnsignedLongLong(v);
+    }
+    case 'b':
+        return PyBool_FromLong(*p != 0);
+    default: {
+        if (view->itemsize == 4) {
+            float x;
+            memcpy(&x, p, 4);
+            return PyFloat_FromDouble(x);
+        }
+        double x;
+        memcpy(&x, p, 8);
+        return PyFloat_FromDouble(x);
+    }
+    }
+}
+
+/* Element type of a buffer in native byte order: 'i' signed or 'u' unsigned
+ * integers, 'f' floats, 'b' bools, or 0 for anything else */
+static char
+buffer_kind(const Py_buffer *view)
+{
+    const char *fmt = view->format != NULL ? view->format : "B";
+    Py_ssize_t size = view->itemsize;
+
+    if (*fmt == '@' || *fmt == '=' ||
+        *fmt == (PY_LITTLE_ENDIAN ? '<' : '>')) {
+        fmt++;
+    }
+    if (fmt[0] == '\0' || fmt[1] != '\0') {
+        return 0;
+    }
+    if (strchr("bhilqn", fmt[0]) != NULL) {
+        return (size == 1 || size == 2 || size == 4 || size == 8) ? 'i' : 0;
+    }
+    if (strchr("BHILQN", fmt[0]) != NULL) {
+        return (size == 1 || size == 2 || size == 4 || size == 8) ? 'u' : 0;
+    }
+    if (fmt[0] == 'f' || fmt[0] == 'd') {
+        return (size == 4 || size == 8) ? 'f' : 0;
+    }
+    if (fmt[0] == '?') {
+        return size == 1 ? 'b' : 0;
+    }
+    return 0;
+}
+
+/* The keys or values of a batch as a private tuple, so comparisons cannot
+ * resize the input under us. A 1-D native buffer of numbers (array.array,
+ * a NumPy array, keys_array()) is read directly instead of iterated. */
+static PyObject *
+batch_tuple(PyObject *obj)
+{
+    Py_buffer view;
+    PyObject *tuple;
+    Py_ssize_t i, n;
+    char kind;
+
+    if (PyTuple_CheckExact(obj) || PyList_CheckExact(obj) || !PyObject_CheckBuffer(obj)) {
+        return PySequence_Tuple(obj);
+    }
+    if (PyObject_GetBuffer(obj, &view, PyBUF_ND | PyBUF_FORMAT) < 0) {
+        PyErr_Clear();  /* Not contiguous: iterate it */
+        return PySequence_Tuple(obj);
+    }
+    kind = buffer_kind(&view);
+    if (view.ndim != 1 || kind == 0) {
+        PyBuffer_Release(&view);
+        return PySequence_Tuple(obj);
+    }
+    n = view.shape[0];
+    tuple = PyTuple_New(n);
+    for (i = 0; tuple != NULL && i < n; i++) {
+        PyObject *item = buffer_item(&view, kind, i);
+        if (item == NULL) {
+            Py_CLEAR(tuple);
+            break;
+        }
+        PyTuple_SET_ITEM(tuple, i, item);
+    }
+    PyBuffer_Release(&view);
+    return tuple;
+}
+
+#define BATCH_GET 0
+#define BATCH_CONTAINS 1
+
+/* Fill result with the value (BATCH_GET) or presence (BATCH_CONTAINS) of
+ * each key of the tuple keys in the tree rooted at root */
+static int
+batch_lookup(PyBTreeNode *root, int bplus, PyObject *keys, PyObject *result,
+             int mode, PyObject *default_value)
+{
+    Finger finger;
+    Py_ssize_t i, n = PyTuple_GET_SIZE(keys);
+
+    finger.bplus = bplus;
+    finger.top = -1;
+    for (i = 0; i < n; i++) {
+        PyBTreeNode *node = NULL;
+        Py_ssize_t idx = 0;
+        PyObject *item;
+        int found = 0;
+
+        if (root != NULL) {
+            found = finger_search(&finger, root, PyTuple_GET_ITEM(keys, i), &node, &idx);
+            if (found < 0) {
+                return -1;
+            }
+        }
+        if (mode == BATCH_CONTAINS) {
+            item = found ? Py_True : Py_False;
+        }
+        else {
+            item = found ? node->values[idx] : default_value;
+        }
+        Py_INCREF(item);
+        PyList_SET_ITEM(result, i, item);
+    }
+    return 0;
+}
+
+/* get_many()/contains_many(): one pinned root (or the tree lock for B+trees,
+ * see btree_pin_root) for the whole batch */
+static PyObject *
+btree_lookup_many(PyBTreeObject *btree, PyObject *keys, int mode, PyObject *default_value)
+{
+    PyObject *seq, *result;
+    PyBTreeNode *root;
+    int status;
+
+    seq = batch_tuple(keys);
+    if (seq == NULL) {
+        return NULL;
+    }
+    result = PyList_New(PyTuple_GET_SIZE(seq));
+    if (result == NULL) {
+        Py_DECREF(seq);
+        return NULL;
+    }
+
+    if (btree_pin_root(btree, &root) < 0) {
+        status = -1;
+    }
+    else if (root != NULL) {
+        status = batch_lookup(root, 0, seq, result, mode, default_value);
+        NODE_UNPIN(root);
+    }
+    else {
+        Py_BEGIN_CRITICAL_SECTION(btree);
+        BTREE_SEARCH_ENTER(btree);
+        status = batch_lookup(btree->root, btree->bplus, seq, result, mode, default_value);
+        BTREE_SEARCH_EXIT(btree);
+        Py_END_CRITICAL_SECTION();
+    }
+    Py_DECREF(seq);
+    if (status < 0) {
+        Py_DECREF(result);
+        return NULL;
+    }
+    return result;
+}
+
+PyDoc_STRVAR(btree_get_many_doc,
+"get_many(keys, default=None, /)\n"
+"--\n\n"
+"Return a list with the value of each key in keys, or default if missing.\n\n"
+"Keys in ascending order are cheapest: each lookup resumes from the node\n"
+"where the previous one ended instead of descending from the root.");
+
+static PyObject *
+btree_get_many(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    if (check_nargs("get_many", nargs, 1, 2) < 0) {
+        return NULL;
+    }
+    return btree_lookup_many((PyBTreeObject *)self, args[0], BATCH_GET,
+                             nargs > 1 ? args[1] : Py_None);
+}
+
+PyDoc_STRVAR(btree_contains_many_doc,
+"contains_many(keys, /)\n"
+"--\n\n"
+"Return a list with True for each key in keys that is present, else False.");
+
+static PyObject *
+btree_contains_many(PyObject *self, PyObject *keys)
+{
+    return btree_lookup_many((PyBTreeObject *)self, keys, BATCH_CONTAINS, NULL);
+}
+
+PyDoc_STRVAR(btree_pop_many_doc,
+"pop_many(keys, default=None, /)\n"
+"--\n\n"
+"Remove each key in keys and return a list of their values.\n"
+"Missing keys give default and leave the tree unchanged.");
+
+static PyObject *
+btree_pop_many(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    PyObject *keys, *default_value;
+    PyObject *seq, *result;
+    Py_ssize_t i, n;
+
+    if (check_nargs("pop_many", nargs, 1, 2) < 0) {
+        return NULL;
+    }
+    keys = args[0];
+    default_value = nargs > 1 ? args[1] : Py_None;
+    if (btree_begin_write((PyBTreeObject *)self) < 0) {
+        return NULL;
+    }
+    seq = batch_tuple(keys);
+    if (seq == NULL) {
+        return NULL;
+    }
+    n = PyTuple_GET_SIZE(seq);
+    result = PyList_New(n);
+    if (result == NULL) {
+        Py_DECREF(seq);
+        return NULL;
+    }
+
+    for (i = 0; i < n; i++) {
+        PyObject *key = PyTuple_GET_ITEM(seq, i);
+        PyObject *value = PyBTree_Search(self, key);
+
+        if (value == NULL) {
+            if (PyErr_Occurred()) {
+                goto error;
+            }
+            Py_INCREF(default_value);
+            value = default_value;
+        }
+        else if (PyBTree_Delete(self, key) < 0) {
+            Py_DECREF(value);
+            goto error;
+        }
+        PyList_SET_ITEM(result, i, value);
+    }
+    Py_DECREF(seq);
+    return result;
+
+error:
+    Py_DECREF(seq);
+    Py_DECREF(result);
+    return NULL;
+}
+
+PyDoc_STRVAR(btree_set_many_doc,
+"set_many(keys, values, /)\n"
+"--\n\n"
+"Set each key in keys to the value at the same position in values.\n\n"
+"Both must have the same length. Like update(), ascending keys into an\n"
+"empty tree are bulk-loaded bottom-up. As in every batch method, keys (and\n"
+"here values) may be any iterable or a 1-D buffer of numbers.");
+
+static PyObject *
+btree_set_many(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    PyObject *key_seq, *value_seq;
+    PairLoader loader;
+    Py_ssize_t i, n;
+    int status = 0;
+
+    if (check_nargs("set_many", nargs, 2, 2) < 0) {
+        return NULL;
+    }
+    if (btree_begin_write((PyBTreeObject *)self) < 0) {
+        return NULL;
+    }
+    key_seq = batch_tuple(args[0]);
+    if (key_seq == NULL) {
+        return NULL;
+    }
+    value_seq = batch_tuple(args[1]);
+    if (value_seq == NULL) {
+        Py_DECREF(key_seq);
+        return NULL;
+    }
+    n = PyTuple_GET_SIZE(key_seq);
+    if (PyTuple_GET_SIZE(value_seq) != n) {
+        PyErr_Format(PyExc_ValueError,
+                     "set_many() got %zd keys but %zd values",
+                     n, PyTuple_GET_SIZE(value_seq));
+        Py_DECREF(key_seq);
+        Py_DECREF(value_seq);
+        return NULL;
+    }
+
+    pairloader_init(&loader, self);
+    for (i = 0; i < n && status == 0; i++) {
+        status = pairloader_add(&loader, PyTuple_GET_ITEM(key_seq, i),
+                                PyTuple_GET_ITEM(value_seq, i));
+    }
+    status = pairloader_finish(&loader, status);
+    Py_DECREF(key_seq);
+    Py_DECREF(value_seq);
+    if (status < 0) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *btree_view_new(PyObject *btree, int kind);
+
+PyDoc_STRVAR(btree_keys_doc,
+"keys()\n"
+"--\n\n"
+"Return a live view of the keys in sorted order.\n\n"
+"The view supports len(), in, reversed(), positional indexing and slicing,\n"
+"set operations, and compares equal to a list of the same keys.");
+
+static PyObject *
+btree_keys_method(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+    return btree_view_new(self, ITER_KEYS);
+}
+
+PyDoc_STRVAR(btree_values_doc,
+"values()\n"
+"--\n\n"
+"Return a live view of the values in key-sorted order.\n\n"
+"The view supports len(), in, reversed(), positional indexing and slicing,\n"
+"and compares equal to a list of the same values.");
+
+static PyObject *
+btree_values_method(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+    return btree_view_new(self, ITER_VALUES);
+}
+
+PyDoc_STRVAR(btree_items_doc,
+"items()\n"
+"--\n\n"
+"Return a live view of the (key, value) pairs in sorted order.\n\n"
+"The view supports len(), in, reversed(), positional indexing and slicing,\n"
+"and compares equal to a list of the same pairs.");
+
+static PyObject *
+btree_items_method(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+    return btree_view_new(self, ITER_ITEMS);
+}
+
+PyDoc_STRVAR(btree_clear_doc,
+"clear()\n"
+"--\n\n"
+"Remove all items from the B-tree.");
+
+static PyObject *
+btree_clear_method(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+    if (PyBTree_Clear(self) < 0) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(btree_min_doc,
+"min()\n"
+"--\n\n"
+"Return the minimum key in the B-tree.");
+
+static PyObject *
+btree_min(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+    PyObject *result = PyBTree_GetMin(self);
+    if (result == NULL && !PyErr_Occurred()) {
+        PyErr_SetString(PyExc_ValueError, "min() arg is an empty B-tree");
+    }
+    return result;
+}
+
+PyDoc_STRVAR(btree_max_doc,
+"max()\n"
+"--\n\n"
+"Return the maximum key in the B-tree.");
+
+static PyObject *
+btree_max(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+    PyObject *result = PyBTree_GetMax(self);
+    if (result == NULL && !PyErr_Occurred()) {
+        PyErr_SetString(PyExc_ValueError, "max() arg is an empty B-tree");
+    }
+    return result;
+}
+
+/* ==================== setdefault Method ==================== */
+
+PyDoc_STRVAR(btree_setdefault_doc,
+"setdefault(key, default=None, /)\n"
+"--\n\n"
+"Insert key with a value of default if key is not in the B-tree.\n\n"
+"Return the value for key if key is in the B-tree, else default.");
+
+static PyObject *
+btree_setdefault(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    PyObject *key, *default_value;
+
+    if (check_nargs("setdefault", nargs, 1, 2) < 0) {
+        return NULL;
+    }
+    key = args[0];
+    default_value = nargs > 1 ? args[1] : Py_None;
+
+    PyObject *value = PyBTree_Search(self, key);
+    if (value != NULL) {
+        return value;  /* Key exists, return existing value */
+    }
+    if (PyErr_Occurred()) {
+        return NULL;
+    }
+
+    /* Key doesn't exist, insert default and return it */
+    if (PyBTree_Insert(self, key, default_value) < 0) {
+        return NULL;
+    }
+    Py_INCREF(default_value);
+    return default_value;
+}
+
+/* ==================== update Method ==================== */
+
+PyDoc_STRVAR(btree_update_doc,
+"update([other], **kwargs)\n"
+"--\n\n"
+"Update the B-tree with key/value pairs from other and kwargs.\n\n"
+"If other is present, it must be a mapping or an iterable of key/value pairs.\n"
+"Keyword arguments are also added as key/value pairs.\n"
+"Sorted input into an empty B-tree is bulk-loaded bottom-up.");
+
+static int
+btree_merge_from_seq2(PyObject *seq2, PairLoader *loader)
+{
+    PyObject *it;       /* iter(seq2) */
+    Py_ssize_t i = 0;   /* index into seq2 */
+    PyObject *item;     /* seq2[i] */
+    PyObject *fast;     /* item as a 2-tuple or 2-list */
+
+    it = PyObject_GetIter(seq2);
+    if (it == NULL)
+        return -1;
+
+    while ((item = PyIter_Next(it)) != NULL) {
+        PyObject *key, *value;
+
+        /* Convert item to sequence, and verify length 2. */
+        fast = PySequence_Fast(item, "");
+        if (fast == NULL) {
+            if (PyErr_ExceptionMatches(PyExc_TypeError)) {
+                PyErr_Format(PyExc_TypeError,
+                    "cannot convert B-tree update "
+                    "sequence element #%zd to a sequence",
+                    i);
+            }
+            goto Fail;
+        }
+        if (PySequence_Fast_GET_SIZE(fast) != 2) {
+            PyErr_Format(PyExc_ValueError,
+                "B-tree update sequence element #%zd "
+                "has length %zd; 2 is required",
+                i, PySequence_Fast_GET_SIZE(fast));
+            goto Fail;
+        }
+
+        key = PySequence_Fast_GET_ITEM(fast, 0);
+        value = PySequence_Fast_GET_ITEM(fast, 1);
+        if (pairloader_add(loader, key, value) < 0) {
+            goto Fail;
+        }
+        Py_DECREF(fast);
+        Py_DECREF(item);
+        i++;
+    }
+    Py_DECREF(it);
+    if (PyErr_Occurred())
+        return -1;
+    return 0;
+
+Fail:
+    Py_XDECREF(fast);
+    Py_DECREF(item);
+    Py_DECREF(it);
+    return -1;
+}
+
+/* Merge a mapping or iterable of pairs into self. Sorted input arriving at
+ * an empty tree is bulk-loaded rather than inserted key by key.
+ */
+static int
+btree_update_from_arg(PyObject *arg, PairLoader *loader)
+{
+    if (PyBTree_Check(arg)) {
+        /* Fast path: merge from another SortedDict */
+        PyObject *items;
+        Py_BEGIN_CRITICAL_SECTION(arg);
+        items = PyBTree_Items(arg);
+        Py_END_CRITICAL_SECTION();
+        if (items == NULL)
+            return -1;
+        Py_ssize_t n = PyList_GET_SIZE(items);
+        for (Py_ssize_t i = 0; i < n; i++) {
+            PyObject *item = PyList_GET_ITEM(items, i);
+            PyObject *key = PyTuple_GET_ITEM(item, 0);
+            PyObject *value = PyTuple_GET_ITEM(item, 1);
+            if (pairloader_add(loader, key, value) < 0) {
+                Py_DECREF(items);
+                return -1;
+            }
+        }
+        Py_DECREF(items);
+    }
+    else if (PyDict_Check(arg)) {
+        /* Fast path for dict */
+        PyObject *key, *value;
+        Py_ssize_t pos = 0;
+        while (PyDict_Next(arg, &pos, &key, &value)) {
+            if (pairloader_add(loader, key, value) < 0)
+                return -1;
+        }
+    }
+    else if (PyObject_HasAttrString(arg, "keys")) {
+        /* Mapping-like object */
+        PyObject *keys = PyMapping_Keys(arg);
+        if (keys == NULL)
+            return -1;
+        PyObject *iter = PyObject_GetIter(keys);
+        Py_DECREF(keys);
+        if (iter == NULL)
+            return -1;
+        PyObject *key;
+        while ((key = PyIter_Next(iter)) != NULL) {
+            PyObject *value = PyObject_GetItem(arg, key);
+            if (value == NULL) {
+                Py_DECREF(key);
+                Py_DECREF(iter);
+                return -1;
+            }
+            int status = pairloader_add(loader, key, value);
+            Py_DECREF(key);
+            Py_DECREF(value);
+            if (status < 0) {
+                Py_DECREF(iter);
+                return -1;
+            }
+        }
+        Py_DECREF(iter);
+        if (PyErr_Occurred())
+            return -1;
+    }
+    else {
+        /* Iterable of key-value pairs */
+        if (btree_merge_from_seq2(arg, loader) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+int
+PyBTree_Update(PyObject *self, PyObject *other)
+{
+    PairLoader loader;
+
+    if (!PyBTree_Check(self)) {
+        PyErr_BadInternalCall();
+        return -1;
+    }
+    pairloader_init(&loader, self);
+    return pairloader_finish(&loader, btree_update_from_arg(other, &loader));
+}
+
+static PyObject *
+btree_update(PyObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    Py_ssize_t i, nkw = kwnames != NULL ? PyTuple_GET_SIZE(kwnames) : 0;
+    PairLoader loader;
+    int status = 0;
+
+    if (check_nargs("update", nargs, 0, 1) < 0) {
+        return NULL;
+    }
+
+    pairloader_init(&loader, self);
+
+    if (nargs > 0) {
+        status = btree_update_from_arg(args[0], &loader);
+    }
+
+    /* Keyword arguments follow the positional ones in args */
+    for (i = 0; i < nkw && status == 0; i++) {
+        status = pairloader_add(&loader, PyTuple_GET_ITEM(kwnames, i), args[nargs + i]);
+    }
+
+    if (pairloader_finish(&loader, status) < 0) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+/* ==================== from_sorted Method ==================== */
+
+PyDoc_STRVAR(btree_from_sorted_doc,
+"from_sorted(iterable, order=64, fill_factor=1.0, cache_i64=True, layout='btree',\n"
+"            key_type=None, key_layout='sorted', aggregate=None, duplicates=False,\n"
+"            write_buffer=0, cache_pairs=False)\n"
+"--\n\n"
+"Build a B-tree from (key, value) pairs given in strictly ascending key order.\n\n"
+"Leaves are packed to fill_factor of their capacity and the internal levels\n"
+"are built above them in a single pass, which is O(n) instead of the\n"
+"O(n log n) of repeated inserts.\n"
+"Raises ValueError if the keys are not strictly ascending, or with\n"
+"duplicates=True, where equal keys keep their order, not ascending.");
+
+static PyObject *
+btree_from_sorted(PyObject *cls, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    PyObject *argv[11] = {NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL};
+    PyObject *iterable;
+    PyObject *result;
+    PyObject *init_kwds;
+    int order = BTREE_DEFAULT_ORDER;
+    double fill_factor = BTREE_DEFAULT_FILL_FACTOR;
+    int cache_i64 = 1;
+    const char *layout = "btree";
+    const char *key_type = NULL;
+    const char *key_layout = "sorted";
+    int duplicates = 0;
+    int write_buffer = 0;
+    int cache_pairs = 0;
+
+    static const char *const kwlist[] = {"iterable", "order", "fill_factor", "cache_i64",
+                                         "layout", "key_type", "key_layout", "aggregate",
+                                         "duplicates", "write_buffer", "cache_pairs", NULL};
+
+    if (unpack_args("from_sorted", args, nargs, kwnames, kwlist, 1, argv) < 0 ||
+        arg_int("from_sorted", "order", argv[1], &order) < 0 ||
+        arg_double(argv[2], &fill_factor) < 0 ||
+        arg_bool(argv[3], &cache_i64) < 0 ||
+        arg_str("from_sorted", "layout", argv[4], 0, &layout) < 0 ||
+        arg_str("from_sorted", "key_type", argv[5], 1, &key_type) < 0 ||
+        arg_str("from_sorted", "key_layout", argv[6], 0, &key_layout) < 0 ||
+        arg_bool(argv[8], &duplicates) < 0 ||
+        arg_int("from_sorted", "write_buffer", argv[9], &write_buffer) < 0 ||
+        arg_bool(argv[10], &cache_pairs) < 0) {
+        return NULL;
+    }
+    iterable = argv[0];
+    if (check_fill_factor(fill_factor) < 0) {
+        return NULL;
+    }
+
+    init_kwds = Py_BuildValue("{s:i,s:O,s:s,s:z,s:s,s:O,s:O,s:i,s:O}", "order", order,
+                              "cache_i64", cache_i64 ? Py_True : Py_False,
+                              "layout", layout, "key_type", key_type,
+                              "key_layout", key_layout,
+                              "aggregate", argv[7] != NULL ? argv[7] : Py_None,
+                              "duplicates", duplicates ? Py_True : Py_False,
+                              "write_buffer", write_buffer,
+                              "cache_pairs", cache_pairs ? Py_True : Py_False);
+    if (init_kwds == NULL) {
+        return NULL;
+    }
+    result = PyObject_VectorcallDict(cls, NULL, 0, init_kwds);
+    Py_DECREF(init_kwds);
+    if (result == NULL) {
+        return NULL;
+    }
+    if (!PyBTree_Check(result)) {
+        PyErr_Format(PyExc_TypeError,
+                     "from_sorted() expected %s to construct a SortedDict",
+                     ((PyTypeObject *)cls)->tp_name);
+        Py_DECREF(result);
+        return NULL;
+    }
+
+    if (btree_fill_from_sorted(result, iterable, fill_factor) < 0) {
+        Py_DECREF(result);
+        return NULL;
+    }
+    return result;
+}
+
+/* ==================== copy Method ==================== */
+
+PyDoc_STRVAR(btree_copy_doc,
+"copy()\n"
+"--\n\n"
+"Return a shallow copy of the B-tree.");
+
+static PyObject *
+btree_copy(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+    return PyBTree_Copy(self);
+}
+
+/* ==================== snapshot Method ==================== */
+
+PyDoc_STRVAR(btree_snapshot_doc,
+"snapshot()\n"
+"--\n\n"
+"Return a read-only, point-in-time view of the B-tree in O(1).\n\n"
+"The snapshot shares nodes with this tree. Later writes to the tree copy\n"
+"only the nodes on the paths they modify, so the snapshot keeps seeing the\n"
+"contents at the time it was taken. Mutating a snapshot raises TypeError;\n"
+"call copy() on it to get a writable tree.");
+
+static PyObject *
+btree_snapshot(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+    PyBTreeObject *btree = (PyBTreeObject *)self;
+    PyBTreeObject *snap;
+
+    if (BTREE_FLUSH(btree)) {
+        return NULL;
+    }
+    if (btree->bplus) {
+        /* Leaf chains cannot be shared, so a B+tree snapshot is a copy */
+        snap = (PyBTreeObject *)PyBTree_Copy(self);
+        if (snap != NULL) {
+            snap->readonly = 1;
+            snap->wbuf_size = 0;
+        }
+        return (PyObject *)snap;
+    }
+
+    snap = PyObject_GC_New(PyBTreeObject, &PyBTree_Type);
+    if (snap == NULL) {
+        return NULL;
+    }
+
+    if (node_share(btree->root) < 0) {
+        PyObject_GC_Del(snap);
+        return NULL;
+    }
+    snap->root = btree->root;
+    snap->size = btree->size;
+    snap->version = 0;
+    snap->order = btree->order;
+    snap->cache_i64 = btree->cache_i64;
+    snap->key_storage = btree->key_storage;
+    snap->eytzinger = btree->eytzinger;
+    snap->duplicates = btree->duplicates;
+    snap->cache_pairs = btree->cache_pairs;
+    snap->readonly = 1;
+    snap->bplus = 0;
+    snap->aggregate = btree->aggregate;
+    Py_XINCREF(btree->agg_func);
+    snap->agg_func = btree->agg_func;
+    snap->wbuf_size = 0;
+    snap->wbuf_n = 0;
+    snap->wbuf_cap = 0;
+    snap->wbuf = NULL;
+    snap->searches = 0;
+    snap->edge_hint = 0;
+
+    PyObject_GC_Track((PyObject *)snap);
+    return (PyObject *)snap;
+}
+
+/* ==================== Order Statistics ==================== */
+
+/* Internal nodes record the size of every child subtree (counts[]), so the
+ * item at a given position and the position of a given key are both found
+ * on a single root-to-leaf walk.
+ */
+
+/* Locate the item at 0-based rank (0 <= rank < size of node's subtree).
+ * Returns the node holding it and stores the key index in *idx. */
+static PyBTreeNode *
+node_select(PyBTreeNode *node, Py_ssize_t rank, Py_ssize_t *idx)
+{
+    while (!node->is_leaf) {
+        Py_ssize_t i;
+        int has_items = NODE_HAS_ITEMS(node);
+        for (i = 0; i < node->n_keys; i++) {
+            if (rank < node->counts[i]) {
+                break;
+            }
+            rank -= node->counts[i];
+            if (!has_items) {
+                continue;
+            }
+            if (rank == 0) {
+                *idx = i;
+                return node;
+            }
+            rank--;
+        }
+        node = node->children[i];
+    }
+    *idx = rank;
+    return node;
+}
+
+/* Number of keys less than key (or less than or equal to it when right is
+ * true). Sets *found if key is present. Returns -1 on comparison error. */
+static Py_ssize_t
+node_rank(PyBTreeNode *node, PyObject *key, int right, int *found)
+{
+    Py_ssize_t rank = 0;
+    int hit;
+
+    *found = 0;
+    while (node != NULL && node->duplicates) {
+        /* Equal keys can continue on both sides of a match, so every level
+         * is searched for the bound itself */
+        Py_ssize_t i, idx;
+
+        node_refresh_eytzinger(node);
+        idx = node_search_bound(node, key, right, &hit);
+        if (idx < 0) {
+            return -1;
+        }
+        *found |= hit;
+        rank += idx;
+        if (node->is_leaf) {
+            return rank;
+        }
+        for (i = 0; i < idx; i++) {
+            rank += node->counts[i];
+        }
+        node = node->children[idx];
+    }
+    while (node != NULL) {
+        Py_ssize_t i, idx = node_search_read(node, key, &hit);
+        if (idx < 0) {
+            return -1;
+        }
+        if (hit && !NODE_HAS_ITEMS(node)) {
+            /* B+tree separator: equal keys live in the right subtree */
+            for (i = 0; i <= idx; i++) {
+                rank += node->counts[i];
+            }
+            node = node->children[idx + 1];
+            continue;
+        }
+        if (NODE_HAS_ITEMS(node)) {
+            rank += idx;
+        }
+        if (!node->is_leaf) {
+            for (i = 0; i < idx; i++) {
+                rank += node->counts[i];
+            }
+        }
+        if (hit) {
+            *found = 1;
             if (!node->is_leaf) {
-                iter_descend_left(it, node->children[frame->key_idx]);
+                rank += node->counts[idx];
+            }
+            return rank + (right ? 1 : 0);
+        }
+        if (node->is_leaf) {
+            break;
+        }
+        node = node->children[idx];
+    }
+    return rank;
+}
+
+/* Ranks [*start, *stop) of the keys between min_key and max_key (None for
+ * no bound), as irange() selects them. Returns -1 on comparison error. */
+static int
+node_range_ranks(PyBTreeNode *root, PyObject *min_key, PyObject *max_key,
+                 int inclusive_min, int inclusive_max, Py_ssize_t *start, Py_ssize_t *stop)
+{
+    int found;
+
+    *start = 0;
+    *stop = root != NULL ? node_size(root) : 0;
+    if (root == NULL) {
+        return 0;
+    }
+    if (min_key != Py_None) {
+        *start = node_rank(root, min_key, !inclusive_min, &found);
+        if (*start < 0) {
+            return -1;
+        }
+    }
+    if (max_key != Py_None) {
+        *stop = node_rank(root, max_key, inclusive_max, &found);
+        if (*stop < 0) {
+            return -1;
+        }
+    }
+    if (*stop < *start) {
+        *stop = *start;
+    }
+    return 0;
+}
+
+/* Normalize a possibly negative index against the tree size.
+ * Returns -1 with IndexError set if it is out of range. */
+static Py_ssize_t
+btree_normalize_index(PyBTreeObject *btree, Py_ssize_t index, const char *name)
+{
+    if (index < 0) {
+        index += btree->size;
+    }
+    if (index < 0 || index >= btree->size) {
+        PyErr_Format(PyExc_IndexError, "%s index out of range", name);
+        return -1;
+    }
+    return index;
+}
+
+PyDoc_STRVAR(btree_index_doc,
+"index(key, /)\n"
+"--\n\n"
+"Return the position of key in sorted order. O(log n).\n"
+"Raises ValueError if key is not present.");
+
+static PyObject *
+btree_index(PyObject *self, PyObject *key)
+{
+    PyBTreeObject *btree = (PyBTreeObject *)self;
+    int found;
+    Py_ssize_t rank;
+
+    rank = btree_rank(btree, key, 0, &found);
+    if (rank < 0) {
+        return NULL;
+    }
+    if (!found) {
+        PyErr_Format(PyExc_ValueError, "%R is not in SortedDict", key);
+        return NULL;
+    }
+    return PyLong_FromSsize_t(rank);
+}
+
+PyDoc_STRVAR(btree_bisect_left_doc,
+"bisect_left(key, /)\n"
+"--\n\n"
+"Return the number of keys less than key, i.e. the position at which key\n"
+"would be inserted before any equal key. O(log n).");
+
+static PyObject *
+btree_bisect_left(PyObject *self, PyObject *key)
+{
+    PyBTreeObject *btree = (PyBTreeObject *)self;
+    int found;
+    Py_ssize_t rank;
+
+    rank = btree_rank(btree, key, 0, &found);
+    if (rank < 0) {
+        return NULL;
+    }
+    return PyLong_FromSsize_t(rank);
+}
+
+PyDoc_STRVAR(btree_bisect_right_doc,
+"bisect_right(key, /)\n"
+"--\n\n"
+"Return the number of keys less than or equal to key. O(log n).\n"
+"bisect() is an alias.");
+
+static PyObject *
+btree_bisect_right(PyObject *self, PyObject *key)
+{
+    PyBTreeObject *btree = (PyBTreeObject *)self;
+    int found;
+    Py_ssize_t rank;
+
+    rank = btree_rank(btree, key, 1, &found);
+    if (rank < 0) {
+        return NULL;
+    }
+    return PyLong_FromSsize_t(rank);
+}
+
+/* ==================== Array Export ==================== */
+
+/* keys_array(), values_array() and irange_array() write the entries straight
+ * into a bytearray exposed as a typed memoryview: cached and native keys are
+ * copied without creating an int object per key. */
+#define ARRAY_INT64 0
+#define ARRAY_FLOAT64 1
+
+static int
+parse_array_dtype(PyObject *dtype, int fallback, int *out)
+{
+    PyObject *name;
+    int status = 0;
+
+    if (dtype == NULL || dtype == Py_None) {
+        *out = fallback;
+        return 0;
+    }
+    /* str() also accepts numpy.dtype objects */
+    name = PyObject_Str(dtype);
+    if (name == NULL) {
+        return -1;
+    }
+    if (PyUnicode_CompareWithASCIIString(name, "int64") == 0) {
+        *out = ARRAY_INT64;
+    }
+    else if (PyUnicode_CompareWithASCIIString(name, "float64") == 0) {
+        *out = ARRAY_FLOAT64;
+    }
+    else {
+        PyErr_Format(PyExc_ValueError,
+                     "dtype must be 'int64' or 'float64', got %R", dtype);
+        status = -1;
+    }
+    Py_DECREF(name);
+    return status;
+}
+
+typedef struct {
+    char *data;
+    Py_ssize_t pos;
+    int dtype;                      /* ARRAY_INT64 or ARRAY_FLOAT64 */
+    int keys;                       /* Export keys rather than values */
+} ArrayWriter;
+
+/* Append the key or value in slot idx of node */
+static int
+array_put(ArrayWriter *w, PyBTreeNode *node, Py_ssize_t idx)
+{
+    char *dst = w->data + w->pos * 8;
+    PyObject *obj;
+
+    if (w->keys && node->nkeys != NULL) {
+        if (node->key_storage == KEYS_I64 && w->dtype == ARRAY_INT64) {
+            memcpy(dst, &node->nkeys[idx].i64, 8);
+        }
+        else if (node->key_storage == KEYS_I64) {
+            double d = (double)node->nkeys[idx].i64;
+            memcpy(dst, &d, 8);
+        }
+        else if (w->dtype == ARRAY_FLOAT64) {
+            memcpy(dst, &node->nkeys[idx].f64, 8);
+        }
+        else {
+            PyErr_SetString(PyExc_TypeError, "float64 keys cannot be exported as int64");
+            return -1;
+        }
+        w->pos++;
+        return 0;
+    }
+    if (w->keys && node->keys_i64_valid != NULL && node->keys_i64_valid[idx] == CACHE_I64) {
+        if (w->dtype == ARRAY_INT64) {
+            memcpy(dst, &node->keys_i64[idx], 8);
+        }
+        else {
+            double d = (double)node->keys_i64[idx];
+            memcpy(dst, &d, 8);
+        }
+        w->pos++;
+        return 0;
+    }
+
+    obj = w->keys ? node->keys[idx] : node->values[idx];
+    if (w->dtype == ARRAY_INT64) {
+        long long v = PyLong_AsLongLong(obj);
+        if (v == -1 && PyErr_Occurred()) {
+            return -1;
+        }
+        memcpy(dst, &v, 8);
+    }
+    else {
+        double d = PyFloat_AsDouble(obj);
+        if (d == -1.0 && PyErr_Occurred()) {
+            return -1;
+        }
+        memcpy(dst, &d, 8);
+    }
+    w->pos++;
+    return 0;
+}
+
+/* Append the entries of the subtree at node whose ranks lie in [start, stop) */
+static int
+array_fill(ArrayWriter *w, PyBTreeNode *node, Py_ssize_t start, Py_ssize_t stop)
+{
+    Py_ssize_t i, offset = 0;
+
+    if (node->is_leaf) {
+        for (i = start; i < stop; i++) {
+            if (array_put(w, node, i) < 0) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+    for (i = 0; i <= node->n_keys && offset < stop; i++) {
+        Py_ssize_t count = node->counts[i];
+
+        if (offset + count > start) {
+            if (array_fill(w, node->children[i],
+                           start > offset ? start - offset : 0,
+                           stop - offset < count ? stop - offset : count) < 0) {
+                return -1;
+            }
+        }
+        offset += count;
+        if (i < node->n_keys && NODE_HAS_ITEMS(node)) {
+            if (offset >= start && offset < stop && array_put(w, node, i) < 0) {
+                return -1;
+            }
+            offset++;
+        }
+    }
+    return 0;
+}
+
+/* Export the keys or values of the tree rooted at root (may be NULL),
+ * restricted to [min_key, max_key) style bounds when ranged */
+static PyObject *
+array_export(PyBTreeNode *root, int keys, int dtype, int ranged,
+             PyObject *min_key, PyObject *max_key, int inclusive_min, int inclusive_max)
+{
+    Py_ssize_t start, stop;
+    PyObject *bytes, *view, *result;
+    ArrayWriter w;
+
+    if (node_range_ranks(root, ranged ? min_key : Py_None, ranged ? max_key : Py_None,
+                         inclusive_min, inclusive_max, &start, &stop) < 0) {
+        return NULL;
+    }
+
+    bytes = PyByteArray_FromStringAndSize(NULL, (stop - start) * 8);
+    if (bytes == NULL) {
+        return NULL;
+    }
+    w.data = PyByteArray_AS_STRING(bytes);
+    w.pos = 0;
+    w.dtype = dtype;
+    w.keys = keys;
+    if (stop > start && array_fill(&w, root, start, stop) < 0) {
+        Py_DECREF(bytes);
+        return NULL;
+    }
+
+    view = PyMemoryView_FromObject(bytes);
+    Py_DECREF(bytes);
+    if (view == NULL) {
+        return NULL;
+    }
+    result = PyObject_CallMethod(view, "cast", "s", dtype == ARRAY_INT64 ? "q" : "d");
+    Py_DECREF(view);
+    return result;
+}
+
+/* Shared body of the array methods: on a pinned root, or under the tree
+ * lock for B+trees (see btree_pin_root) */
+static PyObject *
+btree_array(PyBTreeObject *btree, int keys, PyObject *dtype_obj, int ranged,
+            PyObject *min_key, PyObject *max_key, PyObject *inclusive)
+{
+    int dtype, inclusive_min = 1, inclusive_max = 0;
+    PyBTreeNode *root;
+    PyObject *result;
+
+    if (parse_array_dtype(dtype_obj, keys && btree->key_storage == KEYS_F64
+                                     ? ARRAY_FLOAT64 : ARRAY_INT64, &dtype) < 0 ||
+        parse_inclusive(inclusive, &inclusive_min, &inclusive_max) < 0) {
+        return NULL;
+    }
+
+    if (btree_pin_root(btree, &root) < 0) {
+        return NULL;
+    }
+    if (root != NULL) {
+        result = array_export(root, keys, dtype, ranged, min_key, max_key,
+                              inclusive_min, inclusive_max);
+        NODE_UNPIN(root);
+        return result;
+    }
+    Py_BEGIN_CRITICAL_SECTION(btree);
+    BTREE_SEARCH_ENTER(btree);
+    result = array_export(btree->root, keys, dtype, ranged, min_key, max_key,
+                          inclusive_min, inclusive_max);
+    BTREE_SEARCH_EXIT(btree);
+    Py_END_CRITICAL_SECTION();
+    return result;
+}
+
+PyDoc_STRVAR(btree_keys_array_doc,
+"keys_array(dtype=None)\n"
+"--\n\n"
+"Return the keys in sorted order as a memoryview of int64 or float64.\n\n"
+"dtype defaults to 'float64' for key_type='f64' and to 'int64' otherwise.\n"
+"Cached and native keys are copied without creating int objects; the\n"
+"result can be passed to numpy.asarray() without another copy.");
+
+static PyObject *
+btree_keys_array(PyObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"dtype", NULL};
+    PyObject *dtype = NULL;
+
+    if (unpack_args("keys_array", args, nargs, kwnames, kwlist, 0, &dtype) < 0) {
+        return NULL;
+    }
+    return btree_array((PyBTreeObject *)self, 1, dtype, 0, Py_None, Py_None, NULL);
+}
+
+PyDoc_STRVAR(btree_values_array_doc,
+"values_array(dtype='int64')\n"
+"--\n\n"
+"Return the values in key order as a memoryview of int64 or float64.\n"
+"Raises TypeError or OverflowError for a value that does not convert.");
+
+static PyObject *
+btree_values_array(PyObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"dtype", NULL};
+    PyObject *dtype = NULL;
+
+    if (unpack_args("values_array", args, nargs, kwnames, kwlist, 0, &dtype) < 0) {
+        return NULL;
+    }
+    return btree_array((PyBTreeObject *)self, 0, dtype, 0, Py_None, Py_None, NULL);
+}
+
+PyDoc_STRVAR(btree_irange_array_doc,
+"irange_array(min=None, max=None, inclusive=(True, False), dtype=None)\n"
+"--\n\n"
+"Return the keys of irange(min, max, inclusive) as keys_array() would.");
+
+static PyObject *
+btree_irange_array(PyObject *self, PyObject *const *args, Py_ssize_t nargs,
+                   PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"min", "max", "inclusive", "dtype", NULL};
+    PyObject *argv[4] = {Py_None, Py_None, NULL, NULL};
+
+    if (unpack_args("irange_array", args, nargs, kwnames, kwlist, 0, argv) < 0) {
+        return NULL;
+    }
+    return btree_array((PyBTreeObject *)self, 1, argv[3], 1, argv[0], argv[1], argv[2]);
+}
+
+/* Position a forward iterator so the next key returned has the given rank;
+ * it->remaining already holds the number of items left to yield */
+static void
+iter_seek(PyBTreeIterObject *it, Py_ssize_t rank)
+{
+    PyBTreeNode *node = it->btree->root;
+
+    it->end = rank + it->remaining;
+    it->stack_top = -1;
+    if (it->btree->bplus) {
+        it->leaf_only = 1;
+        it->leaf = node_select(node, rank, &it->leaf_index);
+        return;
+    }
+    it->leaf_only = 0;
+    for (;;) {
+        Py_ssize_t i;
+        it->stack_top++;
+        it->stack[it->stack_top].node = node;
+        if (node->is_leaf) {
+            it->stack[it->stack_top].key_idx = rank;
+            return;
+        }
+        for (i = 0; i < node->n_keys; i++) {
+            if (rank < node->counts[i]) {
+                break;
+            }
+            rank -= node->counts[i];
+            if (rank == 0) {
+                it->stack[it->stack_top].key_idx = i;
+                return;
+            }
+            rank--;
+        }
+        it->stack[it->stack_top].key_idx = i;
+        node = node->children[i];
+    }
+}
+
+/* Position a reverse iterator so the next key returned has the given rank;
+ * it->remaining already holds the number of items left to yield */
+static void
+reviter_seek(PyBTreeReverseIterObject *it, Py_ssize_t rank)
+{
+    PyBTreeNode *node = it->btree->root;
+
+    it->base = rank - it->remaining + 1;
+    it->stack_top = -1;
+    if (it->btree->bplus) {
+        it->leaf_only = 1;
+        it->leaf = node_select(node, rank, &it->leaf_index);
+        return;
+    }
+    it->leaf_only = 0;
+    for (;;) {
+        Py_ssize_t i;
+        it->stack_top++;
+        it->stack[it->stack_top].node = node;
+        if (node->is_leaf) {
+            it->stack[it->stack_top].key_idx = rank;
+            return;
+        }
+        for (i = 0; i < node->n_keys; i++) {
+            if (rank < node->counts[i]) {
+                break;
+            }
+            rank -= node->counts[i];
+            if (rank == 0) {
+                it->stack[it->stack_top].key_idx = i;
+                return;
+            }
+            rank--;
+        }
+        it->stack[it->stack_top].key_idx = i - 1;
+        node = node->children[i];
+    }
+}
+
+PyDoc_STRVAR(btree_islice_doc,
+"islice(start=None, stop=None, reverse=False)\n"
+"--\n\n"
+"Return an iterator over the keys at positions start <= i < stop.\n"
+"Indices follow slice semantics (negative values count from the end and\n"
+"are clamped to the tree). Positioning costs O(log n); with reverse=True\n"
+"the keys are yielded from stop-1 down to start.");
+
+static PyObject *
+btree_islice(PyObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"start", "stop", "reverse", NULL};
+    PyBTreeObject *btree = (PyBTreeObject *)self;
+    PyObject *argv[3] = {Py_None, Py_None, NULL};
+    PyObject *slice;
+    Py_ssize_t start, stop, step, count;
+    int reverse = 0;
+
+    if (unpack_args("islice", args, nargs, kwnames, kwlist, 0, argv) < 0 ||
+        arg_bool(argv[2], &reverse) < 0) {
+        return NULL;
+    }
+
+    slice = PySlice_New(argv[0], argv[1], NULL);
+    if (slice == NULL) {
+        return NULL;
+    }
+    if (PySlice_Unpack(slice, &start, &stop, &step) < 0) {
+        Py_DECREF(slice);
+        return NULL;
+    }
+    Py_DECREF(slice);
+    if (BTREE_FLUSH(btree)) {
+        return NULL;
+    }
+    count = PySlice_AdjustIndices(btree->size, &start, &stop, 1);
+
+    if (!reverse) {
+        PyBTreeIterObject *it = (PyBTreeIterObject *)btree_iter(self);
+        if (it == NULL) {
+            return NULL;
+        }
+        it->remaining = count;
+        if (count > 0) {
+            iter_seek(it, start);
+        }
+        return (PyObject *)it;
+    }
+    else {
+        PyBTreeReverseIterObject *it = (PyBTreeReverseIterObject *)btree_reversed(self, NULL);
+        if (it == NULL) {
+            return NULL;
+        }
+        it->remaining = count;
+        if (count > 0) {
+            reviter_seek(it, stop - 1);
+        }
+        return (PyObject *)it;
+    }
+}
+
+/* ==================== Range Deletion Methods ==================== */
+
+/* Delete the items at ranks [start, stop). See range_cut(). */
+static int
+btree_delete_ranks(PyBTreeObject *btree, Py_ssize_t start, Py_ssize_t stop)
+{
+    RangeTrash trash;
+    PyObject *kept;
+    Py_ssize_t i, bound;
+    int result = 0;
+
+    if (btree_begin_write(btree) < 0) {
+        return -1;
+    }
+    if (start >= stop) {
+        return 0;
+    }
+    if (stop - start == btree->size) {
+        return btree_clear_internal(btree);
+    }
+
+    if (btree->bplus) {
+        kept = Py_None;
+        Py_INCREF(kept);
+    }
+    else {
+        kept = range_kept_key(btree->root, start, stop);
+        if (kept == NULL) {
+            return -1;
+        }
+    }
+    if (BTREE_UNSHARES(btree) && range_unshare(&btree->root, start, stop, btree->size) < 0) {
+        Py_DECREF(kept);
+        return -1;
+    }
+
+    /* Each of the two cut paths gives up at most a node's worth of keys,
+     * values and children per level */
+    bound = 4 * node_height(btree->root) * btree->order;
+    trash.objs = PyMem_Malloc(2 * bound * sizeof(PyObject *));
+    trash.nodes = PyMem_Malloc(bound * sizeof(PyBTreeNode *));
+    if (trash.objs == NULL || trash.nodes == NULL) {
+        PyMem_Free(trash.objs);
+        PyMem_Free(trash.nodes);
+        Py_DECREF(kept);
+        PyErr_NoMemory();
+        return -1;
+    }
+    trash.n_objs = 0;
+    trash.n_nodes = 0;
+
+    btree->size -= range_cut(btree->root, start, stop, 0, &trash);
+    range_repair(btree->root, start, start + (kept != Py_None), btree->bplus);
+    range_collapse_root(&btree->root);
+
+    /* The tree is consistent again */
+    for (i = 0; i < trash.n_objs; i++) {
+        Py_DECREF(trash.objs[i]);
+    }
+    for (i = 0; i < trash.n_nodes; i++) {
+        NODE_DECREF(trash.nodes[i]);
+    }
+    PyMem_Free(trash.objs);
+    PyMem_Free(trash.nodes);
+
+    if (kept != Py_None) {
+        /* The kept item now has rank start */
+        result = btree->duplicates ? btree_delete_rank(btree, start)
+                                   : PyBTree_Delete((PyObject *)btree, kept);
+    }
+    Py_DECREF(kept);
+    return result;
+}
+
+/* Parse the (min=None, max=None, inclusive=(True, False)) arguments of the
+ * range methods into the ranks [*start, *stop) they select */
+static int
+range_args(PyBTreeObject *btree, const char *name, PyObject *const *args, Py_ssize_t nargs,
+           PyObject *kwnames, Py_ssize_t *start, Py_ssize_t *stop)
+{
+    static const char *const kwlist[] = {"min", "max", "inclusive", NULL};
+    PyObject *argv[3] = {Py_None, Py_None, NULL};
+    int inclusive_min = 1, inclusive_max = 0;
+    TreeSearch s;
+
+    if (unpack_args(name, args, nargs, kwnames, kwlist, 0, argv) < 0 ||
+        parse_inclusive(argv[2], &inclusive_min, &inclusive_max) < 0 ||
+        btree_search_begin(btree, &s) < 0) {
+        return -1;
+    }
+    return btree_search_end(btree, &s,
+                            node_range_ranks(s.root, argv[0], argv[1], inclusive_min,
+                                             inclusive_max, start, stop));
+}
+
+/* Store (key, value) tuples for the items of the subtree at node whose
+ * ranks lie in [start, stop) into list, from index *pos on */
+static int
+range_items(PyObject *list, Py_ssize_t *pos, PyBTreeNode *node, Py_ssize_t start, Py_ssize_t stop)
+{
+    Py_ssize_t i, offset = 0;
+    PyObject *item;
+
+    if (node->is_leaf) {
+        for (i = start; i < stop; i++) {
+            if ((item = node_get_item(node, i)) == NULL) {
+                return -1;
+            }
+            PyList_SET_ITEM(list, (*pos)++, item);
+        }
+        return 0;
+    }
+    for (i = 0; i <= node->n_keys && offset < stop; i++) {
+        Py_ssize_t count = node->counts[i];
+
+        if (offset + count > start) {
+            if (range_items(list, pos, node->children[i],
+                            start > offset ? start - offset : 0,
+                            stop - offset < count ? stop - offset : count) < 0) {
+                return -1;
+            }
+        }
+        offset += count;
+        if (i < node->n_keys && NODE_HAS_ITEMS(node)) {
+            if (offset >= start && offset < stop) {
+                if ((item = node_get_item(node, i)) == NULL) {
+                    return -1;
+                }
+                PyList_SET_ITEM(list, (*pos)++, item);
+            }
+            offset++;
+        }
+    }
+    return 0;
+}
+
+PyDoc_STRVAR(btree_count_range_doc,
+"count_range(min=None, max=None, inclusive=(True, False))\n"
+"--\n\n"
+"Return the number of keys irange(min, max, inclusive) would yield.\n"
+"O(log n).");
+
+static PyObject *
+btree_count_range(PyObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    Py_ssize_t start, stop;
+
+    if (range_args((PyBTreeObject *)self, "count_range", args, nargs, kwnames,
+                   &start, &stop) < 0) {
+        return NULL;
+    }
+    return PyLong_FromSsize_t(stop - start);
+}
+
+PyDoc_STRVAR(btree_delete_range_doc,
+"delete_range(min=None, max=None, inclusive=(True, False))\n"
+"--\n\n"
+"Remove the keys irange(min, max, inclusive) would yield and return how\n"
+"many were removed.\n\n"
+"Subtrees inside the range are dropped whole and only the nodes along the\n"
+"two range ends are rebalanced, so this takes O(log n) node operations\n"
+"plus the release of the k removed items, not k separate deletions.");
+
+static PyObject *
+btree_delete_range(PyObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    PyBTreeObject *btree = (PyBTreeObject *)self;
+    Py_ssize_t start, stop;
+
+    if (range_args(btree, "delete_range", args, nargs, kwnames, &start, &stop) < 0 ||
+        btree_delete_ranks(btree, start, stop) < 0) {
+        return NULL;
+    }
+    return PyLong_FromSsize_t(stop - start);
+}
+
+PyDoc_STRVAR(btree_pop_range_doc,
+"pop_range(min=None, max=None, inclusive=(True, False))\n"
+"--\n\n"
+"Remove the keys irange(min, max, inclusive) would yield and return their\n"
+"(key, value) pairs as a list in sorted order. Removal works as in\n"
+"delete_range().");
+
+static PyObject *
+btree_pop_range(PyObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    PyBTreeObject *btree = (PyBTreeObject *)self;
+    Py_ssize_t start, stop, pos = 0;
+    PyObject *items;
+
+    if (range_args(btree, "pop_range", args, nargs, kwnames, &start, &stop) < 0 ||
+        btree_begin_write(btree) < 0) {
+        return NULL;
+    }
+    items = PyList_New(stop - start);
+    if (items == NULL) {
+        return NULL;
+    }
+    if ((stop > start && range_items(items, &pos, btree->root, start, stop) < 0) ||
+        btree_delete_ranks(btree, start, stop) < 0) {
+        Py_DECREF(items);
+        return NULL;
+    }
+    return items;
+}
+
+/* ==================== Duplicate Keys ==================== */
+
+/* A tree created with duplicates=True keeps every item inserted under a key,
+ * in insertion order, as separate items of the same node layout. Inserts
+ * descend to the upper bound of the key and lookups and ranks to its lower
+ * bound (node_search_bound()), so the items of a key hold consecutive ranks
+ * [bisect_left(key), bisect_right(key)). Writes that pick one item of a key
+ * delete it by rank (btree_delete_rank()). */
+
+/* Ranks [*start, *stop) of the items with key. Returns -1 on error,
+ * RuntimeError if a comparison wrote to the tree. */
+static int
+btree_equal_ranks(PyBTreeObject *btree, PyObject *key, Py_ssize_t *start, Py_ssize_t *stop)
+{
+    TreeSearch s;
+    int found;
+
+    if (btree_search_begin(btree, &s) < 0) {
+        return -1;
+    }
+    *start = node_rank(s.root, key, 0, &found);
+    if (*start >= 0 && found && btree->version == s.version) {
+        *stop = node_rank(s.root, key, 1, &found);
+    }
+    else {
+        *stop = *start;
+    }
+    return btree_search_end(btree, &s, *start < 0 || *stop < 0 ? -1 : 0);
+}
+
+/* Find the first item with key whose value equals value, storing its rank.
+ * Returns 1 if found, 0 if not, -1 on error. */
+static int
+btree_find_item(PyBTreeObject *btree, PyObject *key, PyObject *value, Py_ssize_t *rank)
+{
+    Py_ssize_t start, stop;
+
+    if (btree_equal_ranks(btree, key, &start, &stop) < 0) {
+        return -1;
+    }
+    for (*rank = start; *rank < stop; (*rank)++) {
+        size_t version = btree->version;
+        Py_ssize_t idx;
+        PyBTreeNode *node = node_select(btree->root, *rank, &idx);
+        PyObject *item = node->values[idx];
+        int eq;
+
+        Py_INCREF(item);
+        eq = PyObject_RichCompareBool(item, value, Py_EQ);
+        Py_DECREF(item);
+        if (eq >= 0 && btree->version != version) {
+            PyErr_SetString(PyExc_RuntimeError, "SortedDict changed during lookup");
+            return -1;
+        }
+        if (eq != 0) {
+            return eq;
+        }
+    }
+    return 0;
+}
+
+/* del btree[key] with duplicates: remove every item with key */
+static int
+btree_delete_equal(PyBTreeObject *btree, PyObject *key)
+{
+    Py_ssize_t start, stop;
+
+    if (btree_begin_write(btree) < 0 || btree_equal_ranks(btree, key, &start, &stop) < 0) {
+        return -1;
+    }
+    if (start == stop) {
+        PyErr_SetObject(PyExc_KeyError, key);
+        return -1;
+    }
+    return btree_delete_ranks(btree, start, stop);
+}
+
+PyDoc_STRVAR(btree_count_doc,
+"count(key, /)\n"
+"--\n\n"
+"Return the number of items with key: 0 or 1 unless the SortedDict was\n"
+"created with duplicates=True. O(log n).");
+
+static PyObject *
+btree_count(PyObject *self, PyObject *key)
+{
+    Py_ssize_t start, stop;
+
+    if (btree_equal_ranks((PyBTreeObject *)self, key, &start, &stop) < 0) {
+        return NULL;
+    }
+    return PyLong_FromSsize_t(stop - start);
+}
+
+PyDoc_STRVAR(btree_equal_range_doc,
+"equal_range(key, /)\n"
+"--\n\n"
+"Return the positions (start, stop) of the items with key, which are\n"
+"(bisect_left(key), bisect_right(key)); islice(start, stop) or\n"
+"values()[start:stop] reads them in insertion order. O(log n).");
+
+static PyObject *
+btree_equal_range(PyObject *self, PyObject *key)
+{
+    Py_ssize_t start, stop;
+
+    if (btree_equal_ranks((PyBTreeObject *)self, key, &start, &stop) < 0) {
+        return NULL;
+    }
+    return Py_BuildValue("(nn)", start, stop);
+}
+
+PyDoc_STRVAR(btree_remove_one_doc,
+"remove_one(key, value, /)\n"
+"--\n\n"
+"Remove the first item with key whose value equals value, leaving the\n"
+"other items of key in place. Raises KeyError if there is none.\n"
+"O(log n) per item of key compared.");
+
+static PyObject *
+btree_remove_one(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    PyBTreeObject *btree = (PyBTreeObject *)self;
+    Py_ssize_t rank;
+    int found;
+
+    if (check_nargs("remove_one", nargs, 2, 2) < 0 || btree_begin_write(btree) < 0) {
+        return NULL;
+    }
+    found = btree_find_item(btree, args[0], args[1], &rank);
+    if (found < 0) {
+        return NULL;
+    }
+    if (!found) {
+        /* KeyError((key, value)), wrapped so the pair is one argument */
+        PyObject *exc_args = Py_BuildValue("((OO))", args[0], args[1]);
+        if (exc_args != NULL) {
+            PyErr_SetObject(PyExc_KeyError, exc_args);
+            Py_DECREF(exc_args);
+        }
+        return NULL;
+    }
+    if ((btree->duplicates ? btree_delete_rank(btree, rank)
+                           : PyBTree_Delete(self, args[0])) < 0) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+/* ==================== Range Aggregates ==================== */
+
+/* A tree created with aggregate= caches in every node the aggregate of its
+ * subtree's values, so aggregate_range() combines O(log n) cached subtrees
+ * and the items along the two range ends. Writers only mark the nodes they
+ * change (NODE_AGG_CHANGED()); the next query recomputes the stale ones.
+ * The combining code may be arbitrary Python, which must not run inside a
+ * split, and may itself write to the tree: each step checks the tree's
+ * version and gives up with RuntimeError before touching a node again.
+ */
+
+typedef struct {
+    PyBTreeObject *btree;
+    size_t version;               /* btree->version when the query started */
+    PyObject *acc;                /* Aggregate so far, NULL before the first value */
+} AggState;
+
+/* Combine the aggregates a and b of adjacent ranges, a first */
+static PyObject *
+agg_combine(PyBTreeObject *btree, PyObject *a, PyObject *b)
+{
+    int first;
+
+    switch (btree->aggregate) {
+    case AGG_SUM:
+        return PyNumber_Add(a, b);
+    case AGG_MIN:
+    case AGG_MAX:
+        /* Ties keep the earlier value, as min() and max() do */
+        first = PyObject_RichCompareBool(b, a, btree->aggregate == AGG_MIN ? Py_GE : Py_LE);
+        if (first < 0) {
+            return NULL;
+        }
+        Py_INCREF(first ? a : b);
+        return first ? a : b;
+    default:
+        return PyObject_CallFunctionObjArgs(btree->agg_func, a, b, NULL);
+    }
+}
+
+/* Append x to the range aggregated in st */
+static int
+agg_add(AggState *st, PyObject *x)
+{
+    PyObject *acc;
+
+    /* x may belong to a node that the combining code frees */
+    Py_INCREF(x);
+    if (st->acc == NULL) {
+        st->acc = x;
+    }
+    else {
+        acc = agg_combine(st->btree, st->acc, x);
+        Py_DECREF(x);
+        Py_SETREF(st->acc, acc);
+        if (acc == NULL) {
+            return -1;
+        }
+    }
+    if (st->btree->version != st->version) {
+        PyErr_SetString(PyExc_RuntimeError, "SortedDict changed during aggregation");
+        return -1;
+    }
+    return 0;
+}
+
+/* Append the aggregate of the non-empty subtree at node to st. With cache
+ * set, a stale aggregate is stored back into the node; free-threaded
+ * builds only store into nodes no other tree can reach, which other
+ * threads may be reading without this tree's lock. */
+static int
+agg_subtree(AggState *st, PyBTreeNode *node, int cache)
+{
+    AggState sub = {st->btree, st->version, NULL};
+    PyObject *old;
+    Py_ssize_t i;
+
+    if (node->agg_valid) {
+        return agg_add(st, node->agg);
+    }
+#ifdef Py_GIL_DISABLED
+    cache = cache && NODE_REFCNT(node) == 1;
+#endif
+    for (i = 0; i <= node->n_keys; i++) {
+        if (!node->is_leaf && agg_subtree(&sub, node->children[i], cache) < 0) {
+            goto error;
+        }
+        if (i < node->n_keys && NODE_HAS_ITEMS(node) && agg_add(&sub, node->values[i]) < 0) {
+            goto error;
+        }
+    }
+    if (cache) {
+        old = node->agg;
+        Py_INCREF(sub.acc);
+        node->agg = sub.acc;
+        node->agg_valid = 1;
+        Py_XDECREF(old);
+    }
+    i = agg_add(st, sub.acc);
+    Py_DECREF(sub.acc);
+    return (int)i;
+
+error:
+    Py_XDECREF(sub.acc);
+    return -1;
+}
+
+/* Append the values at ranks [start, stop) of the subtree at node, which
+ * holds count items, to st */
+static int
+agg_ranks(AggState *st, PyBTreeNode *node, Py_ssize_t count, Py_ssize_t start,
+          Py_ssize_t stop, int cache)
+{
+    Py_ssize_t i, offset = 0;
+
+    if (start == 0 && stop == count) {
+        return agg_subtree(st, node, cache);
+    }
+#ifdef Py_GIL_DISABLED
+    cache = cache && NODE_REFCNT(node) == 1;
+#endif
+    if (node->is_leaf) {
+        for (i = start; i < stop; i++) {
+            if (agg_add(st, node->values[i]) < 0) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+    for (i = 0; i <= node->n_keys && offset < stop; i++) {
+        Py_ssize_t c = node->counts[i];
+
+        if (offset + c > start) {
+            if (agg_ranks(st, node->children[i], c,
+                          start > offset ? start - offset : 0,
+                          stop - offset < c ? stop - offset : c, cache) < 0) {
+                return -1;
+            }
+        }
+        offset += c;
+        if (i < node->n_keys && NODE_HAS_ITEMS(node)) {
+            if (offset >= start && offset < stop && agg_add(st, node->values[i]) < 0) {
+                return -1;
+            }
+            offset++;
+        }
+    }
+    return 0;
+}
+
+PyDoc_STRVAR(btree_aggregate_range_doc,
+"aggregate_range(min=None, max=None, inclusive=(True, False))\n"
+"--\n\n"
+"Return the aggregate of the values of the keys irange(min, max, inclusive)\n"
+"would yield, or None if there are none. The tree must have been created\n"
+"with aggregate='sum', 'min', 'max' or a callable f(a, b) combining the\n"
+"aggregates of two adjacent ranges, which must be associative.\n\n"
+"Each node caches the aggregate of its subtree, so a query combines\n"
+"O(log n) subtrees and the items along the two range ends, after\n"
+"recomputing the nodes written since the previous query.");
+
+static PyObject *
+btree_aggregate_range(PyObject *self, PyObject *const *args, Py_ssize_t nargs,
+                      PyObject *kwnames)
+{
+    PyBTreeObject *btree = (PyBTreeObject *)self;
+    AggState st = {btree, 0, NULL};
+    Py_ssize_t start, stop;
+
+    if (btree->aggregate == AGG_NONE) {
+        PyErr_SetString(PyExc_TypeError,
+                        "aggregate_range() needs a SortedDict created with aggregate=");
+        return NULL;
+    }
+    if (BTREE_FLUSH(btree)) {
+        return NULL;
+    }
+    st.version = btree->version;
+    if (range_args(btree, "aggregate_range", args, nargs, kwnames, &start, &stop) < 0) {
+        return NULL;
+    }
+    if (btree->version != st.version) {
+        PyErr_SetString(PyExc_RuntimeError, "SortedDict changed during aggregation");
+        return NULL;
+    }
+    if (start >= stop) {
+        Py_RETURN_NONE;
+    }
+    if (agg_ranks(&st, btree->root, btree->size, start, stop, 1) < 0) {
+        Py_XDECREF(st.acc);
+        return NULL;
+    }
+    return st.acc;
+}
+
+/* ==================== Split and Concatenation ==================== */
+
+/* split_at() divides the tree along the path to the split position: each
+ * node on it keeps the keys and children before the path and hands the
+ * rest to a new node of the upper tree. concat() stacks empty single-child
+ * nodes on the lower of the two trees until both are of the same height
+ * and hangs them from a new root. Either way only nodes along the seam are
+ * left short, and range_repair() merges and borrows them back to size as
+ * after a range deletion. Both take O(log n) node operations, and every
+ * node is allocated before the trees change. */
+
+/* Allocate n nodes for btree: internal ones, except a leaf last when leaf
+ * is true. Returns -1 on memory error with none allocated. */
+static int
+btree_alloc_nodes(PyBTreeObject *btree, PyBTreeNode **nodes, Py_ssize_t n, int leaf)
+{
+    Py_ssize_t i;
+
+    for (i = 0; i < n; i++) {
+        int is_leaf = leaf && i == n - 1;
+        nodes[i] = node_alloc(btree->order, is_leaf, is_leaf || !btree->bplus,
+                              BTREE_KEY_SPEC(btree));
+        if (nodes[i] == NULL) {
+            while (--i >= 0) {
+                NODE_DECREF(nodes[i]);
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Return a new empty tree with the same options as btree */
+static PyBTreeObject *
+btree_new_like(PyBTreeObject *btree)
+{
+    PyBTreeObject *tree = (PyBTreeObject *)PyBTree_New(btree->order);
+    PyBTreeNode *root;
+
+    if (tree == NULL) {
+        return NULL;
+    }
+    tree->cache_i64 = btree->cache_i64;
+    tree->key_storage = btree->key_storage;
+    tree->eytzinger = btree->eytzinger;
+    tree->duplicates = btree->duplicates;
+    tree->cache_pairs = btree->cache_pairs;
+    tree->bplus = btree->bplus;
+    tree->aggregate = btree->aggregate;
+    Py_XINCREF(btree->agg_func);
+    tree->agg_func = btree->agg_func;
+    tree->wbuf_size = btree->wbuf_size;
+    root = btreenode_new(tree->order, 1, BTREE_KEY_SPEC(tree));
+    if (root == NULL) {
+        Py_DECREF(tree);
+        return NULL;
+    }
+    NODE_SETREF(tree->root, root);
+    return tree;
+}
+
+/* Move the items of btree from rank r on into the empty tree upper, where
+ * 0 < r < size */
+static int
+btree_split_ranks(PyBTreeObject *btree, PyBTreeObject *upper, Py_ssize_t r)
+{
+    Py_ssize_t height, d, size = btree->size, offset = r;
+    PyBTreeNode **nodes, **slot, *node;
+
+    if (BTREE_UNSHARES(btree) && range_unshare(&btree->root, r, r, size) < 0) {
+        return -1;
+    }
+    height = node_height(btree->root);
+    nodes = PyMem_Malloc(height * sizeof(PyBTreeNode *));
+    if (nodes == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    if (btree_alloc_nodes(btree, nodes, height, 1) < 0) {
+        PyMem_Free(nodes);
+        return -1;
+    }
+
+    NODE_CLEAR(upper->root);
+    slot = &upper->root;
+    node = btree->root;
+    for (d = 0; !node->is_leaf; d++) {
+        PyBTreeNode *right = nodes[d];
+        Py_ssize_t n = node->n_keys;
+        Py_ssize_t i = range_locate(node, offset, &offset);
+
+        /* Keys i.. and children i+1.. go right; child i is split below */
+        move_keys(right, 0, node, i, n - i);
+        clear_keys(node, i, n - i);
+        if (NODE_HAS_ITEMS(node)) {
+            memcpy(right->values, &node->values[i], (n - i) * sizeof(PyObject *));
+            memset(&node->values[i], 0, (n - i) * sizeof(PyObject *));
+        }
+        move_children(right, 1, node, i + 1, n - i);
+        memset(&node->children[i + 1], 0, (n - i) * sizeof(PyBTreeNode *));
+        memset(&node->counts[i + 1], 0, (n - i) * sizeof(Py_ssize_t));
+        right->counts[0] = node->counts[i] - offset;
+        node->counts[i] = offset;
+        right->n_keys = n - i;
+        node->n_keys = i;
+
+        *slot = right;
+        slot = &right->children[0];
+        node = node->children[i];
+    }
+
+    /* The leaf on the path splits at offset */
+    *slot = nodes[d];
+    nodes[d]->n_keys = node->n_keys - offset;
+    move_keys(nodes[d], 0, node, offset, node->n_keys - offset);
+    clear_keys(node, offset, node->n_keys - offset);
+    memcpy(nodes[d]->values, &node->values[offset], nodes[d]->n_keys * sizeof(PyObject *));
+    memset(&node->values[offset], 0, nodes[d]->n_keys * sizeof(PyObject *));
+    node->n_keys = offset;
+    if (btree->bplus) {
+        nodes[d]->next = node->next;
+        if (node->next != NULL) {
+            node->next->prev = nodes[d];
+        }
+        node->next = NULL;
+    }
+    PyMem_Free(nodes);
+
+    btree->size = r;
+    upper->size = size - r;
+    range_repair(btree->root, r, r, btree->bplus);
+    range_collapse_root(&btree->root);
+    range_repair(upper->root, 0, 0, btree->bplus);
+    range_collapse_root(&upper->root);
+    return 0;
+}
+
+/* Append the items of other, whose keys all follow those of btree, and
+ * leave other empty. Both trees are non-empty and have the same options. */
+static int
+btree_concat_trees(PyBTreeObject *btree, PyBTreeObject *other)
+{
+    Py_ssize_t height, other_height, nwrap, d, size = btree->size;
+    PyBTreeNode **nodes, *root, *left, *right;
+    int bplus = btree->bplus;
+
+    if (BTREE_UNSHARES(btree) && (range_unshare(&btree->root, size, size, size) < 0 ||
+                                  range_unshare(&other->root, 0, 0, other->size) < 0)) {
+        return -1;
+    }
+    height = node_height(btree->root);
+    other_height = node_height(other->root);
+    nwrap = height > other_height ? height - other_height : other_height - height;
+
+    /* A new root, the stacked nodes and an empty leaf for other */
+    nodes = PyMem_Malloc((nwrap + 2) * sizeof(PyBTreeNode *));
+    if (nodes == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    if (btree_alloc_nodes(btree, nodes, nwrap + 2, 1) < 0) {
+        PyMem_Free(nodes);
+        return -1;
+    }
+    root = nodes[0];
+
+    if (bplus) {
+        PyBTreeNode *first = get_min_leaf(other->root);
+        PyBTreeNode *last = get_max_leaf(btree->root);
+
+        node_copy_key(root, 0, first, 0);
+        last->next = first;
+        first->prev = last;
+    }
+    else {
+        /* The largest item of btree becomes the separator */
+        PyBTreeNode *node = btree->root;
+        Py_ssize_t idx;
+
+        for (; !node->is_leaf; node = node->children[node->n_keys]) {
+            node->counts[node->n_keys]--;
+        }
+        idx = node->n_keys - 1;
+        move_keys(root, 0, node, idx, 1);
+        root->values[0] = node->values[idx];
+        clear_keys(node, idx, 1);
+        node->values[idx] = NULL;
+        node->n_keys--;
+        size--;
+    }
+
+    left = btree->root;
+    right = other->root;
+    for (d = 1; d <= nwrap; d++) {
+        if (height < other_height) {
+            nodes[d]->children[0] = left;
+            nodes[d]->counts[0] = size;
+            left = nodes[d];
+        }
+        else {
+            nodes[d]->children[0] = right;
+            nodes[d]->counts[0] = other->size;
+            right = nodes[d];
+        }
+    }
+    root->n_keys = 1;
+    root->children[0] = left;
+    root->counts[0] = size;
+    root->children[1] = right;
+    root->counts[1] = other->size;
+
+    btree->root = root;
+    btree->size = size + other->size + !bplus;
+    other->root = nodes[nwrap + 1];
+    other->size = 0;
+    PyMem_Free(nodes);
+
+    range_repair(btree->root, size, size + !bplus, bplus);
+    range_collapse_root(&btree->root);
+    return 0;
+}
+
+PyDoc_STRVAR(btree_split_at_doc,
+"split_at(key, /)\n"
+"--\n\n"
+"Move the keys greater than or equal to key into a new SortedDict with\n"
+"the same options and return it; the keys less than key stay.\n\n"
+"The tree is cut along one root-to-leaf path instead of reinserting the\n"
+"moved items, so this takes O(log n) node operations.");
+
+static PyObject *
+btree_split_at(PyObject *self, PyObject *key)
+{
+    PyBTreeObject *btree = (PyBTreeObject *)self;
+    PyBTreeObject *upper;
+    Py_ssize_t rank;
+    int found;
+
+    if (btree_begin_write(btree) < 0) {
+        return NULL;
+    }
+    rank = btree_rank(btree, key, 0, &found);
+    if (rank < 0) {
+        return NULL;
+    }
+    upper = btree_new_like(btree);
+    if (upper == NULL) {
+        return NULL;
+    }
+    if (rank == 0) {
+        PyBTreeNode *root = upper->root;
+        upper->root = btree->root;
+        upper->size = btree->size;
+        btree->root = root;
+        btree->size = 0;
+    }
+    else if (rank < btree->size && btree_split_ranks(btree, upper, rank) < 0) {
+        Py_DECREF(upper);
+        return NULL;
+    }
+    return (PyObject *)upper;
+}
+
+PyDoc_STRVAR(btree_concat_doc,
+"concat(other, /)\n"
+"--\n\n"
+"Move all items of other, a SortedDict with the same options whose keys\n"
+"all follow the keys of this one, to the end of this one, leaving other\n"
+"empty. Raises ValueError if the key ranges overlap.\n\n"
+"The trees are joined along their facing edges instead of reinserting\n"
+"the moved items, so this takes O(log n) node operations.");
+
+static PyObject *
+btree_concat(PyObject *self, PyObject *arg)
+{
+    PyBTreeObject *btree = (PyBTreeObject *)self;
+    PyBTreeObject *other = (PyBTreeObject *)arg;
+
+    if (!PyBTree_Check(arg)) {
+        PyErr_Format(PyExc_TypeError, "concat() argument must be a SortedDict, not %.200s",
+                     Py_TYPE(arg)->tp_name);
+        return NULL;
+    }
+    if (other == btree) {
+        PyErr_SetString(PyExc_ValueError, "cannot concat a SortedDict with itself");
+        return NULL;
+    }
+    if (btree_begin_write(btree) < 0 || btree_begin_write(other) < 0) {
+        return NULL;
+    }
+    if (other->order != btree->order || other->bplus != btree->bplus ||
+        BTREE_KEY_SPEC(other) != BTREE_KEY_SPEC(btree) ||
+        other->aggregate != btree->aggregate || other->agg_func != btree->agg_func) {
+        PyErr_SetString(PyExc_ValueError,
+            "concat() needs a SortedDict with the same order, layout, key_type, "
+            "cache_i64, cache_pairs, key_layout, aggregate and duplicates");
+        return NULL;
+    }
+
+    if (btree->size > 0 && other->size > 0) {
+        PyBTreeNode *last = get_max_leaf(btree->root);
+        PyObject *max_key = node_get_key(last, last->n_keys - 1);
+        PyObject *min_key = node_get_key(get_min_leaf(other->root), 0);
+        int ordered = -1;
+
+        /* With duplicates other may start with this tree's last key */
+        if (max_key != NULL && min_key != NULL && btree->duplicates) {
+            ordered = PyObject_RichCompareBool(min_key, max_key, Py_LT);
+            ordered = ordered < 0 ? -1 : !ordered;
+        }
+        else if (max_key != NULL && min_key != NULL) {
+            ordered = PyObject_RichCompareBool(max_key, min_key, Py_LT);
+        }
+        Py_XDECREF(max_key);
+        Py_XDECREF(min_key);
+        if (ordered < 0) {
+            return NULL;
+        }
+        if (!ordered) {
+            PyErr_SetString(PyExc_ValueError,
+                btree->duplicates
+                    ? "concat() needs every key of other to be no less than every key"
+                    : "concat() needs every key of other to be greater than every key");
+            return NULL;
+        }
+    }
+
+    if (other->size == 0) {
+        Py_RETURN_NONE;
+    }
+    if (btree->size == 0) {
+        PyBTreeNode *root = btree->root;
+        btree->root = other->root;
+        btree->size = other->size;
+        other->root = root;
+        other->size = 0;
+        Py_RETURN_NONE;
+    }
+    if (btree_concat_trees(btree, other) < 0) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+#ifdef Py_GIL_DISABLED
+static PyObject *
+btree_concat_locked(PyObject *self, PyObject *other)
+{
+    PyObject *result;
+
+    Py_BEGIN_CRITICAL_SECTION2(self, other);
+    result = btree_concat(self, other);
+    Py_END_CRITICAL_SECTION2();
+    return result;
+}
+#endif
+
+/* ==================== Merge and Set Operations ==================== */
+
+/* merge(), intersection_keys(), difference_keys() and == walk two trees
+ * side by side in key order, one comparison per step instead of a
+ * root-to-leaf search per key, and the first three hand their strictly
+ * ascending output to the bottom-up builder, so each takes O(n + m).
+ * Key comparisons and conflict callbacks can run Python code that writes
+ * to either tree, so the walks read snapshots. */
+
+/* Return a new reference to a read-only tree with the contents of tree:
+ * tree itself if it is a snapshot, otherwise a new snapshot of it. */
+static PyObject *
+btree_pin(PyObject *tree)
+{
+    PyObject *pin;
+
+    if (((PyBTreeObject *)tree)->readonly) {
+        Py_INCREF(tree);
+        return tree;
+    }
+    Py_BEGIN_CRITICAL_SECTION(tree);
+    pin = btree_snapshot(tree, NULL);
+    Py_END_CRITICAL_SECTION();
+    return pin;
+}
+
+/* Forward walk over a pinned tree */
+typedef struct {
+    PyBTreeIterObject *it;        /* Iterator over the snapshot */
+    Py_ssize_t size;              /* Items in the snapshot */
+    PyBTreeNode *node;            /* Node and slot of the current entry, */
+    Py_ssize_t idx;               /* node is NULL past the last one */
+} MergeCursor;
+
+static inline void
+cursor_next(MergeCursor *c)
+{
+    if (!iter_advance(c->it, &c->node, &c->idx)) {
+        c->node = NULL;
+    }
+}
+
+static int
+cursor_open(MergeCursor *c, PyObject *tree)
+{
+    PyObject *pin = btree_pin(tree);
+
+    c->it = NULL;
+    c->node = NULL;
+    if (pin == NULL) {
+        return -1;
+    }
+    c->size = ((PyBTreeObject *)pin)->size;
+    c->it = (PyBTreeIterObject *)btree_iter_kind((PyBTreeObject *)pin, ITER_KEYS);
+    Py_DECREF(pin);  /* The iterator holds it */
+    if (c->it == NULL) {
+        return -1;
+    }
+    cursor_next(c);
+    return 0;
+}
+
+static void
+cursor_close(MergeCursor *c)
+{
+    Py_XDECREF(c->it);
+}
+
+/* Compare the keys in slot i of a and slot j of b as compare_keys() does.
+ * Native and cached int64 keys and pairs are compared without key objects. */
+static int
+slot_compare(PyBTreeNode *a, Py_ssize_t i, PyBTreeNode *b, Py_ssize_t j)
+{
+    PyObject *ka, *kb;
+    int cmp;
+    int a_i64 = a->key_storage == KEYS_I64 ||
+                (a->keys_i64_valid && a->keys_i64_valid[i] == CACHE_I64);
+    int b_i64 = b->key_storage == KEYS_I64 ||
+                (b->keys_i64_valid && b->keys_i64_valid[j] == CACHE_I64);
+
+    if (a_i64 && b_i64) {
+        long long x = a->nkeys != NULL ? a->nkeys[i].i64 : a->keys_i64[i];
+        long long y = b->nkeys != NULL ? b->nkeys[j].i64 : b->keys_i64[j];
+        return x < y ? -1 : x > y;
+    }
+    if (a->keys_i64_valid && a->keys_i64_valid[i] == CACHE_STR &&
+        b->keys_i64_valid && b->keys_i64_valid[j] == CACHE_STR) {
+        unsigned long long x = (unsigned long long)a->keys_i64[i];
+        unsigned long long y = (unsigned long long)b->keys_i64[j];
+        if (x != y) {
+            return x < y ? -1 : 1;
+        }
+    }
+    if (a->keys_i64_valid && a->keys_i64_valid[i] == CACHE_PAIR &&
+        b->keys_i64_valid && b->keys_i64_valid[j] == CACHE_PAIR) {
+        long long x = a->keys_i64[i], y = b->keys_i64[j];
+        if (x != y) {
+            return x < y ? -1 : 1;
+        }
+        x = a->keys_i64_2[i];
+        y = b->keys_i64_2[j];
+        return x < y ? -1 : x > y;
+    }
+    if (a->key_storage == KEYS_F64 && b->key_storage == KEYS_F64) {
+        double x = a->nkeys[i].f64, y = b->nkeys[j].f64;
+        return x < y ? -1 : x > y;
+    }
+    if (a->keys != NULL && b->keys != NULL) {
+        return compare_keys(a->keys[i], b->keys[j]);
+    }
+    ka = node_get_key(a, i);
+    kb = node_get_key(b, j);
+    cmp = (ka == NULL || kb == NULL) ? -2 : compare_keys(ka, kb);
+    Py_XDECREF(ka);
+    Py_XDECREF(kb);
+    return cmp;
+}
+
+/* Append the key of the current entry of c with value (borrowed), or with
+ * the entry's own value if value is NULL, to space reserved in buf. Pairs
+ * arrive in ascending key order, so buf->sorted is left as it is. */
+static int
+cursor_emit(MergeCursor *c, PyObject *value, PairBuffer *buf)
+{
+    PyObject *key = node_get_key(c->node, c->idx);
+
+    if (key == NULL) {
+        return -1;
+    }
+    if (value == NULL) {
+        value = c->node->values[c->idx];
+    }
+    Py_INCREF(value);
+    buf->keys[buf->n] = key;
+    buf->values[buf->n] = value;
+    buf->n++;
+    return 0;
+}
+
+/* What merge_walk() keeps */
+#define WALK_UNION        0       /* Keys in either tree */
+#define WALK_INTERSECTION 1       /* Keys of a that are in b */
+#define WALK_DIFFERENCE   2       /* Keys of a that are not in b */
+
+/* How a union picks the value of a key in both trees */
+#define CONFLICT_LEFT  0          /* Keep a's */
+#define CONFLICT_RIGHT 1          /* Take b's */
+#define CONFLICT_CALL  2          /* func(key, a_value, b_value) */
+
+/* Collect the pairs selected by op from a and b into buf in key order.
+ * Keys found in both trees keep a's key object. */
+static int
+merge_walk(MergeCursor *a, MergeCursor *b, int op, int conflict, PyObject *func,
+           PairBuffer *buf)
+{
+    if (pairbuf_reserve(buf, op == WALK_UNION ? a->size + b->size : a->size) < 0) {
+        return -1;
+    }
+
+    while (a->node != NULL && b->node != NULL) {
+        int cmp = slot_compare(a->node, a->idx, b->node, b->idx);
+        if (cmp == -2) {
+            return -1;
+        }
+        if (cmp < 0) {
+            if (op != WALK_INTERSECTION && cursor_emit(a, NULL, buf) < 0) {
+                return -1;
             }
-            
-            Py_INCREF(key);
-            return key;
-        } else {
-            /* Done with this node, pop stack */
-            it->stack_top--;
+            cursor_next(a);
+            continue;
+        }
+        if (cmp > 0) {
+            if (op == WALK_UNION && cursor_emit(b, NULL, buf) < 0) {
+                return -1;
+            }
+            cursor_next(b);
+            continue;
         }
+        if (a->node->duplicates) {
+            /* Each of a's items is matched on its own; a union takes b's
+             * equal items after all of a's */
+            if (op != WALK_DIFFERENCE && cursor_emit(a, NULL, buf) < 0) {
+                return -1;
+            }
+            cursor_next(a);
+            continue;
+        }
+        if (op == WALK_INTERSECTION || (op == WALK_UNION && conflict == CONFLICT_LEFT)) {
+            if (cursor_emit(a, NULL, buf) < 0) {
+                return -1;
+            }
+        }
+        else if (op == WALK_UNION && conflict == CONFLICT_RIGHT) {
+            if (cursor_emit(a, b->node->values[b->idx], buf) < 0) {
+                return -1;
+            }
+        }
+        else if (op == WALK_UNION) {
+            PyObject *key = node_get_key(a->node, a->idx);
+            PyObject *value = NULL;
+            int status;
+
+            if (key != NULL) {
+                value = PyObject_CallFunctionObjArgs(func, key, a->node->values[a->idx],
+                                                     b->node->values[b->idx], NULL);
+                Py_DECREF(key);
+            }
+            if (value == NULL) {
+                return -1;
+            }
+            status = cursor_emit(a, value, buf);
+            Py_DECREF(value);
+            if (status < 0) {
+                return -1;
+            }
+        }
+        cursor_next(a);
+        cursor_next(b);
     }
-    
-    return NULL;  /* Iteration complete */
+
+    for (; a->node != NULL && op != WALK_INTERSECTION; cursor_next(a)) {
+        if (cursor_emit(a, NULL, buf) < 0) {
+            return -1;
+        }
+    }
+    for (; b->node != NULL && op == WALK_UNION; cursor_next(b)) {
+        if (cursor_emit(b, NULL, buf) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Walk self and other and bulk-load the selected pairs into a new tree
+ * with the options of self */
+static PyObject *
+btree_walk_build(PyObject *self, PyObject *other, const char *name, int op,
+                 int conflict, PyObject *func)
+{
+    MergeCursor a, b;
+    PairBuffer buf;
+    PyBTreeObject *result = NULL;
+    int status = -1;
+
+    if (!PyBTree_Check(other)) {
+        PyErr_Format(PyExc_TypeError, "%s() argument must be a SortedDict, not %.200s",
+                     name, Py_TYPE(other)->tp_name);
+        return NULL;
+    }
+    if (op == WALK_UNION && ((PyBTreeObject *)other)->duplicates &&
+        !((PyBTreeObject *)self)->duplicates) {
+        PyErr_Format(PyExc_ValueError,
+                     "%s() of a SortedDict without duplicates needs other without "
+                     "duplicates too", name);
+        return NULL;
+    }
+
+    pairbuf_init(&buf);
+    if (cursor_open(&a, self) == 0 && cursor_open(&b, other) == 0) {
+        status = merge_walk(&a, &b, op, conflict, func, &buf);
+        cursor_close(&b);
+    }
+    cursor_close(&a);
+
+    if (status == 0) {
+        result = btree_new_like((PyBTreeObject *)self);
+        if (result != NULL && btree_load_pairs(result, &buf, BTREE_DEFAULT_FILL_FACTOR) < 0) {
+            Py_CLEAR(result);
+        }
+    }
+    pairbuf_release(&buf);
+    return (PyObject *)result;
+}
+
+PyDoc_STRVAR(btree_merge_doc,
+"merge(other, conflict='right')\n"
+"--\n\n"
+"Return a new SortedDict with the items of this one and of other, a\n"
+"SortedDict. For keys in both, conflict picks the value: 'right' takes\n"
+"other's, as update() would, 'left' keeps this one's, and a callable is\n"
+"called as conflict(key, value, other_value) for the value to store.\n"
+"With duplicates=True nothing conflicts: the result keeps every item of\n"
+"both, this tree's first among equal keys, and conflict is ignored.\n\n"
+"The trees are walked side by side and the result is bulk-loaded, so this\n"
+"takes O(n + m) with no search per key. The result has this tree's options.");
+
+static PyObject *
+btree_merge(PyObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    PyObject *argv[2] = {NULL, NULL};
+    PyObject *func = NULL;
+    int conflict = CONFLICT_RIGHT;
+
+    static const char *const kwlist[] = {"other", "conflict", NULL};
+
+    if (unpack_args("merge", args, nargs, kwnames, kwlist, 1, argv) < 0) {
+        return NULL;
+    }
+    if (argv[1] != NULL && PyUnicode_Check(argv[1])) {
+        if (PyUnicode_CompareWithASCIIString(argv[1], "left") == 0) {
+            conflict = CONFLICT_LEFT;
+        }
+        else if (PyUnicode_CompareWithASCIIString(argv[1], "right") != 0) {
+            PyErr_SetString(PyExc_ValueError,
+                            "conflict must be 'left', 'right' or a callable");
+            return NULL;
+        }
+    }
+    else if (argv[1] != NULL) {
+        if (!PyCallable_Check(argv[1])) {
+            PyErr_Format(PyExc_TypeError,
+                         "merge() argument 'conflict' must be str or callable, not %.200s",
+                         Py_TYPE(argv[1])->tp_name);
+            return NULL;
+        }
+        conflict = CONFLICT_CALL;
+        func = argv[1];
+    }
+    return btree_walk_build(self, argv[0], "merge", WALK_UNION, conflict, func);
+}
+
+PyDoc_STRVAR(btree_intersection_keys_doc,
+"intersection_keys(other, /)\n"
+"--\n\n"
+"Return a new SortedDict with the items of this one whose keys are also\n"
+"in other, a SortedDict. Takes O(n + m) like merge().");
+
+static PyObject *
+btree_intersection_keys(PyObject *self, PyObject *other)
+{
+    return btree_walk_build(self, other, "intersection_keys", WALK_INTERSECTION,
+                            CONFLICT_LEFT, NULL);
+}
+
+PyDoc_STRVAR(btree_difference_keys_doc,
+"difference_keys(other, /)\n"
+"--\n\n"
+"Return a new SortedDict with the items of this one whose keys are not\n"
+"in other, a SortedDict. Takes O(n + m) like merge().");
+
+static PyObject *
+btree_difference_keys(PyObject *self, PyObject *other)
+{
+    return btree_walk_build(self, other, "difference_keys", WALK_DIFFERENCE,
+                            CONFLICT_LEFT, NULL);
+}
+
+/* ==================== __eq__ Comparison ==================== */
+
+/* Walk both trees and compare key by key, stopping at the first difference.
+ * Returns 1 if equal, 0 if not, -1 on error. */
+static int
+btree_items_equal(PyObject *self, PyObject *other)
+{
+    MergeCursor a, b;
+    int result = -1;
+
+    if (cursor_open(&a, self) == 0 && cursor_open(&b, other) == 0) {
+        result = a.size == b.size;
+        while (result == 1 && a.node != NULL) {
+            int cmp = slot_compare(a.node, a.idx, b.node, b.idx);
+            if (cmp == -2) {
+                result = -1;
+            }
+            else if (cmp != 0) {
+                result = 0;
+            }
+            else {
+                result = PyObject_RichCompareBool(a.node->values[a.idx],
+                                                  b.node->values[b.idx], Py_EQ);
+            }
+            cursor_next(&a);
+            cursor_next(&b);
+        }
+        cursor_close(&b);
+    }
+    cursor_close(&a);
+    return result;
+}
+
+static PyObject *
+btree_richcompare(PyObject *self, PyObject *other, int op)
+{
+    int result;
+
+    /* Only support equality/inequality */
+    if (op != Py_EQ && op != Py_NE) {
+        Py_RETURN_NOTIMPLEMENTED;
+    }
+
+    /* Must be comparing two SortedDicts */
+    if (!PyBTree_Check(other)) {
+        if (op == Py_EQ) {
+            Py_RETURN_FALSE;
+        }
+        else {
+            Py_RETURN_TRUE;
+        }
+    }
+
+    result = self == other ? 1 : btree_items_equal(self, other);
+    if (result < 0) {
+        return NULL;
+    }
+
+    if (op == Py_EQ) {
+        return PyBool_FromLong(result);
+    }
+    else {
+        return PyBool_FromLong(!result);
+    }
+}
+
+/* ==================== Serialization ==================== */
+
+/* Pickling and dump() both store the keys and the values of a tree in key
+ * order, and both rebuild it with the bottom-up builder. Typed trees store
+ * their keys as packed little-endian int64 or float64 values instead of
+ * key objects, so loading them creates no key objects at all.
+ *
+ * dump() writes a header followed by the key and value sections:
+ *
+ *   0   magic "BTREEDCT"
+ *   8   u32 format version (DUMP_VERSION)
+ *   12  u32 order
+ *   16  u8 key storage (KEYS_*), u8 flags (DUMP_BPLUS, DUMP_EYTZINGER, DUMP_DUPLICATES,
+ *       DUMP_PAIRS), u16 and u32 zero
+ *   24  u64 number of items
+ *   32  u64 bytes of the key section
+ *   40  u64 bytes of the value section
+ *   48  keys: 8 bytes per key for typed trees, else a pickled list
+ *       values: a pickled list
+ *
+ * All header fields are little-endian. */
+#define DUMP_MAGIC "BTREEDCT"
+#define DUMP_VERSION 1
+#define DUMP_HEADER_SIZE 48
+#define DUMP_BPLUS 1
+#define DUMP_EYTZINGER 2
+#define DUMP_DUPLICATES 4
+#define DUMP_PAIRS 8
+
+static void
+dump_put(unsigned char *p, unsigned long long v, int n)
+{
+    int i;
+    for (i = 0; i < n; i++) {
+        p[i] = (unsigned char)(v >> (8 * i));
+    }
+}
+
+static unsigned long long
+dump_get(const unsigned char *p, int n)
+{
+    unsigned long long v = 0;
+    int i;
+    for (i = n - 1; i >= 0; i--) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+#if PY_BIG_ENDIAN
+/* Reverse the byte order of n 8-byte keys, converting between the host's
+ * and the stored byte order on big-endian machines */
+static void
+native_keys_swap(char *data, Py_ssize_t n)
+{
+    Py_ssize_t i;
+    int j;
+
+    for (i = 0; i < n; i++, data += 8) {
+        for (j = 0; j < 4; j++) {
+            char c = data[j];
+            data[j] = data[7 - j];
+            data[7 - j] = c;
+        }
+    }
+}
+#endif
+
+/* Return the keys of the read-only tree btree: a bytes object of packed
+ * little-endian native keys for typed trees, else a list */
+static PyObject *
+btree_state_keys(PyBTreeObject *btree)
+{
+    PyObject *bytes;
+    ArrayWriter w;
+
+    if (btree->key_storage < KEYS_I64) {
+        return PyBTree_Keys((PyObject *)btree);
+    }
+    bytes = PyBytes_FromStringAndSize(NULL, btree->size * 8);
+    if (bytes == NULL) {
+        return NULL;
+    }
+    w.data = PyBytes_AS_STRING(bytes);
+    w.pos = 0;
+    w.dtype = btree->key_storage == KEYS_I64 ? ARRAY_INT64 : ARRAY_FLOAT64;
+    w.keys = 1;
+    if (btree->size > 0 && array_fill(&w, btree->root, 0, btree->size) < 0) {
+        Py_DECREF(bytes);
+        return NULL;
+    }
+#if PY_BIG_ENDIAN
+    native_keys_swap(w.data, btree->size);
+#endif
+    return bytes;
+}
+
+/* Fill the empty tree btree with n items: keys is a list of key objects or
+ * NULL, in which case typed trees take the packed little-endian keys at
+ * data. values is a list of n values. Raises ValueError unless the keys are
+ * strictly ascending (ascending with duplicates), as they are in any state
+ * this module writes. */
+static int
+btree_load_state(PyBTreeObject *btree, PyObject *keys, const char *data, Py_ssize_t n,
+                 PyObject *values)
+{
+    const char *invalid = btree->duplicates ? "SortedDict state keys are not ascending"
+                                            : "SortedDict state keys are not strictly ascending";
+    NativeKey *nkeys = NULL;
+    PyBTreeNode *root;
+    Py_ssize_t i;
+
+    if (!PyList_Check(values) || PyList_GET_SIZE(values) != n ||
+        (keys != NULL && (!PyList_Check(keys) || PyList_GET_SIZE(keys) != n))) {
+        PyErr_SetString(PyExc_ValueError, "SortedDict state has mismatched keys and values");
+        return -1;
+    }
+    if (keys != NULL) {
+        /* btree_load_pairs() checks the order of the key objects */
+        PairBuffer buf;
+        int status = 0;
+
+        pairbuf_init(&buf);
+        buf.duplicates = btree->duplicates;
+        if (pairbuf_reserve(&buf, n) < 0) {
+            return -1;
+        }
+        for (i = 0; i < n && status == 0; i++) {
+            status = pairbuf_append(&buf, PyList_GET_ITEM(keys, i), PyList_GET_ITEM(values, i));
+        }
+        if (status == 0 && !buf.sorted) {
+            PyErr_SetString(PyExc_ValueError, invalid);
+            status = -1;
+        }
+        if (status == 0) {
+            status = btree_load_pairs(btree, &buf, BTREE_DEFAULT_FILL_FACTOR);
+        }
+        pairbuf_release(&buf);
+        return status;
+    }
+
+    if (btree->key_storage < KEYS_I64) {
+        PyErr_SetString(PyExc_ValueError, "SortedDict state needs key objects");
+        return -1;
+    }
+    if (n > 0) {
+        nkeys = PyMem_Malloc(n * sizeof(NativeKey));
+        if (nkeys == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        memcpy(nkeys, data, n * sizeof(NativeKey));
+#if PY_BIG_ENDIAN
+        native_keys_swap((char *)nkeys, n);
+#endif
+    }
+    for (i = 0; i < n; i++) {
+        int bad = btree->key_storage == KEYS_I64
+            ? i > 0 && (btree->duplicates ? nkeys[i - 1].i64 > nkeys[i].i64
+                                          : nkeys[i - 1].i64 >= nkeys[i].i64)
+            : Py_IS_NAN(nkeys[i].f64) ||
+              (i > 0 && (btree->duplicates ? nkeys[i - 1].f64 > nkeys[i].f64
+                                           : nkeys[i - 1].f64 >= nkeys[i].f64));
+        if (bad) {
+            PyMem_Free(nkeys);
+            PyErr_SetString(PyExc_ValueError, invalid);
+            return -1;
+        }
+    }
+    root = (btree->bplus ? bplus_bulk_build : bulk_build)(
+        btree->order, BTREE_KEY_SPEC(btree), NULL, nkeys,
+        n > 0 ? &PyList_GET_ITEM(values, 0) : NULL, n, BTREE_DEFAULT_FILL_FACTOR);
+    PyMem_Free(nkeys);
+    if (root == NULL) {
+        return -1;
+    }
+    NODE_SETREF(btree->root, root);
+    btree->size = n;
+    return 0;
+}
+
+/* Call pickle.<name>(arg, ...) */
+static PyObject *
+pickle_call(const char *name, PyObject *arg, int dumps)
+{
+    PyObject *pickle = PyImport_ImportModule("pickle");
+    PyObject *result;
+
+    if (pickle == NULL) {
+        return NULL;
+    }
+    result = dumps ? PyObject_CallMethod(pickle, name, "Oi", arg, -1)
+                   : PyObject_CallMethod(pickle, name, "O", arg);
+    Py_DECREF(pickle);
+    return result;
+}
+
+PyDoc_STRVAR(btree_reduce_doc,
+"__reduce__()\n"
+"--\n\n"
+"Return the pickle state: the constructor options and the keys and values\n"
+"in key order, which __setstate__() bulk-loads. Typed trees pickle their\n"
+"keys as packed bytes.");
+
+static PyObject *
+btree_reduce(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+    PyBTreeObject *btree = (PyBTreeObject *)self;
+    const char *key_type = btree_key_type_name(btree);
+    PyObject *pin, *keys, *values = NULL, *aggregate = NULL, *result = NULL;
+
+    pin = btree_pin(self);
+    if (pin == NULL) {
+        return NULL;
+    }
+    keys = btree_state_keys((PyBTreeObject *)pin);
+    if (keys != NULL) {
+        values = PyBTree_Values(pin);
+    }
+    if (values != NULL) {
+        aggregate = btree_aggregate_arg(btree);
+    }
+    if (aggregate != NULL) {
+        result = Py_BuildValue("O(iOszsOOnO)(OO)", (PyObject *)Py_TYPE(self),
+                               btree->order, btree->cache_i64 ? Py_True : Py_False,
+                               btree->bplus ? "bplus" : "btree", key_type,
+                               btree->eytzinger ? "eytzinger" : "sorted", aggregate,
+                               btree->duplicates ? Py_True : Py_False, btree->wbuf_size,
+                               btree->cache_pairs ? Py_True : Py_False, keys, values);
+    }
+    Py_XDECREF(keys);
+    Py_XDECREF(values);
+    Py_XDECREF(aggregate);
+    Py_DECREF(pin);
+    return result;
 }
 
+PyDoc_STRVAR(btree_setstate_doc,
+"__setstate__(state, /)\n"
+"--\n\n"
+"Replace the contents with a state returned by __reduce__().");
+
 static PyObject *
-btreeiter_len(PyObject *self, PyObject *Py_UNUSED(ignored))
+btree_setstate(PyObject *self, PyObject *state)
 {
-    PyBTreeIterObject *it = (PyBTreeIterObject *)self;
-    return PyLong_FromSsize_t(it->remaining > 0 ? it->remaining : 0);
-}
+    PyBTreeObject *btree = (PyBTreeObject *)self;
+    PyObject *keys, *values;
+    Py_buffer view;
+    int status;
 
-static PyMethodDef btreeiter_methods[] = {
-    {"__length_hint__", btreeiter_len, METH_NOARGS, "Private method returning estimate of len(list(it))."},
-    {NULL, NULL, 0, NULL}
-};
+    if (!PyTuple_Check(state) || PyTuple_GET_SIZE(state) != 2) {
+        PyErr_SetString(PyExc_TypeError, "SortedDict state must be a (keys, values) tuple");
+        return NULL;
+    }
+    if (btree_begin_write(btree) < 0) {
+        return NULL;
+    }
+    keys = PyTuple_GET_ITEM(state, 0);
+    values = PyTuple_GET_ITEM(state, 1);
+    btree_clear_internal(btree);
 
-static PyTypeObject PyBTreeIter_Type = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    "btree_iterator",                           /* tp_name */
-    sizeof(PyBTreeIterObject),                  /* tp_basicsize */
-    0,                                          /* tp_itemsize */
-    btreeiter_dealloc,                          /* tp_dealloc */
-    0,                                          /* tp_vectorcall_offset */
-    0,                                          /* tp_getattr */
-    0,                                          /* tp_setattr */
-    0,                                          /* tp_as_async */
-    0,                                          /* tp_repr */
-    0,                                          /* tp_as_number */
-    0,                                          /* tp_as_sequence */
-    0,                                          /* tp_as_mapping */
-    0,                                          /* tp_hash */
-    0,                                          /* tp_call */
-    0,                                          /* tp_str */
-    PyObject_GenericGetAttr,                    /* tp_getattro */
-    0,                                          /* tp_setattro */
-    0,                                          /* tp_as_buffer */
-    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,    /* tp_flags */
-    0,                                          /* tp_doc */
-    btreeiter_traverse,                         /* tp_traverse */
-    0,                                          /* tp_clear */
-    0,                                          /* tp_richcompare */
-    0,                                          /* tp_weaklistoffset */
-    PyObject_SelfIter,                          /* tp_iter */
-    btreeiter_next,                             /* tp_iternext */
-    btreeiter_methods,                          /* tp_methods */
-    0,                                          /* tp_members */
-};
+    if (PyList_Check(keys)) {
+        status = btree_load_state(btree, keys, NULL, PyList_GET_SIZE(keys), values);
+    }
+    else {
+        if (PyObject_GetBuffer(keys, &view, PyBUF_SIMPLE) < 0) {
+            return NULL;
+        }
+        if (view.len % 8 != 0) {
+            PyErr_SetString(PyExc_ValueError, "SortedDict state keys must be 8 bytes each");
+            status = -1;
+        }
+        else {
+            status = btree_load_state(btree, NULL, view.buf, view.len / 8, values);
+        }
+        PyBuffer_Release(&view);
+    }
+    if (status < 0) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(btree_dump_doc,
+"dump(file, /)\n"
+"--\n\n"
+"Write the tree to file, an object with a write() method taking bytes,\n"
+"in the format SortedDict.load() reads. Keys of typed trees are written\n"
+"as packed 8-byte values; key objects and values are pickled, so only\n"
+"load() the result from a source you trust (see SortedDict.load()).");
 
 static PyObject *
-btree_iter(PyObject *self)
+btree_dump(PyObject *self, PyObject *file)
 {
     PyBTreeObject *btree = (PyBTreeObject *)self;
-    PyBTreeIterObject *it;
+    unsigned char header[DUMP_HEADER_SIZE];
+    PyObject *pin, *keys = NULL, *values = NULL, *chunks[3] = {NULL, NULL, NULL};
+    PyObject *result = NULL;
+    int i;
 
-    it = PyObject_GC_New(PyBTreeIterObject, &PyBTreeIter_Type);
-    if (it == NULL) {
+    pin = btree_pin(self);
+    if (pin == NULL) {
         return NULL;
     }
-
-    Py_INCREF(btree);
-    it->btree = btree;
-    it->remaining = btree->size;
-    it->leaf_only = 0;
-    it->leaf = NULL;
-    it->leaf_index = 0;
-    it->stack_top = -1;  /* Empty stack */
-
-    /* Initialize by descending to leftmost leaf */
-    if (btree->root != NULL && btree->root->n_keys > 0) {
-        if (btree->root->is_leaf) {
-            it->leaf_only = 1;
-            it->leaf = btree->root;
+    keys = btree_state_keys((PyBTreeObject *)pin);
+    if (keys != NULL) {
+        values = PyBTree_Values(pin);
+    }
+    if (values == NULL) {
+        goto done;
+    }
+    if (PyList_Check(keys)) {
+        Py_SETREF(keys, pickle_call("dumps", keys, 1));
+        if (keys == NULL) {
+            goto done;
         }
-        else {
-            iter_descend_left(it, btree->root);
+    }
+    Py_SETREF(values, pickle_call("dumps", values, 1));
+    if (values == NULL) {
+        goto done;
+    }
+
+    memset(header, 0, sizeof(header));
+    memcpy(header, DUMP_MAGIC, 8);
+    dump_put(header + 8, DUMP_VERSION, 4);
+    dump_put(header + 12, (unsigned long long)btree->order, 4);
+    header[16] = (unsigned char)btree->key_storage;
+    header[17] = (btree->bplus ? DUMP_BPLUS : 0) | (btree->eytzinger ? DUMP_EYTZINGER : 0) |
+                 (btree->duplicates ? DUMP_DUPLICATES : 0) |
+                 (btree->cache_pairs ? DUMP_PAIRS : 0);
+    dump_put(header + 24, (unsigned long long)((PyBTreeObject *)pin)->size, 8);
+    dump_put(header + 32, (unsigned long long)PyBytes_GET_SIZE(keys), 8);
+    dump_put(header + 40, (unsigned long long)PyBytes_GET_SIZE(values), 8);
+
+    chunks[0] = PyBytes_FromStringAndSize((const char *)header, sizeof(header));
+    if (chunks[0] == NULL) {
+        goto done;
+    }
+    chunks[1] = keys;
+    chunks[2] = values;
+    for (i = 0; i < 3; i++) {
+        PyObject *written = PyObject_CallMethod(file, "write", "O", chunks[i]);
+        if (written == NULL) {
+            goto done;
         }
+        Py_DECREF(written);
     }
+    Py_INCREF(Py_None);
+    result = Py_None;
 
-    PyObject_GC_Track((PyObject *)it);
-    return (PyObject *)it;
+done:
+    Py_XDECREF(chunks[0]);
+    Py_XDECREF(keys);
+    Py_XDECREF(values);
+    Py_DECREF(pin);
+    return result;
 }
 
-/* ==================== Reversed Iterator ==================== */
-
-typedef struct {
-    PyObject_HEAD
-    PyBTreeObject *btree;           /* The B-tree being iterated */
-    Py_ssize_t remaining;           /* Items remaining for length hint */
-    int leaf_only;                  /* Fast path when root is a leaf */
-    PyBTreeNode *leaf;              /* Leaf node for fast path */
-    Py_ssize_t leaf_index;          /* Next index in leaf */
-    Py_ssize_t stack_top;           /* Top of stack (-1 = empty) */
-    IterStackFrame stack[ITER_STACK_SIZE];  /* Stack for tree traversal */
-} PyBTreeReverseIterObject;
+/* Build a tree of type cls from the dump() image in data[0:len] */
+static PyObject *
+btree_from_dump(PyObject *cls, const char *data, Py_ssize_t len)
+{
+    const unsigned char *h = (const unsigned char *)data;
+    unsigned long long count, keys_len, values_len;
+    int key_storage, flags;
+    PyObject *kwds, *tree = NULL, *keys = NULL, *values = NULL, *view;
+    const char *key_type = NULL;
+
+    if (len < DUMP_HEADER_SIZE || memcmp(data, DUMP_MAGIC, 8) != 0) {
+        PyErr_SetString(PyExc_ValueError, "not a SortedDict dump");
+        return NULL;
+    }
+    if (dump_get(h + 8, 4) != DUMP_VERSION) {
+        PyErr_Format(PyExc_ValueError, "unsupported SortedDict dump version %llu",
+                     dump_get(h + 8, 4));
+        return NULL;
+    }
+    key_storage = h[16];
+    flags = h[17];
+    count = dump_get(h + 24, 8);
+    keys_len = dump_get(h + 32, 8);
+    values_len = dump_get(h + 40, 8);
+    if (key_storage > KEYS_F64 || dump_get(h + 12, 4) > INT_MAX ||
+        keys_len > (unsigned long long)(len - DUMP_HEADER_SIZE) ||
+        values_len != (unsigned long long)(len - DUMP_HEADER_SIZE) - keys_len ||
+        (key_storage >= KEYS_I64 && keys_len != count * 8) ||
+        count > (unsigned long long)PY_SSIZE_T_MAX / 8) {
+        PyErr_SetString(PyExc_ValueError, "corrupt or truncated SortedDict dump");
+        return NULL;
+    }
+    if (key_storage == KEYS_I64) {
+        key_type = "i64";
+    }
+    else if (key_storage == KEYS_F64) {
+        key_type = "f64";
+    }
 
-static PyTypeObject PyBTreeReverseIter_Type;
+    kwds = Py_BuildValue("{s:i,s:O,s:s,s:z,s:s,s:O,s:O}", "order", (int)dump_get(h + 12, 4),
+                         "cache_i64", key_storage == KEYS_CACHED ? Py_True : Py_False,
+                         "layout", flags & DUMP_BPLUS ? "bplus" : "btree",
+                         "key_type", key_type,
+                         "key_layout", flags & DUMP_EYTZINGER ? "eytzinger" : "sorted",
+                         "duplicates", flags & DUMP_DUPLICATES ? Py_True : Py_False,
+                         "cache_pairs", flags & DUMP_PAIRS ? Py_True : Py_False);
+    if (kwds == NULL) {
+        return NULL;
+    }
+    tree = PyObject_VectorcallDict(cls, NULL, 0, kwds);
+    Py_DECREF(kwds);
+    if (tree == NULL) {
+        return NULL;
+    }
+    if (!PyBTree_Check(tree)) {
+        PyErr_Format(PyExc_TypeError, "load() expected %s to construct a SortedDict",
+                     ((PyTypeObject *)cls)->tp_name);
+        goto error;
+    }
 
-/* Push a node onto the stack and descend to rightmost leaf */
-static void
-iter_descend_right(PyBTreeReverseIterObject *it, PyBTreeNode *node)
-{
-    while (node != NULL) {
-        it->stack_top++;
-        it->stack[it->stack_top].node = node;
-        it->stack[it->stack_top].key_idx = node->n_keys - 1;
-        
-        if (node->is_leaf) {
-            break;
+    /* Unpickle straight from the file image */
+    view = PyMemoryView_FromMemory((char *)data + DUMP_HEADER_SIZE + keys_len,
+                                   (Py_ssize_t)values_len, PyBUF_READ);
+    if (view == NULL) {
+        goto error;
+    }
+    values = pickle_call("loads", view, 0);
+    Py_DECREF(view);
+    if (values == NULL) {
+        goto error;
+    }
+    if (key_storage < KEYS_I64) {
+        view = PyMemoryView_FromMemory((char *)data + DUMP_HEADER_SIZE,
+                                       (Py_ssize_t)keys_len, PyBUF_READ);
+        if (view == NULL) {
+            goto error;
+        }
+        keys = pickle_call("loads", view, 0);
+        Py_DECREF(view);
+        if (keys == NULL) {
+            goto error;
         }
-        node = node->children[node->n_keys];
     }
+    if (btree_load_state((PyBTreeObject *)tree, keys, data + DUMP_HEADER_SIZE,
+                         (Py_ssize_t)count, values) < 0) {
+        goto error;
+    }
+    Py_XDECREF(keys);
+    Py_DECREF(values);
+    return tree;
+
+error:
+    Py_XDECREF(keys);
+    Py_XDECREF(values);
+    Py_DECREF(tree);
+    return NULL;
 }
 
+/* Call obj.close(), fetching its error into *type, *value and *traceback
+ * unless an earlier one is held there already */
 static void
-btreereviter_dealloc(PyObject *self)
+close_keeping_error(PyObject *obj, PyObject **type, PyObject **value, PyObject **traceback)
 {
-    PyBTreeReverseIterObject *it = (PyBTreeReverseIterObject *)self;
-    PyObject_GC_UnTrack(self);
-    Py_XDECREF(it->btree);
-    PyObject_GC_Del(self);
-}
+    PyObject *closed = PyObject_CallMethod(obj, "close", NULL);
 
-static int
-btreereviter_traverse(PyObject *self, visitproc visit, void *arg)
-{
-    PyBTreeReverseIterObject *it = (PyBTreeReverseIterObject *)self;
-    Py_VISIT(it->btree);
-    return 0;
+    if (closed != NULL) {
+        Py_DECREF(closed);
+    }
+    else if (*type == NULL) {
+        PyErr_Fetch(type, value, traceback);
+    }
+    else {
+        PyErr_Clear();
+    }
 }
 
+PyDoc_STRVAR(btree_load_doc,
+"load(path, mmap=True)\n"
+"--\n\n"
+"Read a tree written by dump() from the file at path.\n\n"
+"With mmap=True the file is memory-mapped and the tree is built straight\n"
+"from the mapped pages instead of from a copy of the file read into\n"
+"memory. The keys of typed trees are copied into the nodes without\n"
+"creating key objects. Raises ValueError for a file that is not a dump.\n\n"
+"Warning: the key objects and values in the file are unpickled, so load()\n"
+"is not secure. It is possible to construct a malicious file that will\n"
+"execute arbitrary code when loaded. Only load files you trust, never one\n"
+"that could have come from an untrusted source or been tampered with.");
+
 static PyObject *
-btreereviter_next(PyObject *self)
+btree_load(PyObject *cls, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
 {
-    PyBTreeReverseIterObject *it = (PyBTreeReverseIterObject *)self;
-
-    if (it->leaf_only) {
-        if (it->leaf_index >= 0) {
-            PyObject *key = it->leaf->keys[it->leaf_index--];
-            it->remaining--;
-            Py_INCREF(key);
-            return key;
-        }
+    static const char *const kwlist[] = {"path", "mmap", NULL};
+    PyObject *argv[2] = {NULL, NULL};
+    PyObject *file, *image = NULL, *result = NULL;
+    PyObject *type = NULL, *value = NULL, *traceback = NULL;
+    Py_buffer view;
+    int use_mmap = 1;
+
+    if (unpack_args("load", args, nargs, kwnames, kwlist, 1, argv) < 0 ||
+        arg_bool(argv[1], &use_mmap) < 0) {
         return NULL;
     }
-    
-    while (it->stack_top >= 0) {
-        IterStackFrame *frame = &it->stack[it->stack_top];
-        PyBTreeNode *node = frame->node;
-        
-        if (frame->key_idx >= 0) {
-            /* Return current key and move backwards */
-            PyObject *key = node->keys[frame->key_idx];
-            Py_ssize_t child_idx = frame->key_idx;
-            frame->key_idx--;
-            it->remaining--;
-            
-            /* If not a leaf, descend into left child of this key */
-            if (!node->is_leaf) {
-                iter_descend_right(it, node->children[child_idx]);
+    file = PyObject_CallMethod(PyImport_AddModule("builtins"), "open", "Os", argv[0], "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+
+    if (use_mmap) {
+        PyObject *mmap = PyImport_ImportModule("mmap");
+        PyObject *fileno = mmap ? PyObject_CallMethod(file, "fileno", NULL) : NULL;
+        PyObject *size = fileno ? PyObject_CallMethod(file, "seek", "ii", 0, 2) : NULL;
+
+        /* mmap() refuses empty files, which are not dumps anyway */
+        if (size != NULL && PyLong_AsSsize_t(size) == 0) {
+            image = PyBytes_FromStringAndSize(NULL, 0);
+        }
+        else if (size != NULL) {
+            PyObject *ctor = PyObject_GetAttrString(mmap, "mmap");
+            PyObject *access = ctor ? PyObject_GetAttrString(mmap, "ACCESS_READ") : NULL;
+            PyObject *kwds = access ? Py_BuildValue("{s:O}", "access", access) : NULL;
+            PyObject *ctor_args = kwds ? Py_BuildValue("(Oi)", fileno, 0) : NULL;
+
+            if (ctor_args != NULL) {
+                image = PyObject_Call(ctor, ctor_args, kwds);
             }
-            
-            Py_INCREF(key);
-            return key;
-        } else {
-            /* Done with this node, pop stack */
-            it->stack_top--;
+            Py_XDECREF(ctor_args);
+            Py_XDECREF(kwds);
+            Py_XDECREF(access);
+            Py_XDECREF(ctor);
         }
+        Py_XDECREF(size);
+        Py_XDECREF(fileno);
+        Py_XDECREF(mmap);
     }
-    
-    return NULL;  /* Iteration complete */
+    else {
+        image = PyObject_CallMethod(file, "read", NULL);
+    }
+
+    if (image != NULL && PyObject_GetBuffer(image, &view, PyBUF_SIMPLE) == 0) {
+        result = btree_from_dump(cls, view.buf, view.len);
+        PyBuffer_Release(&view);
+    }
+
+    /* Close the map and the file now rather than when they are collected,
+     * keeping the first error */
+    if (result == NULL) {
+        PyErr_Fetch(&type, &value, &traceback);
+    }
+    if (image != NULL && !PyBytes_Check(image)) {
+        close_keeping_error(image, &type, &value, &traceback);
+    }
+    close_keeping_error(file, &type, &value, &traceback);
+    Py_XDECREF(image);
+    Py_DECREF(file);
+    if (type != NULL) {
+        Py_CLEAR(result);
+        PyErr_Restore(type, value, traceback);
+    }
+    return result;
 }
 
+/* ==================== peekitem Method ==================== */
+
+PyDoc_STRVAR(btree_peekitem_doc,
+"peekitem(index=-1, /)\n"
+"--\n\n"
+"Return (key, value) pair at index. Default is the last (maximum) item.\n"
+"Raises IndexError if the B-tree is empty or index is out of range.\n\n"
+"Negative indices count from the end. Any index is found in O(log n).");
+
 static PyObject *
-btreereviter_len(PyObject *self, PyObject *Py_UNUSED(ignored))
+btree_peekitem(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
 {
-    PyBTreeReverseIterObject *it = (PyBTreeReverseIterObject *)self;
-    return PyLong_FromSsize_t(it->remaining > 0 ? it->remaining : 0);
+    PyBTreeObject *btree = (PyBTreeObject *)self;
+    Py_ssize_t index = -1;
+    PyBTreeNode *node;
+    Py_ssize_t idx;
+
+    if (check_nargs("peekitem", nargs, 0, 1) < 0) {
+        return NULL;
+    }
+    if (nargs > 0) {
+        index = PyNumber_AsSsize_t(args[0], PyExc_OverflowError);
+        if (index == -1 && PyErr_Occurred()) {
+            return NULL;
+        }
+    }
+
+    if (BTREE_FLUSH(btree)) {
+        return NULL;
+    }
+    if (btree->size == 0) {
+        PyErr_SetString(PyExc_IndexError, "peekitem from empty B-tree");
+        return NULL;
+    }
+    index = btree_normalize_index(btree, index, "peekitem");
+    if (index < 0) {
+        return NULL;
+    }
+
+    node = node_select(btree->root, index, &idx);
+    return node_get_item(node, idx);
 }
 
-static PyMethodDef btreereviter_methods[] = {
-    {"__length_hint__", btreereviter_len, METH_NOARGS, "Private method returning estimate of len(list(it))."},
-    {NULL, NULL, 0, NULL}
-};
+/* ==================== popitem Method ==================== */
 
-static PyTypeObject PyBTreeReverseIter_Type = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    "btree_reverseiterator",                    /* tp_name */
-    sizeof(PyBTreeReverseIterObject),           /* tp_basicsize */
-    0,                                          /* tp_itemsize */
-    btreereviter_dealloc,                       /* tp_dealloc */
-    0,                                          /* tp_vectorcall_offset */
-    0,                                          /* tp_getattr */
-    0,                                          /* tp_setattr */
-    0,                                          /* tp_as_async */
-    0,                                          /* tp_repr */
-    0,                                          /* tp_as_number */
-    0,                                          /* tp_as_sequence */
-    0,                                          /* tp_as_mapping */
-    0,                                          /* tp_hash */
-    0,                                          /* tp_call */
-    0,                                          /* tp_str */
-    PyObject_GenericGetAttr,                    /* tp_getattro */
-    0,                                          /* tp_setattro */
-    0,                                          /* tp_as_buffer */
-    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,    /* tp_flags */
-    0,                                          /* tp_doc */
-    btreereviter_traverse,                      /* tp_traverse */
-    0,                                          /* tp_clear */
-    0,                                          /* tp_richcompare */
-    0,                                          /* tp_weaklistoffset */
-    PyObject_SelfIter,                          /* tp_iter */
-    btreereviter_next,                          /* tp_iternext */
-    btreereviter_methods,                       /* tp_methods */
-    0,                                          /* tp_members */
-};
+PyDoc_STRVAR(btree_popitem_doc,
+"popitem(index=-1, /)\n"
+"--\n\n"
+"Remove and return (key, value) pair at index. Default is the last (maximum) item.\n"
+"Raises KeyError if the B-tree is empty and IndexError if index is out of\n"
+"range. Negative indices count from the end. O(log n).");
 
 static PyObject *
-btree_reversed(PyObject *self, PyObject *Py_UNUSED(ignored))
+btree_popitem(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
 {
     PyBTreeObject *btree = (PyBTreeObject *)self;
-    PyBTreeReverseIterObject *it;
+    Py_ssize_t index = -1;
+    Py_ssize_t idx;
+    PyBTreeNode *node;
+    PyObject *result;
+    int status;
 
-    it = PyObject_GC_New(PyBTreeReverseIterObject, &PyBTreeReverseIter_Type);
-    if (it == NULL) {
+    if (check_nargs("popitem", nargs, 0, 1) < 0) {
         return NULL;
     }
+    if (nargs > 0) {
+        index = PyNumber_AsSsize_t(args[0], PyExc_OverflowError);
+        if (index == -1 && PyErr_Occurred()) {
+            return NULL;
+        }
+    }
 
-    Py_INCREF(btree);
-    it->btree = btree;
-    it->remaining = btree->size;
-    it->leaf_only = 0;
-    it->leaf = NULL;
-    it->leaf_index = -1;
-    it->stack_top = -1;  /* Empty stack */
+    if (BTREE_FLUSH(btree)) {
+        return NULL;
+    }
+    if (btree->size == 0) {
+        PyErr_SetString(PyExc_KeyError, "popitem(): B-tree is empty");
+        return NULL;
+    }
+    index = btree_normalize_index(btree, index, "popitem");
+    if (index < 0) {
+        return NULL;
+    }
 
-    /* Initialize by descending to rightmost leaf */
-    if (btree->root != NULL && btree->root->n_keys > 0) {
-        if (btree->root->is_leaf) {
-            it->leaf_only = 1;
-            it->leaf = btree->root;
-            it->leaf_index = btree->root->n_keys - 1;
-        }
-        else {
-            iter_descend_right(it, btree->root);
-        }
+    /* Hold the pair before deleting */
+    node = node_select(btree->root, index, &idx);
+    result = node_get_item(node, idx);
+    if (result == NULL) {
+        return NULL;
     }
 
-    PyObject_GC_Track((PyObject *)it);
-    return (PyObject *)it;
+    /* With duplicates the key may name an earlier item */
+    if (btree->duplicates) {
+        status = btree_begin_write(btree) < 0 ? -1 : btree_delete_rank(btree, index);
+    }
+    else {
+        status = PyBTree_Delete(self, PyTuple_GET_ITEM(result, 0));
+    }
+    if (status < 0) {
+        Py_DECREF(result);
+        return NULL;
+    }
+    return result;
 }
 
-/* ==================== Range Iterator (irange) ==================== */
+/* ==================== Keys, Values and Items Views ==================== */
+
+/* keys(), values() and items() return live views over the tree instead of
+ * materialized lists. They iterate the nodes directly, index by position
+ * through the subtree counts and compare equal to lists holding the same
+ * entries in order. The keys view is also set-like.
+ */
 
 typedef struct {
     PyObject_HEAD
-    PyBTreeObject *btree;           /* The B-tree being iterated */
-    PyObject *min_key;              /* Minimum key (inclusive), NULL for no min */
-    PyObject *max_key;              /* Maximum key (exclusive), NULL for no max */
-    int inclusive_min;              /* Include min_key */
-    int inclusive_max;              /* Include max_key */
-    int leaf_only;                   /* Fast path when root is a leaf */
-    PyBTreeNode *leaf;               /* Leaf node for fast path */
-    Py_ssize_t leaf_index;           /* Next index in leaf */
-    Py_ssize_t stack_top;           /* Top of stack (-1 = empty) */
-    IterStackFrame stack[ITER_STACK_SIZE];  /* Stack for tree traversal */
-    int started;                    /* Whether iteration has started */
-} PyBTreeRangeIterObject;
+    PyBTreeObject *btree;           /* The B-tree being viewed */
+    int kind;                       /* ITER_KEYS, ITER_VALUES or ITER_ITEMS */
+} PyBTreeViewObject;
 
-static PyTypeObject PyBTreeRangeIter_Type;
+static PyTypeObject PyBTreeKeysView_Type;
+static PyTypeObject PyBTreeValuesView_Type;
+static PyTypeObject PyBTreeItemsView_Type;
+
+#define PyBTreeView_Check(op) \
+    (Py_IS_TYPE((op), &PyBTreeKeysView_Type) || \
+     Py_IS_TYPE((op), &PyBTreeValuesView_Type) || \
+     Py_IS_TYPE((op), &PyBTreeItemsView_Type))
+
+static PyObject *
+btree_view_new(PyObject *btree, int kind)
+{
+    PyTypeObject *type;
+    PyBTreeViewObject *view;
+
+    if (kind == ITER_KEYS) {
+        type = &PyBTreeKeysView_Type;
+    }
+    else if (kind == ITER_VALUES) {
+        type = &PyBTreeValuesView_Type;
+    }
+    else {
+        type = &PyBTreeItemsView_Type;
+    }
+
+    view = PyObject_GC_New(PyBTreeViewObject, type);
+    if (view == NULL) {
+        return NULL;
+    }
+    Py_INCREF(btree);
+    view->btree = (PyBTreeObject *)btree;
+    view->kind = kind;
+    PyObject_GC_Track((PyObject *)view);
+    return (PyObject *)view;
+}
 
 static void
-btreerangeiter_dealloc(PyObject *self)
+btreeview_dealloc(PyObject *self)
 {
-    PyBTreeRangeIterObject *it = (PyBTreeRangeIterObject *)self;
+    PyBTreeViewObject *view = (PyBTreeViewObject *)self;
     PyObject_GC_UnTrack(self);
-    Py_XDECREF(it->btree);
-    Py_XDECREF(it->min_key);
-    Py_XDECREF(it->max_key);
+    Py_XDECREF(view->btree);
     PyObject_GC_Del(self);
 }
 
 static int
-btreerangeiter_traverse(PyObject *self, visitproc visit, void *arg)
+btreeview_traverse(PyObject *self, visitproc visit, void *arg)
 {
-    PyBTreeRangeIterObject *it = (PyBTreeRangeIterObject *)self;
-    Py_VISIT(it->btree);
-    Py_VISIT(it->min_key);
-    Py_VISIT(it->max_key);
+    PyBTreeViewObject *view = (PyBTreeViewObject *)self;
+    Py_VISIT(view->btree);
     return 0;
 }
 
-/* Descend to first key >= min_key (or leftmost if no min) */
-static void
-range_iter_descend_to_start(PyBTreeRangeIterObject *it, PyBTreeNode *node)
+static Py_ssize_t
+btreeview_length(PyObject *self)
 {
-    while (node != NULL) {
-        it->stack_top++;
-        it->stack[it->stack_top].node = node;
-        
-        if (it->min_key == NULL) {
-            /* No minimum, start from leftmost */
-            it->stack[it->stack_top].key_idx = 0;
-            if (node->is_leaf) {
-                break;
-            }
-            node = node->children[0];
-        } else {
-            /* Find position where keys >= min_key */
-            int found;
-            Py_ssize_t idx = node_search_key(node, it->min_key, &found);
-            if (idx < 0) {
-                return;  /* Error */
-            }
-            
-            if (found && !it->inclusive_min) {
-                /* Found exact match but not inclusive, move to next */
-                idx++;
-            }
-            
-            it->stack[it->stack_top].key_idx = idx;
-            
-            if (node->is_leaf) {
-                break;
-            }
-            
-            /* Descend to appropriate child */
-            if (found && !it->inclusive_min) {
-                if (idx <= node->n_keys) {
-                    node = node->children[idx];
-                } else {
-                    break;
-                }
-            } else {
-                node = node->children[idx];
-            }
-        }
+    PyBTreeObject *btree = ((PyBTreeViewObject *)self)->btree;
+
+    if (BTREE_FLUSH(btree)) {
+        return -1;
     }
+    return btree->size;
 }
 
 static PyObject *
-btreerangeiter_next(PyObject *self)
+btreeview_iter(PyObject *self)
 {
-    PyBTreeRangeIterObject *it = (PyBTreeRangeIterObject *)self;
+    PyBTreeViewObject *view = (PyBTreeViewObject *)self;
+    return btree_iter_kind(view->btree, view->kind);
+}
 
-    if (it->leaf_only) {
-        while (it->leaf_index < it->leaf->n_keys) {
-            PyObject *key = it->leaf->keys[it->leaf_index];
-
-            if (it->max_key != NULL) {
-                int cmp = compare_keys(key, it->max_key);
-                if (cmp == -2) return NULL;
-                if (it->inclusive_max) {
-                    if (cmp > 0) return NULL;
-                } else {
-                    if (cmp >= 0) return NULL;
-                }
-            }
+static PyObject *
+btreeview_reversed(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+    PyBTreeViewObject *view = (PyBTreeViewObject *)self;
+    return btree_reversed_kind(view->btree, view->kind);
+}
 
-            it->leaf_index++;
-            Py_INCREF(key);
-            return key;
-        }
-        return NULL;
+static int
+btreeview_contains(PyObject *self, PyObject *obj)
+{
+    PyBTreeViewObject *view = (PyBTreeViewObject *)self;
+    PyObject *it, *item, *value;
+    int result = 0;
+
+    if (view->kind == ITER_KEYS) {
+        return PyBTree_Contains((PyObject *)view->btree, obj);
     }
-    
-    /* Initialize on first call */
-    if (!it->started) {
-        it->started = 1;
-        if (it->btree->root != NULL && it->btree->root->n_keys > 0) {
-            range_iter_descend_to_start(it, it->btree->root);
+
+    if (view->kind == ITER_ITEMS) {
+        if (!PyTuple_Check(obj) || PyTuple_GET_SIZE(obj) != 2) {
+            return 0;
+        }
+        if (view->btree->duplicates) {
+            Py_ssize_t rank;
+            return btree_find_item(view->btree, PyTuple_GET_ITEM(obj, 0),
+                                   PyTuple_GET_ITEM(obj, 1), &rank);
         }
+        value = PyBTree_Search((PyObject *)view->btree, PyTuple_GET_ITEM(obj, 0));
+        if (value == NULL) {
+            return PyErr_Occurred() ? -1 : 0;
+        }
+        result = PyObject_RichCompareBool(value, PyTuple_GET_ITEM(obj, 1), Py_EQ);
+        Py_DECREF(value);
+        return result;
     }
-    
-    while (it->stack_top >= 0) {
-        IterStackFrame *frame = &it->stack[it->stack_top];
-        PyBTreeNode *node = frame->node;
-        
-        if (frame->key_idx < node->n_keys) {
-            PyObject *key = node->keys[frame->key_idx];
-            
-            /* Check if we've exceeded max_key */
-            if (it->max_key != NULL) {
-                int cmp = compare_keys(key, it->max_key);
-                if (cmp == -2) return NULL;  /* Error */
-                if (it->inclusive_max) {
-                    if (cmp > 0) return NULL;  /* Past max, done */
-                } else {
-                    if (cmp >= 0) return NULL;  /* At or past max, done */
-                }
-            }
-            
-            frame->key_idx++;
-            
-            /* If not a leaf, descend into right child of this key */
-            if (!node->is_leaf) {
-                PyBTreeNode *child = node->children[frame->key_idx];
-                while (child != NULL) {
-                    it->stack_top++;
-                    it->stack[it->stack_top].node = child;
-                    it->stack[it->stack_top].key_idx = 0;
-                    if (child->is_leaf) {
-                        break;
-                    }
-                    child = child->children[0];
-                }
-            }
-            
-            Py_INCREF(key);
-            return key;
-        } else {
-            /* Done with this node, pop stack */
-            it->stack_top--;
+
+    /* Values are unordered: linear scan */
+    it = btree_iter_kind(view->btree, ITER_VALUES);
+    if (it == NULL) {
+        return -1;
+    }
+    while ((item = btreeiter_next(it)) != NULL) {
+        result = PyObject_RichCompareBool(item, obj, Py_EQ);
+        Py_DECREF(item);
+        if (result != 0) {
+            break;
         }
     }
-    
-    return NULL;  /* Iteration complete */
+    Py_DECREF(it);
+    return result;
 }
 
-static PyTypeObject PyBTreeRangeIter_Type = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    "btree_rangeiterator",                      /* tp_name */
-    sizeof(PyBTreeRangeIterObject),             /* tp_basicsize */
-    0,                                          /* tp_itemsize */
-    btreerangeiter_dealloc,                     /* tp_dealloc */
-    0,                                          /* tp_vectorcall_offset */
-    0,                                          /* tp_getattr */
-    0,                                          /* tp_setattr */
-    0,                                          /* tp_as_async */
-    0,                                          /* tp_repr */
-    0,                                          /* tp_as_number */
-    0,                                          /* tp_as_sequence */
-    0,                                          /* tp_as_mapping */
-    0,                                          /* tp_hash */
-    0,                                          /* tp_call */
-    0,                                          /* tp_str */
-    PyObject_GenericGetAttr,                    /* tp_getattro */
-    0,                                          /* tp_setattro */
-    0,                                          /* tp_as_buffer */
-    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,    /* tp_flags */
-    0,                                          /* tp_doc */
-    btreerangeiter_traverse,                    /* tp_traverse */
-    0,                                          /* tp_clear */
-    0,                                          /* tp_richcompare */
-    0,                                          /* tp_weaklistoffset */
-    PyObject_SelfIter,                          /* tp_iter */
-    btreerangeiter_next,                        /* tp_iternext */
-    0,                                          /* tp_methods */
-    0,                                          /* tp_members */
-};
+/* Return a new reference to the entry at a valid 0-based position */
+static PyObject *
+btreeview_entry(PyBTreeViewObject *view, Py_ssize_t rank)
+{
+    Py_ssize_t idx;
+    PyBTreeNode *node = node_select(view->btree->root, rank, &idx);
+    PyObject *unused = NULL;
+    PyObject *entry = iter_yield(view->kind, &unused, node, idx);
 
-PyDoc_STRVAR(btree_irange_doc,
-"irange(min=None, max=None, inclusive=(True, False), /)\n"
-"--\n\n"
-"Return an iterator over keys in the range [min, max).\n\n"
-"By default, the range is inclusive of min and exclusive of max.\n"
-"Use inclusive=(True, True) for a fully closed range.\n\n"
-"Args:\n"
-"    min: Minimum key (inclusive by default). None for no minimum.\n"
-"    max: Maximum key (exclusive by default). None for no maximum.\n"
-"    inclusive: Tuple of (min_inclusive, max_inclusive) booleans.\n\n"
-"Example:\n"
-"    >>> bt = SortedDict()\n"
-"    >>> for i in range(10): bt[i] = i\n"
-"    >>> list(bt.irange(3, 7))\n"
-"    [3, 4, 5, 6]\n"
-"    >>> list(bt.irange(3, 7, inclusive=(True, True)))\n"
-"    [3, 4, 5, 6, 7]\n");
+    if (unused != NULL) {
+        /* The items path cached the fresh tuple; hand over that reference */
+        Py_DECREF(unused);
+    }
+    return entry;
+}
 
 static PyObject *
-btree_irange(PyObject *self, PyObject *args, PyObject *kwds)
+btreeview_item(PyObject *self, Py_ssize_t index)
 {
-    PyBTreeObject *btree = (PyBTreeObject *)self;
-    PyBTreeRangeIterObject *it;
-    PyObject *min_key = Py_None;
-    PyObject *max_key = Py_None;
-    PyObject *inclusive = NULL;
-    int inclusive_min = 1;  /* Default: inclusive of min */
-    int inclusive_max = 0;  /* Default: exclusive of max */
-    
-    static char *kwlist[] = {"min", "max", "inclusive", NULL};
-    
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|OOO", kwlist,
-                                     &min_key, &max_key, &inclusive)) {
+    PyBTreeViewObject *view = (PyBTreeViewObject *)self;
+
+    if (BTREE_FLUSH(view->btree)) {
         return NULL;
     }
-    
-    /* Parse inclusive parameter */
-    if (inclusive != NULL && inclusive != Py_None) {
-        if (!PyTuple_Check(inclusive) || PyTuple_GET_SIZE(inclusive) != 2) {
-            PyErr_SetString(PyExc_TypeError,
-                "inclusive must be a tuple of two booleans");
-            return NULL;
-        }
-        inclusive_min = PyObject_IsTrue(PyTuple_GET_ITEM(inclusive, 0));
-        inclusive_max = PyObject_IsTrue(PyTuple_GET_ITEM(inclusive, 1));
-        if (inclusive_min < 0 || inclusive_max < 0) {
-            return NULL;
-        }
-    }
-    
-    it = PyObject_GC_New(PyBTreeRangeIterObject, &PyBTreeRangeIter_Type);
-    if (it == NULL) {
+    if (index < 0 || index >= view->btree->size) {
+        PyErr_SetString(PyExc_IndexError, "view index out of range");
         return NULL;
     }
-    
-    Py_INCREF(btree);
-    it->btree = btree;
-    it->min_key = (min_key == Py_None) ? NULL : min_key;
-    it->max_key = (max_key == Py_None) ? NULL : max_key;
-    Py_XINCREF(it->min_key);
-    Py_XINCREF(it->max_key);
-    it->inclusive_min = inclusive_min;
-    it->inclusive_max = inclusive_max;
-    it->leaf_only = 0;
-    it->leaf = NULL;
-    it->leaf_index = 0;
-    it->stack_top = -1;
-    it->started = 0;
+    return btreeview_entry(view, index);
+}
+
+static PyObject *
+btreeview_slice(PyBTreeViewObject *view, PyObject *slice)
+{
+    Py_ssize_t start, stop, step, count, i;
+    PyObject *list;
+
+    if (PySlice_Unpack(slice, &start, &stop, &step) < 0) {
+        return NULL;
+    }
+    count = PySlice_AdjustIndices(view->btree->size, &start, &stop, step);
 
-    if (btree->root != NULL && btree->root->n_keys > 0 && btree->root->is_leaf) {
-        int found;
-        Py_ssize_t idx = 0;
-        if (it->min_key != NULL) {
-            idx = node_search_key(btree->root, it->min_key, &found);
-            if (idx < 0) {
+    list = PyList_New(count);
+    if (list == NULL || count == 0) {
+        return list;
+    }
+
+    if (step == 1) {
+        /* Contiguous range: seek once, then walk */
+        PyBTreeIterObject *it = (PyBTreeIterObject *)btree_iter_kind(view->btree, view->kind);
+        if (it == NULL) {
+            Py_DECREF(list);
+            return NULL;
+        }
+        it->remaining = count;
+        iter_seek(it, start);
+        for (i = 0; i < count; i++) {
+            PyObject *entry = btreeiter_next((PyObject *)it);
+            if (entry == NULL) {
                 Py_DECREF(it);
+                Py_DECREF(list);
                 return NULL;
             }
-            if (found && !it->inclusive_min) {
-                idx++;
-            }
+            PyList_SET_ITEM(list, i, entry);
         }
-        it->leaf_only = 1;
-        it->leaf = btree->root;
-        it->leaf_index = idx;
-        it->started = 1;
+        Py_DECREF(it);
+        return list;
     }
-    
-    PyObject_GC_Track((PyObject *)it);
-    return (PyObject *)it;
-}
-
-/* ==================== Python Methods ==================== */
 
-PyDoc_STRVAR(btree_insert_doc,
-"insert(key, value, /)\n"
-"--\n\n"
-"Insert a key-value pair into the B-tree.");
+    for (i = 0; i < count; i++) {
+        PyObject *entry = btreeview_entry(view, start + i * step);
+        if (entry == NULL) {
+            Py_DECREF(list);
+            return NULL;
+        }
+        PyList_SET_ITEM(list, i, entry);
+    }
+    return list;
+}
 
 static PyObject *
-btree_insert(PyObject *self, PyObject *args)
+btreeview_subscript(PyObject *self, PyObject *item)
 {
-    PyObject *key, *value;
-    if (!PyArg_ParseTuple(args, "OO", &key, &value)) {
+    PyBTreeViewObject *view = (PyBTreeViewObject *)self;
+
+    if (BTREE_FLUSH(view->btree)) {
         return NULL;
     }
-    if (PyBTree_Insert(self, key, value) < 0) {
-        return NULL;
+    if (PyIndex_Check(item)) {
+        Py_ssize_t index = PyNumber_AsSsize_t(item, PyExc_IndexError);
+        if (index == -1 && PyErr_Occurred()) {
+            return NULL;
+        }
+        if (index < 0) {
+            index += view->btree->size;
+        }
+        return btreeview_item(self, index);
     }
-    Py_RETURN_NONE;
+    if (PySlice_Check(item)) {
+        return btreeview_slice(view, item);
+    }
+    PyErr_Format(PyExc_TypeError, "view indices must be integers or slices, not %.200s",
+                 Py_TYPE(item)->tp_name);
+    return NULL;
 }
 
-PyDoc_STRVAR(btree_get_doc,
-"get(key, default=None, /)\n"
-"--\n\n"
-"Return the value for key if key is in the B-tree, else default.");
+/* Compare two iterables entry by entry. Returns 1 if equal, 0 if not,
+ * -1 on error. */
+static int
+btreeview_sequence_equal(PyObject *self, PyObject *other)
+{
+    PyObject *it_a, *it_b, *a = NULL, *b = NULL;
+    int equal = 1;
+
+    it_a = PyObject_GetIter(self);
+    if (it_a == NULL) {
+        return -1;
+    }
+    it_b = PyObject_GetIter(other);
+    if (it_b == NULL) {
+        Py_DECREF(it_a);
+        return -1;
+    }
+    for (;;) {
+        a = PyIter_Next(it_a);
+        if (a == NULL) {
+            break;
+        }
+        b = PyIter_Next(it_b);
+        if (b == NULL) {
+            break;
+        }
+        equal = PyObject_RichCompareBool(a, b, Py_EQ);
+        Py_CLEAR(a);
+        Py_CLEAR(b);
+        if (equal <= 0) {
+            break;
+        }
+    }
+    Py_XDECREF(a);
+    Py_DECREF(it_a);
+    Py_DECREF(it_b);
+    if (PyErr_Occurred()) {
+        return -1;
+    }
+    return equal;
+}
 
 static PyObject *
-btree_get(PyObject *self, PyObject *args)
+btreeview_richcompare(PyObject *self, PyObject *other, int op)
 {
-    PyObject *key, *default_value = Py_None;
+    PyBTreeViewObject *view = (PyBTreeViewObject *)self;
+    PyObject *tmp, *result;
 
-    if (!PyArg_ParseTuple(args, "O|O", &key, &default_value)) {
+    if (BTREE_FLUSH(view->btree)) {
         return NULL;
     }
+    /* Keys against another set-like object: set comparison */
+    if (view->kind == ITER_KEYS &&
+        (PyAnySet_Check(other) || PyDictKeys_Check(other))) {
+        tmp = PySet_New(self);
+        if (tmp == NULL) {
+            return NULL;
+        }
+        result = PyObject_RichCompare(tmp, other, op);
+        Py_DECREF(tmp);
+        return result;
+    }
 
-    PyObject *value = PyBTree_Search(self, key);
-    if (value == NULL) {
-        if (PyErr_Occurred()) {
+    /* Otherwise a view is a read-only sequence */
+    if (!PyList_Check(other) && !PyTuple_Check(other) &&
+        !(PyBTreeView_Check(other) && ((PyBTreeViewObject *)other)->kind == view->kind)) {
+        Py_RETURN_NOTIMPLEMENTED;
+    }
+
+    if (op == Py_EQ || op == Py_NE) {
+        int equal;
+        Py_ssize_t other_size = PyObject_Size(other);
+        if (other_size < 0) {
             return NULL;
         }
-        Py_INCREF(default_value);
-        return default_value;
+        if (other_size != view->btree->size) {
+            equal = 0;
+        }
+        else {
+            equal = btreeview_sequence_equal(self, other);
+            if (equal < 0) {
+                return NULL;
+            }
+        }
+        return PyBool_FromLong(op == Py_EQ ? equal : !equal);
     }
-    return value;
+
+    /* Ordering: compare as lists (tuples compare as tuples only with tuples) */
+    tmp = PySequence_List(self);
+    if (tmp == NULL) {
+        return NULL;
+    }
+    if (PyTuple_Check(other)) {
+        Py_SETREF(tmp, PyList_AsTuple(tmp));
+        if (tmp == NULL) {
+            return NULL;
+        }
+    }
+    if (PyBTreeView_Check(other)) {
+        PyObject *other_list = PySequence_List(other);
+        if (other_list == NULL) {
+            Py_DECREF(tmp);
+            return NULL;
+        }
+        result = PyObject_RichCompare(tmp, other_list, op);
+        Py_DECREF(other_list);
+    }
+    else {
+        result = PyObject_RichCompare(tmp, other, op);
+    }
+    Py_DECREF(tmp);
+    return result;
 }
 
-PyDoc_STRVAR(btree_pop_doc,
-"pop(key, default=<marker>, /)\n"
-"--\n\n"
-"Remove specified key and return the corresponding value.\n"
-"If key is not found, default is returned if given, otherwise KeyError is raised.");
+static const char *btreeview_names[] = {"SortedKeysView", "SortedValuesView", "SortedItemsView"};
 
 static PyObject *
-btree_pop(PyObject *self, PyObject *args)
+btreeview_repr(PyObject *self)
 {
-    PyObject *key, *default_value = NULL;
+    PyObject *list, *result;
+    int status = Py_ReprEnter(self);
 
-    if (!PyArg_ParseTuple(args, "O|O", &key, &default_value)) {
+    if (status != 0) {
+        return status > 0 ? PyUnicode_FromString("...") : NULL;
+    }
+    list = PySequence_List(self);
+    if (list == NULL) {
+        Py_ReprLeave(self);
         return NULL;
     }
+    result = PyUnicode_FromFormat("%s(%R)", btreeview_names[((PyBTreeViewObject *)self)->kind], list);
+    Py_DECREF(list);
+    Py_ReprLeave(self);
+    return result;
+}
 
-    PyObject *value = PyBTree_Search(self, key);
-    if (value == NULL) {
-        if (PyErr_Occurred()) {
-            return NULL;
-        }
-        if (default_value != NULL) {
-            Py_INCREF(default_value);
-            return default_value;
-        }
-        PyErr_SetObject(PyExc_KeyError, key);
+/* Set operations on the keys view return a plain set, like dict views:
+ * set(a).<method>(b), so either operand may be the view. */
+static PyObject *
+keysview_setop(PyObject *a, PyObject *b, const char *method)
+{
+    PyObject *result, *tmp;
+
+    result = PySet_New(a);
+    if (result == NULL) {
         return NULL;
     }
-
-    if (PyBTree_Delete(self, key) < 0) {
-        Py_DECREF(value);
+    tmp = PyObject_CallMethod(result, method, "O", b);
+    if (tmp == NULL) {
+        Py_DECREF(result);
         return NULL;
     }
-
-    return value;
+    Py_DECREF(tmp);
+    return result;
 }
 
-PyDoc_STRVAR(btree_keys_doc,
-"keys()\n"
-"--\n\n"
-"Return a list of all keys in the B-tree (in sorted order).");
-
 static PyObject *
-btree_keys_method(PyObject *self, PyObject *Py_UNUSED(ignored))
+keysview_and(PyObject *a, PyObject *b)
 {
-    return PyBTree_Keys(self);
+    return keysview_setop(a, b, "intersection_update");
 }
 
-PyDoc_STRVAR(btree_values_doc,
-"values()\n"
-"--\n\n"
-"Return a list of all values in the B-tree (in key-sorted order).");
-
 static PyObject *
-btree_values_method(PyObject *self, PyObject *Py_UNUSED(ignored))
+keysview_or(PyObject *a, PyObject *b)
 {
-    return PyBTree_Values(self);
+    return keysview_setop(a, b, "update");
 }
 
-PyDoc_STRVAR(btree_items_doc,
-"items()\n"
-"--\n\n"
-"Return a list of (key, value) tuples in the B-tree (in sorted order).");
+static PyObject *
+keysview_sub(PyObject *a, PyObject *b)
+{
+    return keysview_setop(a, b, "difference_update");
+}
 
 static PyObject *
-btree_items_method(PyObject *self, PyObject *Py_UNUSED(ignored))
+keysview_xor(PyObject *a, PyObject *b)
 {
-    return PyBTree_Items(self);
+    return keysview_setop(a, b, "symmetric_difference_update");
 }
 
-PyDoc_STRVAR(btree_clear_doc,
-"clear()\n"
+PyDoc_STRVAR(keysview_isdisjoint_doc,
+"isdisjoint(other, /)\n"
 "--\n\n"
-"Remove all items from the B-tree.");
+"Return True if the view and other have no keys in common.");
 
 static PyObject *
-btree_clear_method(PyObject *self, PyObject *Py_UNUSED(ignored))
+keysview_isdisjoint(PyObject *self, PyObject *other)
 {
-    if (PyBTree_Clear(self) < 0) {
+    PyBTreeViewObject *view = (PyBTreeViewObject *)self;
+    PyObject *it, *item;
+
+    it = PyObject_GetIter(other);
+    if (it == NULL) {
         return NULL;
     }
-    Py_RETURN_NONE;
+    while ((item = PyIter_Next(it)) != NULL) {
+        int found = PyBTree_Contains((PyObject *)view->btree, item);
+        Py_DECREF(item);
+        if (found != 0) {
+            Py_DECREF(it);
+            if (found < 0) {
+                return NULL;
+            }
+            Py_RETURN_FALSE;
+        }
+    }
+    Py_DECREF(it);
+    if (PyErr_Occurred()) {
+        return NULL;
+    }
+    Py_RETURN_TRUE;
 }
 
-PyDoc_STRVAR(btree_min_doc,
-"min()\n"
-"--\n\n"
-"Return the minimum key in the B-tree.");
+/* repr, comparisons and the set operations go through the locked
+ * iterator and contains slots */
+#define VIEW_TREE (((PyBTreeViewObject *)self)->btree)
+BTREE_DEFINE_LOCKED(Py_ssize_t, btreeview_length, VIEW_TREE, (PyObject *self), (self))
+BTREE_DEFINE_LOCKED(PyObject *, btreeview_item, VIEW_TREE,
+                    (PyObject *self, Py_ssize_t index), (self, index))
+BTREE_DEFINE_LOCKED(PyObject *, btreeview_subscript, VIEW_TREE,
+                    (PyObject *self, PyObject *item), (self, item))
+BTREE_DEFINE_LOCKED(int, btreeview_contains, VIEW_TREE,
+                    (PyObject *self, PyObject *obj), (self, obj))
+BTREE_DEFINE_LOCKED(PyObject *, btreeview_iter, VIEW_TREE, (PyObject *self), (self))
+BTREE_DEFINE_LOCKED(PyObject *, btreeview_reversed, VIEW_TREE,
+                    (PyObject *self, PyObject *arg), (self, arg))
+
+static PySequenceMethods btreeview_as_sequence = {
+    BTREE_LOCKED(btreeview_length),             /* sq_length */
+    0,                                          /* sq_concat */
+    0,                                          /* sq_repeat */
+    BTREE_LOCKED(btreeview_item),               /* sq_item */
+    0,                                          /* sq_slice */
+    0,                                          /* sq_ass_item */
+    0,                                          /* sq_ass_slice */
+    BTREE_LOCKED(btreeview_contains),           /* sq_contains */
+};
 
-static PyObject *
-btree_min(PyObject *self, PyObject *Py_UNUSED(ignored))
+static PyMappingMethods btreeview_as_mapping = {
+    BTREE_LOCKED(btreeview_length),             /* mp_length */
+    BTREE_LOCKED(btreeview_subscript),          /* mp_subscript */
+    0,                                          /* mp_ass_subscript */
+};
+
+static PyNumberMethods keysview_as_number = {
+    0,                                          /* nb_add */
+    keysview_sub,                               /* nb_subtract */
+    0,                                          /* nb_multiply */
+    0,                                          /* nb_remainder */
+    0,                                          /* nb_divmod */
+    0,                                          /* nb_power */
+    0,                                          /* nb_negative */
+    0,                                          /* nb_positive */
+    0,                                          /* nb_absolute */
+    0,                                          /* nb_bool */
+    0,                                          /* nb_invert */
+    0,                                          /* nb_lshift */
+    0,                                          /* nb_rshift */
+    keysview_and,                               /* nb_and */
+    keysview_xor,                               /* nb_xor */
+    keysview_or,                                /* nb_or */
+};
+
+static PyMethodDef keysview_methods[] = {
+    {"isdisjoint", keysview_isdisjoint, METH_O, keysview_isdisjoint_doc},
+    {"__reversed__", BTREE_LOCKED(btreeview_reversed), METH_NOARGS, "Return a reverse iterator over the keys."},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyMethodDef valuesview_methods[] = {
+    {"__reversed__", BTREE_LOCKED(btreeview_reversed), METH_NOARGS, "Return a reverse iterator over the values."},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyMethodDef itemsview_methods[] = {
+    {"__reversed__", BTREE_LOCKED(btreeview_reversed), METH_NOARGS, "Return a reverse iterator over the items."},
+    {NULL, NULL, 0, NULL}
+};
+
+PyDoc_STRVAR(keysview_doc,
+"Live, set-like view of a SortedDict's keys in sorted order.");
+PyDoc_STRVAR(valuesview_doc,
+"Live view of a SortedDict's values in key order.");
+PyDoc_STRVAR(itemsview_doc,
+"Live view of a SortedDict's (key, value) pairs in key order.");
+
+static PyTypeObject PyBTreeKeysView_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "btreedict.SortedKeysView",                /* tp_name */
+    sizeof(PyBTreeViewObject),                  /* tp_basicsize */
+    0,                                          /* tp_itemsize */
+    btreeview_dealloc,                          /* tp_dealloc */
+    0,                                          /* tp_vectorcall_offset */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_as_async */
+    btreeview_repr,                             /* tp_repr */
+    &keysview_as_number,                       /* tp_as_number */
+    &btreeview_as_sequence,                     /* tp_as_sequence */
+    &btreeview_as_mapping,                      /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    PyObject_GenericGetAttr,                    /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,    /* tp_flags */
+    keysview_doc,                              /* tp_doc */
+    btreeview_traverse,                         /* tp_traverse */
+    0,                                          /* tp_clear */
+    btreeview_richcompare,                      /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    BTREE_LOCKED(btreeview_iter),               /* tp_iter */
+    0,                                          /* tp_iternext */
+    keysview_methods,                          /* tp_methods */
+    0,                                          /* tp_members */
+};
+
+static PyTypeObject PyBTreeValuesView_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "btreedict.SortedValuesView",              /* tp_name */
+    sizeof(PyBTreeViewObject),                  /* tp_basicsize */
+    0,                                          /* tp_itemsize */
+    btreeview_dealloc,                          /* tp_dealloc */
+    0,                                          /* tp_vectorcall_offset */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_as_async */
+    btreeview_repr,                             /* tp_repr */
+    0,                                         /* tp_as_number */
+    &btreeview_as_sequence,                     /* tp_as_sequence */
+    &btreeview_as_mapping,                      /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    PyObject_GenericGetAttr,                    /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,    /* tp_flags */
+    valuesview_doc,                            /* tp_doc */
+    btreeview_traverse,                         /* tp_traverse */
+    0,                                          /* tp_clear */
+    btreeview_richcompare,                      /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    BTREE_LOCKED(btreeview_iter),               /* tp_iter */
+    0,                                          /* tp_iternext */
+    valuesview_methods,                        /* tp_methods */
+    0,                                          /* tp_members */
+};
+
+static PyTypeObject PyBTreeItemsView_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "btreedict.SortedItemsView",               /* tp_name */
+    sizeof(PyBTreeViewObject),                  /* tp_basicsize */
+    0,                                          /* tp_itemsize */
+    btreeview_dealloc,                          /* tp_dealloc */
+    0,                                          /* tp_vectorcall_offset */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_as_async */
+    btreeview_repr,                             /* tp_repr */
+    0,                                         /* tp_as_number */
+    &btreeview_as_sequence,                     /* tp_as_sequence */
+    &btreeview_as_mapping,                      /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    PyObject_GenericGetAttr,                    /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,    /* tp_flags */
+    itemsview_doc,                             /* tp_doc */
+    btreeview_traverse,                         /* tp_traverse */
+    0,                                          /* tp_clear */
+    btreeview_richcompare,                      /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    BTREE_LOCKED(btreeview_iter),               /* tp_iter */
+    0,                                          /* tp_iternext */
+    itemsview_methods,                         /* tp_methods */
+    0,                                          /* tp_members */
+};
+
+/* ==================== Structure Statistics ==================== */
+
+typedef struct {
+    Py_ssize_t nodes;
+    Py_ssize_t leaves;
+    Py_ssize_t keys;              /* Slots in use, separators included */
+    Py_ssize_t capacity;          /* Slots allocated */
+    size_t bytes;
+    size_t cache_bytes;           /* Part of bytes in search caches */
+} NodeStats;
+
+static void
+stats_visit(PyBTreeNode *node, NodeStats *st)
 {
-    PyObject *result = PyBTree_GetMin(self);
-    if (result == NULL && !PyErr_Occurred()) {
-        PyErr_SetString(PyExc_ValueError, "min() arg is an empty B-tree");
-    }
-    return result;
-}
+    Py_ssize_t i;
 
-PyDoc_STRVAR(btree_max_doc,
-"max()\n"
-"--\n\n"
-"Return the maximum key in the B-tree.");
+    st->nodes++;
+    st->keys += node->n_keys;
+    st->capacity += 2 * (Py_ssize_t)node->order - 1;
+    st->bytes += node_bytes(node);
+    st->cache_bytes += node_cache_bytes(node);
+    if (node->is_leaf) {
+        st->leaves++;
+        return;
+    }
+    for (i = 0; i <= node->n_keys; i++) {
+        stats_visit(node->children[i], st);
+    }
+}
 
-static PyObject *
-btree_max(PyObject *self, PyObject *Py_UNUSED(ignored))
+/* Add a Py_ssize_t entry to a stats() dict */
+static int
+stats_set(PyObject *dict, const char *name, Py_ssize_t value)
 {
-    PyObject *result = PyBTree_GetMax(self);
-    if (result == NULL && !PyErr_Occurred()) {
-        PyErr_SetString(PyExc_ValueError, "max() arg is an empty B-tree");
+    PyObject *obj = PyLong_FromSsize_t(value);
+    int result;
+
+    if (obj == NULL) {
+        return -1;
     }
+    result = PyDict_SetItemString(dict, name, obj);
+    Py_DECREF(obj);
     return result;
 }
 
-/* ==================== setdefault Method ==================== */
-
-PyDoc_STRVAR(btree_setdefault_doc,
-"setdefault(key, default=None, /)\n"
+PyDoc_STRVAR(btree_stats_doc,
+"stats(reset=False)\n"
 "--\n\n"
-"Insert key with a value of default if key is not in the B-tree.\n\n"
-"Return the value for key if key is in the B-tree, else default.");
+"Return a dict describing the tree's structure: height, nodes, leaves,\n"
+"fill (average fraction of key slots in use) and bytes (node memory, not\n"
+"counting the keys and values themselves). Builds compiled with\n"
+"-DBTREE_STATS add hot-path counters shared by every tree in the process:\n"
+"cache_i64_hits and cache_i64_misses for searches with int keys,\n"
+"rich_compares for key comparisons that fell back to Python, and splits,\n"
+"merges and borrows. reset=True zeroes the counters after reading them.");
 
 static PyObject *
-btree_setdefault(PyObject *self, PyObject *args)
+btree_stats(PyObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
 {
-    PyObject *key, *default_value = Py_None;
+    static const char *const kwlist[] = {"reset", NULL};
+    PyBTreeObject *btree = (PyBTreeObject *)self;
+    PyObject *argv[1] = {NULL};
+    NodeStats st = {0, 0, 0, 0, 0, 0};
+    PyObject *result, *fill;
+    int reset = 0;
 
-    if (!PyArg_ParseTuple(args, "O|O", &key, &default_value)) {
+    if (unpack_args("stats", args, nargs, kwnames, kwlist, 0, argv) < 0 ||
+        arg_bool(argv[0], &reset) < 0 || BTREE_FLUSH(btree)) {
         return NULL;
     }
+    stats_visit(btree->root, &st);
 
-    PyObject *value = PyBTree_Search(self, key);
-    if (value != NULL) {
-        return value;  /* Key exists, return existing value */
+    result = PyDict_New();
+    if (result == NULL) {
+        return NULL;
     }
-    if (PyErr_Occurred()) {
+    fill = PyFloat_FromDouble(st.capacity > 0 ? (double)st.keys / st.capacity : 0.0);
+    if (fill == NULL || PyDict_SetItemString(result, "fill", fill) < 0 ||
+        stats_set(result, "height", node_height(btree->root)) < 0 ||
+        stats_set(result, "nodes", st.nodes) < 0 ||
+        stats_set(result, "leaves", st.leaves) < 0 ||
+        stats_set(result, "bytes", (Py_ssize_t)st.bytes) < 0) {
+        Py_XDECREF(fill);
+        Py_DECREF(result);
         return NULL;
     }
-
-    /* Key doesn't exist, insert default and return it */
-    if (PyBTree_Insert(self, key, default_value) < 0) {
+    Py_DECREF(fill);
+#ifdef BTREE_STATS
+    if (stats_set(result, "cache_i64_hits", btree_counters.cache_i64_hits) < 0 ||
+        stats_set(result, "cache_i64_misses", btree_counters.cache_i64_misses) < 0 ||
+        stats_set(result, "rich_compares", btree_counters.rich_compares) < 0 ||
+        stats_set(result, "splits", btree_counters.splits) < 0 ||
+        stats_set(result, "merges", btree_counters.merges) < 0 ||
+        stats_set(result, "borrows", btree_counters.borrows) < 0) {
+        Py_DECREF(result);
         return NULL;
     }
-    Py_INCREF(default_value);
-    return default_value;
+    if (reset) {
+        memset(&btree_counters, 0, sizeof(btree_counters));
+    }
+#endif
+    return result;
 }
 
-/* ==================== update Method ==================== */
+/* ==================== Memory Usage ==================== */
 
-PyDoc_STRVAR(btree_update_doc,
-"update([other], **kwargs)\n"
+/* Bytes the tree itself holds, counting the nodes a snapshot shares with it
+ * and leaving out the key and value objects */
+static size_t
+btree_own_bytes(PyBTreeObject *btree, NodeStats *st)
+{
+    size_t size = (size_t)Py_TYPE(btree)->tp_basicsize;
+
+    if (btree->root != NULL) {
+        stats_visit(btree->root, st);
+    }
+    if (btree->wbuf != NULL) {
+        size += 2 * (size_t)btree->wbuf_cap * sizeof(BufferedWrite);
+    }
+    return size + st->bytes;
+}
+
+PyDoc_STRVAR(btree_sizeof_doc,
+"__sizeof__()\n"
 "--\n\n"
-"Update the B-tree with key/value pairs from other and kwargs.\n\n"
-"If other is present, it must be a mapping or an iterable of key/value pairs.\n"
-"Keyword arguments are also added as key/value pairs.");
+"Return the bytes of the tree and its nodes, search caches and write\n"
+"buffer, not counting the keys and values themselves.");
 
-static int
-btree_merge_from_seq2(PyObject *self, PyObject *seq2)
+static PyObject *
+btree_sizeof(PyObject *self, PyObject *Py_UNUSED(ignored))
 {
-    PyObject *it;       /* iter(seq2) */
-    Py_ssize_t i = 0;   /* index into seq2 */
-    PyObject *item;     /* seq2[i] */
-    PyObject *fast;     /* item as a 2-tuple or 2-list */
-
-    it = PyObject_GetIter(seq2);
-    if (it == NULL)
-        return -1;
+    NodeStats st = {0, 0, 0, 0, 0, 0};
 
-    while ((item = PyIter_Next(it)) != NULL) {
-        PyObject *key, *value;
+    return PyLong_FromSize_t(btree_own_bytes((PyBTreeObject *)self, &st));
+}
 
-        /* Convert item to sequence, and verify length 2. */
-        fast = PySequence_Fast(item, "");
-        if (fast == NULL) {
-            if (PyErr_ExceptionMatches(PyExc_TypeError)) {
-                PyErr_Format(PyExc_TypeError,
-                    "cannot convert B-tree update "
-                    "sequence element #%zd to a sequence",
-                    i);
-            }
-            goto Fail;
-        }
-        if (PySequence_Fast_GET_SIZE(fast) != 2) {
-            PyErr_Format(PyExc_ValueError,
-                "B-tree update sequence element #%zd "
-                "has length %zd; 2 is required",
-                i, PySequence_Fast_GET_SIZE(fast));
-            goto Fail;
-        }
+/* Add sys.getsizeof() of obj to *total unless seen holds it already */
+static int
+sizeof_once(PyObject *obj, PyObject *seen, PyObject *getsizeof, Py_ssize_t *total)
+{
+    PyObject *id = PyLong_FromVoidPtr(obj);
+    PyObject *size;
+    int known;
 
-        key = PySequence_Fast_GET_ITEM(fast, 0);
-        value = PySequence_Fast_GET_ITEM(fast, 1);
-        if (PyBTree_Insert(self, key, value) < 0) {
-            goto Fail;
-        }
-        Py_DECREF(fast);
-        Py_DECREF(item);
-        i++;
+    if (id == NULL) {
+        return -1;
     }
-    Py_DECREF(it);
-    if (PyErr_Occurred())
+    known = PySet_Contains(seen, id);
+    if (known != 0 || PySet_Add(seen, id) < 0) {
+        Py_DECREF(id);
+        return known > 0 ? 0 : -1;
+    }
+    Py_DECREF(id);
+    size = PyObject_CallOneArg(getsizeof, obj);
+    if (size == NULL) {
         return -1;
-    return 0;
-
-Fail:
-    Py_XDECREF(fast);
-    Py_DECREF(item);
-    Py_DECREF(it);
-    return -1;
+    }
+    *total += PyLong_AsSsize_t(size);
+    Py_DECREF(size);
+    return *total < 0 && PyErr_Occurred() ? -1 : 0;
 }
 
+/* Sum the sizes of the distinct key and value objects below node */
 static int
-btree_update_common(PyObject *self, PyObject *args, PyObject *kwds)
+sizeof_objects(PyBTreeNode *node, PyObject *seen, PyObject *getsizeof,
+               Py_ssize_t *keys, Py_ssize_t *values)
 {
-    PyObject *arg = NULL;
+    Py_ssize_t i;
 
-    if (!PyArg_UnpackTuple(args, "update", 0, 1, &arg)) {
-        return -1;
+    for (i = 0; i < node->n_keys; i++) {
+        if ((node->keys != NULL && sizeof_once(node->keys[i], seen, getsizeof, keys) < 0) ||
+            (NODE_HAS_ITEMS(node) &&
+             sizeof_once(node->values[i], seen, getsizeof, values) < 0)) {
+            return -1;
+        }
     }
-
-    if (arg != NULL) {
-        if (PyBTree_Check(arg)) {
-            /* Fast path: merge from another SortedDict */
-            PyObject *items = PyBTree_Items(arg);
-            if (items == NULL)
+    if (!node->is_leaf) {
+        for (i = 0; i <= node->n_keys; i++) {
+            if (sizeof_objects(node->children[i], seen, getsizeof, keys, values) < 0) {
                 return -1;
-            Py_ssize_t n = PyList_GET_SIZE(items);
-            for (Py_ssize_t i = 0; i < n; i++) {
-                PyObject *item = PyList_GET_ITEM(items, i);
-                PyObject *key = PyTuple_GET_ITEM(item, 0);
-                PyObject *value = PyTuple_GET_ITEM(item, 1);
-                if (PyBTree_Insert(self, key, value) < 0) {
-                    Py_DECREF(items);
-                    return -1;
-                }
             }
-            Py_DECREF(items);
         }
-        else if (PyDict_Check(arg)) {
-            /* Fast path for dict */
-            PyObject *key, *value;
-            Py_ssize_t pos = 0;
-            while (PyDict_Next(arg, &pos, &key, &value)) {
-                if (PyBTree_Insert(self, key, value) < 0)
-                    return -1;
-            }
+    }
+    return 0;
+}
+
+PyDoc_STRVAR(btree_memory_usage_doc,
+"memory_usage(deep=False)\n"
+"--\n\n"
+"Return a dict of the bytes behind the tree: tree (the SortedDict object),\n"
+"nodes (node blocks without their caches), caches (int64 and str prefix\n"
+"caches and Eytzinger copies), write_buffer and their total, which is\n"
+"__sizeof__(). Nodes a snapshot shares are counted by both trees.\n\n"
+"deep=True adds keys and values, the sys.getsizeof() of each distinct key\n"
+"and value object (not of the objects they refer to), to the total. Keys\n"
+"of a typed tree are stored in the nodes and count as 0.");
+
+static PyObject *
+btree_memory_usage(PyObject *self, PyObject *const *args, Py_ssize_t nargs,
+                   PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"deep", NULL};
+    PyBTreeObject *btree = (PyBTreeObject *)self;
+    PyObject *argv[1] = {NULL};
+    NodeStats st = {0, 0, 0, 0, 0, 0};
+    Py_ssize_t total, keys = 0, values = 0;
+    PyObject *result;
+    int deep = 0;
+
+    if (unpack_args("memory_usage", args, nargs, kwnames, kwlist, 0, argv) < 0 ||
+        arg_bool(argv[0], &deep) < 0 || BTREE_FLUSH(btree)) {
+        return NULL;
+    }
+    total = (Py_ssize_t)btree_own_bytes(btree, &st);
+    if (deep && btree->root != NULL) {
+        /* __sizeof__ methods can write to the tree, so walk a snapshot */
+        PyObject *getsizeof = PySys_GetObject("getsizeof");
+        PyObject *pin, *seen;
+        int status = -1;
+
+        if (getsizeof == NULL) {
+            PyErr_SetString(PyExc_RuntimeError, "lost sys.getsizeof");
+            return NULL;
         }
-        else if (PyObject_HasAttrString(arg, "keys")) {
-            /* Mapping-like object */
-            PyObject *keys = PyMapping_Keys(arg);
-            if (keys == NULL)
-                return -1;
-            PyObject *iter = PyObject_GetIter(keys);
-            Py_DECREF(keys);
-            if (iter == NULL)
-                return -1;
-            PyObject *key;
-            while ((key = PyIter_Next(iter)) != NULL) {
-                PyObject *value = PyObject_GetItem(arg, key);
-                if (value == NULL) {
-                    Py_DECREF(key);
-                    Py_DECREF(iter);
-                    return -1;
-                }
-                int status = PyBTree_Insert(self, key, value);
-                Py_DECREF(key);
-                Py_DECREF(value);
-                if (status < 0) {
-                    Py_DECREF(iter);
-                    return -1;
-                }
-            }
-            Py_DECREF(iter);
-            if (PyErr_Occurred())
-                return -1;
+        Py_INCREF(getsizeof);
+        if (btree->readonly) {
+            Py_INCREF(self);
+            pin = self;
         }
         else {
-            /* Iterable of key-value pairs */
-            if (btree_merge_from_seq2(self, arg) < 0)
-                return -1;
+            pin = btree_snapshot(self, NULL);
         }
-    }
-
-    if (kwds != NULL && PyDict_Size(kwds) > 0) {
-        PyObject *key, *value;
-        Py_ssize_t pos = 0;
-        while (PyDict_Next(kwds, &pos, &key, &value)) {
-            if (PyBTree_Insert(self, key, value) < 0)
-                return -1;
+        seen = PySet_New(NULL);
+        if (pin != NULL && seen != NULL) {
+            status = sizeof_objects(((PyBTreeObject *)pin)->root, seen, getsizeof,
+                                    &keys, &values);
+        }
+        Py_XDECREF(seen);
+        Py_XDECREF(pin);
+        Py_DECREF(getsizeof);
+        if (status < 0) {
+            return NULL;
         }
     }
 
-    return 0;
+    result = PyDict_New();
+    if (result == NULL) {
+        return NULL;
+    }
+    if (stats_set(result, "tree", Py_TYPE(btree)->tp_basicsize) < 0 ||
+        stats_set(result, "nodes", (Py_ssize_t)(st.bytes - st.cache_bytes)) < 0 ||
+        stats_set(result, "caches", (Py_ssize_t)st.cache_bytes) < 0 ||
+        stats_set(result, "write_buffer",
+                  total - Py_TYPE(btree)->tp_basicsize - (Py_ssize_t)st.bytes) < 0 ||
+        (deep && (stats_set(result, "keys", keys) < 0 ||
+                  stats_set(result, "values", values) < 0)) ||
+        stats_set(result, "total", total + keys + values) < 0) {
+        Py_DECREF(result);
+        return NULL;
+    }
+    return result;
 }
 
-static PyObject *
-btree_update(PyObject *self, PyObject *args, PyObject *kwds)
+/* Copy the items below node in order: key objects into keys, or native keys
+ * into nkeys for a typed tree, with their values, all borrowed */
+static void
+node_gather(PyBTreeNode *node, PyObject **keys, NativeKey *nkeys, PyObject **values,
+            Py_ssize_t *pos)
 {
-    if (btree_update_common(self, args, kwds) < 0) {
-        return NULL;
+    Py_ssize_t i;
+
+    for (i = 0; i <= node->n_keys; i++) {
+        if (!node->is_leaf) {
+            node_gather(node->children[i], keys, nkeys, values, pos);
+        }
+        if (i < node->n_keys && NODE_HAS_ITEMS(node)) {
+            if (nkeys != NULL) {
+                nkeys[*pos] = node->nkeys[i];
+            }
+            else {
+                keys[*pos] = node->keys[i];
+            }
+            values[(*pos)++] = node->values[i];
+        }
     }
-    Py_RETURN_NONE;
 }
 
-/* ==================== copy Method ==================== */
-
-PyDoc_STRVAR(btree_copy_doc,
-"copy()\n"
+PyDoc_STRVAR(btree_compact_doc,
+"compact(fill_factor=1.0)\n"
 "--\n\n"
-"Return a shallow copy of the B-tree.");
+"Rebuild the tree bottom-up with its leaves packed to fill_factor, as\n"
+"from_sorted() would build it, releasing the nodes that deletions left\n"
+"partly empty and the write buffer's array. O(n), without comparing keys.");
 
 static PyObject *
-btree_copy(PyObject *self, PyObject *Py_UNUSED(ignored))
+btree_compact(PyObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
 {
+    static const char *const kwlist[] = {"fill_factor", NULL};
     PyBTreeObject *btree = (PyBTreeObject *)self;
-    PyObject *new_btree;
-    PyObject *items;
-
-    new_btree = PyBTree_New(btree->order);
-    if (new_btree == NULL) {
+    PyObject *argv[1] = {NULL};
+    double fill_factor = BTREE_DEFAULT_FILL_FACTOR;
+    Py_ssize_t n, pos = 0;
+    PyObject **keys = NULL, **values;
+    NativeKey *nkeys = NULL;
+    PyBTreeNode *root;
+
+    if (unpack_args("compact", args, nargs, kwnames, kwlist, 0, argv) < 0 ||
+        arg_double(argv[0], &fill_factor) < 0 || check_fill_factor(fill_factor) < 0 ||
+        btree_begin_write(btree) < 0) {
         return NULL;
     }
+    PyMem_Free(btree->wbuf);
+    btree->wbuf = NULL;
+    btree->wbuf_cap = 0;
 
-    items = PyBTree_Items(self);
-    if (items == NULL) {
-        Py_DECREF(new_btree);
+    n = btree->size;
+    values = PyMem_New(PyObject *, n > 0 ? n : 1);
+    if (btree->key_storage >= KEYS_I64) {
+        nkeys = PyMem_New(NativeKey, n > 0 ? n : 1);
+    }
+    else {
+        keys = PyMem_New(PyObject *, n > 0 ? n : 1);
+    }
+    if (values == NULL || (keys == NULL && nkeys == NULL)) {
+        PyMem_Free(values);
+        PyMem_Free(keys);
+        PyMem_Free(nkeys);
+        return PyErr_NoMemory();
+    }
+    node_gather(btree->root, keys, nkeys, values, &pos);
+    /* The new nodes take their own references before the old ones go */
+    root = (btree->bplus ? bplus_bulk_build : bulk_build)(
+        btree->order, BTREE_KEY_SPEC(btree), keys, nkeys, values, n, fill_factor);
+    PyMem_Free(values);
+    PyMem_Free(keys);
+    PyMem_Free(nkeys);
+    if (root == NULL) {
         return NULL;
     }
+    NODE_SETREF(btree->root, root);
+    Py_RETURN_NONE;
+}
 
-    Py_ssize_t n = PyList_GET_SIZE(items);
-    for (Py_ssize_t i = 0; i < n; i++) {
-        PyObject *item = PyList_GET_ITEM(items, i);
-        PyObject *key = PyTuple_GET_ITEM(item, 0);
-        PyObject *value = PyTuple_GET_ITEM(item, 1);
-        if (PyBTree_Insert(new_btree, key, value) < 0) {
-            Py_DECREF(items);
-            Py_DECREF(new_btree);
-            return NULL;
-        }
-    }
-    Py_DECREF(items);
+/* ==================== Invariant Checking ==================== */
 
-    return new_btree;
-}
+typedef struct {
+    Py_ssize_t count;             /* Keys seen so far */
+    Py_ssize_t leaf_depth;        /* Depth of the first leaf, -1 until seen */
+    PyObject *prev;               /* Previous key in order (owned) */
+    int bplus;                    /* Checking a B+tree */
+    PyObject *lower;              /* B+tree: separator the next key must reach (owned) */
+    PyBTreeNode *last_leaf;       /* B+tree: previous leaf in the chain */
+    int key_storage;              /* Tree's KEYS_* storage */
+    int duplicates;               /* Equal keys allowed */
+    int cache_pairs;              /* Nodes cache int64 pairs (KEYS_PAIRS) */
+} CheckState;
 
-/* ==================== __eq__ Comparison ==================== */
+static int
+check_fail(const char *msg, Py_ssize_t depth)
+{
+    PyErr_Format(PyExc_AssertionError, "B-tree invariant violated at depth %zd: %s",
+                 depth, msg);
+    return -1;
+}
 
-static PyObject *
-btree_richcompare(PyObject *self, PyObject *other, int op)
+static int
+check_node(PyBTreeNode *node, int is_root, Py_ssize_t depth, CheckState *st)
 {
-    PyBTreeObject *a, *b;
-    PyObject *a_items, *b_items;
-    int result;
+    PyObject *key;
+    Py_ssize_t t = node->order;
+    Py_ssize_t i;
 
-    /* Only support equality/inequality */
-    if (op != Py_EQ && op != Py_NE) {
-        Py_RETURN_NOTIMPLEMENTED;
+    if (node->n_keys > 2 * t - 1) {
+        return check_fail("node has more than 2*order-1 keys", depth);
     }
-
-    /* Must be comparing two SortedDicts */
-    if (!PyBTree_Check(other)) {
-        if (op == Py_EQ) {
-            Py_RETURN_FALSE;
-        }
-        else {
-            Py_RETURN_TRUE;
-        }
+    if (!is_root && node->n_keys < t - 1) {
+        return check_fail("non-root node has fewer than order-1 keys", depth);
     }
-
-    a = (PyBTreeObject *)self;
-    b = (PyBTreeObject *)other;
-
-    /* Quick size check */
-    if (a->size != b->size) {
-        if (op == Py_EQ) {
-            Py_RETURN_FALSE;
+    if (node->is_leaf) {
+        if (st->leaf_depth < 0) {
+            st->leaf_depth = depth;
         }
-        else {
-            Py_RETURN_TRUE;
+        else if (st->leaf_depth != depth) {
+            return check_fail("leaves at different depths", depth);
         }
-    }
-
-    /* Empty trees are equal */
-    if (a->size == 0) {
-        if (op == Py_EQ) {
-            Py_RETURN_TRUE;
+        if (st->bplus) {
+            if (node->prev != st->last_leaf ||
+                (st->last_leaf != NULL && st->last_leaf->next != node)) {
+                return check_fail("broken leaf chain", depth);
+            }
+            st->last_leaf = node;
         }
-        else {
-            Py_RETURN_FALSE;
+        else if (node->next != NULL || node->prev != NULL) {
+            return check_fail("leaf chain in a B-tree", depth);
         }
     }
-
-    /* Compare items */
-    a_items = PyBTree_Items(self);
-    if (a_items == NULL) {
-        return NULL;
-    }
-    b_items = PyBTree_Items(other);
-    if (b_items == NULL) {
-        Py_DECREF(a_items);
-        return NULL;
-    }
-
-    result = PyObject_RichCompareBool(a_items, b_items, Py_EQ);
-    Py_DECREF(a_items);
-    Py_DECREF(b_items);
-
-    if (result < 0) {
-        return NULL;
+    if (NODE_HAS_ITEMS(node) != (node->is_leaf || !st->bplus)) {
+        return check_fail(st->bplus ? "B+tree internal node stores values"
+                                    : "node without values", depth);
     }
 
-    if (op == Py_EQ) {
-        return PyBool_FromLong(result);
-    }
-    else {
-        return PyBool_FromLong(!result);
+    for (i = 0; i <= node->n_keys; i++) {
+        if (!node->is_leaf) {
+            if (node->children[i] == NULL) {
+                return check_fail("missing child", depth);
+            }
+            Py_ssize_t before = st->count;
+            if (check_node(node->children[i], 0, depth + 1, st) < 0) {
+                return -1;
+            }
+            if (node->counts[i] != st->count - before) {
+                return check_fail("stale subtree count", depth);
+            }
+        }
+        if (i == node->n_keys) {
+            break;
+        }
+        if ((node->nkeys != NULL) != (st->key_storage >= KEYS_I64) ||
+            node->duplicates != st->duplicates ||
+            (node->keys_i64_2 != NULL) != st->cache_pairs) {
+            return check_fail("node key storage differs from the tree's", depth);
+        }
+        if ((node->keys != NULL && node->keys[i] == NULL) ||
+            (NODE_HAS_ITEMS(node) && node->values[i] == NULL)) {
+            return check_fail("missing key or value", depth);
+        }
+        key = node_get_key(node, i);
+        if (key == NULL) {
+            return -1;
+        }
+        if (!NODE_HAS_ITEMS(node)) {
+            /* Separator: above everything to its left, at most everything
+             * to its right (checked when the next key is seen) */
+            int cmp = st->prev != NULL ? compare_keys(st->prev, key) : -1;
+            if (cmp == -2) {
+                Py_DECREF(key);
+                return -1;
+            }
+            if (cmp >= 0) {
+                Py_DECREF(key);
+                return check_fail("separator not above its left subtree", depth);
+            }
+            Py_XSETREF(st->lower, key);
+            continue;
+        }
+        if (st->lower != NULL) {
+            int cmp = compare_keys(st->lower, key);
+            if (cmp == -2) {
+                Py_DECREF(key);
+                return -1;
+            }
+            if (cmp > 0) {
+                Py_DECREF(key);
+                return check_fail("separator above its right subtree", depth);
+            }
+            Py_CLEAR(st->lower);
+        }
+        if (st->prev != NULL) {
+            int cmp = compare_keys(st->prev, key);
+            if (cmp == -2) {
+                Py_DECREF(key);
+                return -1;
+            }
+            if (cmp > 0 || (cmp == 0 && !st->duplicates)) {
+                Py_DECREF(key);
+                return check_fail("keys out of order", depth);
+            }
+        }
+        if (NODE_EYT_N(node) >= 0) {
+            /* Slot k holds key eyt_rank[k]; checked once per node, at i == 0 */
+            Py_ssize_t k;
+            const long long *sorted_i64 = node->nkeys != NULL ? &node->nkeys[0].i64
+                                                              : node->keys_i64;
+            for (k = 1; i == 0 && k <= node->eyt_n; k++) {
+                if (node->eyt_n != node->n_keys ||
+                    node->eyt_keys[k] != sorted_i64[node->eyt_rank[k]]) {
+                    Py_DECREF(key);
+                    return check_fail("stale Eytzinger key copy", depth);
+                }
+            }
+        }
+        if (node->keys_i64_valid && node->keys_i64_valid[i] == CACHE_I64) {
+            int overflow = 0;
+            long long value = PyLong_AsLongLongAndOverflow(key, &overflow);
+            if (!PyLong_CheckExact(key) || overflow || value != node->keys_i64[i]) {
+                PyErr_Clear();
+                Py_DECREF(key);
+                return check_fail("stale int64 key cache", depth);
+            }
+        }
+        if (node->keys_i64_valid && node->keys_i64_valid[i] == CACHE_STR &&
+            (!PyUnicode_CheckExact(key) ||
+             (long long)str_prefix(key) != node->keys_i64[i])) {
+            Py_DECREF(key);
+            return check_fail("stale str prefix cache", depth);
+        }
+        if (node->keys_i64_valid && node->keys_i64_valid[i] == CACHE_PAIR) {
+            long long first, second;
+            if (!exact_int64_pair(key, &first, &second) || first != node->keys_i64[i] ||
+                second != node->keys_i64_2[i]) {
+                Py_DECREF(key);
+                return check_fail("stale int64 pair cache", depth);
+            }
+        }
+        Py_XSETREF(st->prev, key);
+        st->count++;
     }
+    return 0;
 }
 
-/* ==================== peekitem Method ==================== */
-
-PyDoc_STRVAR(btree_peekitem_doc,
-"peekitem(index=-1, /)\n"
-"--\n\n"
-"Return (key, value) pair at index. Default is the last (maximum) item.\n"
-"Raises IndexError if the B-tree is empty or index is out of range.\n\n"
-"Negative indices count from the end. Only -1 (last) and 0 (first) are\n"
-"supported for O(log n) performance.");
-
-static PyObject *
-btree_peekitem(PyObject *self, PyObject *args)
+/* Append every value of the subtree at node to st, bypassing the caches */
+static int
+check_agg_values(AggState *st, PyBTreeNode *node)
 {
-    PyBTreeObject *btree = (PyBTreeObject *)self;
-    Py_ssize_t index = -1;
-    PyBTreeNode *node;
-    PyObject *key, *value, *result;
+    Py_ssize_t i;
 
-    if (!PyArg_ParseTuple(args, "|n", &index)) {
-        return NULL;
+    for (i = 0; i <= node->n_keys; i++) {
+        if (!node->is_leaf && check_agg_values(st, node->children[i]) < 0) {
+            return -1;
+        }
+        if (i < node->n_keys && NODE_HAS_ITEMS(node) && agg_add(st, node->values[i]) < 0) {
+            return -1;
+        }
     }
+    return 0;
+}
 
-    if (btree->size == 0) {
-        PyErr_SetString(PyExc_IndexError, "peekitem from empty B-tree");
-        return NULL;
-    }
+/* Compare every up-to-date cached aggregate under node with its values */
+static int
+check_aggregates(PyBTreeObject *btree, PyBTreeNode *node, Py_ssize_t depth)
+{
+    Py_ssize_t i;
 
-    /* Only support 0 (first) and -1 (last) for O(log n) */
-    if (index == 0) {
-        /* Get minimum */
-        node = btree->root;
-        while (!node->is_leaf) {
-            node = node->children[0];
+    if (node->agg_valid) {
+        AggState fresh = {btree, btree->version, NULL};
+        int eq;
+
+        if (check_agg_values(&fresh, node) < 0) {
+            Py_XDECREF(fresh.acc);
+            return -1;
         }
-        key = node->keys[0];
-        value = node->values[0];
-    }
-    else if (index == -1 || index == btree->size - 1) {
-        /* Get maximum */
-        node = btree->root;
-        while (!node->is_leaf) {
-            node = node->children[node->n_keys];
+        if (fresh.acc == NULL) {
+            return check_fail("aggregate cached for an empty node", depth);
+        }
+        eq = PyObject_RichCompareBool(fresh.acc, node->agg, Py_EQ);
+        Py_DECREF(fresh.acc);
+        if (eq <= 0) {
+            return eq < 0 ? -1 : check_fail("stale subtree aggregate", depth);
         }
-        key = node->keys[node->n_keys - 1];
-        value = node->values[node->n_keys - 1];
     }
-    else {
-        /* For other indices, we need O(n) traversal - not supported efficiently */
-        PyErr_SetString(PyExc_IndexError,
-            "peekitem() only supports index 0 (first) or -1 (last) for O(log n) access");
-        return NULL;
+    for (i = 0; !node->is_leaf && i <= node->n_keys; i++) {
+        if (check_aggregates(btree, node->children[i], depth + 1) < 0) {
+            return -1;
+        }
     }
-
-    result = PyTuple_Pack(2, key, value);
-    return result;
+    return 0;
 }
 
-/* ==================== popitem Method ==================== */
-
-PyDoc_STRVAR(btree_popitem_doc,
-"popitem(index=-1, /)\n"
+PyDoc_STRVAR(btree_check_doc,
+"_check()\n"
 "--\n\n"
-"Remove and return (key, value) pair at index. Default is the last (maximum) item.\n"
-"Raises KeyError if the B-tree is empty.\n\n"
-"Only -1 (last) and 0 (first) are supported for O(log n) performance.");
+"Verify the structural invariants of the B-tree, raising AssertionError\n"
+"on the first violation. Intended for tests.");
 
 static PyObject *
-btree_popitem(PyObject *self, PyObject *args)
+btree_check(PyObject *self, PyObject *Py_UNUSED(ignored))
 {
     PyBTreeObject *btree = (PyBTreeObject *)self;
-    Py_ssize_t index = -1;
-    PyObject *key, *value, *result;
+    CheckState st = {0, -1, NULL, btree->bplus, NULL, NULL, btree->key_storage,
+                     btree->duplicates, btree->cache_pairs};
+    int status;
 
-    if (!PyArg_ParseTuple(args, "|n", &index)) {
+    if (BTREE_FLUSH(btree)) {
         return NULL;
     }
-
-    if (btree->size == 0) {
-        PyErr_SetString(PyExc_KeyError, "popitem(): B-tree is empty");
-        return NULL;
-    }
-
-    /* Get the key first */
-    if (index == 0) {
-        key = PyBTree_GetMin(self);
-    }
-    else if (index == -1 || index == btree->size - 1) {
-        key = PyBTree_GetMax(self);
+    if (btree->root == NULL) {
+        Py_RETURN_NONE;
     }
-    else {
-        PyErr_SetString(PyExc_IndexError,
-            "popitem() only supports index 0 (first) or -1 (last) for O(log n) access");
+    status = check_node(btree->root, 1, 0, &st);
+    Py_XDECREF(st.prev);
+    Py_XDECREF(st.lower);
+    if (status < 0) {
         return NULL;
     }
-
-    if (key == NULL) {
-        return NULL;
+    if (st.last_leaf != NULL && st.last_leaf->next != NULL) {
+        return PyErr_Format(PyExc_AssertionError,
+                            "B-tree invariant violated: leaf chain runs past the last leaf");
     }
-
-    /* Get the value before deleting */
-    value = PyBTree_Search(self, key);
-    if (value == NULL) {
-        Py_DECREF(key);
-        if (!PyErr_Occurred()) {
-            PyErr_SetString(PyExc_RuntimeError, "key disappeared during popitem");
-        }
+    if (st.count != btree->size) {
+        PyErr_Format(PyExc_AssertionError,
+                     "B-tree size is %zd but %zd keys are stored",
+                     btree->size, st.count);
         return NULL;
     }
-
-    /* Delete the key */
-    if (PyBTree_Delete(self, key) < 0) {
-        Py_DECREF(key);
-        Py_DECREF(value);
+    if (btree->aggregate != AGG_NONE && check_aggregates(btree, btree->root, 0) < 0) {
         return NULL;
     }
-
-    result = PyTuple_Pack(2, key, value);
-    Py_DECREF(key);
-    Py_DECREF(value);
-    return result;
+    Py_RETURN_NONE;
 }
 
+/* Everything but from_sorted() (a new tree), the lookups get(), get_many()
+ * and contains_many() and the array exports (see btree_pin_root) runs under
+ * the tree lock */
+BTREE_LOCKED_FASTCALL(btree_insert)
+BTREE_LOCKED_FASTCALL(btree_pop)
+BTREE_LOCKED_FASTCALL(btree_pop_many)
+BTREE_LOCKED_FASTCALL(btree_set_many)
+BTREE_LOCKED_FASTCALL(btree_setdefault)
+BTREE_LOCKED_METHOD(btree_copy)
+BTREE_LOCKED_METHOD(btree_snapshot)
+BTREE_LOCKED_METHOD(btree_keys_method)
+BTREE_LOCKED_METHOD(btree_values_method)
+BTREE_LOCKED_METHOD(btree_items_method)
+BTREE_LOCKED_METHOD(btree_clear_method)
+BTREE_LOCKED_METHOD(btree_min)
+BTREE_LOCKED_METHOD(btree_max)
+BTREE_LOCKED_FASTCALL(btree_peekitem)
+BTREE_LOCKED_FASTCALL(btree_popitem)
+BTREE_LOCKED_METHOD(btree_index)
+BTREE_LOCKED_METHOD(btree_bisect_left)
+BTREE_LOCKED_METHOD(btree_bisect_right)
+BTREE_LOCKED_METHOD(btree_reversed)
+BTREE_LOCKED_METHOD(btree_check)
+BTREE_LOCKED_FASTCALL_KW(btree_stats)
+BTREE_LOCKED_FASTCALL_KW(btree_memory_usage)
+BTREE_LOCKED_FASTCALL_KW(btree_compact)
+BTREE_LOCKED_METHOD(btree_sizeof)
+BTREE_LOCKED_FASTCALL_KW(btree_update)
+BTREE_LOCKED_FASTCALL_KW(btree_islice)
+BTREE_LOCKED_FASTCALL_KW(btree_irange)
+BTREE_LOCKED_FASTCALL_KW(btree_items_range)
+BTREE_LOCKED_FASTCALL_KW(btree_values_range)
+BTREE_LOCKED_FASTCALL_KW(btree_count_range)
+BTREE_LOCKED_FASTCALL_KW(btree_aggregate_range)
+BTREE_LOCKED_FASTCALL_KW(btree_delete_range)
+BTREE_LOCKED_FASTCALL_KW(btree_pop_range)
+BTREE_LOCKED_METHOD(btree_count)
+BTREE_LOCKED_METHOD(btree_equal_range)
+BTREE_LOCKED_FASTCALL(btree_remove_one)
+BTREE_LOCKED_METHOD(btree_split_at)
+BTREE_LOCKED_METHOD(btree_setstate)
+BTREE_DEFINE_LOCKED(PyObject *, btree_repr, self, (PyObject *self), (self))
+BTREE_DEFINE_LOCKED(Py_ssize_t, btree_length, self, (PyObject *self), (self))
+BTREE_DEFINE_LOCKED(int, btree_ass_subscript, self,
+                    (PyObject *self, PyObject *key, PyObject *value), (self, key, value))
+BTREE_DEFINE_LOCKED(PyObject *, btree_iter, self, (PyObject *self), (self))
+
 static PyMethodDef btree_methods[] = {
-    {"insert", btree_insert, METH_VARARGS, btree_insert_doc},
-    {"get", btree_get, METH_VARARGS, btree_get_doc},
-    {"pop", btree_pop, METH_VARARGS, btree_pop_doc},
-    {"setdefault", btree_setdefault, METH_VARARGS, btree_setdefault_doc},
-    {"update", (PyCFunction)btree_update, METH_VARARGS | METH_KEYWORDS, btree_update_doc},
-    {"copy", btree_copy, METH_NOARGS, btree_copy_doc},
-    {"keys", btree_keys_method, METH_NOARGS, btree_keys_doc},
-    {"values", btree_values_method, METH_NOARGS, btree_values_doc},
-    {"items", btree_items_method, METH_NOARGS, btree_items_doc},
-    {"clear", btree_clear_method, METH_NOARGS, btree_clear_doc},
-    {"min", btree_min, METH_NOARGS, btree_min_doc},
-    {"max", btree_max, METH_NOARGS, btree_max_doc},
-    {"peekitem", btree_peekitem, METH_VARARGS, btree_peekitem_doc},
-    {"popitem", btree_popitem, METH_VARARGS, btree_popitem_doc},
-    {"irange", (PyCFunction)btree_irange, METH_VARARGS | METH_KEYWORDS, btree_irange_doc},
-    {"__reversed__", btree_reversed, METH_NOARGS, "Return a reverse iterator over the keys."},
+    {"insert", (PyCFunction)(void (*)(void))BTREE_LOCKED(btree_insert), METH_FASTCALL, btree_insert_doc},
+    {"get", (PyCFunction)(void (*)(void))btree_get, METH_FASTCALL, btree_get_doc},
+    {"pop", (PyCFunction)(void (*)(void))BTREE_LOCKED(btree_pop), METH_FASTCALL, btree_pop_doc},
+    {"setdefault", (PyCFunction)(void (*)(void))BTREE_LOCKED(btree_setdefault), METH_FASTCALL, btree_setdefault_doc},
+    {"update", (PyCFunction)(void (*)(void))BTREE_LOCKED(btree_update), METH_FASTCALL | METH_KEYWORDS, btree_update_doc},
+    {"get_many", (PyCFunction)(void (*)(void))btree_get_many, METH_FASTCALL, btree_get_many_doc},
+    {"contains_many", btree_contains_many, METH_O, btree_contains_many_doc},
+    {"pop_many", (PyCFunction)(void (*)(void))BTREE_LOCKED(btree_pop_many), METH_FASTCALL, btree_pop_many_doc},
+    {"set_many", (PyCFunction)(void (*)(void))BTREE_LOCKED(btree_set_many), METH_FASTCALL, btree_set_many_doc},
+    {"keys_array", (PyCFunction)(void (*)(void))btree_keys_array, METH_FASTCALL | METH_KEYWORDS, btree_keys_array_doc},
+    {"values_array", (PyCFunction)(void (*)(void))btree_values_array, METH_FASTCALL | METH_KEYWORDS, btree_values_array_doc},
+    {"irange_array", (PyCFunction)(void (*)(void))btree_irange_array, METH_FASTCALL | METH_KEYWORDS, btree_irange_array_doc},
+    {"from_sorted", (PyCFunction)(void (*)(void))btree_from_sorted, METH_FASTCALL | METH_KEYWORDS | METH_CLASS, btree_from_sorted_doc},
+    {"copy", BTREE_LOCKED(btree_copy), METH_NOARGS, btree_copy_doc},
+    {"snapshot", BTREE_LOCKED(btree_snapshot), METH_NOARGS, btree_snapshot_doc},
+    {"keys", BTREE_LOCKED(btree_keys_method), METH_NOARGS, btree_keys_doc},
+    {"values", BTREE_LOCKED(btree_values_method), METH_NOARGS, btree_values_doc},
+    {"items", BTREE_LOCKED(btree_items_method), METH_NOARGS, btree_items_doc},
+    {"clear", BTREE_LOCKED(btree_clear_method), METH_NOARGS, btree_clear_doc},
+    {"min", BTREE_LOCKED(btree_min), METH_NOARGS, btree_min_doc},
+    {"max", BTREE_LOCKED(btree_max), METH_NOARGS, btree_max_doc},
+    {"peekitem", (PyCFunction)(void (*)(void))BTREE_LOCKED(btree_peekitem), METH_FASTCALL, btree_peekitem_doc},
+    {"popitem", (PyCFunction)(void (*)(void))BTREE_LOCKED(btree_popitem), METH_FASTCALL, btree_popitem_doc},
+    {"index", BTREE_LOCKED(btree_index), METH_O, btree_index_doc},
+    {"bisect_left", BTREE_LOCKED(btree_bisect_left), METH_O, btree_bisect_left_doc},
+    {"bisect_right", BTREE_LOCKED(btree_bisect_right), METH_O, btree_bisect_right_doc},
+    {"bisect", BTREE_LOCKED(btree_bisect_right), METH_O, btree_bisect_right_doc},
+    {"islice", (PyCFunction)(void (*)(void))BTREE_LOCKED(btree_islice), METH_FASTCALL | METH_KEYWORDS, btree_islice_doc},
+    {"irange", (PyCFunction)(void (*)(void))BTREE_LOCKED(btree_irange), METH_FASTCALL | METH_KEYWORDS, btree_irange_doc},
+    {"items_range", (PyCFunction)(void (*)(void))BTREE_LOCKED(btree_items_range), METH_FASTCALL | METH_KEYWORDS, btree_items_range_doc},
+    {"values_range", (PyCFunction)(void (*)(void))BTREE_LOCKED(btree_values_range), METH_FASTCALL | METH_KEYWORDS, btree_values_range_doc},
+    {"cursor", btree_cursor, METH_NOARGS, btree_cursor_doc},
+    {"count_range", (PyCFunction)(void (*)(void))BTREE_LOCKED(btree_count_range), METH_FASTCALL | METH_KEYWORDS, btree_count_range_doc},
+    {"aggregate_range", (PyCFunction)(void (*)(void))BTREE_LOCKED(btree_aggregate_range), METH_FASTCALL | METH_KEYWORDS, btree_aggregate_range_doc},
+    {"delete_range", (PyCFunction)(void (*)(void))BTREE_LOCKED(btree_delete_range), METH_FASTCALL | METH_KEYWORDS, btree_delete_range_doc},
+    {"pop_range", (PyCFunction)(void (*)(void))BTREE_LOCKED(btree_pop_range), METH_FASTCALL | METH_KEYWORDS, btree_pop_range_doc},
+    {"count", BTREE_LOCKED(btree_count), METH_O, btree_count_doc},
+    {"equal_range", BTREE_LOCKED(btree_equal_range), METH_O, btree_equal_range_doc},
+    {"remove_one", (PyCFunction)(void (*)(void))BTREE_LOCKED(btree_remove_one), METH_FASTCALL, btree_remove_one_doc},
+    {"split_at", BTREE_LOCKED(btree_split_at), METH_O, btree_split_at_doc},
+    {"concat", BTREE_LOCKED(btree_concat), METH_O, btree_concat_doc},
+    {"merge", (PyCFunction)(void (*)(void))btree_merge, METH_FASTCALL | METH_KEYWORDS, btree_merge_doc},
+    {"intersection_keys", btree_intersection_keys, METH_O, btree_intersection_keys_doc},
+    {"difference_keys", btree_difference_keys, METH_O, btree_difference_keys_doc},
+    {"dump", btree_dump, METH_O, btree_dump_doc},
+    {"load", (PyCFunction)(void (*)(void))btree_load, METH_FASTCALL | METH_KEYWORDS | METH_CLASS, btree_load_doc},
+    {"__reduce__", btree_reduce, METH_NOARGS, btree_reduce_doc},
+    {"__setstate__", BTREE_LOCKED(btree_setstate), METH_O, btree_setstate_doc},
+    {"__reversed__", BTREE_LOCKED(btree_reversed), METH_NOARGS, "Return a reverse iterator over the keys."},
+    {"stats", (PyCFunction)(void (*)(void))BTREE_LOCKED(btree_stats), METH_FASTCALL | METH_KEYWORDS, btree_stats_doc},
+    {"memory_usage", (PyCFunction)(void (*)(void))BTREE_LOCKED(btree_memory_usage), METH_FASTCALL | METH_KEYWORDS, btree_memory_usage_doc},
+    {"compact", (PyCFunction)(void (*)(void))BTREE_LOCKED(btree_compact), METH_FASTCALL | METH_KEYWORDS, btree_compact_doc},
+    {"__sizeof__", BTREE_LOCKED(btree_sizeof), METH_NOARGS, btree_sizeof_doc},
+    {"_check", BTREE_LOCKED(btree_check), METH_NOARGS, btree_check_doc},
     {NULL, NULL, 0, NULL}
 };
 
 /* ==================== Sequence/Mapping Protocols ==================== */
 
 static PySequenceMethods btree_as_sequence = {
-    btree_length,                               /* sq_length */
+    BTREE_LOCKED(btree_length),                 /* sq_length */
     0,                                          /* sq_concat */
     0,                                          /* sq_repeat */
     0,                                          /* sq_item */
@@ -2725,23 +11957,52 @@ static PySequenceMethods btree_as_sequence = {
 };
 
 static PyMappingMethods btree_as_mapping = {
-    btree_length,                               /* mp_length */
+    BTREE_LOCKED(btree_length),                 /* mp_length */
     btree_subscript,                            /* mp_subscript */
-    btree_ass_subscript,                        /* mp_ass_subscript */
+    BTREE_LOCKED(btree_ass_subscript),          /* mp_ass_subscript */
 };
 
 /* ==================== SortedDict __init__ ==================== */
 
 PyDoc_STRVAR(btree_doc,
-"SortedDict(order=64, cache_i64=True, /)\n"
+"SortedDict([iterable], order=64, cache_i64=True, layout='btree', key_type=None,\n"
+"           key_layout='sorted', aggregate=None, duplicates=False, write_buffer=0,\n"
+"           cache_pairs=False)\n"
 "--\n\n"
 "Create a new B-tree with the specified order (minimum degree).\n\n"
+"If given, iterable is a mapping or an iterable of (key, value) pairs used\n"
+"as the initial contents; input already in ascending key order is\n"
+"bulk-loaded bottom-up instead of inserted one key at a time.\n\n"
 "The order determines the minimum and maximum number of keys in each node:\n"
 "- Each node (except root) has at least order-1 keys\n"
 "- Each node has at most 2*order-1 keys\n"
 "- Default order is 64 (up to 127 keys per node)\n\n"
-"cache_i64 enables caching of int64 keys to reduce comparison overhead\n"
-"at the cost of higher memory usage.\n\n"
+"cache_i64 enables caching of int64 keys and of the first 8 bytes of str\n"
+"keys to reduce comparison overhead at the cost of higher memory usage.\n"
+"cache_pairs=True extends it to keys that are 2-tuples of int64 ints, such\n"
+"as (tenant_id, timestamp), with a second int64 column per node. It needs\n"
+"cache_i64=True.\n\n"
+"layout='bplus' keeps all items in chained leaves with separator-only\n"
+"internal nodes, which makes iteration and irange() sequential leaf walks.\n\n"
+"key_type='i64' or 'f64' stores keys as native 64-bit integers or doubles\n"
+"instead of Python objects; every key must then be an int (or, for 'f64',\n"
+"an int or float).\n\n"
+"key_layout='eytzinger' also keeps a BFS-ordered copy of each node's int64\n"
+"keys, rebuilt by the first lookup after a change, for cache-friendly\n"
+"searches in large nodes. It needs key_type='i64' or cache_i64=True.\n\n"
+"duplicates=True makes a multimap: bt[key] = value adds an item after any\n"
+"with an equal key instead of replacing it, bt[key] and pop(key) use the\n"
+"first item of key, del bt[key] removes all of them, and count(),\n"
+"equal_range() and remove_one() address them individually. It needs\n"
+"layout='btree'.\n\n"
+"write_buffer=n holds back up to n bt[key] = value writes and applies\n"
+"them sorted by key once n are waiting or before the tree is next read or\n"
+"otherwise written, so random bulk writes reach each leaf together. Every\n"
+"key of a typed tree is held back; in an object tree only int keys are,\n"
+"while its first and last keys are ints too. Any other write is applied at\n"
+"once, so an int key in a tree of str keys raises TypeError from its own\n"
+"assignment. An error from applying a held-back write, such as running\n"
+"out of memory, is raised by the later call.\n\n"
 "Example:\n"
 "    >>> bt = SortedDict()\n"
 "    >>> bt[1] = 'one'\n"
@@ -2753,18 +12014,105 @@ PyDoc_STRVAR(btree_doc,
 "    >>> list(bt)\n"
 "    [1, 2]\n");
 
+/* Map a key_type name to its KEYS_* storage, or to KEYS_OBJECT for None.
+ * Returns -1 with ValueError set for an unknown name. */
 static int
-btree_init(PyObject *self, PyObject *args, PyObject *kwds)
+btree_parse_key_type(const char *key_type)
 {
-    PyBTreeObject *btree = (PyBTreeObject *)self;
-    int order = BTREE_DEFAULT_ORDER;
-    int cache_i64 = 1;
+    if (key_type == NULL) {
+        return KEYS_OBJECT;
+    }
+    if (strcmp(key_type, "i64") == 0) {
+        return KEYS_I64;
+    }
+    if (strcmp(key_type, "f64") == 0) {
+        return KEYS_F64;
+    }
+    PyErr_Format(PyExc_ValueError, "key_type must be None, 'i64' or 'f64', got '%s'",
+                 key_type);
+    return -1;
+}
+
+/* Map a key_layout name to the eytzinger flag. Returns -1 with ValueError
+ * set for an unknown name. */
+static int
+btree_parse_key_layout(const char *key_layout)
+{
+    if (strcmp(key_layout, "sorted") == 0) {
+        return 0;
+    }
+    if (strcmp(key_layout, "eytzinger") == 0) {
+        return 1;
+    }
+    PyErr_Format(PyExc_ValueError, "key_layout must be 'sorted' or 'eytzinger', got '%s'",
+                 key_layout);
+    return -1;
+}
 
-    static char *kwlist[] = {"order", "cache_i64", NULL};
+/* Map a layout name to the bplus flag. Returns -1 with ValueError set for
+ * an unknown name. */
+static int
+btree_parse_layout(const char *layout)
+{
+    if (strcmp(layout, "btree") == 0) {
+        return 0;
+    }
+    if (strcmp(layout, "bplus") == 0) {
+        return 1;
+    }
+    PyErr_Format(PyExc_ValueError, "layout must be 'btree' or 'bplus', got '%s'", layout);
+    return -1;
+}
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|ip", kwlist, &order, &cache_i64)) {
+/* Map an aggregate= argument (NULL or None for none) to AGG_*, storing the
+ * callable of AGG_CALL in *func as a new reference. Returns -1 with an
+ * exception set for anything else. */
+static int
+btree_parse_aggregate(PyObject *aggregate, PyObject **func)
+{
+    *func = NULL;
+    if (aggregate == NULL || aggregate == Py_None) {
+        return AGG_NONE;
+    }
+    if (PyUnicode_Check(aggregate)) {
+        if (PyUnicode_CompareWithASCIIString(aggregate, "sum") == 0) {
+            return AGG_SUM;
+        }
+        if (PyUnicode_CompareWithASCIIString(aggregate, "min") == 0) {
+            return AGG_MIN;
+        }
+        if (PyUnicode_CompareWithASCIIString(aggregate, "max") == 0) {
+            return AGG_MAX;
+        }
+        PyErr_Format(PyExc_ValueError,
+                     "aggregate must be 'sum', 'min', 'max' or a callable, got '%U'",
+                     aggregate);
+        return -1;
+    }
+    if (!PyCallable_Check(aggregate)) {
+        PyErr_Format(PyExc_TypeError,
+                     "aggregate must be None, a str or a callable, not %.200s",
+                     Py_TYPE(aggregate)->tp_name);
         return -1;
     }
+    Py_INCREF(aggregate);
+    *func = aggregate;
+    return AGG_CALL;
+}
+
+/* Reset btree to an empty tree with the given constructor options, then
+ * load source (may be NULL) into it. Shared by __init__ and the vectorcall
+ * constructor. */
+static int
+btree_configure(PyBTreeObject *btree, PyObject *source, int order, int cache_i64,
+                const char *layout, const char *key_type, const char *key_layout,
+                PyObject *aggregate, int duplicates, int write_buffer, int cache_pairs)
+{
+    int bplus;
+    int key_storage;
+    int eytzinger;
+    int agg;
+    PyObject *agg_func;
 
     if (order < BTREE_MIN_ORDER) {
         PyErr_Format(PyExc_ValueError,
@@ -2772,22 +12120,122 @@ btree_init(PyObject *self, PyObject *args, PyObject *kwds)
                      BTREE_MIN_ORDER, order);
         return -1;
     }
+    bplus = btree_parse_layout(layout);
+    if (bplus < 0) {
+        return -1;
+    }
+    key_storage = btree_parse_key_type(key_type);
+    if (key_storage < 0) {
+        return -1;
+    }
+    if (key_storage == KEYS_OBJECT && cache_i64) {
+        key_storage = KEYS_CACHED;
+    }
+    if (cache_pairs && key_storage != KEYS_CACHED) {
+        PyErr_SetString(PyExc_ValueError, "cache_pairs=True needs cache_i64=True");
+        return -1;
+    }
+    eytzinger = btree_parse_key_layout(key_layout);
+    if (eytzinger < 0) {
+        return -1;
+    }
+    if (eytzinger && key_storage != KEYS_CACHED && key_storage != KEYS_I64) {
+        PyErr_SetString(PyExc_ValueError,
+                        "key_layout='eytzinger' needs int64 keys "
+                        "(key_type='i64' or cache_i64=True)");
+        return -1;
+    }
+    if (duplicates && bplus) {
+        PyErr_SetString(PyExc_ValueError, "duplicates=True needs layout='btree'");
+        return -1;
+    }
+    if (write_buffer < 0) {
+        PyErr_Format(PyExc_ValueError, "write_buffer must be non-negative, got %d",
+                     write_buffer);
+        return -1;
+    }
+    btree_discard_writes(btree);
+    if (btree_begin_write(btree) < 0) {
+        return -1;
+    }
+    agg = btree_parse_aggregate(aggregate, &agg_func);
+    if (agg < 0) {
+        return -1;
+    }
 
     btree->order = order;
+    btree->bplus = bplus;
     btree->size = 0;
-    btree->cache_i64 = cache_i64 ? 1 : 0;
+    btree->cache_i64 = key_storage == KEYS_CACHED;
+    btree->key_storage = key_storage;
+    btree->eytzinger = eytzinger;
+    btree->duplicates = duplicates;
+    btree->cache_pairs = cache_pairs;
+    btree->aggregate = agg;
+    Py_XSETREF(btree->agg_func, agg_func);
+    btree->wbuf_size = write_buffer;
 
     /* Clear any existing root */
-    Py_CLEAR(btree->root);
+    NODE_CLEAR(btree->root);
 
-    btree->root = (PyBTreeNode *)btreenode_new(order, 1, btree->cache_i64);
+    btree->root = btreenode_new(order, 1, BTREE_KEY_SPEC(btree));
     if (btree->root == NULL) {
         return -1;
     }
 
+    if (source != NULL) {
+        PairLoader loader;
+        pairloader_init(&loader, (PyObject *)btree);
+        return pairloader_finish(&loader, btree_update_from_arg(source, &loader));
+    }
+
     return 0;
 }
 
+static int
+btree_init(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *source = NULL;
+    PyObject *options = args;
+    int order = BTREE_DEFAULT_ORDER;
+    int cache_i64 = 1;
+    const char *layout = "btree";
+    const char *key_type = NULL;
+    const char *key_layout = "sorted";
+    PyObject *aggregate = NULL;
+    int duplicates = 0;
+    int write_buffer = 0;
+    int cache_pairs = 0;
+    int ok;
+
+    static char *kwlist[] = {"order", "cache_i64", "layout", "key_type", "key_layout",
+                             "aggregate", "duplicates", "write_buffer", "cache_pairs", NULL};
+
+    /* A leading non-int positional argument is the initial contents, as in
+     * dict(iterable); integers keep the SortedDict(order, cache_i64) form. */
+    if (PyTuple_GET_SIZE(args) > 0 && !PyLong_Check(PyTuple_GET_ITEM(args, 0))) {
+        source = PyTuple_GET_ITEM(args, 0);
+        options = PyTuple_GetSlice(args, 1, PyTuple_GET_SIZE(args));
+        if (options == NULL) {
+            return -1;
+        }
+    }
+    else {
+        Py_INCREF(options);
+    }
+
+    ok = PyArg_ParseTupleAndKeywords(options, kwds, "|ipszsOpip", kwlist,
+                                     &order, &cache_i64, &layout, &key_type, &key_layout,
+                                     &aggregate, &duplicates, &write_buffer, &cache_pairs);
+    Py_DECREF(options);
+    if (!ok) {
+        return -1;
+    }
+    return btree_configure((PyBTreeObject *)self, source, order, cache_i64, layout,
+                           key_type, key_layout, aggregate, duplicates, write_buffer,
+                           cache_pairs);
+}
+
 static PyObject *
 btree_new(PyTypeObject *type, PyObject *Py_UNUSED(args), PyObject *Py_UNUSED(kwds))
 {
@@ -2800,17 +12248,153 @@ btree_new(PyTypeObject *type, PyObject *Py_UNUSED(args), PyObject *Py_UNUSED(kwd
 
     self->root = NULL;
     self->size = 0;
+    self->version = 0;
     self->order = BTREE_DEFAULT_ORDER;
     self->cache_i64 = 1;
+    self->key_storage = KEYS_CACHED;
+    self->readonly = 0;
+    self->bplus = 0;
+    self->eytzinger = 0;
+    self->duplicates = 0;
+    self->cache_pairs = 0;
+    self->aggregate = AGG_NONE;
+    self->agg_func = NULL;
+    self->wbuf_size = 0;
+    self->wbuf_n = 0;
+    self->wbuf_cap = 0;
+    self->wbuf = NULL;
+    self->searches = 0;
+    self->edge_hint = 0;
 
     return (PyObject *)self;
 }
 
+static PyObject *
+btree_get_layout(PyObject *self, void *Py_UNUSED(closure))
+{
+    return PyUnicode_FromString(((PyBTreeObject *)self)->bplus ? "bplus" : "btree");
+}
+
+static PyObject *
+btree_get_key_type(PyObject *self, void *Py_UNUSED(closure))
+{
+    const char *key_type = btree_key_type_name((PyBTreeObject *)self);
+
+    if (key_type == NULL) {
+        Py_RETURN_NONE;
+    }
+    return PyUnicode_FromString(key_type);
+}
+
+static PyObject *
+btree_get_key_layout(PyObject *self, void *Py_UNUSED(closure))
+{
+    return PyUnicode_FromString(((PyBTreeObject *)self)->eytzinger ? "eytzinger" : "sorted");
+}
+
+static PyObject *
+btree_get_aggregate(PyObject *self, void *Py_UNUSED(closure))
+{
+    return btree_aggregate_arg((PyBTreeObject *)self);
+}
+
+static PyObject *
+btree_get_duplicates(PyObject *self, void *Py_UNUSED(closure))
+{
+    return PyBool_FromLong(((PyBTreeObject *)self)->duplicates);
+}
+
+static PyObject *
+btree_get_cache_pairs(PyObject *self, void *Py_UNUSED(closure))
+{
+    return PyBool_FromLong(((PyBTreeObject *)self)->cache_pairs);
+}
+
+static PyObject *
+btree_get_write_buffer(PyObject *self, void *Py_UNUSED(closure))
+{
+    return PyLong_FromSsize_t(((PyBTreeObject *)self)->wbuf_size);
+}
+
+static PyGetSetDef btree_getset[] = {
+    {"layout", btree_get_layout, NULL, "Node layout: 'btree' or 'bplus'.", NULL},
+    {"key_type", btree_get_key_type, NULL, "Native key storage: None, 'i64' or 'f64'.", NULL},
+    {"key_layout", btree_get_key_layout, NULL,
+     "Intra-node search layout: 'sorted' or 'eytzinger'.", NULL},
+    {"aggregate", btree_get_aggregate, NULL,
+     "Values combined by aggregate_range(): None, 'sum', 'min', 'max' or a callable.",
+     NULL},
+    {"duplicates", btree_get_duplicates, NULL,
+     "Whether equal keys are kept as separate items, in insertion order.", NULL},
+    {"write_buffer", btree_get_write_buffer, NULL,
+     "Number of bt[key] = value writes held back and applied in key order.", NULL},
+    {"cache_pairs", btree_get_cache_pairs, NULL,
+     "Whether 2-tuples of int64 keys are cached in native columns.", NULL},
+    {NULL, NULL, NULL, NULL, NULL}
+};
+
+BTREE_DEFINE_LOCKED(int, btree_init, self,
+                    (PyObject *self, PyObject *args, PyObject *kwds), (self, args, kwds))
+
+/* tp_vectorcall: SortedDict(...) without packing the arguments into a
+ * tuple and dict for tp_new and tp_init. The new tree is not shared yet, so
+ * it needs no critical section. Subclasses do not inherit tp_vectorcall and
+ * go through tp_new and tp_init as before. */
+static PyObject *
+btree_vectorcall(PyObject *type, PyObject *const *args, size_t nargsf, PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"order", "cache_i64", "layout", "key_type",
+                                         "key_layout", "aggregate", "duplicates",
+                                         "write_buffer", "cache_pairs", NULL};
+    Py_ssize_t nargs = PyVectorcall_NARGS(nargsf);
+    PyObject *argv[9] = {NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL};
+    PyObject *source = NULL;
+    PyObject *self;
+    int order = BTREE_DEFAULT_ORDER;
+    int cache_i64 = 1;
+    const char *layout = "btree";
+    const char *key_type = NULL;
+    const char *key_layout = "sorted";
+    int duplicates = 0;
+    int write_buffer = 0;
+    int cache_pairs = 0;
+
+    /* The same leading source argument as btree_init() */
+    if (nargs > 0 && !PyLong_Check(args[0])) {
+        source = args[0];
+        args++;
+        nargs--;
+    }
+    if (unpack_args("SortedDict", args, nargs, kwnames, kwlist, 0, argv) < 0 ||
+        arg_int("SortedDict", "order", argv[0], &order) < 0 ||
+        arg_bool(argv[1], &cache_i64) < 0 ||
+        arg_str("SortedDict", "layout", argv[2], 0, &layout) < 0 ||
+        arg_str("SortedDict", "key_type", argv[3], 1, &key_type) < 0 ||
+        arg_str("SortedDict", "key_layout", argv[4], 0, &key_layout) < 0 ||
+        arg_bool(argv[6], &duplicates) < 0 ||
+        arg_int("SortedDict", "write_buffer", argv[7], &write_buffer) < 0 ||
+        arg_bool(argv[8], &cache_pairs) < 0) {
+        return NULL;
+    }
+
+    self = btree_new((PyTypeObject *)type, NULL, NULL);
+    if (self == NULL) {
+        return NULL;
+    }
+    if (btree_configure((PyBTreeObject *)self, source, order, cache_i64, layout,
+                        key_type, key_layout, argv[5], duplicates, write_buffer,
+                        cache_pairs) < 0) {
+        Py_DECREF(self);
+        return NULL;
+    }
+    return self;
+}
+
 /* ==================== Type Definition ==================== */
 
 static PyTypeObject PyBTree_Type = {
     PyVarObject_HEAD_INIT(NULL, 0)
-    "btree.SortedDict",                         /* tp_name */
+    "btreedict.SortedDict",                     /* tp_name */
     sizeof(PyBTreeObject),                      /* tp_basicsize */
     0,                                          /* tp_itemsize */
     btree_dealloc,                              /* tp_dealloc */
@@ -2818,7 +12402,7 @@ static PyTypeObject PyBTree_Type = {
     0,                                          /* tp_getattr */
     0,                                          /* tp_setattr */
     0,                                          /* tp_as_async */
-    btree_repr,                                 /* tp_repr */
+    BTREE_LOCKED(btree_repr),                   /* tp_repr */
     0,                                          /* tp_as_number */
     &btree_as_sequence,                         /* tp_as_sequence */
     &btree_as_mapping,                          /* tp_as_mapping */
@@ -2835,22 +12419,135 @@ static PyTypeObject PyBTree_Type = {
     btree_clear_slot,                           /* tp_clear */
     btree_richcompare,                          /* tp_richcompare */
     0,                                          /* tp_weaklistoffset */
-    btree_iter,                                 /* tp_iter */
+    BTREE_LOCKED(btree_iter),                   /* tp_iter */
     0,                                          /* tp_iternext */
     btree_methods,                              /* tp_methods */
     0,                                          /* tp_members */
-    0,                                          /* tp_getset */
+    btree_getset,                               /* tp_getset */
     0,                                          /* tp_base */
     0,                                          /* tp_dict */
     0,                                          /* tp_descr_get */
     0,                                          /* tp_descr_set */
     0,                                          /* tp_dictoffset */
-    btree_init,                                 /* tp_init */
+    BTREE_LOCKED(btree_init),                   /* tp_init */
     PyType_GenericAlloc,                        /* tp_alloc */
     btree_new,                                  /* tp_new */
     PyObject_GC_Del,                            /* tp_free */
 };
 
+/* ==================== C API Capsule ==================== */
+
+typedef struct {
+    PyBTreeObject *btree;
+    size_t version;               /* btree->version when the walk started */
+    PyBTree_VisitFunc visit;
+    void *arg;
+} VisitState;
+
+/* Visit the items of the subtree at node with ranks [start, stop). Returns
+ * 0 to go on, 1 if visit stopped, -1 on error. */
+static int
+range_visit(VisitState *st, PyBTreeNode *node, Py_ssize_t start, Py_ssize_t stop)
+{
+    Py_ssize_t i, offset = 0;
+
+    for (i = 0; i <= node->n_keys && offset < stop; i++) {
+        int status;
+
+        if (!node->is_leaf) {
+            Py_ssize_t count = node->counts[i];
+            if (offset + count > start) {
+                status = range_visit(st, node->children[i],
+                                     start > offset ? start - offset : 0,
+                                     stop - offset < count ? stop - offset : count);
+                if (status != 0) {
+                    return status;
+                }
+            }
+            offset += count;
+        }
+        if (i == node->n_keys || !NODE_HAS_ITEMS(node)) {
+            continue;
+        }
+        if (offset >= start && offset < stop) {
+            /* Object keys are passed as stored; typed keys are boxed. The
+             * item is held across visit, which may write to the tree, and
+             * node is not read again until the version says it is intact. */
+            PyObject *key = node->keys != NULL ? node->keys[i] : node_get_key(node, i);
+            PyObject *value = node->values[i];
+
+            if (key == NULL) {
+                return -1;
+            }
+            if (node->keys != NULL) {
+                Py_INCREF(key);
+            }
+            Py_INCREF(value);
+            status = st->visit(key, value, st->arg);
+            Py_DECREF(key);
+            Py_DECREF(value);
+            if (status != 0) {
+                return status < 0 ? -1 : 1;
+            }
+            if (st->btree->version != st->version) {
+                PyErr_SetString(PyExc_RuntimeError, "SortedDict changed during iteration");
+                return -1;
+            }
+        }
+        offset++;
+    }
+    return 0;
+}
+
+int
+PyBTree_VisitRange(PyObject *self, PyObject *min, PyObject *max, int inclusive_min,
+                   int inclusive_max, PyBTree_VisitFunc visit, void *arg)
+{
+    PyBTreeObject *btree = (PyBTreeObject *)self;
+    VisitState st = {btree, 0, visit, arg};
+    TreeSearch s;
+    Py_ssize_t start, stop;
+
+    if (!PyBTree_Check(self) || visit == NULL) {
+        PyErr_BadInternalCall();
+        return -1;
+    }
+    if (btree_search_begin(btree, &s) < 0 ||
+        btree_search_end(btree, &s, node_range_ranks(s.root, min != NULL ? min : Py_None,
+                                                     max != NULL ? max : Py_None,
+                                                     inclusive_min, inclusive_max,
+                                                     &start, &stop)) < 0) {
+        return -1;
+    }
+    /* visit is free to write to the tree: range_visit() stops at the first
+     * version change without touching a node again */
+    st.version = btree->version;
+    return start < stop ? range_visit(&st, btree->root, start, stop) : 0;
+}
+
+/* Exported as btreedict._C_API, see btreeobject.h */
+static PyBTree_CAPI btree_capi = {
+    PyBTree_CAPI_VERSION,
+    &PyBTree_Type,
+    PyBTree_New,
+    PyBTree_FromSortedItems,
+    PyBTree_FromSortedArrays,
+    PyBTree_Size,
+    PyBTree_Insert,
+    PyBTree_Search,
+    PyBTree_Delete,
+    PyBTree_Contains,
+    PyBTree_GetMin,
+    PyBTree_GetMax,
+    PyBTree_Keys,
+    PyBTree_Values,
+    PyBTree_Items,
+    PyBTree_Clear,
+    PyBTree_Copy,
+    PyBTree_Update,
+    PyBTree_VisitRange,
+};
+
 /* ==================== Module Definition ==================== */
 
 static struct PyModuleDef btreemodule = {
@@ -2871,29 +12568,48 @@ static struct PyModuleDef btreemodule = {
 PyMODINIT_FUNC
 PyInit_btreedict(void)
 {
-    PyObject *m;
+    PyObject *m, *capi;
 
-    /* Finalize the type objects */
-    if (PyType_Ready(&PyBTreeNode_Type) < 0) {
-        return NULL;
-    }
+    /* Finalize the type objects. tp_vectorcall follows slots the static
+     * initializer leaves out, so it is set here. */
+    PyBTree_Type.tp_vectorcall = btree_vectorcall;
     if (PyType_Ready(&PyBTree_Type) < 0) {
         return NULL;
     }
     if (PyType_Ready(&PyBTreeIter_Type) < 0) {
         return NULL;
     }
+    if (PyType_Ready(&NodeShare_Type) < 0) {
+        return NULL;
+    }
     if (PyType_Ready(&PyBTreeReverseIter_Type) < 0) {
         return NULL;
     }
     if (PyType_Ready(&PyBTreeRangeIter_Type) < 0) {
         return NULL;
     }
+    if (PyType_Ready(&PyBTreeCursor_Type) < 0) {
+        return NULL;
+    }
+    if (PyType_Ready(&PyBTreeKeysView_Type) < 0) {
+        return NULL;
+    }
+    if (PyType_Ready(&PyBTreeValuesView_Type) < 0) {
+        return NULL;
+    }
+    if (PyType_Ready(&PyBTreeItemsView_Type) < 0) {
+        return NULL;
+    }
+
+    select_i64_search_kernel();
 
     m = PyModule_Create(&btreemodule);
     if (m == NULL) {
         return NULL;
     }
+#ifdef Py_GIL_DISABLED
+    PyUnstable_Module_SetGIL(m, Py_MOD_GIL_NOT_USED);
+#endif
 
     /* Add the SortedDict type to the module */
     Py_INCREF(&PyBTree_Type);
@@ -2902,6 +12618,16 @@ PyInit_btreedict(void)
         Py_DECREF(m);
         return NULL;
     }
+    if (PyModule_AddStringConstant(m, "_search_kernel", i64_search_kernel) < 0) {
+        Py_DECREF(m);
+        return NULL;
+    }
+    capi = PyCapsule_New(&btree_capi, PyBTree_CAPSULE_NAME, NULL);
+    if (capi == NULL || PyModule_AddObject(m, "_C_API", capi) < 0) {
+        Py_XDECREF(capi);
+        Py_DECREF(m);
+        return NULL;
+    }
 
     return m;
 }
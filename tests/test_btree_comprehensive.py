@@ -10,18 +10,99 @@ Or directly:
     python tests/test_btree_comprehensive.py
 """
 
+import array
+import bisect
+import copy
+import ctypes
+import functools
 import gc
+import io
+import operator
+import pickle
 import random
 import sys
 import os
+import tempfile
+import threading
 import unittest
 import weakref
 
 # Add parent directory to path for in-place builds
 sys.path.insert(0, os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
 
+import btreedict
 from btreedict import SortedDict
 
+# Seed of every randomized test: fixed, so that a failure reproduces
+SEED = 0
+
+
+class MeddlingKey(float):
+    """A float key whose first few < comparisons each empty tree and refill
+    it with the same items, freeing every node, the way a key comparison
+    that runs Python code can write to the tree being searched."""
+
+    def __new__(cls, value, tree, writes=10):
+        self = super().__new__(cls, value)
+        self.tree = tree
+        self.writes = writes
+        return self
+
+    def __lt__(self, other):
+        if self.writes > 0 and len(self.tree):
+            self.writes -= 1
+            items = list(self.tree.items())
+            self.tree.clear()
+            self.tree.update(items)
+        return float(self) < other
+
+    __hash__ = float.__hash__
+
+
+def in_range(key, low, high, inclusive=(True, False)):
+    """Whether key lies in the range irange(low, high, inclusive) walks."""
+    return ((low is None or (key >= low if inclusive[0] else key > low)) and
+            (high is None or (key <= high if inclusive[1] else key < high)))
+
+
+def run_model_ops(test, bt, model, ops, steps, rng, expected=None, check_every=50):
+    """Check bt against model, a dict or list holding the same items, over
+    steps operations drawn from ops (list an op twice to draw it twice as
+    often). Each op(bt, model, step) applies one write or query to both and
+    asserts that they agree. Every check_every steps, and at the end, bt is
+    checked and its items compared with expected(model), by default the
+    sorted items of a dict."""
+    if expected is None:
+        expected = lambda model: sorted(model.items())
+    for step in range(steps):
+        rng.choice(ops)(bt, model, step)
+        if step % check_every == 0:
+            bt._check()
+            test.assertEqual(bt.items(), expected(model))
+    bt._check()
+    test.assertEqual(bt.items(), expected(model))
+
+
+def point_ops(test, random_key):
+    """Ops for run_model_ops() with a dict model: bt[key] = step, pop(key),
+    and get(), bisect_left() and bisect_right(), on keys from random_key()."""
+
+    def assign(bt, model, step):
+        key = random_key()
+        bt[key] = model[key] = step
+
+    def pop(bt, model, step):
+        key = random_key()
+        test.assertEqual(bt.pop(key, None), model.pop(key, None))
+
+    def lookup(bt, model, step):
+        key = random_key()
+        test.assertEqual(bt.get(key), model.get(key))
+        test.assertEqual(bt.bisect_left(key), sum(1 for k in model if k < key))
+        test.assertEqual(bt.bisect_right(key), sum(1 for k in model if k <= key))
+
+    return (assign, assign, assign, assign, pop, pop, lookup)
+
 
 class SortedDictTest(unittest.TestCase):
     """Comprehensive tests for SortedDict, modeled after CPython's dict tests."""
@@ -796,6 +877,33 @@ class SortedDictTest(unittest.TestCase):
         gc.collect()
         self.assertIsNone(ref())
 
+    def test_nodes_not_gc_tracked(self):
+        """Test that only the tree itself is visible to the cyclic GC."""
+        gc.collect()
+        before = len(gc.get_objects())
+        bt = SortedDict(order=2)
+        for i in range(5000):
+            bt[i] = i
+        self.assertLess(len(gc.get_objects()) - before, 10)
+        self.assertTrue(gc.is_tracked(bt))
+
+    def test_reference_cycle_collected(self):
+        """Test that a cycle through the tree's values is collected."""
+        class Node:
+            pass
+
+        for layout in ('btree', 'bplus'):
+            bt = SortedDict(order=3, layout=layout)
+            for i in range(300):
+                bt[i] = Node()
+            holder = Node()
+            holder.tree = bt
+            bt[150] = holder
+            ref = weakref.ref(holder)
+            del bt, holder
+            gc.collect()
+            self.assertIsNone(ref())
+
 
 class SortedDictIteratorTest(unittest.TestCase):
     """Tests specific to SortedDict iteration behavior."""
@@ -1016,6 +1124,39 @@ class SortedDictCopyTest(unittest.TestCase):
         self.assertNotIn('b', bt)
         self.assertEqual(len(bt), 1)
 
+    def test_copy_large_structure(self):
+        """Test copying a multi-level tree preserves contents and invariants."""
+        bt = SortedDict(order=3)
+        keys = list(range(2000))
+        random.Random(SEED).shuffle(keys)
+        for k in keys:
+            bt[k] = str(k)
+        bt_copy = bt.copy()
+        bt_copy._check()
+        self.assertEqual(bt_copy.items(), bt.items())
+
+        for k in range(0, 2000, 2):
+            del bt_copy[k]
+        bt_copy._check()
+        bt._check()
+        self.assertEqual(len(bt), 2000)
+        self.assertEqual(len(bt_copy), 1000)
+
+    def test_copy_preserves_options(self):
+        """Test copy() keeps order and cache_i64 settings."""
+        bt = SortedDict(order=5, cache_i64=False)
+        bt[1] = 1
+        self.assertEqual(repr(bt.copy()), "SortedDict(order=5, size=1, cache_i64=False)")
+
+    def test_copy_mixed_keys(self):
+        """Test copying a tree with big ints and non-int keys."""
+        bt = SortedDict(order=2)
+        for k in [2**70, -2**70, 5, 3, 2**40]:
+            bt[k] = k
+        bt_copy = bt.copy()
+        bt_copy._check()
+        self.assertEqual(bt_copy.keys(), sorted([2**70, -2**70, 5, 3, 2**40]))
+
 
 class SortedDictEqualityTest(unittest.TestCase):
     """Test __eq__ comparison."""
@@ -1263,6 +1404,2679 @@ class SortedDictPopitemTest(unittest.TestCase):
         self.assertEqual(len(bt), 0)
 
 
+class SortedDictPositionalTest(unittest.TestCase):
+    """Test positional access: peekitem/popitem(i), index, bisect, islice."""
+
+    def setUp(self):
+        random.seed(4)
+        self.keys = random.sample(range(10000), 2000)
+        self.sorted_keys = sorted(self.keys)
+        self.bt = SortedDict(order=4)
+        for k in self.keys:
+            self.bt[k] = k * 2
+
+    def test_peekitem_any_index(self):
+        """Test peekitem() at arbitrary positive and negative indices."""
+        for i in (1, 7, 500, 1999, -2, -1000, -2000):
+            k = self.sorted_keys[i]
+            self.assertEqual(self.bt.peekitem(i), (k, k * 2))
+
+    def test_peekitem_out_of_range(self):
+        """Test peekitem() with an index outside the tree."""
+        with self.assertRaises(IndexError):
+            self.bt.peekitem(2000)
+        with self.assertRaises(IndexError):
+            self.bt.peekitem(-2001)
+
+    def test_popitem_any_index(self):
+        """Test popitem() removes the item at an arbitrary index."""
+        expected = list(self.sorted_keys)
+        random.seed(5)
+        for _ in range(300):
+            i = random.randrange(-len(expected), len(expected))
+            k = expected.pop(i)
+            self.assertEqual(self.bt.popitem(i), (k, k * 2))
+        self.assertEqual(self.bt.keys(), expected)
+        self.bt._check()
+
+    def test_popitem_out_of_range(self):
+        """Test popitem() with an index outside the tree leaves it intact."""
+        with self.assertRaises(IndexError):
+            self.bt.popitem(5000)
+        self.assertEqual(len(self.bt), 2000)
+
+    def test_index(self):
+        """Test index() returns the sorted position of a key."""
+        for i in (0, 1, 999, 1999):
+            self.assertEqual(self.bt.index(self.sorted_keys[i]), i)
+        with self.assertRaises(ValueError):
+            self.bt.index(-1)
+
+    def test_bisect(self):
+        """Test bisect_left()/bisect_right() against the bisect module."""
+        import bisect
+        for k in (-5, 0, 1, 4999, 5000, 9999, 10000, 20000):
+            self.assertEqual(self.bt.bisect_left(k),
+                             bisect.bisect_left(self.sorted_keys, k))
+            self.assertEqual(self.bt.bisect_right(k),
+                             bisect.bisect_right(self.sorted_keys, k))
+        k = self.sorted_keys[10]
+        self.assertEqual(self.bt.bisect_left(k), 10)
+        self.assertEqual(self.bt.bisect_right(k), 11)
+        self.assertEqual(self.bt.bisect(k), 11)
+
+    def test_rank_comparison_writes_to_tree(self):
+        """Test index() and bisect when a comparison writes to the tree."""
+        for name in ('index', 'bisect_left', 'bisect_right'):
+            with self.assertRaises(RuntimeError):
+                getattr(self.bt, name)(MeddlingKey(self.sorted_keys[100], self.bt))
+            self.bt._check()
+            self.assertEqual(list(self.bt), self.sorted_keys)
+
+    def test_islice(self):
+        """Test islice() follows list slicing semantics."""
+        for start, stop in [(None, None), (0, 10), (5, 5), (10, 5), (1990, 3000),
+                            (-10, None), (None, -1990), (-3000, 3)]:
+            self.assertEqual(list(self.bt.islice(start, stop)),
+                             self.sorted_keys[start:stop])
+            self.assertEqual(list(self.bt.islice(start, stop, reverse=True)),
+                             self.sorted_keys[start:stop][::-1])
+
+    def test_islice_length_hint(self):
+        """Test islice() iterators report the slice length."""
+        import operator
+        self.assertEqual(operator.length_hint(self.bt.islice(100, 250)), 150)
+
+    def test_positions_after_deletes(self):
+        """Test subtree counts stay correct through deletes and rebalancing."""
+        for k in self.keys[:1500]:
+            del self.bt[k]
+        remaining = sorted(self.keys[1500:])
+        self.bt._check()
+        for i in range(0, len(remaining), 37):
+            self.assertEqual(self.bt.peekitem(i)[0], remaining[i])
+            self.assertEqual(self.bt.index(remaining[i]), i)
+
+    def test_bulk_loaded_positions(self):
+        """Test positional access on a tree built by from_sorted()."""
+        bt = SortedDict.from_sorted(((i, i) for i in range(1000)), order=3,
+                                    fill_factor=0.6)
+        self.assertEqual(bt.peekitem(321), (321, 321))
+        self.assertEqual(list(bt.islice(10, 15)), [10, 11, 12, 13, 14])
+        bt._check()
+
+
+class SortedDictViewsTest(unittest.TestCase):
+    """Test the keys(), values() and items() view objects."""
+
+    def setUp(self):
+        self.bt = SortedDict(order=3)
+        for k in [5, 3, 8, 1, 9, 2, 7]:
+            self.bt[k] = k * 10
+
+    def test_len_and_contains(self):
+        """Test len() and membership on each view."""
+        self.assertEqual(len(self.bt.keys()), 7)
+        self.assertEqual(len(self.bt.values()), 7)
+        self.assertEqual(len(self.bt.items()), 7)
+        self.assertIn(8, self.bt.keys())
+        self.assertNotIn(4, self.bt.keys())
+        self.assertIn(70, self.bt.values())
+        self.assertNotIn(7, self.bt.values())
+        self.assertIn((7, 70), self.bt.items())
+        self.assertNotIn((7, 71), self.bt.items())
+        self.assertNotIn(7, self.bt.items())
+
+    def test_views_are_live(self):
+        """Test views reflect later changes to the SortedDict."""
+        keys = self.bt.keys()
+        items = self.bt.items()
+        self.bt[4] = 40
+        del self.bt[9]
+        self.assertEqual(keys, [1, 2, 3, 4, 5, 7, 8])
+        self.assertEqual(items[-1], (8, 80))
+
+    def test_reversed(self):
+        """Test reversed() on each view."""
+        self.assertEqual(list(reversed(self.bt.keys())), [9, 8, 7, 5, 3, 2, 1])
+        self.assertEqual(list(reversed(self.bt.values())), [90, 80, 70, 50, 30, 20, 10])
+        self.assertEqual(list(reversed(self.bt.items()))[0], (9, 90))
+
+    def test_indexing_and_slicing(self):
+        """Test positional indexing and slicing on views."""
+        keys = [1, 2, 3, 5, 7, 8, 9]
+        self.assertEqual(self.bt.keys()[0], 1)
+        self.assertEqual(self.bt.keys()[-2], 8)
+        self.assertEqual(self.bt.values()[3], 50)
+        self.assertEqual(self.bt.items()[4], (7, 70))
+        self.assertEqual(self.bt.keys()[2:5], keys[2:5])
+        self.assertEqual(self.bt.keys()[::-2], keys[::-2])
+        self.assertEqual(self.bt.items()[5:], [(8, 80), (9, 90)])
+        with self.assertRaises(IndexError):
+            self.bt.keys()[7]
+        with self.assertRaises(TypeError):
+            self.bt.keys()['a']
+
+    def test_sequence_equality(self):
+        """Test views compare equal to lists, tuples and like views."""
+        self.assertEqual(self.bt.keys(), [1, 2, 3, 5, 7, 8, 9])
+        self.assertEqual(self.bt.keys(), (1, 2, 3, 5, 7, 8, 9))
+        self.assertNotEqual(self.bt.keys(), [1, 2, 3])
+        self.assertEqual(self.bt.items(), self.bt.copy().items())
+        self.assertNotEqual(self.bt.keys(), self.bt.values())
+        self.assertTrue(self.bt.keys() < [1, 2, 4])
+
+    def test_keys_set_operations(self):
+        """Test the keys view behaves like a set."""
+        keys = self.bt.keys()
+        self.assertEqual(keys, {1, 2, 3, 5, 7, 8, 9})
+        self.assertEqual(keys & {1, 4, 9}, {1, 9})
+        self.assertEqual({1, 4, 9} & keys, {1, 9})
+        self.assertEqual(keys | {4}, {1, 2, 3, 4, 5, 7, 8, 9})
+        self.assertEqual(keys - {1, 2, 3}, {5, 7, 8, 9})
+        self.assertEqual({1, 4} - keys, {4})
+        self.assertEqual(keys ^ {1, 4}, {2, 3, 4, 5, 7, 8, 9})
+        self.assertTrue(keys <= {1, 2, 3, 4, 5, 6, 7, 8, 9})
+        self.assertTrue(keys.isdisjoint([4, 6]))
+        self.assertFalse(keys.isdisjoint([4, 5]))
+        self.assertEqual(keys, {k: None for k in keys}.keys())
+
+    def test_items_iteration(self):
+        """Test items iteration yields correct pairs whether or not kept."""
+        kept = list(self.bt.items())
+        self.assertEqual(kept, [(1, 10), (2, 20), (3, 30), (5, 50),
+                                (7, 70), (8, 80), (9, 90)])
+        total = 0
+        for k, v in self.bt.items():
+            total += v - k * 10
+        self.assertEqual(total, 0)
+        self.assertEqual(dict(self.bt.items()), dict(kept))
+
+    def test_repr(self):
+        """Test view repr."""
+        bt = SortedDict()
+        bt[1] = 'a'
+        self.assertEqual(repr(bt.keys()), "SortedKeysView([1])")
+        self.assertEqual(repr(bt.items()), "SortedItemsView([(1, 'a')])")
+
+    def test_unhashable(self):
+        """Test views are unhashable like lists."""
+        with self.assertRaises(TypeError):
+            hash(self.bt.keys())
+
+
+class SortedDictFromSortedTest(unittest.TestCase):
+    """Test bulk loading via from_sorted() and sorted-input detection."""
+
+    def test_from_sorted_basic(self):
+        """Test from_sorted() builds the expected mapping."""
+        bt = SortedDict.from_sorted((i, i * 10) for i in range(1000))
+        self.assertEqual(len(bt), 1000)
+        self.assertEqual(bt.keys(), list(range(1000)))
+        self.assertEqual(bt[500], 5000)
+        bt._check()
+
+    def test_from_sorted_empty(self):
+        """Test from_sorted() with no items."""
+        bt = SortedDict.from_sorted([])
+        self.assertEqual(len(bt), 0)
+        bt[1] = 'one'
+        self.assertEqual(bt.items(), [(1, 'one')])
+
+    def test_from_sorted_orders_and_fill(self):
+        """Test structure is valid across orders, sizes and fill factors."""
+        for order in [2, 3, 5, 16]:
+            for n in [1, 2, 3, 7, 40, 333]:
+                for fill in [0.1, 0.5, 1.0]:
+                    bt = SortedDict.from_sorted(
+                        [(i, i) for i in range(n)], order=order, fill_factor=fill)
+                    bt._check()
+                    self.assertEqual(bt.keys(), list(range(n)))
+
+    def test_from_sorted_then_mutate(self):
+        """Test a bulk-loaded tree supports inserts and deletes."""
+        bt = SortedDict.from_sorted([(i, i) for i in range(0, 2000, 2)], order=3)
+        for i in range(1, 2000, 2):
+            bt[i] = i
+        bt._check()
+        for i in range(0, 2000, 3):
+            del bt[i]
+        bt._check()
+        expected = [i for i in range(2000) if i % 3 != 0]
+        self.assertEqual(bt.keys(), expected)
+
+    def test_from_sorted_rejects_unsorted(self):
+        """Test from_sorted() raises on unsorted or duplicate keys."""
+        with self.assertRaises(ValueError):
+            SortedDict.from_sorted([(2, 'b'), (1, 'a')])
+        with self.assertRaises(ValueError):
+            SortedDict.from_sorted([(1, 'a'), (1, 'b')])
+
+    def test_from_sorted_invalid_fill_factor(self):
+        """Test from_sorted() validates fill_factor."""
+        with self.assertRaises(ValueError):
+            SortedDict.from_sorted([(1, 1)], fill_factor=0)
+        with self.assertRaises(ValueError):
+            SortedDict.from_sorted([(1, 1)], fill_factor=1.5)
+
+    def test_from_sorted_options(self):
+        """Test from_sorted() honours order and cache_i64."""
+        bt = SortedDict.from_sorted([(1, 1)], order=7, cache_i64=False)
+        self.assertEqual(repr(bt), "SortedDict(order=7, size=1, cache_i64=False)")
+
+    def test_from_sorted_subclass(self):
+        """Test from_sorted() constructs the calling subclass."""
+        class MyDict(SortedDict):
+            pass
+        bt = MyDict.from_sorted([(1, 'a'), (2, 'b')])
+        self.assertIsInstance(bt, MyDict)
+        self.assertEqual(bt.items(), [(1, 'a'), (2, 'b')])
+
+    def test_constructor_with_iterable(self):
+        """Test SortedDict(iterable) with sorted and unsorted input."""
+        self.assertEqual(SortedDict([(1, 'a'), (2, 'b')]).items(), [(1, 'a'), (2, 'b')])
+        bt = SortedDict([(3, 'c'), (1, 'a'), (2, 'b'), (1, 'z')])
+        self.assertEqual(bt.items(), [(1, 'z'), (2, 'b'), (3, 'c')])
+        bt._check()
+
+    def test_constructor_with_mapping_and_order(self):
+        """Test SortedDict(mapping, order=...) keeps the options."""
+        bt = SortedDict({i: i for i in range(100)}, order=3)
+        self.assertEqual(repr(bt), "SortedDict(order=3, size=100, cache_i64=True)")
+        bt._check()
+
+    def test_constructor_positional_order(self):
+        """Test SortedDict(order) positional form still works."""
+        bt = SortedDict(5)
+        self.assertEqual(repr(bt), "SortedDict(order=5, size=0, cache_i64=True)")
+
+    def test_update_sorted_into_empty(self):
+        """Test update() bulk-loads sorted input into an empty tree."""
+        bt = SortedDict(order=4)
+        bt.update((i, -i) for i in range(500))
+        bt._check()
+        self.assertEqual(bt.values(), [-i for i in range(500)])
+
+    def test_update_partially_sorted(self):
+        """Test update() falls back correctly when order breaks midway."""
+        pairs = [(i, i) for i in range(100)] + [(50, 'x')] + [(i, i) for i in range(200, 100, -1)]
+        bt = SortedDict(order=3)
+        bt.update(pairs)
+        bt._check()
+        expected = dict(pairs)
+        self.assertEqual(bt.items(), sorted(expected.items()))
+
+    def test_update_error_element(self):
+        """Test update() still reports malformed elements."""
+        bt = SortedDict()
+        with self.assertRaises(ValueError):
+            bt.update([(1, 2, 3)])
+        with self.assertRaises(TypeError):
+            bt.update([1])
+
+
+class SortedDictSnapshotTest(unittest.TestCase):
+    """Test copy-on-write snapshot() views."""
+
+    def test_snapshot_contents(self):
+        """Test a snapshot sees the contents at the time it was taken."""
+        bt = SortedDict()
+        for i in range(100):
+            bt[i] = i
+        snap = bt.snapshot()
+        self.assertEqual(len(snap), 100)
+        self.assertEqual(snap.items(), bt.items())
+
+    def test_snapshot_isolated_from_writes(self):
+        """Test later inserts, updates and deletes don't leak into a snapshot."""
+        bt = SortedDict(order=3)
+        for i in range(500):
+            bt[i] = i
+        snap = bt.snapshot()
+        for i in range(0, 500, 2):
+            del bt[i]
+        for i in range(500, 700):
+            bt[i] = i
+        for i in range(1, 500, 2):
+            bt[i] = -i
+        bt._check()
+        snap._check()
+        self.assertEqual(snap.items(), [(i, i) for i in range(500)])
+        self.assertEqual(len(bt), 450)
+        self.assertEqual(bt[1], -1)
+
+    def test_snapshot_is_readonly(self):
+        """Test mutating a snapshot raises TypeError."""
+        bt = SortedDict()
+        bt[1] = 'one'
+        snap = bt.snapshot()
+        with self.assertRaises(TypeError):
+            snap[2] = 'two'
+        with self.assertRaises(TypeError):
+            del snap[1]
+        with self.assertRaises(TypeError):
+            snap.clear()
+        with self.assertRaises(TypeError):
+            snap.update({3: 'three'})
+        with self.assertRaises(TypeError):
+            snap.popitem()
+        self.assertEqual(snap.items(), [(1, 'one')])
+
+    def test_snapshot_copy_is_writable(self):
+        """Test copy() of a snapshot yields an independent writable tree."""
+        bt = SortedDict()
+        bt[1] = 'one'
+        tree = bt.snapshot().copy()
+        tree[2] = 'two'
+        self.assertEqual(tree.items(), [(1, 'one'), (2, 'two')])
+        self.assertEqual(bt.items(), [(1, 'one')])
+
+    def test_many_snapshots_random_ops(self):
+        """Test several live snapshots under random mutation."""
+        rng = random.Random(SEED)
+        bt = SortedDict(order=2)
+        ref = {}
+        snaps = []
+        for step in range(3000):
+            key = rng.randrange(300)
+            if rng.random() < 0.6:
+                bt[key] = step
+                ref[key] = step
+            elif key in ref:
+                del bt[key]
+                del ref[key]
+            if step % 250 == 0:
+                snaps.append((bt.snapshot(), sorted(ref.items())))
+        bt._check()
+        self.assertEqual(bt.items(), sorted(ref.items()))
+        for snap, expected in snaps:
+            snap._check()
+            self.assertEqual(snap.items(), expected)
+
+    def test_snapshot_outlives_tree(self):
+        """Test a snapshot stays valid after the source tree is gone."""
+        bt = SortedDict()
+        for i in range(1000):
+            bt[i] = str(i)
+        snap = bt.snapshot()
+        del bt
+        gc.collect()
+        self.assertEqual(snap[999], '999')
+        self.assertEqual(len(list(snap)), 1000)
+
+    def test_cycle_through_snapshot_collected(self):
+        """Test that a cycle through nodes shared with a snapshot is collected."""
+        class Holder(list):
+            pass
+
+        bt = SortedDict()
+        holder = Holder()
+        bt[0] = holder
+        snap = bt.snapshot()
+        holder.append(bt)
+        holder.append(snap)
+        ref = weakref.ref(holder)
+        del bt, snap, holder
+        gc.collect()
+        self.assertIsNone(ref())
+
+        # Writes after the snapshot share the untouched children instead
+        bt = SortedDict(order=3)
+        holder = Holder([bt])
+        bt[-1] = holder
+        for i in range(2000):
+            bt[i] = i
+        snap = bt.snapshot()
+        for i in range(0, 2000, 7):
+            bt[i] = -i
+        holder.append(snap.snapshot())
+        ref = weakref.ref(holder)
+        del bt, snap, holder
+        gc.collect()
+        self.assertIsNone(ref())
+
+    def test_snapshot_keeps_shared_values_after_collection(self):
+        """Test that collecting a tree's cycle leaves its snapshot intact."""
+        class Holder(list):
+            pass
+
+        bt = SortedDict(order=3)
+        for i in range(1000):
+            bt[i] = [i]
+        holder = Holder([bt])
+        bt[-1] = holder
+        snap = bt.snapshot()
+        bt[500] = None
+        del bt, holder
+        gc.collect()
+        snap._check()
+        self.assertEqual(len(snap), 1001)
+        self.assertEqual(snap[500], [500])
+        self.assertIsInstance(snap[-1][0], SortedDict)
+
+
+class SortedDictBPlusLayoutTest(unittest.TestCase):
+    """Test the leaf-chained B+tree layout."""
+
+    def test_layout_attribute(self):
+        """Test layout is reported and validated."""
+        self.assertEqual(SortedDict().layout, 'btree')
+        bt = SortedDict(layout='bplus')
+        self.assertEqual(bt.layout, 'bplus')
+        self.assertIn("layout='bplus'", repr(bt))
+        with self.assertRaises(ValueError):
+            SortedDict(layout='hash')
+
+    def test_insert_lookup_delete(self):
+        """Test basic mapping operations match a dict reference."""
+        bt = SortedDict(order=3, layout='bplus')
+        ref = {}
+        rng = random.Random(SEED)
+        for _ in range(3000):
+            key = rng.randrange(500)
+            if rng.random() < 0.6:
+                bt[key] = key * 2
+                ref[key] = key * 2
+            elif key in ref:
+                del bt[key]
+                del ref[key]
+            else:
+                with self.assertRaises(KeyError):
+                    del bt[key]
+        bt._check()
+        self.assertEqual(bt.items(), sorted(ref.items()))
+        for key in range(500):
+            self.assertEqual(key in bt, key in ref)
+            self.assertEqual(bt.get(key), ref.get(key))
+
+    def test_delete_to_empty(self):
+        """Test removing every key leaves a valid empty tree."""
+        bt = SortedDict(order=2, layout='bplus')
+        keys = list(range(200))
+        for key in keys:
+            bt[key] = key
+        random.Random(SEED).shuffle(keys)
+        for key in keys:
+            del bt[key]
+        bt._check()
+        self.assertEqual(len(bt), 0)
+        self.assertEqual(list(bt), [])
+        bt[1] = 1
+        self.assertEqual(bt.items(), [(1, 1)])
+
+    def test_iteration_and_ranges(self):
+        """Test forward, reverse and range scans over the leaf chain."""
+        bt = SortedDict(order=4, layout='bplus')
+        for key in range(0, 1000, 2):
+            bt[key] = -key
+        keys = list(range(0, 1000, 2))
+        self.assertEqual(list(bt), keys)
+        self.assertEqual(list(reversed(bt)), keys[::-1])
+        self.assertEqual(list(bt.values()), [-k for k in keys])
+        self.assertEqual(list(bt.irange(101, 121)), list(range(102, 121, 2)))
+        self.assertEqual(list(bt.irange(100, 120, (False, True))),
+                         list(range(102, 121, 2)))
+        self.assertEqual(list(bt.irange(None, 6)), [0, 2, 4])
+        self.assertEqual(list(bt.irange(994)), [994, 996, 998])
+
+    def test_positional_access(self):
+        """Test order-statistic methods on the B+tree layout."""
+        bt = SortedDict(order=3, layout='bplus')
+        for key in range(100):
+            bt[key] = key
+        self.assertEqual(bt.peekitem(37), (37, 37))
+        self.assertEqual(bt.index(64), 64)
+        self.assertEqual(bt.bisect_left(50), 50)
+        self.assertEqual(bt.bisect_right(50), 51)
+        self.assertEqual(list(bt.islice(10, 15)), [10, 11, 12, 13, 14])
+        self.assertEqual(list(bt.islice(10, 15, reverse=True)),
+                         [14, 13, 12, 11, 10])
+        self.assertEqual(bt.keys()[-3:], [97, 98, 99])
+        self.assertEqual(bt.popitem(0), (0, 0))
+        bt._check()
+
+    def test_from_sorted(self):
+        """Test bulk loading builds a valid B+tree."""
+        for n in (0, 1, 2, 7, 100, 1000):
+            for fill in (0.01, 0.5, 1.0):
+                bt = SortedDict.from_sorted(((i, i) for i in range(n)),
+                                            order=3, fill_factor=fill,
+                                            layout='bplus')
+                bt._check()
+                self.assertEqual(bt.layout, 'bplus')
+                self.assertEqual(list(bt), list(range(n)))
+                self.assertEqual(list(reversed(bt)), list(range(n))[::-1])
+
+    def test_copy_and_snapshot(self):
+        """Test copies and snapshots are independent and keep the layout."""
+        bt = SortedDict(order=3, layout='bplus')
+        for key in range(300):
+            bt[key] = key
+        clone = bt.copy()
+        snap = bt.snapshot()
+        for key in range(0, 300, 2):
+            del bt[key]
+        for tree in (bt, clone, snap):
+            tree._check()
+        self.assertEqual(clone.layout, 'bplus')
+        self.assertEqual(list(clone), list(range(300)))
+        self.assertEqual(list(snap), list(range(300)))
+        self.assertEqual(list(bt), list(range(1, 300, 2)))
+
+
+class SortedDictTypedKeysTest(unittest.TestCase):
+    """Test native int64/float64 key storage."""
+
+    LAYOUTS = ('btree', 'bplus')
+
+    def test_key_type_attribute(self):
+        """Test key_type is reported and validated."""
+        self.assertIsNone(SortedDict().key_type)
+        bt = SortedDict(key_type='i64')
+        self.assertEqual(bt.key_type, 'i64')
+        self.assertIn("key_type='i64'", repr(bt))
+        self.assertEqual(SortedDict(key_type='f64').key_type, 'f64')
+        with self.assertRaises(ValueError):
+            SortedDict(key_type='str')
+
+    def test_i64_matches_dict(self):
+        """Test an i64 tree behaves like a dict with sorted int keys."""
+        for layout in self.LAYOUTS:
+            bt = SortedDict(order=3, layout=layout, key_type='i64')
+            ref = {}
+            rng = random.Random(SEED)
+            for _ in range(3000):
+                key = rng.randrange(-400, 400) * rng.choice((1, 2 ** 52))
+                if rng.random() < 0.6:
+                    bt[key] = key
+                    ref[key] = key
+                elif key in ref:
+                    del bt[key]
+                    del ref[key]
+            bt._check()
+            self.assertEqual(bt.items(), sorted(ref.items()))
+            self.assertEqual(list(reversed(bt)), sorted(ref, reverse=True))
+            lo, hi = -10 * 2 ** 52, 10 * 2 ** 52
+            self.assertEqual(list(bt.irange(lo, hi)),
+                             sorted(k for k in ref if lo <= k < hi))
+            self.assertEqual(bt.min(), min(ref))
+            self.assertEqual(bt.max(), max(ref))
+
+    def test_i64_key_validation(self):
+        """Test i64 trees reject non-int and out-of-range keys."""
+        bt = SortedDict(key_type='i64')
+        bt[1] = 'one'
+        with self.assertRaises(TypeError):
+            bt['a'] = 1
+        with self.assertRaises(TypeError):
+            bt[1.5] = 1
+        with self.assertRaises(OverflowError):
+            bt[2 ** 63] = 1
+        self.assertNotIn(2 ** 63, bt)
+        self.assertEqual(bt.bisect_left(2 ** 100), 1)
+        self.assertEqual(bt.bisect_left(-2 ** 100), 0)
+        self.assertIs(type(bt.peekitem(0)[0]), int)
+        bt._check()
+
+    def test_f64_keys(self):
+        """Test f64 trees convert ints and reject NaN."""
+        for layout in self.LAYOUTS:
+            bt = SortedDict(order=2, layout=layout, key_type='f64')
+            for i in range(200):
+                bt[i / 4] = i
+            bt[3] = 'int'
+            self.assertEqual(bt[3.0], 'int')
+            self.assertEqual(len(bt), 200)
+            self.assertIs(type(bt.min()), float)
+            self.assertEqual(list(bt.irange(1, 2)), [1.0, 1.25, 1.5, 1.75])
+            with self.assertRaises(ValueError):
+                bt[float('nan')] = 1
+            with self.assertRaises(TypeError):
+                bt['1.0'] = 1
+            bt._check()
+
+    def test_from_sorted_copy_snapshot(self):
+        """Test bulk loading, copies and snapshots keep the key type."""
+        for layout in self.LAYOUTS:
+            bt = SortedDict.from_sorted(((i, i) for i in range(500)), order=3,
+                                        fill_factor=0.6, layout=layout,
+                                        key_type='i64')
+            bt._check()
+            self.assertEqual(bt.key_type, 'i64')
+            clone = bt.copy()
+            snap = bt.snapshot()
+            for key in range(0, 500, 2):
+                del bt[key]
+            for tree in (bt, clone, snap):
+                tree._check()
+                self.assertEqual(tree.key_type, 'i64')
+            self.assertEqual(list(clone), list(range(500)))
+            self.assertEqual(list(snap), list(range(500)))
+            self.assertEqual(list(bt), list(range(1, 500, 2)))
+            with self.assertRaises(TypeError):
+                SortedDict.from_sorted([('a', 1)], key_type='i64')
+
+
+class SortedDictSearchKernelTest(unittest.TestCase):
+    """Test the vector int64 node search against plain lookups."""
+
+    def test_kernel_reported(self):
+        """Test the selected kernel is exposed for diagnostics."""
+        import btreedict
+        self.assertIn(btreedict._search_kernel,
+                      ('scalar', 'avx2', 'avx512', 'neon'))
+
+    def test_lower_bound_every_node_size(self):
+        """Test bisect and membership for every fill of a single node."""
+        for key_type in (None, 'i64'):
+            for n in range(0, 128):
+                bt = SortedDict(key_type=key_type)
+                for i in range(n):
+                    bt[i * 3 - 100] = i
+                for probe in range(-110, n * 3 - 90):
+                    expected = sum(1 for i in range(n) if i * 3 - 100 < probe)
+                    self.assertEqual(bt.bisect_left(probe), expected)
+                    self.assertEqual(probe in bt, probe % 3 == 2 and
+                                     -100 <= probe < n * 3 - 100)
+
+    def test_extreme_and_mixed_keys(self):
+        """Test int64 extremes and nodes mixing ints with other numbers."""
+        extremes = [-2 ** 63, -2 ** 63 + 1, -1, 0, 1, 2 ** 63 - 2, 2 ** 63 - 1]
+        for key_type in (None, 'i64'):
+            bt = SortedDict(key_type=key_type)
+            for key in extremes:
+                bt[key] = key
+            for key in extremes:
+                self.assertEqual(bt[key], key)
+            self.assertEqual(bt.bisect_left(2 ** 63 - 1), 6)
+            self.assertEqual(bt.bisect_right(-2 ** 63), 1)
+        bt = SortedDict()
+        for i in range(50):
+            bt[i] = i
+        bt[10.5] = 'float'
+        bt[2 ** 70] = 'big'
+        self.assertEqual(bt[10.5], 'float')
+        self.assertEqual(bt.bisect_left(11), 12)
+        self.assertEqual(bt[2 ** 70], 'big')
+        bt._check()
+
+
+class SortedDictKeyLayoutTest(unittest.TestCase):
+    """Test the Eytzinger intra-node search layout."""
+
+    def test_key_layout_attribute(self):
+        """Test key_layout is reported and validated."""
+        self.assertEqual(SortedDict().key_layout, 'sorted')
+        bt = SortedDict(key_layout='eytzinger')
+        self.assertEqual(bt.key_layout, 'eytzinger')
+        self.assertIn("key_layout='eytzinger'", repr(bt))
+        with self.assertRaises(ValueError):
+            SortedDict(key_layout='bfs')
+        with self.assertRaises(ValueError):
+            SortedDict(key_type='f64', key_layout='eytzinger')
+        with self.assertRaises(ValueError):
+            SortedDict(cache_i64=False, key_layout='eytzinger')
+
+    def test_reads_between_writes(self):
+        """Test lookups stay correct as writes invalidate the search copy."""
+        for key_type in (None, 'i64'):
+            for layout in ('btree', 'bplus'):
+                bt = SortedDict(order=8, layout=layout, key_type=key_type,
+                                key_layout='eytzinger')
+                ref = {}
+                rng = random.Random(SEED)
+                for step in range(4000):
+                    key = rng.randrange(-300, 300)
+                    op = rng.random()
+                    if op < 0.4:
+                        bt[key] = step
+                        ref[key] = step
+                    elif op < 0.6 and key in ref:
+                        del bt[key]
+                        del ref[key]
+                    else:
+                        self.assertEqual(bt.get(key), ref.get(key))
+                        self.assertEqual(bt.bisect_left(key),
+                                         sum(1 for k in ref if k < key))
+                    if step % 500 == 0:
+                        bt._check()
+                bt._check()
+                self.assertEqual(bt.items(), sorted(ref.items()))
+
+    def test_large_order(self):
+        """Test a wide node searched through its Eytzinger copy."""
+        bt = SortedDict.from_sorted(((i * 2, i) for i in range(3000)), order=1024,
+                                    key_layout='eytzinger')
+        for probe in range(-1, 6001):
+            self.assertEqual(probe in bt, probe % 2 == 0 and probe < 6000)
+        self.assertEqual(list(bt.irange(101, 107)), [102, 104, 106])
+        bt._check()
+
+    def test_mixed_keys_and_copies(self):
+        """Test nodes with non-int keys and copies of indexed trees."""
+        bt = SortedDict(key_layout='eytzinger')
+        for i in range(40):
+            bt[i] = i
+        self.assertEqual(bt[7], 7)
+        bt[7.5] = 'float'
+        self.assertEqual(bt[7.5], 'float')
+        self.assertEqual(bt.bisect_left(8), 9)
+        clone = bt.copy()
+        snap = bt.snapshot()
+        del bt[7.5]
+        for tree in (bt, clone, snap):
+            self.assertEqual(tree.key_layout, 'eytzinger')
+            self.assertEqual(tree[20], 20)
+            tree._check()
+        self.assertIn(7.5, clone)
+        self.assertNotIn(7.5, bt)
+
+
+class SortedDictThreadingTest(unittest.TestCase):
+    """Test concurrent use from several threads."""
+
+    def setUp(self):
+        self.interval = sys.getswitchinterval()
+        sys.setswitchinterval(1e-6)
+
+    def tearDown(self):
+        sys.setswitchinterval(self.interval)
+
+    def run_threads(self, *targets):
+        errors = []
+
+        def wrap(target):
+            try:
+                target()
+            except BaseException as exc:  # Reported in the main thread
+                errors.append(exc)
+
+        threads = [threading.Thread(target=wrap, args=(t,)) for t in targets]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        if errors:
+            raise errors[0]
+
+    def test_readers_and_writer(self):
+        """Test lookups and snapshots while another thread writes."""
+        for options in (dict(), dict(layout='bplus'),
+                        dict(key_type='i64', key_layout='eytzinger')):
+            bt = SortedDict(order=4, **options)
+            for i in range(0, 2000, 2):
+                bt[i] = i
+            done = threading.Event()
+
+            def writer():
+                rng = random.Random(SEED)
+                for _ in range(20000):
+                    key = rng.randrange(1, 2000, 2)
+                    if rng.random() < 0.5:
+                        bt[key] = key
+                    else:
+                        bt.pop(key, None)
+                done.set()
+
+            def reader():
+                rng = random.Random(threading.get_ident())
+                while not done.is_set():
+                    key = rng.randrange(0, 2000, 2)
+                    self.assertEqual(bt.get(key), key)
+                    self.assertIn(key, bt)
+                    self.assertEqual(bt[key], key)
+                    self.assertGreaterEqual(bt.bisect_left(key), key // 2)
+                    snap = bt.snapshot()
+                    self.assertEqual(len(list(snap.keys())), len(snap))
+
+            self.run_threads(writer, reader, reader)
+            bt._check()
+            self.assertEqual([k for k in bt if k % 2 == 0], list(range(0, 2000, 2)))
+
+    def test_comparison_modifies_tree(self):
+        """Test a lookup whose key comparison writes to the same tree."""
+        bt = SortedDict(order=2)
+        for i in range(100):
+            bt[i] = i
+
+        class Meddler(float):
+            def __lt__(self, other):
+                if len(bt) > 50:
+                    del bt[min(bt.keys())]
+                    bt[1000 + len(bt)] = None
+                return float(self) < other
+
+            def __gt__(self, other):
+                return float(self) > other
+
+            __hash__ = float.__hash__
+
+        self.assertIsNone(bt.get(Meddler(60.5)))
+        self.assertNotIn(Meddler(70.5), bt)
+        bt._check()
+
+    def test_comparison_writes_to_bplus_tree(self):
+        """Test B+tree lookups refuse writes from their key comparisons."""
+        lookups = (lambda bt, key: bt.get(key),
+                   lambda bt, key: key in bt,
+                   lambda bt, key: bt.get_many([key]),
+                   lambda bt, key: bt.irange_array(key),
+                   lambda bt, key: list(bt.irange(key)),
+                   lambda bt, key: bt.cursor().seek(key),
+                   lambda bt, key: bt.bisect_left(key),
+                   lambda bt, key: bt.count_range(key, 200))
+        for lookup in lookups:
+            bt = SortedDict(((i, i) for i in range(300)), order=2, layout='bplus')
+            with self.assertRaises(RuntimeError):
+                lookup(bt, MeddlingKey(100.5, bt))
+            bt._check()
+            self.assertEqual(bt.keys(), list(range(300)))
+            bt[300] = 300
+            self.assertEqual(len(bt), 301)
+
+
+class SortedDictBatchTest(unittest.TestCase):
+    """Test get_many(), contains_many(), pop_many() and set_many()."""
+
+    def test_get_many_matches_get(self):
+        """Test batch lookups in sorted, reversed and random key order."""
+        rng = random.Random(SEED)
+        for options in (dict(), dict(layout='bplus'), dict(key_type='i64'),
+                        dict(key_type='f64'), dict(key_layout='eytzinger')):
+            bt = SortedDict(order=3, **options)
+            for key in rng.sample(range(-2000, 2000), 1500):
+                bt[key] = -key
+            probes = [rng.randrange(-2500, 2500) for _ in range(1000)]
+            for batch in (probes, sorted(probes), sorted(probes, reverse=True)):
+                self.assertEqual(bt.get_many(batch, 'missing'),
+                                 [bt.get(k, 'missing') for k in batch])
+                self.assertEqual(bt.contains_many(iter(batch)),
+                                 [k in bt for k in batch])
+
+    def test_empty_and_errors(self):
+        """Test empty inputs, empty trees and propagated errors."""
+        bt = SortedDict()
+        self.assertEqual(bt.get_many([1, 2]), [None, None])
+        self.assertEqual(bt.contains_many(()), [])
+        bt[1] = 'one'
+        with self.assertRaises(TypeError):
+            bt.get_many([1, 'one'])
+        with self.assertRaises(TypeError):
+            bt.contains_many(5)
+        typed = SortedDict(key_type='i64')
+        typed[1] = 'one'
+        self.assertEqual(typed.get_many([2 ** 70, 1, -2 ** 70]), [None, 'one', None])
+
+    def test_pop_many(self):
+        """Test batch removal with missing keys and duplicates."""
+        for layout in ('btree', 'bplus'):
+            bt = SortedDict(((i, str(i)) for i in range(100)), order=2, layout=layout)
+            self.assertEqual(bt.pop_many([5, 500, 5, 7]), ['5', None, None, '7'])
+            self.assertEqual(bt.pop_many(range(90, 110), 0)[-11:], ['99'] + [0] * 10)
+            self.assertEqual(len(bt), 88)
+            bt._check()
+        with self.assertRaises(TypeError):
+            bt.snapshot().pop_many([1])
+
+    def test_set_many(self):
+        """Test batch assignment, bulk loading and length mismatch."""
+        bt = SortedDict(order=4)
+        bt.set_many(range(1000), range(1000, 2000))
+        self.assertEqual(bt.items()[:2], [(0, 1000), (1, 1001)])
+        bt.set_many([5, 2000, 5], ['a', 'b', 'c'])
+        self.assertEqual((bt[5], bt[2000], len(bt)), ('c', 'b', 1001))
+        with self.assertRaises(ValueError):
+            bt.set_many([1, 2], [1])
+        self.assertEqual(bt[1], 1001)
+        bt._check()
+
+
+class SortedDictArrayTest(unittest.TestCase):
+    """Test keys_array(), values_array(), irange_array() and buffer input."""
+
+    def test_export_matches_views(self):
+        """Test exported arrays against the views for every key storage."""
+        rng = random.Random(SEED)
+        for options in (dict(), dict(layout='bplus'), dict(key_type='i64'),
+                        dict(key_type='f64'), dict(cache_i64=False)):
+            bt = SortedDict(order=3, **options)
+            for key in rng.sample(range(-10 ** 6, 10 ** 6), 500):
+                bt[key] = key // 7
+            keys = bt.keys_array()
+            self.assertEqual(keys.format, 'd' if options.get('key_type') == 'f64' else 'q')
+            self.assertEqual(keys.tolist(), list(bt.keys()))
+            self.assertEqual(bt.keys_array(dtype='float64').tolist(),
+                             [float(k) for k in bt.keys()])
+            self.assertEqual(bt.values_array().tolist(), list(bt.values()))
+            self.assertEqual(bt.values_array('float64').tolist(),
+                             [float(v) for v in bt.values()])
+            for _ in range(20):
+                low, high = sorted(rng.sample(range(-10 ** 6, 10 ** 6), 2))
+                for inclusive in ((True, False), (False, True)):
+                    self.assertEqual(bt.irange_array(low, high, inclusive).tolist(),
+                                     list(bt.irange(low, high, inclusive)))
+            self.assertEqual(bt.irange_array(max=bt.min()).tolist(), [])
+
+    def test_export_errors(self):
+        """Test dtype validation and keys or values that do not convert."""
+        self.assertEqual(SortedDict().keys_array().tolist(), [])
+        bt = SortedDict({'a': 1})
+        with self.assertRaises(TypeError):
+            bt.keys_array()
+        bt = SortedDict({2 ** 70: 1.5})
+        with self.assertRaises(OverflowError):
+            bt.keys_array()
+        self.assertEqual(bt.keys_array('float64').tolist(), [2.0 ** 70])
+        with self.assertRaises(TypeError):
+            bt.values_array()
+        with self.assertRaises(ValueError):
+            bt.keys_array(dtype='int32')
+        with self.assertRaises(TypeError):
+            SortedDict({1.5: 0}, key_type='f64').keys_array('int64')
+
+    def test_buffer_input(self):
+        """Test batch methods reading array.array and memoryview buffers."""
+        bt = SortedDict()
+        bt.set_many(array.array('q', range(0, 100, 2)), array.array('d', range(50)))
+        self.assertEqual(bt[98], 49.0)
+        copy = SortedDict(key_type='i64')
+        copy.set_many(bt.keys_array(), bt.values_array('float64'))
+        self.assertEqual(copy.items(), bt.items())
+        self.assertEqual(bt.get_many(array.array('H', [2, 3])), [1.0, None])
+        self.assertEqual(bt.contains_many(memoryview(array.array('q', range(6)))[::2]),
+                         [True, True, True])
+        self.assertEqual(bt.pop_many(array.array('b', [-1, 0])), [None, 0.0])
+
+
+class SortedDictArgumentsTest(unittest.TestCase):
+    """Test argument handling of the vectorcall entry points."""
+
+    def test_positional_counts(self):
+        """Test methods reject missing and extra positional arguments."""
+        bt = SortedDict({1: 'a', 2: 'b'})
+        for call in (lambda: bt.get(), lambda: bt.get(1, 2, 3), lambda: bt.insert(1),
+                     lambda: bt.pop(), lambda: bt.setdefault(1, 2, 3),
+                     lambda: bt.peekitem(0, 1), lambda: bt.set_many([1]),
+                     lambda: bt.update({}, {}), lambda: bt.islice(0, 1, True, 2)):
+            with self.assertRaises(TypeError):
+                call()
+        with self.assertRaises(TypeError):
+            bt.peekitem(1.0)
+        self.assertEqual(bt.peekitem(True), (2, 'b'))
+        self.assertEqual(len(bt), 2)
+
+    def test_keywords(self):
+        """Test keyword arguments, duplicates and unknown names."""
+        bt = SortedDict((i, i) for i in range(10))
+        self.assertEqual(list(bt.irange(max=3, min=1, inclusive=(True, True))), [1, 2, 3])
+        self.assertEqual(list(bt.islice(stop=3, reverse=True)), [2, 1, 0])
+        self.assertEqual(bt.irange_array(7, dtype='float64').tolist(), [7.0, 8.0, 9.0])
+        with self.assertRaises(TypeError):
+            bt.irange(1, min=2)
+        with self.assertRaises(TypeError):
+            bt.irange(lo=1)
+        with self.assertRaises(TypeError):
+            bt.get(key=1)
+        bt.update({10: 10})
+        self.assertEqual(bt[10], 10)
+        named = SortedDict()
+        named.update(a=1, b=2)
+        self.assertEqual(list(named.items()), [('a', 1), ('b', 2)])
+
+    def test_constructor(self):
+        """Test SortedDict() and from_sorted() options by position and name."""
+        bt = SortedDict({2: 'b', 1: 'a'}, 8, key_type='i64', layout='bplus')
+        self.assertEqual((bt.key_type, bt.layout, list(bt)), ('i64', 'bplus', [1, 2]))
+        self.assertIsNone(SortedDict(8, False, key_type=None).key_type)
+        self.assertEqual(SortedDict(key_layout='eytzinger').key_layout, 'eytzinger')
+        for kwargs in (dict(order=2.5), dict(bogus=1), dict(layout=3)):
+            with self.assertRaises(TypeError):
+                SortedDict(**kwargs)
+        with self.assertRaises(TypeError):
+            SortedDict(8, order=9)
+        with self.assertRaises(ValueError):
+            SortedDict(order=1)
+        bt = SortedDict.from_sorted([(1, 2)], 4, 0.5, key_type='i64')
+        self.assertEqual((bt.key_type, bt[1]), ('i64', 2))
+        with self.assertRaises(TypeError):
+            SortedDict.from_sorted()
+        with self.assertRaises(TypeError):
+            SortedDict.from_sorted([], spam=1)
+
+    def test_subclass_constructor(self):
+        """Test subclasses still run their own __init__."""
+        class Tagged(SortedDict):
+            def __init__(self, *args, tag=None, **kwargs):
+                super().__init__(*args, **kwargs)
+                self.tag = tag
+
+        bt = Tagged({1: 2}, order=4, tag='x')
+        self.assertEqual((type(bt), bt.tag, bt[1]), (Tagged, 'x', 2))
+        self.assertIs(type(Tagged.from_sorted([(1, 2)])), Tagged)
+
+
+class SortedDictRangeDeletionTest(unittest.TestCase):
+    """Test delete_range(), pop_range() and count_range()."""
+
+    OPTIONS = (dict(), dict(layout='bplus'), dict(key_type='i64'), dict(key_type='f64'),
+               dict(cache_i64=True), dict(key_layout='eytzinger'))
+
+    def test_random_ranges_match_model(self):
+        """Test random ranges against a dict for every layout and key storage."""
+        rng = random.Random(SEED)
+        for options in self.OPTIONS:
+            convert = float if options.get('key_type') == 'f64' else int
+
+            def in_bounds(model):
+                lo, hi = sorted(convert(rng.randrange(-10, 3010)) for _ in range(2))
+                inclusive = (rng.random() < 0.5, rng.random() < 0.5)
+                keys = [k for k in sorted(model) if in_range(k, lo, hi, inclusive)]
+                return lo, hi, inclusive, keys
+
+            def pop_range(bt, model, step):
+                lo, hi, inclusive, keys = in_bounds(model)
+                self.assertEqual(bt.count_range(lo, hi, inclusive), len(keys))
+                self.assertEqual(bt.pop_range(lo, hi, inclusive),
+                                 [(k, model.pop(k)) for k in keys])
+
+            def delete_range(bt, model, step):
+                lo, hi, inclusive, keys = in_bounds(model)
+                self.assertEqual(bt.delete_range(lo, hi, inclusive=inclusive), len(keys))
+                for k in keys:
+                    del model[k]
+
+            def refill(bt, model, step):
+                for key in rng.sample(range(3000), 20):
+                    bt[convert(key)] = model[convert(key)] = key
+
+            for order in (2, 3, 16):
+                keys = [convert(k) for k in rng.sample(range(3000), 1000)]
+                bt = SortedDict(((k, -k) for k in keys), order=order, **options)
+                run_model_ops(self, bt, dict(bt.items()),
+                              (pop_range, delete_range, refill, refill), 30, rng,
+                              check_every=1)
+
+    def test_unbounded_and_empty_ranges(self):
+        """Test None bounds, whole-tree deletion and ranges that select nothing."""
+        for layout in ('btree', 'bplus'):
+            bt = SortedDict(((i, i) for i in range(500)), order=3, layout=layout)
+            self.assertEqual(bt.delete_range(max=100), 100)
+            self.assertEqual(bt.delete_range(400), 100)
+            self.assertEqual(bt.delete_range(300, 200), 0)
+            self.assertEqual(bt.pop_range(150, 150), [])
+            self.assertEqual(bt.count_range(), 300)
+            self.assertEqual((bt.min(), bt.max()), (100, 399))
+            self.assertEqual(bt.pop_range(None, 103, (True, True)),
+                             [(100, 100), (101, 101), (102, 102), (103, 103)])
+            self.assertEqual(bt.delete_range(), 296)
+            self.assertEqual(len(bt), 0)
+            bt._check()
+            bt[1] = 1
+            self.assertEqual(bt.items(), [(1, 1)])
+
+    def test_snapshots_unchanged(self):
+        """Test shared nodes are copied before a range is cut out."""
+        rng = random.Random(SEED)
+        bt = SortedDict(((i, i) for i in rng.sample(range(5000), 2000)), order=4)
+        for _ in range(20):
+            snap = bt.snapshot()
+            before = snap.items()[:]
+            lo = rng.randrange(5000)
+            bt.delete_range(lo, lo + rng.randrange(500))
+            snap._check()
+            self.assertEqual(snap.items(), before)
+        bt._check()
+        with self.assertRaises(TypeError):
+            bt.snapshot().delete_range(0, 10)
+        with self.assertRaises(TypeError):
+            bt.snapshot().pop_range(0, 10)
+
+    def test_released_items(self):
+        """Test removed keys and values are released."""
+        class Value:
+            pass
+
+        for layout in ('btree', 'bplus'):
+            values = [Value() for _ in range(300)]
+            refs = [weakref.ref(v) for v in values]
+            bt = SortedDict(zip(range(300), values), order=2, layout=layout)
+            del values
+            self.assertEqual(len(bt.pop_range(50, 70)), 20)
+            bt.delete_range(100, 250)
+            gc.collect()
+            self.assertEqual([i for i, r in enumerate(refs) if r() is None],
+                             list(range(50, 70)) + list(range(100, 250)))
+
+    def test_comparison_writes_to_tree(self):
+        """Test a bound whose comparisons write to the tree raises RuntimeError."""
+        for name in ('count_range', 'delete_range', 'pop_range', 'aggregate_range'):
+            bt = SortedDict(((i, i) for i in range(300)), order=2, aggregate='sum')
+            with self.assertRaises(RuntimeError):
+                getattr(bt, name)(MeddlingKey(100.5, bt), MeddlingKey(200.5, bt))
+            bt._check()
+            self.assertEqual(len(bt), 300)
+
+    def test_arguments(self):
+        """Test argument errors."""
+        bt = SortedDict({1: 1})
+        with self.assertRaises(TypeError):
+            bt.delete_range(0, 1, (True,))
+        with self.assertRaises(TypeError):
+            bt.count_range(0, 1, (True, True), 5)
+        with self.assertRaises(TypeError):
+            bt.pop_range('a')
+        self.assertEqual(len(bt), 1)
+
+
+class SortedDictSplitConcatTest(unittest.TestCase):
+    """Test split_at() and concat()."""
+
+    OPTIONS = SortedDictRangeDeletionTest.OPTIONS
+
+    def test_split_and_rejoin_match_model(self):
+        """Test random split points for every layout and key storage."""
+        rng = random.Random(SEED)
+        for options in self.OPTIONS:
+            convert = float if options.get('key_type') == 'f64' else int
+            for order in (2, 3, 16):
+                for size in (0, 1, 10, 1000):
+                    keys = sorted(convert(k) for k in rng.sample(range(3 * size + 1), size))
+                    bt = SortedDict(((k, -k) for k in keys), order=order, **options)
+                    pivot = convert(rng.randrange(-2, 3 * size + 3))
+                    upper = bt.split_at(pivot)
+                    bt._check()
+                    upper._check()
+                    self.assertEqual(bt.keys(), [k for k in keys if k < pivot])
+                    self.assertEqual(upper.keys(), [k for k in keys if k >= pivot])
+                    upper[convert(3 * size + 5)] = 0
+                    expected = bt.items()[:] + upper.items()[:]
+                    bt.concat(upper)
+                    bt._check()
+                    upper._check()
+                    self.assertEqual(bt.items(), expected)
+                    self.assertEqual(len(upper), 0)
+                    upper[convert(-5)] = 0
+                    self.assertEqual(upper.items(), [(convert(-5), 0)])
+
+    def test_concat_different_heights(self):
+        """Test joining trees of very different sizes in both directions."""
+        for layout in ('btree', 'bplus'):
+            for small, large in ((1, 5000), (5000, 1), (300, 4000), (0, 50)):
+                a = SortedDict(((i, i) for i in range(small)), order=3, layout=layout)
+                b = SortedDict(((i, i) for i in range(small, small + large)),
+                               order=3, layout=layout)
+                a.concat(b)
+                a._check()
+                self.assertEqual(a.keys(), list(range(small + large)))
+                self.assertEqual(len(b), 0)
+
+    def test_snapshots_unchanged(self):
+        """Test shared nodes are copied before a tree is split or joined."""
+        rng = random.Random(SEED)
+        bt = SortedDict(((i, i) for i in rng.sample(range(5000), 2000)), order=4)
+        for _ in range(20):
+            snap = bt.snapshot()
+            before = snap.items()[:]
+            upper = bt.split_at(rng.randrange(5000))
+            upper_snap = upper.snapshot()
+            upper_before = upper_snap.items()[:]
+            bt.concat(upper)
+            for view, items in ((snap, before), (upper_snap, upper_before)):
+                view._check()
+                self.assertEqual(view.items(), items)
+        bt._check()
+        self.assertEqual(bt.items(), before)
+
+    def test_comparison_writes_to_tree(self):
+        """Test a split key whose comparison writes to the tree."""
+        bt = SortedDict(((i, i) for i in range(300)), order=2)
+        with self.assertRaises(RuntimeError):
+            bt.split_at(MeddlingKey(150.5, bt))
+        bt._check()
+        self.assertEqual(bt.keys(), list(range(300)))
+
+    def test_errors(self):
+        """Test ordering, configuration and read-only errors."""
+        low = SortedDict(((i, i) for i in range(10)))
+        high = SortedDict(((i, i) for i in range(5, 20)))
+        with self.assertRaises(ValueError):
+            low.concat(high)
+        with self.assertRaises(ValueError):
+            low.concat(low)
+        with self.assertRaises(ValueError):
+            low.concat(SortedDict({20: 0}, order=8))
+        with self.assertRaises(ValueError):
+            low.concat(SortedDict({20: 0}, layout='bplus'))
+        with self.assertRaises(ValueError):
+            low.concat(SortedDict({20: 0}, key_type='i64'))
+        with self.assertRaises(TypeError):
+            low.concat({20: 0})
+        with self.assertRaises(TypeError):
+            low.concat(SortedDict({20: 0}).snapshot())
+        with self.assertRaises(TypeError):
+            low.snapshot().concat(SortedDict({20: 0}))
+        with self.assertRaises(TypeError):
+            low.snapshot().split_at(5)
+        with self.assertRaises(TypeError):
+            low.split_at('a')
+        self.assertEqual(low.keys(), list(range(10)))
+        self.assertEqual(len(high), 15)
+
+
+class SortedDictMergeTest(unittest.TestCase):
+    """Test merge(), intersection_keys(), difference_keys() and ==."""
+
+    OPTIONS = SortedDictRangeDeletionTest.OPTIONS
+
+    def test_random_trees_match_model(self):
+        """Test random pairs of trees for every layout and key storage."""
+        rng = random.Random(SEED)
+        for options in self.OPTIONS:
+            convert = float if options.get('key_type') == 'f64' else int
+            for size_a, size_b in ((0, 0), (1, 0), (0, 10), (300, 200), (50, 1000)):
+                left = {convert(k): ('a', k) for k in rng.sample(range(2000), size_a)}
+                right = {convert(k): ('b', k) for k in rng.sample(range(2000), size_b)}
+                a = SortedDict(left, order=3, **options)
+                b = SortedDict(right, order=rng.choice((2, 16)),
+                               layout=rng.choice(('btree', 'bplus')))
+                both = set(left) & set(right)
+                results = {
+                    'right': (a.merge(b), {**left, **right}),
+                    'left': (a.merge(b, conflict='left'), {**right, **left}),
+                    'call': (a.merge(b, lambda k, x, y: (k, x, y)),
+                             {**left, **right, **{k: (k, left[k], right[k]) for k in both}}),
+                    'and': (a.intersection_keys(b),
+                            {k: v for k, v in left.items() if k in right}),
+                    'sub': (a.difference_keys(b),
+                            {k: v for k, v in left.items() if k not in right}),
+                }
+                for name, (tree, expected) in results.items():
+                    tree._check()
+                    self.assertEqual(tree.items(), sorted(expected.items()), name)
+                self.assertEqual(a.items(), sorted(left.items()))
+                self.assertEqual(b.items(), sorted(right.items()))
+
+    def test_equality(self):
+        """Test == walks keys and values across layouts."""
+        for layout in ('btree', 'bplus'):
+            items = [(i, str(i)) for i in range(1000)]
+            a = SortedDict(items, order=3)
+            b = SortedDict(items, order=16, layout=layout)
+            self.assertTrue(a == b)
+            self.assertFalse(a != b)
+            self.assertEqual(a, b.snapshot())
+            b[500] = 'x'
+            self.assertNotEqual(a, b)
+            del b[500]
+            self.assertNotEqual(a, b)
+            b[500.0] = '500'
+            self.assertEqual(a, b)
+        self.assertEqual(SortedDict({1: 1}, key_type='i64'), SortedDict({1: 1}))
+        self.assertNotEqual(SortedDict({1: 1}), {1: 1})
+
+    def test_mutation_during_walk(self):
+        """Test callbacks that write to the trees see consistent inputs."""
+        a = SortedDict(((i, i) for i in range(2000)), order=3)
+        b = SortedDict(((i, -i) for i in range(0, 4000, 2)), order=3)
+
+        def conflict(key, value, other_value):
+            a.clear()
+            b[key + 0.5] = None
+            return value + other_value
+
+        merged = a.merge(b, conflict)
+        merged._check()
+        self.assertEqual(len(merged), 3000)
+        self.assertEqual(merged[10], 0)
+        self.assertEqual(len(a), 0)
+        self.assertEqual(len(b), 3000)
+
+    def test_errors(self):
+        """Test argument errors and exceptions from the walk."""
+        bt = SortedDict({1: 1, 2: 2})
+        with self.assertRaises(TypeError):
+            bt.merge({1: 2})
+        with self.assertRaises(TypeError):
+            bt.intersection_keys([1])
+        with self.assertRaises(ValueError):
+            bt.merge(bt, 'middle')
+        with self.assertRaises(TypeError):
+            bt.merge(bt, conflict=5)
+        with self.assertRaises(ZeroDivisionError):
+            bt.merge(SortedDict({2: 0}), lambda key, x, y: 1 / 0)
+        with self.assertRaises(TypeError):
+            SortedDict({1: 1}, key_type='i64').merge(SortedDict({'a': 1}))
+        with self.assertRaises(TypeError):
+            bt.difference_keys(SortedDict({'a': 1}))
+        self.assertEqual(bt.merge(SortedDict({3: 3}), lambda *args: 0).items(),
+                         [(1, 1), (2, 2), (3, 3)])
+
+
+class SortedDictRangeIterationTest(unittest.TestCase):
+    """Test irange() reverse= and limit=, items_range() and values_range()."""
+
+    OPTIONS = SortedDictRangeDeletionTest.OPTIONS
+
+    def test_random_ranges_match_model(self):
+        """Test every bound, direction and limit against a sorted list."""
+        rng = random.Random(SEED)
+        for options in self.OPTIONS:
+            convert = float if options.get('key_type') == 'f64' else int
+
+            def query(bt, model, step):
+                low = rng.choice((None, convert(rng.randrange(-5, 2005))))
+                high = rng.choice((None, convert(rng.randrange(-5, 2005))))
+                kwargs = dict(inclusive=(rng.random() < 0.5, rng.random() < 0.5),
+                              reverse=rng.random() < 0.5, limit=rng.choice((None, 0, 1, 10)))
+                keys = [k for k in sorted(model) if in_range(k, low, high, kwargs['inclusive'])]
+                if kwargs['reverse']:
+                    keys.reverse()
+                keys = keys[:kwargs['limit']]
+                self.assertEqual(list(bt.irange(low, high, **kwargs)), keys)
+                self.assertEqual(list(bt.values_range(low, high, **kwargs)),
+                                 [model[k] for k in keys])
+                self.assertEqual(list(bt.items_range(low, high, **kwargs)),
+                                 [(k, model[k]) for k in keys])
+
+            for size in (0, 1, 7, 500):
+                model = {convert(k): -k for k in rng.sample(range(0, 2000, 2), size)}
+                bt = SortedDict(model, order=3, **options)
+                run_model_ops(self, bt, model, (query,), 30, rng)
+
+    def test_latest_before(self):
+        """Test the latest keys before a bound come newest first."""
+        bt = SortedDict({t: 'event%d' % t for t in range(0, 1000, 10)})
+        self.assertEqual(list(bt.irange(max=500, reverse=True, limit=3)), [490, 480, 470])
+        self.assertEqual(list(bt.items_range(max=500, inclusive=(True, True), reverse=True,
+                                             limit=2)),
+                         [(500, 'event500'), (490, 'event490')])
+        self.assertEqual(list(bt.values_range(995, reverse=True)), [])
+
+    def test_writes_during_reverse_iteration(self):
+        """Test a reverse range iterator resumes below its last key."""
+        for options in self.OPTIONS:
+            convert = float if options.get('key_type') == 'f64' else int
+            bt = SortedDict({convert(i): i for i in range(200)}, order=3, **options)
+            it = bt.irange(convert(50), convert(150), reverse=True)
+            self.assertEqual([next(it) for _ in range(3)], [149, 148, 147])
+            del bt[convert(147)]
+            bt[convert(500)] = 0
+            bt[convert(146)] = 'x'
+            self.assertEqual(list(it), list(range(146, 49, -1)))
+            it = bt.items_range(reverse=True)
+            next(it)
+            bt.pop(convert(0))
+            self.assertRaises(RuntimeError, next, it)
+
+    def test_errors(self):
+        """Test limit validation."""
+        bt = SortedDict({1: 1})
+        self.assertRaises(ValueError, bt.irange, limit=-1)
+        self.assertRaises(TypeError, bt.values_range, limit=1.5)
+        self.assertRaises(TypeError, bt.items_range, 1, 2, (True, False), False, None, 3)
+        self.assertEqual(list(bt.irange(limit=None)), [1])
+
+
+class SortedDictCursorTest(unittest.TestCase):
+    """Test modification tracking in iterators and the Cursor object."""
+
+    OPTIONS = SortedDictRangeDeletionTest.OPTIONS
+
+    def test_iterators_detect_size_change(self):
+        """Test iterators raise RuntimeError when the tree grows or shrinks."""
+        for options in self.OPTIONS:
+            bt = SortedDict({i: i for i in range(100)}, order=3, **options)
+            makers = (iter, reversed, lambda t: iter(t.items()),
+                      lambda t: t.irange(10, 90), lambda t: t.islice(5, 50, reverse=True))
+            for make in makers:
+                it = make(bt)
+                next(it)
+                bt[1000] = 0
+                self.assertRaises(RuntimeError, next, it)
+                self.assertRaises(RuntimeError, next, it)
+                del bt[1000]
+                it = make(bt)
+                next(it)
+                bt.pop(50)
+                self.assertRaises(RuntimeError, next, it)
+                bt[50] = 50
+            # An exhausted iterator stays exhausted
+            it = iter(bt)
+            list(it)
+            bt[1000] = 0
+            self.assertRaises(StopIteration, next, it)
+            del bt[1000]
+
+    def test_iterators_survive_same_size_writes(self):
+        """Test value updates and delete/insert pairs re-seek the iterator."""
+        for options in self.OPTIONS:
+            convert = float if options.get('key_type') == 'f64' else int
+            bt = SortedDict({convert(i): i for i in range(300)}, order=3, **options)
+            snapshots = []
+            seen = []
+            for key in bt:
+                seen.append(key)
+                bt[key] = -key
+                snapshots.append(bt.snapshot())
+                if len(snapshots) > 2:
+                    snapshots.pop(0)
+            self.assertEqual(seen, list(range(300)))
+            seen = []
+            for key in reversed(bt):
+                seen.append(key)
+                bt[key] = 0
+            self.assertEqual(seen, list(range(299, -1, -1)))
+
+            it = iter(bt)
+            self.assertEqual([next(it) for _ in range(10)], list(range(10)))
+            del bt[convert(3)]
+            bt[convert(500)] = 0
+            self.assertEqual(list(it), list(range(11, 300)) + [500])
+
+            it = bt.irange(convert(20), convert(100))
+            self.assertEqual([next(it) for _ in range(5)], list(range(20, 25)))
+            del bt[convert(24)]
+            bt[convert(-1)] = 0
+            self.assertEqual(list(it), list(range(25, 100)))
+            bt._check()
+
+    def test_cursor_walk(self):
+        """Test seek(), next(), prev(), key, value and set_value()."""
+        for options in self.OPTIONS:
+            convert = float if options.get('key_type') == 'f64' else int
+            bt = SortedDict({convert(i): i for i in range(0, 200, 2)}, order=3, **options)
+            c = bt.cursor()
+            self.assertRaises(KeyError, getattr, c, 'key')
+            self.assertTrue(c.next())
+            self.assertEqual((c.key, c.value), (0, 0))
+            self.assertFalse(c.prev())
+            self.assertTrue(c.prev())
+            self.assertEqual(c.key, 198)
+            self.assertFalse(c.next())
+            self.assertTrue(c.seek(convert(51)))
+            self.assertEqual(c.key, 52)
+            self.assertTrue(c.seek(convert(52)))
+            self.assertEqual(c.key, 52)
+            self.assertFalse(c.seek(convert(199)))
+            self.assertTrue(c.seek(convert(-5)))
+            keys = [c.key]
+            while c.next():
+                c.set_value('v%d' % c.key)
+                keys.append(c.key)
+            self.assertEqual(keys, list(range(0, 200, 2)))
+            self.assertEqual(bt[convert(100)], 'v100')
+            reverse = []
+            while c.prev():
+                reverse.append(c.key)
+            self.assertEqual(reverse, keys[::-1])
+
+    def test_cursor_reseeks_after_writes(self):
+        """Test the cursor survives writes, sitting in the gap of a removed key."""
+        for options in self.OPTIONS:
+            convert = float if options.get('key_type') == 'f64' else int
+            bt = SortedDict({convert(i): i for i in range(100)}, order=3, **options)
+            c = bt.cursor()
+            c.seek(convert(50))
+            bt.update({convert(i): 0 for i in range(100, 400)})
+            self.assertEqual((c.key, c.value), (50, 50))
+            del bt[convert(50)]
+            self.assertRaises(KeyError, getattr, c, 'value')
+            self.assertTrue(c.next())
+            self.assertEqual(c.key, 51)
+            del bt[convert(51)]
+            self.assertTrue(c.prev())
+            self.assertEqual(c.key, 49)
+            snapshot = bt.snapshot()
+            c.set_value('x')
+            self.assertEqual((bt[convert(49)], snapshot[convert(49)]), ('x', 49))
+            bt.clear()
+            self.assertFalse(c.next())
+            bt[convert(7)] = 7
+            self.assertTrue(c.next())
+            self.assertEqual(c.key, 7)
+            frozen = snapshot.cursor()
+            self.assertTrue(frozen.seek(convert(49)))
+            self.assertRaises(TypeError, frozen.set_value, 0)
+
+    def test_cursor_random_model(self):
+        """Test random moves and writes against a sorted-list model."""
+        rng = random.Random(SEED)
+        for options in self.OPTIONS:
+            convert = float if options.get('key_type') == 'f64' else int
+            for _ in range(5):
+                bt = SortedDict(order=rng.choice((2, 3, 8)), **options)
+                model = {}
+                for k in rng.sample(range(500), rng.randrange(200)):
+                    bt[convert(k)] = model[k] = k
+                c = bt.cursor()
+                at, gap = None, False  # Key the cursor is on or left
+                for _ in range(300):
+                    keys = sorted(model)
+                    op = rng.randrange(6)
+                    if op == 0:
+                        i = 0 if at is None else (bisect.bisect_left if gap else bisect.bisect_right)(keys, at)
+                        at = keys[i] if i < len(keys) else None
+                        self.assertEqual(c.next(), at is not None)
+                        gap = False
+                    elif op == 1:
+                        i = len(keys) if at is None else bisect.bisect_left(keys, at)
+                        at = keys[i - 1] if i > 0 else None
+                        self.assertEqual(c.prev(), at is not None)
+                        gap = False
+                    elif op == 2:
+                        k = rng.randrange(520)
+                        i = bisect.bisect_left(keys, k)
+                        at = keys[i] if i < len(keys) else None
+                        self.assertEqual(c.seek(convert(k)), at is not None)
+                        gap = False
+                    elif op == 3:
+                        k = rng.randrange(500)
+                        bt[convert(k)] = model[k] = -k
+                        gap = gap and at != k
+                    elif op == 4 and model:
+                        k = rng.choice(keys)
+                        del bt[convert(k)], model[k]
+                        gap = gap or at == k
+                    elif op == 5 and at is not None and not gap:
+                        c.set_value('x')
+                        model[at] = 'x'
+                    if at is not None and not gap:
+                        self.assertEqual((c.key, c.value), (at, model[at]))
+                    else:
+                        self.assertRaises(KeyError, getattr, c, 'key')
+                self.assertEqual(bt.items(), sorted(model.items()))
+                bt._check()
+
+
+class PicklableSubclass(SortedDict):
+    """Module-level subclass, so pickle can find it by name."""
+
+
+class SortedDictSerializationTest(unittest.TestCase):
+    """Test pickling, dump() and load()."""
+
+    OPTIONS = SortedDictRangeDeletionTest.OPTIONS + (
+        dict(layout='bplus', key_type='f64', order=3),)
+
+    def setUp(self):
+        self.dir = tempfile.TemporaryDirectory()
+        self.path = os.path.join(self.dir.name, 'tree.bin')
+
+    def tearDown(self):
+        self.dir.cleanup()
+
+    def trees(self):
+        rng = random.Random(SEED)
+        for options in self.OPTIONS:
+            convert = float if options.get('key_type') == 'f64' else int
+            for size in (0, 1, 1000):
+                keys = sorted(rng.sample(range(-5000, 5000), size))
+                yield SortedDict([(convert(k), [k]) for k in keys], **options)
+
+    def assertSameTree(self, tree, expected):
+        tree._check()
+        self.assertIs(type(tree), type(expected))
+        self.assertEqual(tree, expected)
+        self.assertEqual(repr(tree), repr(expected))
+
+    def test_pickle(self):
+        """Test pickle round trips for every layout, key storage and protocol."""
+        for bt in self.trees():
+            for protocol in range(pickle.HIGHEST_PROTOCOL + 1):
+                self.assertSameTree(pickle.loads(pickle.dumps(bt, protocol)), bt)
+            self.assertSameTree(pickle.loads(pickle.dumps(bt.snapshot())), bt)
+            self.assertSameTree(copy.copy(bt), bt)
+            deep = copy.deepcopy(bt)
+            self.assertSameTree(deep, bt)
+            if len(bt):
+                self.assertIsNot(deep.values()[0], bt.values()[0])
+
+    def test_typed_keys_pickle_as_bytes(self):
+        """Test typed trees pickle their keys as packed little-endian values."""
+        bt = SortedDict(((i, None) for i in range(100)), key_type='i64')
+        keys, values = bt.__reduce__()[2]
+        self.assertEqual(keys, b''.join(i.to_bytes(8, 'little', signed=True)
+                                        for i in range(100)))
+        self.assertEqual(values, [None] * 100)
+
+    def test_dump_and_load(self):
+        """Test dump() and load() with and without mmap."""
+        for bt in self.trees():
+            with open(self.path, 'wb') as f:
+                bt.dump(f)
+            for use_mmap in (True, False):
+                self.assertSameTree(SortedDict.load(self.path, mmap=use_mmap), bt)
+            buf = io.BytesIO()
+            bt.dump(buf)
+            with open(self.path, 'rb') as f:
+                self.assertEqual(f.read(), buf.getvalue())
+
+    def test_subclass(self):
+        """Test subclasses pickle and load as themselves."""
+        bt = PicklableSubclass({1: 'a', 2: 'b'}, order=5)
+        self.assertSameTree(pickle.loads(pickle.dumps(bt)), bt)
+        with open(self.path, 'wb') as f:
+            bt.dump(f)
+        self.assertIs(type(PicklableSubclass.load(self.path)), PicklableSubclass)
+
+    def test_invalid_files(self):
+        """Test load() rejects files that are not complete dumps."""
+        buf = io.BytesIO()
+        SortedDict(((i, i) for i in range(100)), key_type='i64').dump(buf)
+        data = buf.getvalue()
+        corrupt = bytearray(data)
+        corrupt[48:56] = (10 ** 6).to_bytes(8, 'little')
+        for contents in (b'', b'not a dump', data[:-3], data[:40], bytes(corrupt)):
+            with open(self.path, 'wb') as f:
+                f.write(contents)
+            for use_mmap in (True, False):
+                with self.assertRaises(ValueError):
+                    SortedDict.load(self.path, mmap=use_mmap)
+        with self.assertRaises(FileNotFoundError):
+            SortedDict.load(os.path.join(self.dir.name, 'missing'))
+
+    def test_invalid_state(self):
+        """Test __setstate__() argument errors."""
+        with self.assertRaises(ValueError):
+            SortedDict().__setstate__(([2, 1], [1, 2]))
+        with self.assertRaises(ValueError):
+            SortedDict().__setstate__(([1], [1, 2]))
+        with self.assertRaises(ValueError):
+            SortedDict(key_type='i64').__setstate__((b'1234567', [1]))
+        descending = array.array('d', [2.0, 1.0])
+        if sys.byteorder == 'big':
+            descending.byteswap()
+        with self.assertRaises(ValueError):
+            SortedDict(key_type='f64').__setstate__((descending.tobytes(), [1, 2]))
+        with self.assertRaises(TypeError):
+            SortedDict().__setstate__(None)
+        with self.assertRaises(TypeError):
+            SortedDict().snapshot().__setstate__(([], []))
+        bt = SortedDict({5: 5})
+        bt.__setstate__(([1, 2], ['a', 'b']))
+        self.assertEqual(bt.items(), [(1, 'a'), (2, 'b')])
+
+
+class SortedDictStatsTest(unittest.TestCase):
+    """Test stats()."""
+
+    def test_structure(self):
+        """Test height, node counts, fill and bytes as the tree grows."""
+        for layout in ('btree', 'bplus'):
+            for key_type in (None, 'i64'):
+                bt = SortedDict(order=4, layout=layout, key_type=key_type)
+                stats = bt.stats()
+                self.assertEqual((stats['height'], stats['nodes'], stats['leaves']), (1, 1, 1))
+                self.assertEqual(stats['fill'], 0.0)
+                previous = stats
+                keys = list(range(2000))
+                random.Random(SEED).shuffle(keys)
+                for i in keys:
+                    bt[i] = i
+                stats = bt.stats()
+                self.assertGreater(stats['height'], 2)
+                self.assertGreater(stats['nodes'], stats['leaves'])
+                self.assertGreater(stats['bytes'], previous['bytes'])
+                self.assertTrue(0.0 < stats['fill'] <= 1.0)
+                packed = SortedDict.from_sorted(bt.items(), order=4, layout=layout,
+                                                key_type=key_type)
+                self.assertGreater(packed.stats()['fill'], stats['fill'])
+                self.assertLess(packed.stats()['nodes'], stats['nodes'])
+                bt.clear()
+                self.assertEqual(bt.stats()['nodes'], 1)
+
+    def test_counters(self):
+        """Test the BTREE_STATS counters, when compiled in."""
+        SortedDict().stats(reset=True)
+        if 'splits' not in SortedDict().stats():
+            self.skipTest('built without BTREE_STATS')
+        bt = SortedDict(order=3)
+        for i in range(100):
+            bt[i] = i
+        bt.get(50)
+        stats = bt.stats(reset=True)
+        self.assertGreater(stats['splits'], 0)
+        self.assertGreater(stats['cache_i64_hits'], 0)
+        for i in range(100):
+            del bt[i]
+        stats = bt.stats()
+        self.assertGreater(stats['merges'] + stats['borrows'], 0)
+        self.assertEqual(stats['splits'], 0)
+        tuples = SortedDict({(i, i): i for i in range(10)})
+        tuples.stats(reset=True)
+        tuples.get((5, 5))
+        self.assertGreater(tuples.stats()['rich_compares'], 0)
+
+    def test_errors(self):
+        """Test stats() argument errors."""
+        with self.assertRaises(TypeError):
+            SortedDict().stats(1, 2)
+        with self.assertRaises(TypeError):
+            SortedDict().stats(bogus=True)
+        self.assertIn('height', SortedDict({1: 1}).snapshot().stats())
+
+
+class SortedDictStrPrefixTest(unittest.TestCase):
+    """Test the cached str prefixes against plain string ordering."""
+
+    ALPHABET = ['', '\x00', 'a', 'b', '\x7f', '\xe9', '\xff', '\u0100', '\u4e2d',
+                '\ud800', '\uffff', '\U0001f600', '\U0010ffff']
+
+    def random_key(self, rng):
+        prefix = rng.choice(['', 'abcdefg', 'abcdefgh', 'https://example.com/'])
+        return prefix + ''.join(rng.choice(self.ALPHABET) for _ in range(rng.randrange(6)))
+
+    def test_random_keys_match_model(self):
+        """Test mixed-width keys, shared prefixes and NULs against a dict."""
+        rng = random.Random(SEED)
+        ops = point_ops(self, lambda: self.random_key(rng))
+        for cache_i64 in (True, False):
+            for layout in ('btree', 'bplus'):
+                bt = SortedDict(order=3, cache_i64=cache_i64, layout=layout)
+                run_model_ops(self, bt, {}, ops, 3000, rng, check_every=500)
+
+    def test_subclass_and_merge(self):
+        """Test str subclasses in cached nodes and merging str trees."""
+        class Name(str):
+            pass
+
+        words = ['delta', 'alpha', 'charlie', 'bravo', 'echo', 'alphabet soup']
+        bt = SortedDict(order=2)
+        for i, word in enumerate(words):
+            bt[Name(word) if i % 2 else word] = i
+        bt._check()
+        self.assertEqual(list(bt), sorted(words))
+        self.assertEqual(bt[Name('alphabet soup')], 5)
+        self.assertEqual(bt['bravo'], 3)
+        other = SortedDict({w + '!': w for w in words}, order=2)
+        merged = bt.merge(other)
+        merged._check()
+        self.assertEqual(list(merged), sorted(words + [w + '!' for w in words]))
+        with self.assertRaises(TypeError):
+            bt[1] = 1
+
+
+class SortedDictEdgeInsertTest(unittest.TestCase):
+    """Test inserts beyond either end of the tree."""
+
+    def test_ascending_and_descending_fill(self):
+        """Test appends and prepends leave nearly full nodes."""
+        for layout in ('btree', 'bplus'):
+            for key_type in (None, 'i64', 'f64'):
+                for order in (2, 3, 16):
+                    for keys in (range(3000), range(3000, 0, -1)):
+                        bt = SortedDict(order=order, layout=layout, key_type=key_type)
+                        for k in keys:
+                            bt[k] = -k
+                        bt._check()
+                        self.assertEqual(list(bt), sorted(keys))
+                        self.assertEqual(bt.peekitem(1234), (sorted(keys)[1234], -sorted(keys)[1234]))
+                        self.assertGreater(bt.stats()['fill'], 0.9)
+
+    def test_runs_after_random_inserts(self):
+        """Test appends and prepends are found again after inner inserts."""
+        rng = random.Random(SEED)
+        for layout in ('btree', 'bplus'):
+            for key_type in (None, 'i64'):
+                bt = SortedDict(order=8, layout=layout, key_type=key_type)
+                for k in rng.sample(range(10000, 20000), 500):
+                    bt[k] = k
+                for keys in (range(20000, 40000), range(9999, -10001, -1)):
+                    for k in keys:
+                        bt[k] = k
+                    bt._check()
+                    self.assertGreater(bt.stats()['fill'], 0.9)
+                self.assertEqual(len(bt), 40500)
+
+    def test_random_edges_match_model(self):
+        """Test interleaved appends, prepends, inner writes and deletes."""
+        rng = random.Random(SEED)
+        ends = [0, 0]
+
+        def append(bt, model, step):
+            ends[1] += 1
+            bt[ends[1]] = model[ends[1]] = step
+
+        def prepend(bt, model, step):
+            ends[0] -= 1
+            bt[ends[0]] = model[ends[0]] = step
+
+        def inner(bt, model, step):
+            key = rng.randint(ends[0] - 1, ends[1] + 1)
+            bt[key] = model[key] = step
+
+        def delete(bt, model, step):
+            if model:
+                key = rng.choice(list(model))
+                del bt[key], model[key]
+
+        ops = (append,) * 8 + (prepend,) * 6 + (inner,) * 3 + (delete,) * 3
+        for layout in ('btree', 'bplus'):
+            for order in (2, 3, 5):
+                bt = SortedDict(order=order, layout=layout)
+                ends[:] = [0, 0]
+                run_model_ops(self, bt, {}, ops, 3000, rng, check_every=300)
+                self.assertEqual(bt.index(max(bt)), len(bt) - 1)
+
+    def test_snapshots_unchanged(self):
+        """Test appends and prepends copy shared nodes."""
+        bt = SortedDict({i: i for i in range(200)}, order=3)
+        snap = bt.snapshot()
+        for i in range(200, 400):
+            bt[i] = i
+            bt[-i] = i
+        bt._check()
+        snap._check()
+        self.assertEqual(list(snap), list(range(200)))
+        self.assertEqual(len(bt), 600)
+
+class SortedDictAggregateTest(unittest.TestCase):
+    """Test aggregate= and aggregate_range()."""
+
+    @staticmethod
+    def expected(model, aggregate, lo, hi):
+        values = [v for k, v in sorted(model.items())
+                  if (lo is None or k >= lo) and (hi is None or k < hi)]
+        if not values:
+            return None
+        if aggregate == 'min':
+            return min(values)
+        if aggregate == 'max':
+            return max(values)
+        return functools.reduce(operator.add, values)
+
+    def test_random_writes_match_model(self):
+        """Test every kind of write keeps the cached aggregates current."""
+        rng = random.Random(SEED)
+
+        def assign(bt, model, step):
+            key = rng.randrange(200)
+            bt[key] = model[key] = rng.randrange(1000)
+
+        def pop(bt, model, step):
+            key = rng.randrange(200)
+            self.assertEqual(bt.pop(key, None), model.pop(key, None))
+
+        def pop_range(bt, model, step):
+            key = rng.randrange(200)
+            for k, v in bt.pop_range(key, key + rng.randrange(40)):
+                self.assertEqual(model.pop(k), v)
+
+        def split_and_concat(bt, model, step):
+            bt.concat(bt.split_at(rng.randrange(200)))
+
+        def cursor_writes(bt, model, step):
+            c = bt.cursor()
+            while c.next() and rng.random() < 0.9:
+                c.set_value(step)
+                model[c.key] = step
+
+        def append_run(bt, model, step):
+            start = max(model, default=0) + 1
+            for k in range(start, start + rng.randrange(1, 30)):
+                bt[k] = model[k] = k
+
+        def update_shared(bt, model, step):
+            key = rng.randrange(200)
+            snap = bt.snapshot()
+            bt.update({k: -k for k in range(key, key + 10)})
+            model.update({k: -k for k in range(key, key + 10)})
+            snap._check()
+
+        def delete_range(bt, model, step):
+            key = rng.randrange(200)
+            bt.delete_range(key, key + 5)
+            for k in [k for k in model if key <= k < key + 5]:
+                del model[k]
+
+        ops = (assign, assign, assign, pop, pop_range, split_and_concat, cursor_writes,
+               append_run, update_shared, delete_range)
+        for layout in ('btree', 'bplus'):
+            for aggregate in ('sum', 'min', 'max', operator.add):
+                def query(bt, model, step):
+                    lo = rng.choice([None, rng.randrange(-10, 260)])
+                    hi = rng.choice([None, rng.randrange(-10, 260)])
+                    self.assertEqual(bt.aggregate_range(lo, hi),
+                                     self.expected(model, aggregate, lo, hi))
+
+                for order in (2, 3):
+                    bt = SortedDict(order=order, layout=layout, aggregate=aggregate)
+                    run_model_ops(self, bt, {}, ops + (query,) * 10, 600, rng)
+
+    def test_inclusive_and_empty(self):
+        """Test inclusive bounds and empty ranges."""
+        bt = SortedDict({i: i for i in range(100)}, order=4, aggregate='sum')
+        self.assertEqual(bt.aggregate_range(), sum(range(100)))
+        self.assertEqual(bt.aggregate_range(10, 20), sum(range(10, 20)))
+        self.assertEqual(bt.aggregate_range(10, 20, (False, True)), sum(range(11, 21)))
+        self.assertEqual(bt.aggregate_range(min=90), sum(range(90, 100)))
+        self.assertIsNone(bt.aggregate_range(20, 10))
+        self.assertIsNone(SortedDict(aggregate='max').aggregate_range())
+
+    def test_min_max_ties(self):
+        """Test min and max keep the first of equal values."""
+        a, b = (1.0, 'a'), (1.0, 'b')
+        bt = SortedDict(aggregate=lambda x, y: x if x[0] >= y[0] else y)
+        bt.update({1: a, 2: b})
+        self.assertIs(bt.aggregate_range(), a)
+        bt = SortedDict({1: 1.0, 2: 1}, aggregate='min')
+        self.assertIs(type(bt.aggregate_range()), float)
+        bt = SortedDict({1: 1.0, 2: 1}, aggregate='max')
+        self.assertIs(type(bt.aggregate_range()), float)
+
+    def test_callable_order(self):
+        """Test a callable combines adjacent ranges in key order."""
+        bt = SortedDict(((i, str(i % 10)) for i in range(500)), order=3,
+                        aggregate=operator.add)
+        self.assertEqual(bt.aggregate_range(), ''.join(str(i % 10) for i in range(500)))
+        self.assertEqual(bt.aggregate_range(123, 321),
+                         ''.join(str(i % 10) for i in range(123, 321)))
+
+    def test_options_kept(self):
+        """Test copies, snapshots, split_at, pickling and from_sorted keep the aggregate."""
+        bt = SortedDict({i: i for i in range(50)}, layout='bplus', aggregate='max')
+        self.assertEqual(bt.aggregate, 'max')
+        for other in (bt.copy(), bt.snapshot(), pickle.loads(pickle.dumps(bt)),
+                      SortedDict.from_sorted(bt.items(), aggregate='max'), bt.split_at(25)):
+            self.assertEqual(other.aggregate, 'max')
+            self.assertEqual(other.aggregate_range(), 49)
+        self.assertIsNone(SortedDict().aggregate)
+        self.assertIs(SortedDict(aggregate=operator.add).aggregate, operator.add)
+        self.assertEqual(repr(bt), "SortedDict(order=64, size=25, cache_i64=True, "
+                                   "layout='bplus', aggregate='max')")
+        self.assertIn('aggregate=<built-in function add>',
+                      repr(SortedDict(aggregate=operator.add)))
+
+    def test_writes_during_aggregation(self):
+        """Test a combining callable that writes to the tree."""
+        for layout in ('btree', 'bplus'):
+            def combine(a, b):
+                bt.pop(bt.min(), None)
+                return a + b
+
+            bt = SortedDict(((i, i) for i in range(100)), layout=layout, order=2,
+                            aggregate=combine)
+            with self.assertRaises(RuntimeError):
+                bt.aggregate_range()
+            bt._check()
+
+    def test_errors(self):
+        """Test invalid aggregates."""
+        with self.assertRaises(ValueError):
+            SortedDict(aggregate='mean')
+        with self.assertRaises(TypeError):
+            SortedDict(aggregate=3)
+        with self.assertRaises(TypeError):
+            SortedDict().aggregate_range()
+        with self.assertRaises(TypeError):
+            SortedDict({1: 'a', 2: 3}, aggregate='sum').aggregate_range()
+        with self.assertRaises(ValueError):
+            SortedDict(aggregate='sum').concat(SortedDict(aggregate='min'))
+
+class SortedDictCAPITest(unittest.TestCase):
+    """Test the btreedict._C_API capsule, called through ctypes."""
+
+    VISIT = ctypes.CFUNCTYPE(ctypes.c_int, ctypes.py_object, ctypes.py_object, ctypes.c_void_p)
+
+    class CAPI(ctypes.Structure):
+        """Mirror of PyBTree_CAPI in btreeobject.h."""
+        obj = ctypes.py_object
+        _fields_ = [
+            ('version', ctypes.c_int),
+            ('SortedDictType', ctypes.c_void_p),
+            ('New', ctypes.c_void_p),
+            ('FromSortedItems', ctypes.c_void_p),
+            ('FromSortedArrays', ctypes.PYFUNCTYPE(
+                obj, ctypes.POINTER(obj), ctypes.POINTER(obj), ctypes.c_ssize_t,
+                ctypes.c_int, ctypes.c_double)),
+            ('Size', ctypes.PYFUNCTYPE(ctypes.c_ssize_t, obj)),
+            ('Insert', ctypes.PYFUNCTYPE(ctypes.c_int, obj, obj, obj)),
+            ('Search', ctypes.c_void_p),
+            ('Delete', ctypes.PYFUNCTYPE(ctypes.c_int, obj, obj)),
+            ('Contains', ctypes.PYFUNCTYPE(ctypes.c_int, obj, obj)),
+            ('GetMin', ctypes.c_void_p),
+            ('GetMax', ctypes.c_void_p),
+            ('Keys', ctypes.c_void_p),
+            ('Values', ctypes.c_void_p),
+            ('Items', ctypes.c_void_p),
+            ('Clear', ctypes.c_void_p),
+            ('Copy', ctypes.c_void_p),
+            ('Update', ctypes.PYFUNCTYPE(ctypes.c_int, obj, obj)),
+            ('VisitRange', ctypes.PYFUNCTYPE(
+                ctypes.c_int, obj, obj, obj, ctypes.c_int, ctypes.c_int,
+                ctypes.CFUNCTYPE(ctypes.c_int, obj, obj, ctypes.c_void_p),
+                ctypes.c_void_p)),
+        ]
+
+    @classmethod
+    def setUpClass(cls):
+        get_pointer = ctypes.pythonapi.PyCapsule_GetPointer
+        get_pointer.restype = ctypes.c_void_p
+        get_pointer.argtypes = [ctypes.py_object, ctypes.c_char_p]
+        cls.api = cls.CAPI.from_address(get_pointer(btreedict._C_API, b'btreedict._C_API'))
+
+    def visit_range(self, bt, lo, hi, inclusive=(True, False), stop_after=None):
+        seen = []
+
+        def visit(key, value, arg):
+            seen.append((key, value))
+            return 1 if len(seen) == stop_after else 0
+
+        status = self.api.VisitRange(bt, lo, hi, *inclusive, self.VISIT(visit), None)
+        return status, seen
+
+    def test_version_and_type(self):
+        """Test the capsule header entries."""
+        self.assertGreaterEqual(self.api.version, 1)
+        self.assertEqual(self.api.SortedDictType, id(SortedDict))
+
+    def test_point_operations(self):
+        """Test Insert, Contains, Delete, Size and Update."""
+        bt = SortedDict()
+        for i in range(100):
+            self.assertEqual(self.api.Insert(bt, i, str(i)), 0)
+        self.assertEqual(self.api.Size(bt), 100)
+        self.assertEqual(bt[42], '42')
+        self.assertEqual(self.api.Contains(bt, 42), 1)
+        self.assertEqual(self.api.Delete(bt, 42), 0)
+        self.assertEqual(self.api.Contains(bt, 42), 0)
+        with self.assertRaises(KeyError):
+            self.api.Delete(bt, 42)
+        self.assertEqual(self.api.Update(bt, {1000: 'x', 1001: 'y'}), 0)
+        self.assertEqual(len(bt), 101)
+        bt._check()
+
+    def test_from_sorted_arrays(self):
+        """Test bulk loading from C arrays."""
+        n = 1000
+        keys = (ctypes.py_object * n)(*range(n))
+        values = (ctypes.py_object * n)(*(i * i for i in range(n)))
+        bt = self.api.FromSortedArrays(keys, values, n, 8, 1.0)
+        bt._check()
+        self.assertEqual(bt.items(), [(i, i * i) for i in range(n)])
+        keys[10] = 5
+        with self.assertRaises(ValueError):
+            self.api.FromSortedArrays(keys, values, n, 8, 1.0)
+
+    def test_visit_range(self):
+        """Test range iteration with a C callback."""
+        for layout in ('btree', 'bplus'):
+            for key_type in (None, 'i64'):
+                bt = SortedDict({i: -i for i in range(0, 500, 2)}, order=3,
+                                layout=layout, key_type=key_type)
+                self.assertEqual(self.visit_range(bt, 10, 20),
+                                 (0, [(i, -i) for i in range(10, 20, 2)]))
+                self.assertEqual(self.visit_range(bt, 10, 20, (False, True)),
+                                 (0, [(i, -i) for i in range(12, 21, 2)]))
+                self.assertEqual(self.visit_range(bt, None, None)[1], bt.items())
+                self.assertEqual(self.visit_range(bt, 100, None, stop_after=3),
+                                 (1, [(100, -100), (102, -102), (104, -104)]))
+                self.assertEqual(self.visit_range(bt, 20, 10), (0, []))
+
+    def test_visit_range_writes_to_tree(self):
+        """Test a callback or a bound comparison that writes to the tree."""
+        for layout in ('btree', 'bplus'):
+            for key_type in (None, 'i64'):
+                bt = SortedDict({i: -i for i in range(300)}, order=2,
+                                layout=layout, key_type=key_type)
+                seen = []
+
+                def visit(key, value, arg):
+                    seen.append((key, value))
+                    items = bt.items()[:]
+                    bt.clear()
+                    bt.update(items)
+                    return 0
+
+                with self.assertRaises(RuntimeError):
+                    self.api.VisitRange(bt, 100, 200, 1, 0, self.VISIT(visit), None)
+                self.assertEqual(seen, [(100, -100)])
+                bt._check()
+                self.assertEqual(len(bt), 300)
+        bt = SortedDict({i: -i for i in range(300)}, order=2)
+        with self.assertRaises(RuntimeError):
+            self.visit_range(bt, MeddlingKey(100.5, bt), MeddlingKey(200.5, bt))
+        bt._check()
+        self.assertEqual(len(bt), 300)
+
+
+class SortedDictDuplicatesTest(unittest.TestCase):
+    """Test duplicates=True: equal keys kept as separate items."""
+
+    OPTIONS = (dict(order=2), dict(order=3), dict(order=3, key_type='i64'),
+               dict(order=4, key_layout='eytzinger'), dict(order=3, cache_i64=False))
+
+    @staticmethod
+    def insert(model, key, value):
+        """Insert into a sorted list of pairs after the equal keys."""
+        model.insert(bisect.bisect_right([k for k, _ in model], key), (key, value))
+
+    def test_basic(self):
+        """Test equal keys keep insertion order and lookups see the first."""
+        bt = SortedDict(duplicates=True, order=2)
+        for i, key in enumerate([3, 1, 3, 2, 3, 1]):
+            bt[key] = i
+        self.assertTrue(bt.duplicates)
+        self.assertEqual(bt.items(), [(1, 1), (1, 5), (2, 3), (3, 0), (3, 2), (3, 4)])
+        self.assertEqual(len(bt), 6)
+        self.assertEqual(bt[3], 0)
+        self.assertEqual(bt.count(3), 3)
+        self.assertEqual(bt.count(4), 0)
+        self.assertEqual(bt.equal_range(3), (3, 6))
+        self.assertEqual(bt.equal_range(0), (0, 0))
+        self.assertEqual(bt.index(3), 3)
+        self.assertIn((3, 2), bt.items())
+        self.assertNotIn((3, 1), bt.items())
+        bt.remove_one(3, 2)
+        self.assertEqual(bt.items()[3:], [(3, 0), (3, 4)])
+        with self.assertRaises(KeyError):
+            bt.remove_one(3, 2)
+        self.assertEqual(bt.pop(1), 1)
+        del bt[3]
+        self.assertEqual(bt.items(), [(1, 5), (2, 3)])
+        with self.assertRaises(KeyError):
+            del bt[3]
+        self.assertIn('duplicates=True', repr(bt))
+        bt._check()
+
+    def test_options(self):
+        """Test the option is validated and carried by every constructor."""
+        with self.assertRaises(ValueError):
+            SortedDict(duplicates=True, layout='bplus')
+        self.assertFalse(SortedDict().duplicates)
+        pairs = [(1, 'a'), (1, 'b'), (2, 'c')]
+        bt = SortedDict.from_sorted(pairs, duplicates=True, order=2)
+        self.assertEqual(bt.items(), pairs)
+        with self.assertRaises(ValueError):
+            SortedDict.from_sorted(pairs[::-1], duplicates=True)
+        with self.assertRaises(ValueError):
+            SortedDict.from_sorted(pairs)
+        for other in (bt.copy(), bt.snapshot(), pickle.loads(pickle.dumps(bt))):
+            other._check()
+            self.assertTrue(other.duplicates)
+            self.assertEqual(other.items(), pairs)
+        buf = io.BytesIO()
+        bt.dump(buf)
+        with tempfile.TemporaryDirectory() as d:
+            path = os.path.join(d, 'tree.bin')
+            with open(path, 'wb') as f:
+                f.write(buf.getvalue())
+            self.assertEqual(SortedDict.load(path).items(), pairs)
+        with self.assertRaises(ValueError):
+            SortedDict(order=2).concat(SortedDict(duplicates=True, order=2))
+        with self.assertRaises(ValueError):
+            SortedDict().merge(bt)
+
+    def test_random_ops_match_model(self):
+        """Test writes and queries against a sorted list of pairs."""
+        rng = random.Random(SEED)
+
+        def run_of(model):
+            """A random key and the positions [lo, hi) of its items"""
+            key = rng.randrange(30)
+            keys = [k for k, _ in model]
+            return key, bisect.bisect_left(keys, key), bisect.bisect_right(keys, key)
+
+        def assign(bt, model, step):
+            key = rng.randrange(30)
+            bt[key] = step
+            self.insert(model, key, step)
+
+        def pop(bt, model, step):
+            key, lo, hi = run_of(model)
+            self.assertEqual(bt.pop(key, None), model.pop(lo)[1] if lo < hi else None)
+
+        def delete(bt, model, step):
+            key, lo, hi = run_of(model)
+            if lo < hi:
+                del bt[key]
+                del model[lo:hi]
+
+        def remove_one(bt, model, step):
+            key, lo, hi = run_of(model)
+            if lo < hi:
+                bt.remove_one(key, model.pop(rng.randrange(lo, hi))[1])
+
+        def popitem(bt, model, step):
+            if model:
+                i = rng.randrange(len(model))
+                self.assertEqual(bt.popitem(i), model.pop(i))
+
+        def ranges(bt, model, step):
+            key = rng.randrange(30)
+            stop = key + rng.randrange(5)
+            inclusive = (rng.random() < 0.5, rng.random() < 0.5)
+            reverse = rng.random() < 0.5
+            keys = [k for k, _ in model if in_range(k, key, stop, inclusive)]
+            self.assertEqual(list(bt.irange(key, stop, inclusive, reverse)),
+                             keys[::-1] if reverse else keys)
+            self.assertEqual(bt.count_range(key, stop, inclusive), len(keys))
+
+        def split_and_concat(bt, model, step):
+            bt.concat(bt.split_at(rng.randrange(30)))
+
+        def get_many(bt, model, step):
+            probes = sorted(rng.randrange(30) for _ in range(8))
+            first = {}
+            for k, v in model:
+                first.setdefault(k, v)
+            self.assertEqual(bt.get_many(probes), [first.get(p) for p in probes])
+
+        def lookup(bt, model, step):
+            key, lo, hi = run_of(model)
+            self.assertEqual(bt.equal_range(key), (lo, hi))
+            c = bt.cursor()
+            if c.seek(key) and c.key == key:
+                self.assertEqual(c.value, model[lo][1])
+
+        ops = (assign,) * 4 + (pop, delete, remove_one, popitem, ranges, split_and_concat,
+                               get_many, lookup)
+        for options in self.OPTIONS:
+            bt = SortedDict(duplicates=True, **options)
+            run_model_ops(self, bt, [], ops, 600, rng, expected=list)
+
+    def test_merge_keeps_every_item(self):
+        """Test merge() of trees with duplicates is a multiset union."""
+        a = SortedDict(duplicates=True, order=2)
+        b = SortedDict(duplicates=True, order=2)
+        for i in range(20):
+            a[i % 3] = i
+            b[i % 4] = -i
+        merged = a.merge(b)
+        merged._check()
+        self.assertEqual(merged.items(), sorted(list(a.items()) + list(b.items()),
+                                                key=lambda kv: kv[0]))
+
+    def test_comparison_writes_to_tree(self):
+        """Test lookups of a key whose comparison writes to the tree."""
+        ops = (lambda bt, key: bt.count(key),
+               lambda bt, key: bt.equal_range(key),
+               lambda bt, key: bt.__delitem__(key))
+        for op in ops:
+            bt = SortedDict(duplicates=True, order=2)
+            for i in range(300):
+                bt[i % 100] = i
+            with self.assertRaises(RuntimeError):
+                op(bt, MeddlingKey(50, bt))
+            bt._check()
+            self.assertEqual(len(bt), 300)
+
+    def test_iteration_resumes_inside_a_run(self):
+        """Test a range iterator resumed after a write skips no equal keys."""
+        bt = SortedDict(duplicates=True, order=2)
+        for i in range(40):
+            bt[i % 4] = i
+        for reverse in (False, True):
+            c = bt.cursor()
+            seen = []
+            for key, value in bt.items_range(reverse=reverse):
+                seen.append((key, value))
+                c.seek(key)
+                c.set_value(c.value)
+            expected = list(bt.items())
+            self.assertEqual(seen, expected[::-1] if reverse else expected)
+
+
+class SortedDictWriteBufferTest(unittest.TestCase):
+    """Test write_buffer=: bt[key] = value writes held back and sorted."""
+
+    OPTIONS = (dict(order=2), dict(order=3, key_type='i64'), dict(order=3, key_type='f64'),
+               dict(order=3, layout='bplus'), dict(order=3, duplicates=True),
+               dict(order=3, aggregate='sum'))
+
+    def test_matches_unbuffered(self):
+        """Test random writes and reads agree with a write-through tree."""
+        for options in self.OPTIONS:
+            rng = random.Random(SEED)
+            plain = SortedDict(**options)
+            bt = SortedDict(write_buffer=5, **options)
+            self.assertEqual(bt.write_buffer, 5)
+            for step in range(600):
+                key = rng.randrange(-40, 40)
+                if rng.random() < 0.7:
+                    plain[key] = step
+                    bt[key] = step
+                    continue
+                check = step % 7
+                if check == 0:
+                    self.assertEqual(len(bt), len(plain))
+                elif check == 1:
+                    self.assertEqual(bt.get(key), plain.get(key))
+                elif check == 2:
+                    self.assertEqual(list(bt.irange(key, key + 10)), list(plain.irange(key, key + 10)))
+                elif check == 3:
+                    self.assertEqual(bt.bisect_left(key), plain.bisect_left(key))
+                elif check == 4:
+                    self.assertEqual(bt.pop(key, None), plain.pop(key, None))
+                elif check == 5:
+                    self.assertEqual(bt.count_range(key, key + 5), plain.count_range(key, key + 5))
+                else:
+                    self.assertEqual(bt.keys()[:3], plain.keys()[:3])
+            self.assertEqual(list(bt.items()), list(plain.items()))
+            bt._check()
+
+    def test_held_back_until_read(self):
+        """Test writes wait in the buffer and any access applies them."""
+        bt = SortedDict(write_buffer=100, order=2)
+        for key in [5, 1, 4, 1, 3]:
+            bt[key] = key * 10
+        self.assertEqual(list(bt.items()), [(1, 10), (3, 30), (4, 40), (5, 50)])
+        bt.insert(2, 20)
+        self.assertIn(2, bt)
+        del bt[2]
+        self.assertNotIn(2, bt)
+        with self.assertRaises(KeyError):
+            del bt[2]
+        bt[0] = 0
+        c = bt.cursor()
+        self.assertTrue(c.next())
+        self.assertEqual(c.key, 0)
+
+    def test_unbuffered_keys_write_through(self):
+        """Test keys outside the int64 order are inserted in write order."""
+        bt = SortedDict(write_buffer=8)
+        bt[2] = 'int'
+        bt[2 ** 70] = 'big'
+        bt[1.5] = 'float'
+        bt[True] = 'bool'
+        self.assertEqual(list(bt.items()),
+                         [(True, 'bool'), (1.5, 'float'), (2, 'int'), (2 ** 70, 'big')])
+
+    def test_failed_write_raises_at_its_call(self):
+        """Test a write that cannot be inserted raises from its own call."""
+        bt = SortedDict(write_buffer=8)
+        bt['a'] = 1
+        with self.assertRaises(TypeError):
+            bt[5] = 2
+        self.assertIn('a', bt)
+        self.assertEqual(list(bt.items()), [('a', 1)])
+        bt = SortedDict(write_buffer=8)
+        bt[5] = 2
+        with self.assertRaises(TypeError):
+            bt['a'] = 1
+        self.assertEqual(list(bt.items()), [(5, 2)])
+        bt = SortedDict({1.5: 0, 2: 0}, write_buffer=8)
+        bt[3] = 0
+        self.assertEqual(bt.memory_usage()['write_buffer'], 0)
+        with self.assertRaises(TypeError):
+            SortedDict(write_buffer=8, key_type='i64')['a'] = 1
+
+    def test_large_write_buffer(self):
+        """Test a huge write_buffer only holds memory for waiting writes."""
+        bt = SortedDict(write_buffer=2 ** 31 - 1)
+        bt[1] = 1
+        self.assertLess(bt.memory_usage()['write_buffer'], 1 << 16)
+        keys = list(range(5000))
+        random.Random(SEED).shuffle(keys)
+        for key in keys:
+            bt[key] = -key
+        self.assertEqual(len(bt), 5000)
+        self.assertLess(bt.memory_usage()['write_buffer'], 1 << 20)
+        self.assertEqual(list(bt.items()), [(key, -key) for key in range(5000)])
+        bt._check()
+        for size in (1, 3, 64, 65, 200):
+            bt = SortedDict(write_buffer=size, order=3)
+            plain = {}
+            for key in keys[:700]:
+                bt[key] = key
+                plain[key] = key
+            self.assertEqual(list(bt.items()), sorted(plain.items()))
+
+    def test_iterator_sees_held_back_writes(self):
+        """Test an iterator notices a held-back write that changed the size."""
+        bt = SortedDict(write_buffer=16)
+        for i in range(10):
+            bt[i] = i
+        it = iter(bt)
+        next(it)
+        bt[3] = -3
+        self.assertEqual(next(it), 1)
+        bt[20] = 20
+        with self.assertRaises(RuntimeError):
+            next(it)
+
+    def test_option_is_kept(self):
+        """Test copies, pickles and from_sorted() keep write_buffer."""
+        bt = SortedDict.from_sorted([(1, 1)], write_buffer=4)
+        bt[0] = 0
+        self.assertEqual(bt.write_buffer, 4)
+        self.assertEqual(bt.copy().write_buffer, 4)
+        restored = pickle.loads(pickle.dumps(bt))
+        self.assertEqual(restored.write_buffer, 4)
+        self.assertEqual(list(restored.items()), [(0, 0), (1, 1)])
+        snap = bt.snapshot()
+        self.assertEqual(snap.write_buffer, 0)
+        self.assertEqual(list(snap.items()), [(0, 0), (1, 1)])
+        self.assertEqual(SortedDict().write_buffer, 0)
+        self.assertEqual(repr(bt), "SortedDict(order=64, size=2, cache_i64=True, write_buffer=4)")
+        self.assertEqual(repr(SortedDict(key_type='i64', aggregate='sum', write_buffer=8)),
+                         "SortedDict(order=64, size=0, key_type='i64', aggregate='sum', "
+                         "write_buffer=8)")
+        with self.assertRaises(ValueError):
+            SortedDict(write_buffer=-1)
+
+    def test_clear_drops_held_back_writes(self):
+        """Test clear() and garbage collection release buffered writes."""
+        bt = SortedDict(write_buffer=8)
+        bt[1] = 1
+        bt.clear()
+        self.assertEqual(len(bt), 0)
+        value = type('Value', (), {})()
+        value.tree = bt
+        bt[2] = value
+        ref = weakref.ref(value)
+        del bt, value
+        gc.collect()
+        self.assertIsNone(ref())
+
+
+class SortedDictMemoryTest(unittest.TestCase):
+    """Test __sizeof__(), memory_usage() and compact()."""
+
+    def test_sizeof_counts_nodes(self):
+        """Test sys.getsizeof() grows with the nodes and matches stats()."""
+        small = SortedDict()
+        bt = SortedDict.from_sorted((i, None) for i in range(10000))
+        self.assertGreater(sys.getsizeof(bt), sys.getsizeof(small) + 10000 * 8)
+        usage = bt.memory_usage()
+        self.assertEqual(usage['total'], bt.__sizeof__())
+        self.assertEqual(usage['nodes'] + usage['caches'], bt.stats()['bytes'])
+        self.assertEqual(usage['total'],
+                         usage['tree'] + usage['nodes'] + usage['caches'] + usage['write_buffer'])
+        self.assertNotIn('keys', usage)
+        self.assertEqual(SortedDict(key_type='i64').memory_usage()['caches'], 0)
+
+    def test_write_buffer_counted(self):
+        """Test the write buffer's array counts once it is allocated."""
+        bt = SortedDict(write_buffer=100)
+        self.assertEqual(bt.memory_usage()['write_buffer'], 0)
+        bt[1] = 1
+        self.assertGreater(bt.memory_usage()['write_buffer'], 100 * 16)
+        bt.compact()
+        self.assertEqual(bt.memory_usage()['write_buffer'], 0)
+        self.assertEqual(list(bt.items()), [(1, 1)])
+
+    def test_deep_counts_distinct_objects(self):
+        """Test deep=True adds each distinct key and value object once."""
+        value = 'x' * 1000
+        bt = SortedDict()
+        for i in range(100):
+            bt[str(i)] = value
+        usage = bt.memory_usage(deep=True)
+        self.assertEqual(usage['keys'], sum(sys.getsizeof(str(i)) for i in range(100)))
+        self.assertEqual(usage['values'], sys.getsizeof(value))
+        self.assertEqual(usage['total'], bt.__sizeof__() + usage['keys'] + usage['values'])
+        typed = SortedDict(key_type='i64')
+        typed[1] = value
+        self.assertEqual(typed.memory_usage(deep=True)['keys'], 0)
+
+    def test_deep_survives_sizeof_writing_to_the_tree(self):
+        """Test a __sizeof__ that clears the tree does not break the walk."""
+        bt = SortedDict(order=2)
+
+        class Clearing:
+            def __sizeof__(self):
+                bt.clear()
+                return 1
+
+        for i in range(50):
+            bt[i] = Clearing()
+        self.assertEqual(bt.memory_usage(deep=True)['values'], 50 * sys.getsizeof(Clearing()))
+        self.assertEqual(len(bt), 0)
+
+    def test_compact_after_deletions(self):
+        """Test compact() shrinks a tree emptied by deletions and keeps its items."""
+        for options in (dict(order=3), dict(order=3, key_type='i64'), dict(order=3, layout='bplus'),
+                        dict(order=3, duplicates=True), dict(order=3, aggregate='sum'),
+                        dict(order=3, key_layout='eytzinger')):
+            bt = SortedDict(**options)
+            keys = random.Random(SEED).sample(range(10000), 2000)
+            for key in keys:
+                bt[key] = key
+            for key in keys[:1500]:
+                del bt[key]
+            expected = list(bt.items())
+            before = bt.stats()
+            bt.compact()
+            bt._check()
+            self.assertEqual(list(bt.items()), expected)
+            self.assertLess(bt.stats()['nodes'], before['nodes'])
+            self.assertGreater(bt.stats()['fill'], before['fill'])
+            if options.get('aggregate'):
+                self.assertEqual(bt.aggregate_range(), sum(k for k, _ in expected))
+            bt.compact(fill_factor=0.5)
+            bt._check()
+            self.assertEqual(list(bt.items()), expected)
+            bt[-1] = -1
+            self.assertEqual(bt.peekitem(0), (-1, -1))
+
+    def test_compact_keeps_snapshots_and_iterators(self):
+        """Test compact() leaves snapshots intact and iterators going."""
+        bt = SortedDict(order=2)
+        for i in range(100):
+            bt[i] = i
+        snap = bt.snapshot()
+        for i in range(0, 100, 2):
+            del bt[i]
+        it = iter(bt)
+        self.assertEqual(next(it), 1)
+        bt.compact()
+        self.assertEqual(next(it), 3)
+        self.assertEqual(list(snap.keys()), list(range(100)))
+        with self.assertRaises(TypeError):
+            snap.compact()
+        with self.assertRaises(ValueError):
+            bt.compact(fill_factor=0)
+        empty = SortedDict()
+        empty.compact()
+        self.assertEqual(len(empty), 0)
+
+
+class SortedDictTupleKeyTest(unittest.TestCase):
+    """Test the tuple comparator and the cache_pairs=True int64 pair cache."""
+
+    def random_key(self, rng):
+        tenant = rng.randrange(4)
+        kind = rng.random()
+        if kind < 0.6:
+            second = rng.randrange(50) if rng.random() < 0.9 else rng.randrange(-2**63, 2**63)
+            return (tenant, second)
+        if kind < 0.7:
+            return (tenant, rng.randrange(50) + 0.5)
+        if kind < 0.8:
+            return (tenant,)
+        if kind < 0.9:
+            return (tenant, rng.randrange(50), rng.randrange(3))
+        return (tenant, 2**64 + rng.randrange(3))
+
+    def test_random_keys_match_model(self):
+        """Test cached, mixed and big-int tuples against a dict."""
+        rng = random.Random(SEED)
+        ops = point_ops(self, lambda: self.random_key(rng))
+        for options in ({}, {'cache_pairs': True}, {'cache_i64': False},
+                        {'cache_pairs': True, 'layout': 'bplus'},
+                        {'cache_pairs': True, 'key_layout': 'eytzinger'}):
+            bt = SortedDict(order=3, **options)
+            run_model_ops(self, bt, {}, ops, 3000, rng, check_every=500)
+
+    def test_matches_tuple_comparison(self):
+        """Test lengths, nesting, equal int and float items and errors."""
+        keys = [(), (1,), (1, 2), (1, 2, 0), (1, 2.5), (2, 'a'), (2, 'b', 1), (3, (0, 1))]
+        bt = SortedDict((k, None) for k in reversed(keys))
+        self.assertEqual(list(bt), keys)
+        self.assertIn((1, 2.0), bt)
+        self.assertIn((1.0, 2), bt)
+        nan = float('nan')
+        bt[(4, nan)] = 1
+        self.assertEqual(bt[(4, nan)], 1)
+        with self.assertRaises(TypeError):
+            bt[(2, 1)] = None
+        bt._check()
+
+    def test_deep_nesting_raises(self):
+        """Test comparing deeply nested tuples raises RecursionError."""
+        def nested(leaf):
+            key = (leaf,)
+            for _ in range(100000):
+                key = (key,)
+            return key
+
+        bt = SortedDict()
+        bt[nested(1)] = 1
+        with self.assertRaises(RecursionError):
+            bt[nested(2)] = 2
+
+    def test_cache_pairs_option(self):
+        """Test the option is kept by copies, pickles and dumps."""
+        self.assertFalse(SortedDict().cache_pairs)
+        with self.assertRaises(ValueError):
+            SortedDict(cache_i64=False, cache_pairs=True)
+        bt = SortedDict(((t, i), i) for t in range(3) for i in range(100))
+        pairs = SortedDict.from_sorted(bt.items(), cache_pairs=True)
+        self.assertTrue(pairs.cache_pairs)
+        self.assertIn('cache_pairs=True', repr(pairs))
+        self.assertGreater(pairs.memory_usage()['caches'], bt.memory_usage()['caches'])
+        for tree in (pairs.copy(), pairs.snapshot(), pickle.loads(pickle.dumps(pairs))):
+            self.assertTrue(tree.cache_pairs)
+            self.assertEqual(list(tree.items()), list(bt.items()))
+            tree._check()
+        with tempfile.TemporaryDirectory() as tmp:
+            path = os.path.join(tmp, 'pairs.btd')
+            with open(path, 'wb') as f:
+                pairs.dump(f)
+            loaded = SortedDict.load(path)
+        self.assertTrue(loaded.cache_pairs)
+        self.assertEqual(list(loaded.items()), list(bt.items()))
+        with self.assertRaises(ValueError):
+            pairs.concat(SortedDict())
+        high = pairs.split_at((1, 50))
+        self.assertTrue(high.cache_pairs)
+        high._check()
+        pairs.concat(high)
+        self.assertEqual(list(pairs.items()), list(bt.items()))
+
+    def test_cached_pairs_in_range_queries(self):
+        """Test ranges, ranks and merges over cached int64 pairs."""
+        items = [((t, ts), t * 1000 + ts) for t in (-2**63, 0, 5, 2**63 - 1)
+                 for ts in (-2**63, -1, 0, 7, 2**63 - 1)]
+        bt = SortedDict(order=3, cache_pairs=True)
+        for key, value in reversed(items):
+            bt[key] = value
+        bt._check()
+        self.assertEqual(list(bt.items()), sorted(items))
+        keys = sorted(k for k, _ in items)
+        self.assertEqual(list(bt.irange((5, -1), (5, 2**63 - 1))),
+                         [k for k in keys if (5, -1) <= k < (5, 2**63 - 1)])
+        self.assertEqual(bt.index((2**63 - 1, 0)), keys.index((2**63 - 1, 0)))
+        other = SortedDict([((5, 3), 'x'), ((0, 0), 'y')], cache_pairs=True)
+        merged = bt.merge(other)
+        merged._check()
+        self.assertTrue(merged.cache_pairs)
+        self.assertEqual(list(merged), sorted(set(keys) | {(5, 3)}))
+        self.assertEqual(merged[(5, 3)], 'x')
+        self.assertEqual(merged[(0, 0)], 'y')
+
+
 def run_tests():
     """Run all tests."""
     loader = unittest.TestLoader()
@@ -1280,6 +4094,33 @@ def run_tests():
     suite.addTests(loader.loadTestsFromTestCase(SortedDictIrangeTest))
     suite.addTests(loader.loadTestsFromTestCase(SortedDictPeekitemTest))
     suite.addTests(loader.loadTestsFromTestCase(SortedDictPopitemTest))
+    suite.addTests(loader.loadTestsFromTestCase(SortedDictPositionalTest))
+    suite.addTests(loader.loadTestsFromTestCase(SortedDictViewsTest))
+    suite.addTests(loader.loadTestsFromTestCase(SortedDictFromSortedTest))
+    suite.addTests(loader.loadTestsFromTestCase(SortedDictSnapshotTest))
+    suite.addTests(loader.loadTestsFromTestCase(SortedDictBPlusLayoutTest))
+    suite.addTests(loader.loadTestsFromTestCase(SortedDictTypedKeysTest))
+    suite.addTests(loader.loadTestsFromTestCase(SortedDictSearchKernelTest))
+    suite.addTests(loader.loadTestsFromTestCase(SortedDictKeyLayoutTest))
+    suite.addTests(loader.loadTestsFromTestCase(SortedDictThreadingTest))
+    suite.addTests(loader.loadTestsFromTestCase(SortedDictBatchTest))
+    suite.addTests(loader.loadTestsFromTestCase(SortedDictArrayTest))
+    suite.addTests(loader.loadTestsFromTestCase(SortedDictArgumentsTest))
+    suite.addTests(loader.loadTestsFromTestCase(SortedDictRangeDeletionTest))
+    suite.addTests(loader.loadTestsFromTestCase(SortedDictSplitConcatTest))
+    suite.addTests(loader.loadTestsFromTestCase(SortedDictMergeTest))
+    suite.addTests(loader.loadTestsFromTestCase(SortedDictSerializationTest))
+    suite.addTests(loader.loadTestsFromTestCase(SortedDictRangeIterationTest))
+    suite.addTests(loader.loadTestsFromTestCase(SortedDictCursorTest))
+    suite.addTests(loader.loadTestsFromTestCase(SortedDictStatsTest))
+    suite.addTests(loader.loadTestsFromTestCase(SortedDictStrPrefixTest))
+    suite.addTests(loader.loadTestsFromTestCase(SortedDictEdgeInsertTest))
+    suite.addTests(loader.loadTestsFromTestCase(SortedDictAggregateTest))
+    suite.addTests(loader.loadTestsFromTestCase(SortedDictCAPITest))
+    suite.addTests(loader.loadTestsFromTestCase(SortedDictDuplicatesTest))
+    suite.addTests(loader.loadTestsFromTestCase(SortedDictWriteBufferTest))
+    suite.addTests(loader.loadTestsFromTestCase(SortedDictMemoryTest))
+    suite.addTests(loader.loadTestsFromTestCase(SortedDictTupleKeyTest))
     
     runner = unittest.TextTestRunner(verbosity=2)
     result = runner.run(suite)